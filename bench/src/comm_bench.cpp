@@ -0,0 +1,353 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+
+#include "ksync/logging.h"
+#include "ksync/tracing.h"
+#include "ksync/messages.h"
+#include "ksync/utilities.h"
+#include "ksync/common_ops.h"
+#include "ksync/client_communicator.h"
+#include "ksync/pstreams_command_system.h"
+#include "ksync/client_handler.h"
+#include "ksync/shard.h"
+#include "ksync/client/session.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "ksync/ArgParseStandalone.h"
+
+class BenchConfig {
+	public:
+		std::string backend;
+		std::string mode;
+		std::string command;
+		int num_clients;
+		double rate;
+		double duration;
+		int message_size;
+		int max_in_flight;
+		int num_shards;
+		//Network conditions simulated by the loopback backend.
+		KSync::Comm::LoopbackConditions loopback;
+};
+
+class BenchResult {
+	public:
+		BenchResult() : sent(0), completed(0), errors(0), elapsed(0.) {}
+		std::string backend;
+		size_t sent;
+		size_t completed;
+		size_t errors;
+		double elapsed;
+		//Nanoseconds from the time a request was scheduled until its reply arrived.
+		std::vector<uint64_t> latencies;
+};
+
+//Latencies are measured from the time a request was scheduled rather than the time
+//it was actually sent, so a stalled sender shows up in the tail instead of hiding it.
+class BenchClient {
+	public:
+		BenchClient(std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator, const BenchConfig& config) : session(communicator, (size_t) config.max_in_flight), config(config) {
+			this->sent = 0;
+			this->errors.store(0);
+		}
+
+		void Run(const std::chrono::steady_clock::time_point start) {
+			const std::chrono::steady_clock::time_point end = start+std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(this->config.duration));
+			std::chrono::steady_clock::duration interval(0);
+			if(this->config.rate > 0.) {
+				interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1./this->config.rate));
+			}
+			std::string payload((size_t) this->config.message_size, 'k');
+			const KSync::Comm::Type_t expected_type = (this->config.mode == "command") ? KSync::Comm::CommandOutput::Type : KSync::Comm::CommString::Type;
+			std::chrono::steady_clock::time_point scheduled = start;
+			while(scheduled < end) {
+				if(interval.count() > 0) {
+					std::this_thread::sleep_until(scheduled);
+				} else {
+					scheduled = std::chrono::steady_clock::now();
+				}
+				std::shared_ptr<KSync::Comm::CommObject> send_obj;
+				if(this->config.mode == "command") {
+					KSync::Comm::ExecuteCommand command(this->config.command);
+					send_obj = command.GetCommObject();
+				} else {
+					KSync::Comm::CommString message(payload);
+					send_obj = message.GetCommObject();
+				}
+				this->session.Request(send_obj, [this, scheduled, expected_type](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+					if(error||(!reply)||(reply->GetType() != expected_type)) {
+						++this->errors;
+						return;
+					}
+					this->latencies.push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-scheduled).count());
+				});
+				++this->sent;
+				scheduled += interval;
+			}
+			this->session.Flush();
+		}
+
+		size_t GetSent() const {
+			return this->sent;
+		}
+		size_t GetErrors() const {
+			return this->errors.load();
+		}
+		//Only safe to read after Run has returned.
+		const std::vector<uint64_t>& GetLatencies() const {
+			return this->latencies;
+		}
+	private:
+		KSync::Client::Session session;
+		const BenchConfig& config;
+		size_t sent;
+		std::atomic<size_t> errors;
+		std::vector<uint64_t> latencies;
+};
+
+int RunBackend(const BenchConfig& config, BenchResult& result) {
+	result.backend = config.backend;
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	int status;
+	if(config.backend == "loopback") {
+		status = KSync::Comm::GetLoopbackCommSystem(comm_system, config.loopback);
+	} else {
+		status = KSync::Utilities::GetCommSystem(comm_system, config.backend);
+	}
+	if(status < 0) {
+		LOGF(SEVERE, "There was a problem initializing the (%s) comm system!", config.backend.c_str());
+		return -1;
+	}
+
+	//Server side, the same shards the master thread runs minus the gateway.
+	std::shared_ptr<KSync::Commanding::SystemInterface> command_system(new KSync::Commanding::PSCommandSystem());
+	KSync::Server::ShardList shards;
+	KSync::Server::CreateShards(shards, (size_t) config.num_shards, command_system);
+
+	std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>> client_sides;
+	try {
+		for(int i = 0; i < config.num_clients; ++i) {
+			KSync::Utilities::client_id_t client_id = KSync::Utilities::GenUniformRandom<KSync::Utilities::client_id_t>();
+			std::shared_ptr<KSync::Comm::ClientCommunicator> server_side(new KSync::Comm::ClientCommunicator(comm_system, client_id, true));
+			KSync::Server::Shard& shard = *shards[KSync::Server::GetShardIndex(client_id, shards.size())];
+			while(!shard.admissions.try_push(server_side)) {
+				std::this_thread::yield();
+			}
+			client_sides.push_back(std::shared_ptr<KSync::Comm::ClientCommunicator>(new KSync::Comm::ClientCommunicator(comm_system, client_id, false)));
+		}
+	} catch (KSync::Comm::ClientCommunicator::SocketException& e) {
+		LOGF(SEVERE, "There was a problem creating the client sockets! (%s)", e.GetMessage().c_str());
+		return -2;
+	}
+
+	std::vector<std::shared_ptr<BenchClient>> clients;
+	for(size_t i = 0; i < client_sides.size(); ++i) {
+		clients.push_back(std::shared_ptr<BenchClient>(new BenchClient(client_sides[i], config)));
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<std::thread> client_threads;
+	for(size_t i = 0; i < clients.size(); ++i) {
+		client_threads.push_back(std::thread(&BenchClient::Run, clients[i].get(), start));
+	}
+	for(size_t i = 0; i < client_threads.size(); ++i) {
+		client_threads[i].join();
+	}
+	result.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+	KSync::Server::StopShards(shards);
+	KSync::Server::JoinShards(shards);
+
+	for(size_t i = 0; i < clients.size(); ++i) {
+		result.sent += clients[i]->GetSent();
+		result.errors += clients[i]->GetErrors();
+		const std::vector<uint64_t>& latencies = clients[i]->GetLatencies();
+		result.latencies.insert(result.latencies.end(), latencies.begin(), latencies.end());
+	}
+	result.completed = result.latencies.size();
+	return 0;
+}
+
+double Percentile(const std::vector<uint64_t>& sorted, const double q) {
+	if(sorted.size() == 0) {
+		return 0.;
+	}
+	size_t idx = std::min(sorted.size()-1, (size_t) (q*sorted.size()));
+	return sorted[idx]/1000.;
+}
+
+std::string ResultToJson(const BenchConfig& config, BenchResult& result) {
+	std::sort(result.latencies.begin(), result.latencies.end());
+	double mean = 0.;
+	for(size_t i = 0; i < result.latencies.size(); ++i) {
+		mean += result.latencies[i];
+	}
+	if(result.latencies.size() != 0) {
+		mean /= (1000.*result.latencies.size());
+	}
+	std::stringstream ss;
+	ss << "{";
+	ss << "\"backend\": \"" << result.backend << "\", ";
+	ss << "\"mode\": \"" << config.mode << "\", ";
+	ss << "\"clients\": " << config.num_clients << ", ";
+	ss << "\"shards\": " << config.num_shards << ", ";
+	ss << "\"rate_per_client\": " << config.rate << ", ";
+	ss << "\"message_size\": " << config.message_size << ", ";
+	ss << "\"max_in_flight\": " << config.max_in_flight << ", ";
+	ss << "\"elapsed_s\": " << result.elapsed << ", ";
+	ss << "\"sent\": " << result.sent << ", ";
+	ss << "\"completed\": " << result.completed << ", ";
+	ss << "\"errors\": " << result.errors << ", ";
+	ss << "\"msgs_per_s\": " << ((result.elapsed > 0.) ? result.completed/result.elapsed : 0.) << ", ";
+	ss << "\"latency_us\": {";
+	ss << "\"mean\": " << mean << ", ";
+	ss << "\"p50\": " << Percentile(result.latencies, 0.5) << ", ";
+	ss << "\"p99\": " << Percentile(result.latencies, 0.99) << ", ";
+	ss << "\"p999\": " << Percentile(result.latencies, 0.999) << ", ";
+	ss << "\"max\": " << (result.latencies.size() ? result.latencies.back()/1000. : 0.);
+	ss << "}}";
+	return ss.str();
+}
+
+int main(int argc, char** argv) {
+	std::string log_dir;
+	std::string output_path;
+	std::string trace_path;
+	double loopback_latency_us = 0.;
+	int loopback_seed = 0;
+	BenchConfig config;
+	config.backend = "all";
+	config.mode = "echo";
+	config.command = "true";
+	config.num_clients = 1;
+	config.rate = 0.;
+	config.duration = 5.;
+	config.message_size = 64;
+	config.max_in_flight = KSync::Client::Session::DefaultMaxInFlight;
+	config.num_shards = 1;
+
+	ArgParse::ArgParser arg_parser("KSync Bench - Measure latency and throughput of the KSync comm layer.");
+	arg_parser.AddArgument("--log-dir", "Use this directory for logging.", &log_dir);
+	arg_parser.AddArgument("--backend", "Comm backend to measure, or 'all'. Default is all.", &config.backend);
+	arg_parser.AddArgument("--mode", "Request type to send: 'echo' (CommString) or 'command' (ExecuteCommand). Default is echo.", &config.mode);
+	arg_parser.AddArgument("--command", "Command to execute in command mode. Default is 'true'.", &config.command);
+	arg_parser.AddArgument("--clients", "Number of synthetic clients. Default is 1.", &config.num_clients);
+	arg_parser.AddArgument("--shards", "Number of server shards, 0 for one per core. Default is 1.", &config.num_shards);
+	arg_parser.AddArgument("--rate", "Requests per second per client, 0 for as fast as possible. Default is 0.", &config.rate);
+	arg_parser.AddArgument("--duration", "Seconds to run each backend for. Default is 5.", &config.duration);
+	arg_parser.AddArgument("--message-size", "Size of echo messages in bytes. Default is 64.", &config.message_size);
+	arg_parser.AddArgument("--max-in-flight", "Maximum outstanding requests per client.", &config.max_in_flight);
+	arg_parser.AddArgument("--loopback-latency", "Microseconds the loopback backend delays each message by. Default is 0.", &loopback_latency_us);
+	arg_parser.AddArgument("--loopback-bandwidth", "Bytes per second each loopback socket can send, 0 for no limit. Default is 0.", &config.loopback.bandwidth);
+	arg_parser.AddArgument("--loopback-loss", "Fraction of loopback messages to drop, from 0 to 1. Default is 0.", &config.loopback.loss);
+	arg_parser.AddArgument("--loopback-seed", "Seed for choosing which loopback messages are dropped. Default is 0.", &loopback_seed);
+	arg_parser.AddArgument("--output", "Write the JSON report here instead of stdout.", &output_path);
+	arg_parser.AddArgument("--trace", "Record per-message spans and write them to this file as Chrome trace JSON.", &trace_path);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	if((config.mode != "echo")&&(config.mode != "command")) {
+		printf("Unknown mode (%s)!\n", config.mode.c_str());
+		return -1;
+	}
+	if((config.num_clients <= 0)||(config.max_in_flight <= 0)||(config.message_size < 0)||(config.duration <= 0.)||(config.num_shards < 0)) {
+		printf("Client count, in flight depth and duration must be positive, and shards can't be negative!\n");
+		return -1;
+	}
+	if((loopback_latency_us < 0.)||(config.loopback.loss < 0.)||(config.loopback.loss > 1.)) {
+		printf("Loopback latency can't be negative and loss must be between 0 and 1!\n");
+		return -1;
+	}
+	config.loopback.latency_ns = (uint64_t) (loopback_latency_us*1000.);
+	config.loopback.seed = (uint32_t) loopback_seed;
+
+	if (log_dir == "") {
+		if(KSync::Utilities::get_user_ksync_dir(log_dir) < 0) {
+			printf("There was a problem getting the ksync user directory!\n");
+			return -2;
+		}
+	}
+
+	//Initialize logging:
+	std::unique_ptr<g3::LogWorker> logworker;
+	KSync::InitializeLogger(logworker, false, "KSync Bench", log_dir);
+	if(trace_path != "") {
+		if(KSync::Tracing::Enable(trace_path, "KSync Bench") < 0) {
+			LOGF(SEVERE, "There was a problem enabling tracing!");
+			return -2;
+		}
+	}
+
+	std::vector<std::string> backends;
+	if(config.backend == "all") {
+		backends = KSync::Utilities::GetCommSystemNames();
+	} else {
+		backends.push_back(config.backend);
+	}
+
+	std::stringstream report;
+	report << "[" << std::endl;
+	for(size_t i = 0; i < backends.size(); ++i) {
+		BenchConfig backend_config = config;
+		backend_config.backend = backends[i];
+		BenchResult result;
+		if(RunBackend(backend_config, result) < 0) {
+			LOGF(SEVERE, "Benchmarking (%s) failed!", backends[i].c_str());
+			return -3;
+		}
+		report << "\t" << ResultToJson(backend_config, result);
+		if(i+1 != backends.size()) {
+			report << ",";
+		}
+		report << std::endl;
+	}
+	report << "]" << std::endl;
+	if(KSync::Tracing::Finish() < 0) {
+		LOGF(WARNING, "There was a problem writing the trace!");
+	}
+
+	if(output_path != "") {
+		std::ofstream out(output_path.c_str());
+		if(!out) {
+			LOGF(SEVERE, "Couldn't open (%s) for the report!", output_path.c_str());
+			return -4;
+		}
+		out << report.str();
+	} else {
+		printf("%s", report.str().c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,430 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+
+#include "ksync/thread_utilities.h"
+
+#include "ksync/ArgParseStandalone.h"
+
+//Count every heap allocation in the process so we can report allocations per operation.
+//Kept out of line so the compiler doesn't pair an inlined free with a new expression.
+static std::atomic<size_t> num_allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+	++num_allocations;
+	void* p = malloc(size ? size : 1);
+	if(!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+//Uniform push/pop interface over the containers under test.
+template<class Container>
+class Adapter;
+
+template<class T>
+class Adapter<KSync::Utilities::threadsafe_lock_free_stack<T>> {
+	public:
+		static const char* Name() {
+			return "threadsafe_lock_free_stack";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+		void push(const T& value) {
+			this->container.push(value);
+		}
+		bool pop() {
+			return (bool) this->container.pop();
+		}
+	private:
+		KSync::Utilities::threadsafe_lock_free_stack<T> container;
+};
+
+template<class T>
+class Adapter<KSync::Utilities::epoch_lock_free_stack<T>> {
+	public:
+		static const char* Name() {
+			return "epoch_lock_free_stack";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+		void push(const T& value) {
+			this->container.push(value);
+		}
+		bool pop() {
+			return (bool) this->container.pop();
+		}
+	private:
+		KSync::Utilities::epoch_lock_free_stack<T> container;
+};
+
+template<class Queue, class T>
+class QueueAdapter {
+	public:
+		void push(const T& value) {
+			std::shared_ptr<T> p(std::make_shared<T>(value));
+			this->container.push(p);
+		}
+		bool pop() {
+			return (bool) this->container.pop();
+		}
+	private:
+		Queue container;
+};
+
+template<class T>
+class Adapter<KSync::Utilities::spsc_threadsafe_lock_free_queue<T>> : public QueueAdapter<KSync::Utilities::spsc_threadsafe_lock_free_queue<T>, T> {
+	public:
+		static const char* Name() {
+			return "spsc_threadsafe_lock_free_queue";
+		}
+		static bool MultiProducer() {
+			return false;
+		}
+};
+
+template<class T>
+class Adapter<KSync::Utilities::threadsafe_queue<T>> : public QueueAdapter<KSync::Utilities::threadsafe_queue<T>, T> {
+	public:
+		static const char* Name() {
+			return "threadsafe_queue";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+};
+
+template<class T>
+class Adapter<KSync::Utilities::threadsafe_lock_free_queue<T>> : public QueueAdapter<KSync::Utilities::threadsafe_lock_free_queue<T>, T> {
+	public:
+		static const char* Name() {
+			return "threadsafe_lock_free_queue";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+};
+
+template<class T>
+class Adapter<KSync::Utilities::epoch_lock_free_queue<T>> : public QueueAdapter<KSync::Utilities::epoch_lock_free_queue<T>, T> {
+	public:
+		static const char* Name() {
+			return "epoch_lock_free_queue";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+};
+
+template<class T>
+class Adapter<KSync::Utilities::spsc_channel<T>> {
+	public:
+		static const char* Name() {
+			return "spsc_channel";
+		}
+		static bool MultiProducer() {
+			return false;
+		}
+		void push(const T& value) {
+			T item(value);
+			while(!this->container.try_push(item)) {
+				std::this_thread::yield();
+			}
+		}
+		bool pop() {
+			T item;
+			return this->container.try_pop(item);
+		}
+	private:
+		KSync::Utilities::spsc_channel<T> container;
+};
+
+template<class T>
+class Adapter<KSync::Utilities::threadsafe_list<T>> {
+	public:
+		static const char* Name() {
+			return "threadsafe_list";
+		}
+		static bool MultiProducer() {
+			return true;
+		}
+		void push(const T& value) {
+			this->container.push_front(value);
+		}
+		//The list has no pop, so remove the first element we come across.
+		//remove_if still walks the rest of the list, which is what a lookup costs too.
+		bool pop() {
+			bool removed = false;
+			this->container.remove_if([&removed](const T&) {
+				if(removed) {
+					return false;
+				}
+				removed = true;
+				return true;
+			});
+			return removed;
+		}
+	private:
+		KSync::Utilities::threadsafe_list<T> container;
+};
+
+class BenchResult {
+	public:
+		std::string container;
+		int producers;
+		int consumers;
+		size_t ops;
+		double elapsed;
+		size_t allocations;
+		//Sampled nanosecond latencies of individual operations.
+		std::vector<uint64_t> push_latencies;
+		std::vector<uint64_t> pop_latencies;
+};
+
+//Only time every SampleInterval-th operation so reading the clock doesn't dominate.
+static const size_t SampleInterval = 64;
+
+template<class Container>
+void RunContainer(const int producers, const int consumers, const size_t ops_per_producer, BenchResult& result) {
+	typedef std::chrono::steady_clock clock;
+	Adapter<Container> container;
+	const size_t total = ops_per_producer*producers;
+	std::atomic<size_t> num_popped(0);
+	std::atomic<bool> go(false);
+	std::atomic<int> ready(0);
+	std::vector<std::vector<uint64_t>> push_samples(producers);
+	std::vector<std::vector<uint64_t>> pop_samples(consumers);
+
+	std::vector<std::thread> threads;
+	for(int p = 0; p < producers; ++p) {
+		threads.push_back(std::thread([&, p]() {
+			std::vector<uint64_t>& samples = push_samples[p];
+			samples.reserve(ops_per_producer/SampleInterval+1);
+			++ready;
+			while(!go.load()) {
+				std::this_thread::yield();
+			}
+			for(size_t i = 0; i < ops_per_producer; ++i) {
+				if(i%SampleInterval == 0) {
+					clock::time_point start = clock::now();
+					container.push((int) i);
+					samples.push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now()-start).count());
+				} else {
+					container.push((int) i);
+				}
+			}
+		}));
+	}
+	for(int c = 0; c < consumers; ++c) {
+		threads.push_back(std::thread([&, c]() {
+			std::vector<uint64_t>& samples = pop_samples[c];
+			samples.reserve(total/(SampleInterval*consumers)+1);
+			size_t attempt = 0;
+			++ready;
+			while(!go.load()) {
+				std::this_thread::yield();
+			}
+			while(num_popped.load(std::memory_order_relaxed) < total) {
+				bool popped;
+				if(attempt++%SampleInterval == 0) {
+					clock::time_point start = clock::now();
+					popped = container.pop();
+					if(popped) {
+						samples.push_back((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now()-start).count());
+					}
+				} else {
+					popped = container.pop();
+				}
+				if(popped) {
+					++num_popped;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+
+	//Don't count the threads' own setup.
+	while(ready.load() != producers+consumers) {
+		std::this_thread::yield();
+	}
+	const size_t allocations_before = num_allocations.load();
+	clock::time_point start = clock::now();
+	go.store(true);
+	for(size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+	result.elapsed = std::chrono::duration<double>(clock::now()-start).count();
+	result.allocations = num_allocations.load()-allocations_before;
+
+	result.container = Adapter<Container>::Name();
+	result.producers = producers;
+	result.consumers = consumers;
+	result.ops = 2*total;
+	for(int p = 0; p < producers; ++p) {
+		result.push_latencies.insert(result.push_latencies.end(), push_samples[p].begin(), push_samples[p].end());
+	}
+	for(int c = 0; c < consumers; ++c) {
+		result.pop_latencies.insert(result.pop_latencies.end(), pop_samples[c].begin(), pop_samples[c].end());
+	}
+}
+
+uint64_t Percentile(const std::vector<uint64_t>& sorted, const double q) {
+	if(sorted.size() == 0) {
+		return 0;
+	}
+	return sorted[std::min(sorted.size()-1, (size_t) (q*sorted.size()))];
+}
+
+std::string LatencyJson(std::vector<uint64_t>& latencies) {
+	std::sort(latencies.begin(), latencies.end());
+	std::stringstream ss;
+	ss << "{\"p50\": " << Percentile(latencies, 0.5);
+	ss << ", \"p99\": " << Percentile(latencies, 0.99);
+	ss << ", \"p999\": " << Percentile(latencies, 0.999);
+	ss << ", \"max\": " << (latencies.size() ? latencies.back() : 0) << "}";
+	return ss.str();
+}
+
+std::string ResultToJson(BenchResult& result) {
+	std::stringstream ss;
+	ss << "{\"container\": \"" << result.container << "\"";
+	ss << ", \"producers\": " << result.producers;
+	ss << ", \"consumers\": " << result.consumers;
+	ss << ", \"ops\": " << result.ops;
+	ss << ", \"elapsed_s\": " << result.elapsed;
+	ss << ", \"ops_per_s\": " << ((result.elapsed > 0.) ? result.ops/result.elapsed : 0.);
+	ss << ", \"allocs_per_op\": " << ((result.ops > 0) ? ((double) result.allocations)/result.ops : 0.);
+	ss << ", \"push_latency_ns\": " << LatencyJson(result.push_latencies);
+	ss << ", \"pop_latency_ns\": " << LatencyJson(result.pop_latencies);
+	ss << "}";
+	return ss.str();
+}
+
+template<class Container>
+void RunThreadCounts(const int max_threads, const size_t ops_per_producer, std::vector<std::string>& reports) {
+	const int max_producers = Adapter<Container>::MultiProducer() ? max_threads : 1;
+	for(int n = 1; n <= max_producers; ++n) {
+		BenchResult result;
+		RunContainer<Container>(n, n, ops_per_producer/n, result);
+		reports.push_back(ResultToJson(result));
+		fprintf(stderr, "%s %ix%i: %.0f ops/s\n", result.container.c_str(), n, n, result.ops/result.elapsed);
+	}
+}
+
+int main(int argc, char** argv) {
+	int max_threads = (int) std::max(1u, std::thread::hardware_concurrency());
+	int num_ops = 1000000;
+	std::string container = "all";
+	std::string output_path;
+
+	ArgParse::ArgParser arg_parser("KSync Container Bench - Measure the concurrent containers in thread_utilities.h.");
+	arg_parser.AddArgument("--max-threads", "Run 1 to this many producers and as many consumers. Default is the number of cores.", &max_threads);
+	arg_parser.AddArgument("--ops", "Total number of elements pushed per run. Default is 1000000.", &num_ops);
+	arg_parser.AddArgument("--container", "Container to measure, or 'all'. Default is all.", &container);
+	arg_parser.AddArgument("--output", "Write the JSON report here instead of stdout.", &output_path);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	if((max_threads <= 0)||(num_ops <= 0)) {
+		printf("Thread and operation counts must be positive!\n");
+		return -1;
+	}
+
+	std::vector<std::string> reports;
+	if((container == "all")||(container == "threadsafe_lock_free_stack")) {
+		RunThreadCounts<KSync::Utilities::threadsafe_lock_free_stack<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "epoch_lock_free_stack")) {
+		RunThreadCounts<KSync::Utilities::epoch_lock_free_stack<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "spsc_threadsafe_lock_free_queue")) {
+		RunThreadCounts<KSync::Utilities::spsc_threadsafe_lock_free_queue<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "spsc_channel")) {
+		RunThreadCounts<KSync::Utilities::spsc_channel<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "threadsafe_queue")) {
+		RunThreadCounts<KSync::Utilities::threadsafe_queue<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "threadsafe_lock_free_queue")) {
+		RunThreadCounts<KSync::Utilities::threadsafe_lock_free_queue<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "epoch_lock_free_queue")) {
+		RunThreadCounts<KSync::Utilities::epoch_lock_free_queue<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if((container == "all")||(container == "threadsafe_list")) {
+		RunThreadCounts<KSync::Utilities::threadsafe_list<int>>(max_threads, (size_t) num_ops, reports);
+	}
+	if(reports.size() == 0) {
+		printf("Unknown container (%s)!\n", container.c_str());
+		return -1;
+	}
+
+	std::stringstream report;
+	report << "[" << std::endl;
+	for(size_t i = 0; i < reports.size(); ++i) {
+		report << "\t" << reports[i];
+		if(i+1 != reports.size()) {
+			report << ",";
+		}
+		report << std::endl;
+	}
+	report << "]" << std::endl;
+
+	if(output_path != "") {
+		std::ofstream out(output_path.c_str());
+		if(!out) {
+			printf("Couldn't open (%s) for the report!\n", output_path.c_str());
+			return -2;
+		}
+		out << report.str();
+	} else {
+		printf("%s", report.str().c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+
+#include "ksync/thread_utilities.h"
+#include "ksync/sha256.h"
+#include "ksync/blake3.h"
+#include "ksync/xxh3.h"
+
+#include "ksync/ArgParseStandalone.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+class BenchResult {
+	public:
+		std::string algorithm;
+		std::string implementation;
+		size_t threads;
+		size_t size;
+		size_t iterations;
+		double elapsed;
+};
+
+std::string ResultToJson(const BenchResult& result) {
+	const double bytes = ((double) result.size)*((double) result.iterations);
+	std::stringstream ss;
+	ss << "{\"algorithm\": \"" << result.algorithm << "\"";
+	ss << ", \"implementation\": \"" << result.implementation << "\"";
+	ss << ", \"threads\": " << result.threads;
+	ss << ", \"size\": " << result.size;
+	ss << ", \"iterations\": " << result.iterations;
+	ss << ", \"elapsed_s\": " << result.elapsed;
+	ss << ", \"gb_per_s\": " << ((result.elapsed > 0.) ? bytes/result.elapsed/1e9 : 0.);
+	ss << "}";
+	return ss.str();
+}
+
+//Hash the buffer over and over for at least min_seconds.
+template<class Function>
+void Measure(const std::vector<uint8_t>& buffer, const double min_seconds, Function hash, BenchResult& result) {
+	result.size = buffer.size();
+	result.iterations = 0;
+	//Once to warm the caches and pick the implementation.
+	hash(buffer);
+	const clock_type::time_point start = clock_type::now();
+	do {
+		hash(buffer);
+		++result.iterations;
+		result.elapsed = std::chrono::duration<double>(clock_type::now()-start).count();
+	} while(result.elapsed < min_seconds);
+}
+
+void Report(BenchResult& result, std::vector<std::string>& reports) {
+	reports.push_back(ResultToJson(result));
+	fprintf(stderr, "%s (%s, %lu threads) %lu bytes: %.2f GB/s\n", result.algorithm.c_str(), result.implementation.c_str(), result.threads, result.size, ((double) result.size)*((double) result.iterations)/result.elapsed/1e9);
+}
+
+int main(int argc, char** argv) {
+	int size = 64*1024*1024;
+	int max_threads = (int) std::max(1u, std::thread::hardware_concurrency());
+	double min_seconds = 1.;
+	std::string algorithm = "all";
+	std::string output_path;
+
+	ArgParse::ArgParser arg_parser("KSync Hash Bench - Measure the throughput of the hash functions.");
+	arg_parser.AddArgument("--size", "Bytes hashed per iteration. Default is 67108864.", &size);
+	arg_parser.AddArgument("--max-threads", "Run parallel Blake3 with 1 to this many threads. Default is the number of cores.", &max_threads);
+	arg_parser.AddArgument("--seconds", "Minimum time to spend on each measurement. Default is 1.", &min_seconds);
+	arg_parser.AddArgument("--algorithm", "sha256, blake3, xxh3 or 'all'. Default is all.", &algorithm);
+	arg_parser.AddArgument("--output", "Write the JSON report here instead of stdout.", &output_path);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	if((size <= 0)||(max_threads <= 0)||(min_seconds <= 0.)) {
+		printf("Size, threads and seconds must be positive!\n");
+		return -1;
+	}
+
+	std::vector<uint8_t> buffer((size_t) size);
+	for(size_t i = 0; i < buffer.size(); ++i) {
+		buffer[i] = (uint8_t) ((i*2654435761u) >> 13);
+	}
+
+	std::vector<std::string> reports;
+	if((algorithm == "all")||(algorithm == "sha256")) {
+		BenchResult result;
+		result.algorithm = "sha256";
+		result.implementation = "portable";
+		result.threads = 1;
+		Measure(buffer, min_seconds, [](const std::vector<uint8_t>& data) {
+			KSync::Hash::digest_t digest;
+			KSync::Hash::Sha256::Digest(data.data(), data.size(), digest);
+		}, result);
+		Report(result, reports);
+	}
+	if((algorithm == "all")||(algorithm == "blake3")) {
+		const std::string best = KSync::Hash::Blake3::GetImplementation();
+		const char* implementations[] = {"portable", "avx2", "avx512"};
+		for(size_t i = 0; i < sizeof(implementations)/sizeof(implementations[0]); ++i) {
+			if(KSync::Hash::Blake3::SetImplementation(implementations[i]) < 0) {
+				continue;
+			}
+			BenchResult result;
+			result.algorithm = "blake3";
+			result.implementation = implementations[i];
+			result.threads = 1;
+			Measure(buffer, min_seconds, [](const std::vector<uint8_t>& data) {
+				KSync::Hash::digest_t digest;
+				KSync::Hash::Blake3::Digest(data.data(), data.size(), digest);
+			}, result);
+			Report(result, reports);
+		}
+		if(KSync::Hash::Blake3::SetImplementation(best) < 0) {
+			printf("Couldn't go back to the (%s) implementation!\n", best.c_str());
+			return -2;
+		}
+		//The calling thread works too, so the pool is one smaller.
+		for(int n = 2; n <= max_threads; ++n) {
+			KSync::Utilities::thread_pool pool((size_t) (n-1));
+			BenchResult result;
+			result.algorithm = "blake3";
+			result.implementation = best;
+			result.threads = (size_t) n;
+			Measure(buffer, min_seconds, [&pool](const std::vector<uint8_t>& data) {
+				KSync::Hash::digest_t digest;
+				KSync::Hash::Blake3 blake3;
+				blake3.UpdateParallel(data.data(), data.size(), pool);
+				blake3.Final(digest);
+			}, result);
+			Report(result, reports);
+		}
+	}
+	if((algorithm == "all")||(algorithm == "xxh3")) {
+		const std::string best = KSync::Hash::Xxh3GetImplementation();
+		const char* implementations[] = {"portable", "avx2"};
+		for(size_t i = 0; i < sizeof(implementations)/sizeof(implementations[0]); ++i) {
+			if(KSync::Hash::Xxh3SetImplementation(implementations[i]) < 0) {
+				continue;
+			}
+			BenchResult result;
+			result.algorithm = "xxh3";
+			result.implementation = implementations[i];
+			result.threads = 1;
+			volatile uint64_t sink = 0;
+			Measure(buffer, min_seconds, [&sink](const std::vector<uint8_t>& data) {
+				sink = sink+KSync::Hash::Xxh3Hash64(data.data(), data.size());
+			}, result);
+			Report(result, reports);
+		}
+		if(KSync::Hash::Xxh3SetImplementation(best) < 0) {
+			printf("Couldn't go back to the (%s) implementation!\n", best.c_str());
+			return -2;
+		}
+	}
+	if(reports.size() == 0) {
+		printf("Unknown algorithm (%s)!\n", algorithm.c_str());
+		return -1;
+	}
+
+	std::stringstream report;
+	report << "[" << std::endl;
+	for(size_t i = 0; i < reports.size(); ++i) {
+		report << "\t" << reports[i];
+		if(i+1 != reports.size()) {
+			report << ",";
+		}
+		report << std::endl;
+	}
+	report << "]" << std::endl;
+
+	if(output_path != "") {
+		std::ofstream out(output_path.c_str());
+		if(!out) {
+			printf("Couldn't open (%s) for the report!\n", output_path.c_str());
+			return -2;
+		}
+		out << report.str();
+	} else {
+		printf("%s", report.str().c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ftw.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+
+#include "ksync/logging.h"
+#include "ksync/utilities.h"
+#include "ksync/client_communicator.h"
+#include "ksync/transfer_pipeline.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "ksync/ArgParseStandalone.h"
+
+class BenchResult {
+	public:
+		BenchResult() : files(0), files_received(0), bytes(0), errors(0), elapsed(0.) {}
+		std::string mode;
+		size_t connections;
+		size_t hash_threads;
+		size_t queue_depth;
+		uint64_t files;
+		uint64_t files_received;
+		uint64_t bytes;
+		uint64_t errors;
+		double elapsed;
+};
+
+static std::vector<std::string>* walk_paths = nullptr;
+static size_t walk_prefix = 0;
+
+static int AddPath(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+	(void) st;
+	(void) ftw;
+	if(type == FTW_F) {
+		walk_paths->push_back(std::string(path+walk_prefix));
+	}
+	return 0;
+}
+
+//Regular files under root, relative to it.
+int ListFiles(const std::string& root, std::vector<std::string>& paths) {
+	walk_paths = &paths;
+	walk_prefix = root.size()+1;
+	if(nftw(root.c_str(), AddPath, 64, FTW_PHYS) < 0) {
+		LOGF(SEVERE, "Couldn't walk (%s)! (%s)", root.c_str(), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+//Send every file from source to dest over loopback connections, receiving on a thread per connection.
+int RunPipeline(const std::string& source, const std::string& dest, const std::vector<std::string>& paths, const KSync::Transfer::PipelineConfig& config, const size_t connections, const KSync::Comm::LoopbackConditions& conditions, BenchResult& result) {
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, conditions) < 0) {
+		LOGF(SEVERE, "There was a problem initializing the loopback comm system!");
+		return -1;
+	}
+
+	std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>> senders;
+	std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>> receivers;
+	try {
+		for(size_t i = 0; i < connections; ++i) {
+			KSync::Utilities::client_id_t client_id = KSync::Utilities::GenUniformRandom<KSync::Utilities::client_id_t>();
+			receivers.push_back(std::shared_ptr<KSync::Comm::ClientCommunicator>(new KSync::Comm::ClientCommunicator(comm_system, client_id, true)));
+			senders.push_back(std::shared_ptr<KSync::Comm::ClientCommunicator>(new KSync::Comm::ClientCommunicator(comm_system, client_id, false)));
+		}
+	} catch (KSync::Comm::ClientCommunicator::SocketException& e) {
+		LOGF(SEVERE, "There was a problem creating the sockets! (%s)", e.GetMessage().c_str());
+		return -2;
+	}
+
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> files_received(0);
+	std::atomic<uint64_t> receive_errors(0);
+	std::vector<std::thread> receive_threads;
+	for(size_t i = 0; i < receivers.size(); ++i) {
+		std::shared_ptr<KSync::Comm::ClientCommunicator> communicator = receivers[i];
+		receive_threads.push_back(std::thread([communicator, &dest, &stop, &files_received, &receive_errors]() {
+			std::shared_ptr<KSync::Comm::ClientCommunicator> the_communicator = communicator;
+			KSync::Transfer::Receiver receiver(the_communicator, dest);
+			while(true) {
+				std::shared_ptr<KSync::Comm::CommObject> recv_obj = the_communicator->get();
+				if(!recv_obj) {
+					if(stop.load()) {
+						break;
+					}
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+					continue;
+				}
+				const int status = receiver.HandleMessage(recv_obj);
+				if(status < 0) {
+					receive_errors.fetch_add(1);
+				} else if (status == KSync::Transfer::Receiver::Finished) {
+					files_received.fetch_add(1);
+				}
+			}
+		}));
+	}
+
+	KSync::Transfer::Pipeline pipeline(config, senders);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if(pipeline.Run(source, paths) < 0) {
+		LOGF(WARNING, "Some files weren't sent!");
+	}
+	//Every stream is acknowledged by the time Run returns, the receivers only have the last files to check.
+	stop.store(true);
+	for(size_t i = 0; i < receive_threads.size(); ++i) {
+		receive_threads[i].join();
+	}
+	result.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	result.files = pipeline.GetFilesSent();
+	result.files_received = files_received.load();
+	result.bytes = pipeline.GetBytesSent();
+	result.errors = pipeline.GetNumErrors()+receive_errors.load();
+	return 0;
+}
+
+std::string ResultToJson(const BenchResult& result) {
+	std::stringstream ss;
+	ss << "{\"mode\": \"" << result.mode << "\"";
+	ss << ", \"connections\": " << result.connections;
+	ss << ", \"hash_threads\": " << result.hash_threads;
+	ss << ", \"queue_depth\": " << result.queue_depth;
+	ss << ", \"files\": " << result.files;
+	ss << ", \"files_received\": " << result.files_received;
+	ss << ", \"bytes\": " << result.bytes;
+	ss << ", \"errors\": " << result.errors;
+	ss << ", \"elapsed_s\": " << result.elapsed;
+	ss << ", \"mb_per_s\": " << ((result.elapsed > 0.) ? ((double) result.bytes)/result.elapsed/1e6 : 0.);
+	ss << ", \"files_per_s\": " << ((result.elapsed > 0.) ? ((double) result.files)/result.elapsed : 0.);
+	ss << "}";
+	return ss.str();
+}
+
+int main(int argc, char** argv) {
+	std::string log_dir;
+	std::string source;
+	std::string dest;
+	std::string mode = "all";
+	std::string output_path;
+	KSync::Transfer::PipelineConfig defaults;
+	int connections = 4;
+	int read_threads = (int) defaults.read.num_threads;
+	int hash_threads = (int) defaults.hash.num_threads;
+	int queue_depth = (int) defaults.hash.queue_depth;
+	int block_size = (int) defaults.block_size;
+	unsigned long max_buffered_size = defaults.max_buffered_size;
+	unsigned long max_buffered_bytes = defaults.max_buffered_bytes;
+	double loopback_latency_us = 0.;
+	KSync::Comm::LoopbackConditions conditions;
+
+	ArgParse::ArgParser arg_parser("KSync Pipeline Bench - Measure sending a tree through the transfer pipeline against one file at a time.");
+	arg_parser.AddArgument("--log-dir", "Use this directory for logging.", &log_dir);
+	arg_parser.AddArgument("--source", "Directory to send.", &source, ArgParse::Argument::Required);
+	arg_parser.AddArgument("--dest", "Directory to receive into.", &dest, ArgParse::Argument::Required);
+	arg_parser.AddArgument("--mode", "'pipelined', 'sequential' or 'all'. Default is all.", &mode);
+	arg_parser.AddArgument("--connections", "Loopback connections, each with its own send thread. Default is 4.", &connections);
+	arg_parser.AddArgument("--read-threads", "Threads reading files. Default is 2.", &read_threads);
+	arg_parser.AddArgument("--hash-threads", "Threads hashing files. Default is the number of cores.", &hash_threads);
+	arg_parser.AddArgument("--queue-depth", "Files queued in front of each stage. Default is 16.", &queue_depth);
+	arg_parser.AddArgument("--block-size", "Hash block size in bytes. Default is 65536.", &block_size);
+	arg_parser.AddArgument("--max-buffered-size", "Files up to this many bytes are read into memory. Default is 8 MiB.", &max_buffered_size);
+	arg_parser.AddArgument("--max-buffered-bytes", "Bytes of files held in memory at once. Default is 256 MiB.", &max_buffered_bytes);
+	arg_parser.AddArgument("--loopback-latency", "Microseconds the loopback backend delays each message by. Default is 0.", &loopback_latency_us);
+	arg_parser.AddArgument("--loopback-bandwidth", "Bytes per second each loopback socket can send, 0 for no limit. Default is 0.", &conditions.bandwidth);
+	arg_parser.AddArgument("--output", "Write the JSON report here instead of stdout.", &output_path);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	if((connections <= 0)||(read_threads <= 0)||(hash_threads <= 0)||(queue_depth <= 0)||(block_size <= 0)||(loopback_latency_us < 0.)) {
+		printf("Connections, threads, queue depth and block size must be positive!\n");
+		return -1;
+	}
+	if((mode != "all")&&(mode != "pipelined")&&(mode != "sequential")) {
+		printf("Unknown mode (%s)!\n", mode.c_str());
+		return -1;
+	}
+	conditions.latency_ns = (uint64_t) (loopback_latency_us*1000.);
+
+	if (log_dir == "") {
+		if(KSync::Utilities::get_user_ksync_dir(log_dir) < 0) {
+			printf("There was a problem getting the ksync user directory!\n");
+			return -2;
+		}
+	}
+
+	//Initialize logging:
+	std::unique_ptr<g3::LogWorker> logworker;
+	KSync::InitializeLogger(logworker, false, "KSync Pipeline Bench", log_dir);
+
+	std::vector<std::string> paths;
+	if(ListFiles(source, paths) < 0) {
+		return -2;
+	}
+
+	std::vector<BenchResult> results;
+	if((mode == "all")||(mode == "sequential")) {
+		//One file all the way through before the next, like a command per file.
+		KSync::Transfer::PipelineConfig config;
+		config.read = KSync::Transfer::StageConfig(1, 1);
+		config.hash = KSync::Transfer::StageConfig(1, 1);
+		config.filter = KSync::Transfer::StageConfig(1, 1);
+		config.send_queue_depth = 1;
+		config.block_size = (uint32_t) block_size;
+		BenchResult result;
+		result.mode = "sequential";
+		result.connections = 1;
+		result.hash_threads = 1;
+		result.queue_depth = 1;
+		if(RunPipeline(source, dest, paths, config, 1, conditions, result) < 0) {
+			return -3;
+		}
+		results.push_back(result);
+	}
+	if((mode == "all")||(mode == "pipelined")) {
+		KSync::Transfer::PipelineConfig config;
+		config.read = KSync::Transfer::StageConfig((size_t) read_threads, (size_t) queue_depth);
+		config.hash = KSync::Transfer::StageConfig((size_t) hash_threads, (size_t) queue_depth);
+		config.filter = KSync::Transfer::StageConfig(1, (size_t) queue_depth);
+		config.send_queue_depth = (size_t) queue_depth;
+		config.block_size = (uint32_t) block_size;
+		config.max_buffered_size = max_buffered_size;
+		config.max_buffered_bytes = max_buffered_bytes;
+		BenchResult result;
+		result.mode = "pipelined";
+		result.connections = (size_t) connections;
+		result.hash_threads = (size_t) hash_threads;
+		result.queue_depth = (size_t) queue_depth;
+		if(RunPipeline(source, dest, paths, config, (size_t) connections, conditions, result) < 0) {
+			return -3;
+		}
+		results.push_back(result);
+	}
+
+	std::stringstream report;
+	report << "[" << std::endl;
+	for(size_t i = 0; i < results.size(); ++i) {
+		fprintf(stderr, "%s: %lu files, %.1f MB/s, %lu errors\n", results[i].mode.c_str(), results[i].files, ((double) results[i].bytes)/results[i].elapsed/1e6, results[i].errors);
+		report << "\t" << ResultToJson(results[i]);
+		if(i+1 != results.size()) {
+			report << ",";
+		}
+		report << std::endl;
+	}
+	report << "]" << std::endl;
+
+	if(output_path != "") {
+		std::ofstream out(output_path.c_str());
+		if(!out) {
+			LOGF(SEVERE, "Couldn't open (%s) for the report!", output_path.c_str());
+			return -4;
+		}
+		out << report.str();
+	} else {
+		printf("%s", report.str().c_str());
+	}
+	return 0;
+}
@@ -2,10 +2,18 @@
 #define KSYNC_CLIENT_UTILITIES_HDR
 
 #include "ksync/comm/interface.h"
+#include "ksync/client_communicator.h"
 
 namespace KSync {
 	namespace Client {
-		int ConnectToServer(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string gateway_socket_url, std::shared_ptr<KSync::Comm::CommSystemSocket>& client_push_socket, std::shared_ptr<KSync::Comm::CommSystemSocket>& client_pull_socket);
+		//The gateway is asked again with a longer timeout whenever it doesn't answer,
+		//so a busy or restarting server delays the handshake instead of failing it.
+		static const int GatewayInitialTimeout = 250;
+		static const int GatewayMaxTimeout = 4000;
+		static const int GatewayMaxAttempts = 8;
+
+		//Negotiate a client socket with the server's gateway and connect to it and the broadcast socket.
+		int ConnectToServer(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string gateway_socket_url, std::shared_ptr<KSync::Comm::ClientCommunicator>& client_communicator, std::shared_ptr<KSync::Comm::CommSystemSocket>& broadcast_socket) __attribute__((warn_unused_result));
 	}
 }
 
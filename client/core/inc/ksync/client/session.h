@@ -0,0 +1,58 @@
+#ifndef KSYNC_CLIENT_SESSION_HDR
+#define KSYNC_CLIENT_SESSION_HDR
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "ksync/client_communicator.h"
+#include "ksync/thread_utilities.h"
+
+namespace KSync {
+	namespace Client {
+		//Pipelined request/reply session on top of a ClientCommunicator.
+		//Any number of threads may issue requests; at most max_in_flight of them
+		//are outstanding at once and further requests block until a reply frees a slot.
+		class Session {
+			public:
+				typedef KSync::Utilities::FutureWrapper<std::shared_ptr<KSync::Comm::CommObject>> Future_t;
+				typedef KSync::Comm::ClientCommunicator::ReplyCallback Callback_t;
+
+				static const size_t DefaultMaxInFlight = 256;
+
+				Session(std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator, const size_t max_in_flight = DefaultMaxInFlight, const int reply_timeout = KSync::Comm::ClientCommunicator::DefaultReplyTimeout);
+				~Session();
+
+				Session(const Session& rhs) = delete;
+				Session& operator=(const Session& rhs) = delete;
+
+				Future_t Request(std::shared_ptr<KSync::Comm::CommObject>& obj);
+				//callback runs on the communicator's watch thread.
+				void Request(std::shared_ptr<KSync::Comm::CommObject>& obj, Callback_t callback);
+				//Send without expecting a reply, waiting for room in the send queue. Returns < 0 if it wasn't sent.
+				int Post(std::shared_ptr<KSync::Comm::CommObject>& obj) __attribute__((warn_unused_result));
+
+				//Block until every outstanding request has completed and its callback returned.
+				void Flush();
+
+				size_t GetInFlight();
+				void SetMaxInFlight(const size_t max_in_flight);
+				std::shared_ptr<KSync::Comm::ClientCommunicator>& GetCommunicator() {
+					return this->communicator;
+				}
+			private:
+				void AcquireSlot();
+				void ReleaseSlot();
+
+				std::shared_ptr<KSync::Comm::ClientCommunicator> communicator;
+				std::mutex in_flight_mutex;
+				std::condition_variable in_flight_cond;
+				size_t in_flight;
+				size_t max_in_flight;
+				int reply_timeout;
+		};
+	}
+}
+
+#endif
@@ -1,88 +1,108 @@
+#include <algorithm>
+
 #include "ksync/logging.h"
+#include "ksync/messages.h"
+#include "ksync/utilities.h"
 #include "ksync/client/client_utilities.h"
 
 namespace KSync {
 	namespace Client {
-		int ConnectToServer(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string gateway_socket_url, std::shared_ptr<KSync::Comm::CommSystemSocket>& client_push_socket, std::shared_ptr<KSync::Comm::CommSystemSocket>& client_pull_socket) {
-	//Connect to gateway socket
-	std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_socket;
-	if (comm_system->Create_Gateway_Req_Socket(gateway_socket) < 0) {
-		LOGF(SEVERE, "There was a problem creating the gateway socket!");
-		return -1;
-	}
-
-	if(gateway_socket->SetRecvTimeout(20000) < 0) {
-		LOGF(SEVERE, "There was a problem setting the receive timeout!");
-		return -2;
-	}
-
-	if (gateway_socket->Connect(gateway_socket_url) < 0) {
-		LOGF(SEVERE, "There was a problem connecting to the gateway socket!");
-		return -3;
-	}
-
-	client_push_socket.reset();
-	client_pull_socket.reset();
-	int status = 0;
-	//Request client socket connection
-	while ((!client_push_socket)||(!client_pull_socket)) {
-		KSync::Comm::GatewaySocketInitializationRequest request(KSync::Utilities::GenerateNewClientId());
-		std::shared_ptr<KSync::Comm::CommObject> request_obj = request.GetCommObject();
-		status = gateway_socket->Send(request_obj);
-		if(status == KSync::Comm::CommSystemSocket::Other) {
-			LOGF(WARNING, "There was a problem sending the message!!");
-		} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-			LOGF(WARNING, "Sending the message timed out!");
-		} else {
-			std::shared_ptr<KSync::Comm::CommObject> recv_obj;
-			status = gateway_socket->Recv(recv_obj);
-			if(status == KSync::Comm::CommSystemSocket::Other) {
-				LOGF(WARNING, "Problem receiving response");
-			} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-				LOGF(WARNING, "Receiving response timed out!");
-			} else {
-				if(recv_obj->GetType() == KSync::Comm::ClientSocketCreation::Type) {
-					std::shared_ptr<KSync::Comm::ClientSocketCreation> creation_response;
-					KSync::Comm::CommCreator(creation_response, recv_obj);
-					//Start and connect to client socket
-					if(comm_system->Create_Pair_Socket(client_socket) < 0) {
-						LOGF(SEVERE, "There was a problem creating the pair socket!");
+		int ConnectToServer(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string gateway_socket_url, std::shared_ptr<KSync::Comm::ClientCommunicator>& client_communicator, std::shared_ptr<KSync::Comm::CommSystemSocket>& broadcast_socket) {
+			client_communicator.reset();
+			broadcast_socket.reset();
+			KSync::Utilities::client_id_t client_id = KSync::Utilities::GenUniformRandom<KSync::Utilities::client_id_t>();
+			std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_socket;
+			int attempts = 0;
+			int recv_timeout = GatewayInitialTimeout;
+			int status = 0;
+			//Request client socket connection
+			while (!client_communicator) {
+				//A REQ socket which missed its reply is stuck, so every retry starts
+				//over with a fresh one and waits a little longer.
+				if(!gateway_socket) {
+					if(attempts == GatewayMaxAttempts) {
+						LOGF(WARNING, "The gateway didn't answer after (%i) attempts!", attempts);
+						return -5;
+					}
+					if(attempts != 0) {
+						LOGF(INFO, "No answer from the gateway, retrying with a (%i) ms timeout", recv_timeout);
+					}
+					++attempts;
+					if (comm_system->Create_Gateway_Req_Socket(gateway_socket) < 0) {
+						LOGF(SEVERE, "There was a problem creating the gateway socket!");
 						return -1;
 					}
-					if(client_socket->SetRecvTimeout(1000) < 0) {
-						LOGF(SEVERE, "There was a problem setting the client socket timeout!");
+					if(gateway_socket->SetRecvTimeout(recv_timeout) < 0) {
+						LOGF(SEVERE, "There was a problem setting the receive timeout!");
 						return -2;
 					}
-					if(client_socket->Connect(creation_response->GetClientUrl()) < 0) {
-						LOGF(SEVERE, "Couldn't connect to the new client socket address!!");
+					if (gateway_socket->Connect(gateway_socket_url) < 0) {
+						LOGF(SEVERE, "There was a problem connecting to the gateway socket!");
 						return -3;
 					}
-
+					recv_timeout = std::min(2*recv_timeout, GatewayMaxTimeout);
+				}
+				KSync::Comm::GatewaySocketInitializationRequest request(client_id);
+				std::shared_ptr<KSync::Comm::CommObject> request_obj = request.GetCommObject();
+				status = gateway_socket->Send(request_obj);
+				if(status == KSync::Comm::CommSystemSocket::Other) {
+					LOGF(WARNING, "There was a problem sending the message!!");
+					return -4;
+				} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
+					LOGF(WARNING, "Sending the message timed out!");
+					gateway_socket.reset();
+					continue;
+				}
+				std::shared_ptr<KSync::Comm::CommObject> recv_obj;
+				status = gateway_socket->Recv(recv_obj);
+				if(status == KSync::Comm::CommSystemSocket::Other) {
+					LOGF(WARNING, "Problem receiving response");
+					return -5;
+				} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
+					gateway_socket.reset();
+					continue;
+				}
+				if(recv_obj->GetType() == KSync::Comm::ClientSocketCreation::Type) {
+					std::string broadcast_url;
+					try {
+						std::shared_ptr<KSync::Comm::ClientSocketCreation> creation_response;
+						KSync::Comm::CommCreator(creation_response, recv_obj);
+						broadcast_url = creation_response->GetBroadcastUrl().str();
+					} catch (KSync::Comm::CommObject::UnPackException& e) {
+						LOGF(SEVERE, "The gateway's reply was malformed! (%s)", e.GetMessage().c_str());
+						return -8;
+					}
 					//Start and connect to broadcast socket
 					if(comm_system->Create_Sub_Socket(broadcast_socket) < 0) {
 						LOGF(SEVERE, "There was a problem creating the broadcast socket!");
-						return -4;
+						return -6;
 					}
 					if(broadcast_socket->SetRecvTimeout(1000) < 0) {
 						LOGF(SEVERE, "Couldn't set the timeout of the broadcast socket!");
-						return -5;
+						return -6;
 					}
-					if(broadcast_socket->Connect(creation_response->GetBroadcastUrl()) < 0) {
+					if(broadcast_socket->Connect(broadcast_url) < 0) {
 						LOGF(SEVERE, "There was a problem connecting to the broadcast socket!");
-						return -5;
+						return -6;
+					}
+					//Connect to the client socket the server bound for us
+					try {
+						client_communicator.reset(new KSync::Comm::ClientCommunicator(comm_system, client_id, false));
+					} catch (KSync::Comm::ClientCommunicator::SocketException& e) {
+						LOGF(SEVERE, "Couldn't connect to the new client socket address!! (%s)", e.GetMessage().c_str());
+						return -7;
 					}
 				} else if(recv_obj->GetType() == KSync::Comm::GatewaySocketInitializationChangeId::Type) {
 					LOGF(WARNING, "Received a ChangeId Request!!");
+					client_id = KSync::Utilities::GenUniformRandom<KSync::Utilities::client_id_t>();
 				} else {
 					LOGF(WARNING, "Unrecognized Message!");
 				}
 			}
-		}
-	}
-
-	//Close gateway socket connection
-	gateway_socket.reset();
 
+			//Close gateway socket connection
+			gateway_socket.reset();
+			return 0;
 		}
 	}
 }
@@ -0,0 +1,74 @@
+#include "ksync/logging.h"
+#include "ksync/client/session.h"
+
+namespace KSync {
+	namespace Client {
+		Session::Session(std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator, const size_t max_in_flight, const int reply_timeout) {
+			this->communicator = communicator;
+			this->in_flight = 0;
+			this->max_in_flight = max_in_flight;
+			this->reply_timeout = reply_timeout;
+		}
+
+		Session::~Session() {
+			//Callbacks reference this session, so they must all run before it goes away.
+			this->Flush();
+		}
+
+		void Session::AcquireSlot() {
+			std::unique_lock<std::mutex> lk(this->in_flight_mutex);
+			this->in_flight_cond.wait(lk, [this] { return this->in_flight < this->max_in_flight; });
+			++this->in_flight;
+		}
+
+		void Session::ReleaseSlot() {
+			std::lock_guard<std::mutex> lk(this->in_flight_mutex);
+			--this->in_flight;
+			this->in_flight_cond.notify_all();
+		}
+
+		Session::Future_t Session::Request(std::shared_ptr<KSync::Comm::CommObject>& obj) {
+			std::shared_ptr<KSync::Utilities::PromiseWrapper<std::shared_ptr<KSync::Comm::CommObject>>> promise(new KSync::Utilities::PromiseWrapper<std::shared_ptr<KSync::Comm::CommObject>>());
+			Future_t future = promise->get_future();
+			this->Request(obj, [promise](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+				if(error) {
+					promise->set_exception(error);
+				} else {
+					promise->set_value(reply);
+				}
+			});
+			return future;
+		}
+
+		void Session::Request(std::shared_ptr<KSync::Comm::CommObject>& obj, Callback_t callback) {
+			this->AcquireSlot();
+			this->communicator->send_with_callback(obj, [this, callback](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+				//Release after the callback so Flush means the callbacks have run too.
+				if(callback) {
+					callback(reply, error);
+				}
+				this->ReleaseSlot();
+			}, this->reply_timeout);
+		}
+
+		int Session::Post(std::shared_ptr<KSync::Comm::CommObject>& obj) {
+			return this->communicator->send(obj);
+		}
+
+		void Session::Flush() {
+			std::unique_lock<std::mutex> lk(this->in_flight_mutex);
+			this->in_flight_cond.wait(lk, [this] { return this->in_flight == 0; });
+		}
+
+		size_t Session::GetInFlight() {
+			std::lock_guard<std::mutex> lk(this->in_flight_mutex);
+			return this->in_flight;
+		}
+
+		void Session::SetMaxInFlight(const size_t max_in_flight) {
+			std::lock_guard<std::mutex> lk(this->in_flight_mutex);
+			this->max_in_flight = max_in_flight;
+			this->in_flight_cond.notify_all();
+		}
+	}
+}
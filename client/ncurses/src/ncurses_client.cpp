@@ -14,8 +14,11 @@
 #include "ksync/ui/ncurses/window.h"
 #include "ksync/ui/ncurses/menu.h"
 #include "ksync/client/client_state.h"
+#include "ksync/client/client_utilities.h"
+#include "ksync/client/session.h"
 #include "ksync/comm/interface.h"
 #include "ksync/comm/factory.h"
+#include "ksync/messages.h"
 
 class StateInfo : public KSync::Ui::NCursesWindow {
 	public:
@@ -46,6 +49,8 @@ class AppStateManager : public KSync::Ui::NCursesWindow {
 
 		void Draw();
 		void InitializeCommSystem();
+		void ConnectToServer();
+		void PingServer();
 		void HandleEvent(const chtype event);
 
 		void Run();
@@ -60,6 +65,8 @@ class AppStateManager : public KSync::Ui::NCursesWindow {
 		std::string gateway_socket_url;
 		std::shared_ptr<KSync::Client::ClientState> client_state;
 		std::shared_ptr<KSync::Comm::CommSystemInterface> comm_interface;
+		std::shared_ptr<KSync::Comm::CommSystemSocket> broadcast_socket;
+		std::shared_ptr<KSync::Client::Session> session;
 };
 
 StateInfo::StateInfo(std::shared_ptr<KSync::Client::ClientState>& state, unsigned int h, unsigned int w, unsigned int y, unsigned int x, KSync::Ui::Object* parent) : KSync::Ui::NCursesWindow(h, w, y, x, parent) {
@@ -94,6 +101,11 @@ void StateInfo::Draw() {
 	mvaddch(this->starty()+4, this->startx(), lt);
 	mvaddch(this->starty()+4, this->startx()+this->width()-1, rt);
 	mvhline(this->starty()+4, this->startx()+1, ts, this->width()-2);
+	if(this->client_state->GetConnectedToServer()) {
+		this->print_center_justified(5, 1, this->width()-2, "Connected To Server");
+	} else {
+		this->print_center_justified(5, 1, this->width()-2, "Not Connected");
+	}
 }
 
 
@@ -112,6 +124,10 @@ void MainMenu::HandleEvent(const chtype event) {
 			((AppStateManager*) this->GetParentObject())->Quit();
 		} else if (this->GetNameOfSelected() == "Initialize Comm System") {
 			((AppStateManager*) this->GetParentObject())->InitializeCommSystem();
+		} else if (this->GetNameOfSelected() == "Connect To Server") {
+			((AppStateManager*) this->GetParentObject())->ConnectToServer();
+		} else if (this->GetNameOfSelected() == "Ping Server") {
+			((AppStateManager*) this->GetParentObject())->PingServer();
 		}
 	} else {
 		KSync::Ui::NCursesMenu::HandleEvent(event);
@@ -136,6 +152,8 @@ AppStateManager::AppStateManager(const bool nanomsg, const std::string& gateway_
 }
 
 AppStateManager::~AppStateManager() {
+	//Wait for outstanding requests before the communicator goes away.
+	this->session.reset();
 }
 
 void AppStateManager::PositionSubordinates() {
@@ -208,15 +226,47 @@ void AppStateManager::InitializeCommSystem() {
 	}
 }
 
+void AppStateManager::ConnectToServer() {
+	std::shared_ptr<KSync::Comm::ClientCommunicator> client_communicator;
+	if(KSync::Client::ConnectToServer(this->comm_interface, this->gateway_socket_url, client_communicator, this->broadcast_socket) < 0) {
+		LOGF(SEVERE, "There was a problem connecting to the server!");
+		return;
+	}
+	this->session.reset(new KSync::Client::Session(client_communicator));
+	this->client_state->SetClientId(client_communicator->GetClientId());
+	this->client_state->SetConnectedToServer(true);
+	MainMenu* main_menu = (MainMenu*) this->GetChildObject("main_menu");
+	if(main_menu != 0) {
+		main_menu->ReplaceMenuItem("Connect To Server", "Ping Server");
+	}
+}
+
+void AppStateManager::PingServer() {
+	if(!this->session) {
+		return;
+	}
+	KSync::Comm::CommString ping("ping");
+	std::shared_ptr<KSync::Comm::CommObject> ping_obj = ping.GetCommObject();
+	//Don't block the ui waiting on the reply.
+	this->session->Request(ping_obj, [](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+		if(error||(!reply)) {
+			LOGF(WARNING, "The server didn't answer the ping!");
+		} else {
+			LOGF(INFO, "Received ping reply.");
+		}
+	});
+}
+
 //gui thread
 int main(int argc, char** argv) {
 	std::string log_dir;
 	std::string gateway_socket_url;
 	bool gateway_socket_url_defined;
 	bool nanomsg;
+	KSync::Utilities::CommTuning comm_tuning;
 
 	ArgParse::ArgParser arg_parser("KSync Server - Client side of a Client-Server synchonization system using rsync.");
-	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg);
+	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg, comm_tuning);
 
 	if(arg_parser.ParseArgs(argc, argv) < 0) {
 		printf("Problem parsing arguments\n");
@@ -24,24 +24,109 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <thread>
 #include <atomic>
 #include <future>
+#include <fstream>
 
 #include "ksync/logging.h"
+#include "ksync/tracing.h"
 #include "ksync/client.h"
 #include "ksync/messages.h"
 #include "ksync/utilities.h"
 #include "ksync/comm/interface.h"
-#include "ksync/comm/factory.h"
+#include "ksync/common_ops.h"
+#include "ksync/client/client_utilities.h"
+#include "ksync/client/session.h"
 
 #include "ksync/ArgParseStandalone.h"
 
+std::shared_ptr<KSync::Comm::CommObject> WaitForReply(KSync::Client::Session::Future_t&& future) {
+	try {
+		return future.get();
+	} catch (KSync::Utilities::PendingTimeoutException& e) {
+		LOGF(WARNING, "Timed out waiting for a reply!");
+	} catch (std::exception& e) {
+		LOGF(WARNING, "There was a problem getting a reply! (%s)", e.what());
+	}
+	return std::shared_ptr<KSync::Comm::CommObject>();
+}
+
+void PrintCommandOutput(const std::shared_ptr<KSync::Comm::CommObject>& ret_obj) {
+	std::shared_ptr<KSync::Comm::CommandOutput> com_output;
+	KSync::Comm::CommCreator(com_output, ret_obj);
+	printf("Output:\n");
+	printf("%s\n", com_output->GetStdout().c_str());
+	printf("Error:\n");
+	printf("%s\n", com_output->GetStderr().c_str());
+	printf("Return Code: (%i)\n", com_output->GetReturnCode());
+}
+
+void PrintRefusal(const std::shared_ptr<KSync::Comm::CommObject>& ret_obj) {
+	std::shared_ptr<KSync::Comm::RequestRefused> refusal;
+	KSync::Comm::CommCreator(refusal, ret_obj);
+	LOGF(WARNING, "Request refused (%s)", refusal->c_str());
+}
+
+//Send every line of the script without waiting for the replies in between.
+//Lines starting with 'command:' are executed on the server, others are echoed.
+int RunScript(KSync::Client::Session& session, const std::string& script_path) {
+	std::ifstream script(script_path.c_str());
+	if(!script) {
+		LOGF(SEVERE, "Couldn't open the script (%s)!", script_path.c_str());
+		return -1;
+	}
+	std::atomic<size_t> num_failed(0);
+	size_t num_sent = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::string line;
+	while(std::getline(script, line)) {
+		if(line == "") {
+			continue;
+		}
+		std::shared_ptr<KSync::Comm::CommObject> send_obj;
+		KSync::Comm::Type_t expected_type;
+		if(line.substr(0,8) == "command:") {
+			std::string extracted_command = line.substr(8);
+			KSync::Comm::ExecuteCommand command = KSync::Utilities::trim(extracted_command);
+			send_obj = command.GetCommObject();
+			expected_type = KSync::Comm::CommandOutput::Type;
+		} else {
+			KSync::Comm::CommString message = line;
+			send_obj = message.GetCommObject();
+			expected_type = KSync::Comm::CommString::Type;
+		}
+		session.Request(send_obj, [&num_failed, expected_type](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+			if(error||(!reply)||(reply->GetType() != expected_type)) {
+				++num_failed;
+			} else if (expected_type == KSync::Comm::CommandOutput::Type) {
+				PrintCommandOutput(reply);
+			}
+		});
+		++num_sent;
+	}
+	session.Flush();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	LOGF(INFO, "Sent (%lu) requests in (%f) s, (%lu) failed.", num_sent, elapsed, num_failed.load());
+	printf("Sent (%lu) requests in (%f) s (%f req/s), (%lu) failed.\n", num_sent, elapsed, elapsed > 0 ? num_sent/elapsed : 0., num_failed.load());
+	if(num_failed.load() != 0) {
+		return -2;
+	}
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	std::string log_dir;
 	std::string gateway_socket_url;
 	bool gateway_socket_url_defined;
 	bool nanomsg;
+	KSync::Utilities::CommTuning comm_tuning;
+	std::string script_path;
+	std::string trace_path;
+	int max_in_flight = KSync::Client::Session::DefaultMaxInFlight;
 
 	ArgParse::ArgParser arg_parser("KSync Server - Client side of a Client-Server synchonization system using rsync.");
-	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg);
+	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg, comm_tuning);
+	arg_parser.AddArgument("--script", "Pipeline every line of this file to the server and exit.", &script_path);
+	arg_parser.AddArgument("--max-in-flight", "Maximum number of requests waiting on a reply at once.", &max_in_flight);
+	arg_parser.AddArgument("--trace", "Record per-message spans and write them to this file as Chrome trace JSON.", &trace_path);
 
 	if(arg_parser.ParseArgs(argc, argv) < 0) {
 		LOGF(SEVERE, "Problem parsing arguments");
@@ -63,6 +148,12 @@ int main(int argc, char** argv) {
 	//Initialize logging:
 	std::unique_ptr<g3::LogWorker> logworker;
 	KSync::InitializeLogger(logworker, true, "KSync Client", log_dir);
+	if(trace_path != "") {
+		if(KSync::Tracing::Enable(trace_path, "KSync Client") < 0) {
+			LOGF(SEVERE, "There was a problem enabling tracing!");
+			return -2;
+		}
+	}
 
 	//Get Default gateway socket url
 	if (!gateway_socket_url_defined) {
@@ -81,97 +172,29 @@ int main(int argc, char** argv) {
 
 	//Initialize Comm System
 	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
-	if (!nanomsg) {
-		if (KSync::Comm::GetZeromqCommSystem(comm_system) < 0) {
-			LOGF(SEVERE, "There was a problem initializing the ZeroMQ communication system!");
-			return -2;
-		}
-	} else {
-		if (KSync::Comm::GetNanomsgCommSystem(comm_system) < 0) {
-			LOGF(SEVERE, "There was a problem initializing the Nanomsg communication system!");
-			return -2;
-		}
+	if (KSync::Utilities::GetCommSystem(comm_system, nanomsg, comm_tuning) < 0) {
+		LOGF(SEVERE, "There was a problem initializing the comm system!");
+		return -2;
 	}
 
-	//Connect to gateway socket
-	std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_socket;
-	if (comm_system->Create_Gateway_Req_Socket(gateway_socket) < 0) {
-		LOGF(SEVERE, "There was a problem creating the gateway socket!");
+	std::shared_ptr<KSync::Comm::ClientCommunicator> client_communicator;
+	std::shared_ptr<KSync::Comm::CommSystemSocket> broadcast_socket;
+	if(KSync::Client::ConnectToServer(comm_system, gateway_socket_url, client_communicator, broadcast_socket) < 0) {
+		LOGF(SEVERE, "There was a problem connecting to the server!");
 		return -3;
 	}
 
-	if(gateway_socket->SetRecvTimeout(20000) < 0) {
-		LOGF(SEVERE, "There was a problem setting the receive timeout!");
-		return -4;
-	}
-
-	if (gateway_socket->Connect(gateway_socket_url) < 0) {
-		LOGF(SEVERE, "There was a problem connecting to the gateway socket!");
-		return -4;
-	}
+	KSync::Client::Session session(client_communicator, (size_t) max_in_flight);
 
-	std::shared_ptr<KSync::Comm::CommSystemSocket> client_socket;
-	std::shared_ptr<KSync::Comm::CommSystemSocket> broadcast_socket;
-	int status = 0;
-	//Request client socket connection
-	while (!client_socket) {
-		KSync::Comm::GatewaySocketInitializationRequest request(KSync::Utilities::GenerateNewClientId());
-		std::shared_ptr<KSync::Comm::CommObject> request_obj = request.GetCommObject();
-		status = gateway_socket->Send(request_obj);
-		if(status == KSync::Comm::CommSystemSocket::Other) {
-			LOGF(WARNING, "There was a problem sending the message!!");
-		} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-			LOGF(WARNING, "Sending the message timed out!");
-		} else {
-			std::shared_ptr<KSync::Comm::CommObject> recv_obj;
-			status = gateway_socket->Recv(recv_obj);
-			if(status == KSync::Comm::CommSystemSocket::Other) {
-				LOGF(WARNING, "Problem receiving response");
-			} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-				LOGF(WARNING, "Receiving response timed out!");
-			} else {
-				if(recv_obj->GetType() == KSync::Comm::ClientSocketCreation::Type) {
-					std::shared_ptr<KSync::Comm::ClientSocketCreation> creation_response;
-					KSync::Comm::CommCreator(creation_response, recv_obj);
-					//Start and connect to client socket
-					if(comm_system->Create_Pair_Socket(client_socket) < 0) {
-						LOGF(SEVERE, "There was a problem creating the pair socket!");
-						return -1;
-					}
-					if(client_socket->SetRecvTimeout(1000) < 0) {
-						LOGF(SEVERE, "There was a problem setting the client socket timeout!");
-						return -2;
-					}
-					if(client_socket->Connect(creation_response->GetClientUrl()) < 0) {
-						LOGF(SEVERE, "Couldn't connect to the new client socket address!!");
-						return -3;
-					}
-
-					//Start and connect to broadcast socket
-					if(comm_system->Create_Sub_Socket(broadcast_socket) < 0) {
-						LOGF(SEVERE, "There was a problem creating the broadcast socket!");
-						return -4;
-					}
-					if(broadcast_socket->SetRecvTimeout(1000) < 0) {
-						LOGF(SEVERE, "Couldn't set the timeout of the broadcast socket!");
-						return -5;
-					}
-					if(broadcast_socket->Connect(creation_response->GetBroadcastUrl()) < 0) {
-						LOGF(SEVERE, "There was a problem connecting to the broadcast socket!");
-						return -5;
-					}
-				} else if(recv_obj->GetType() == KSync::Comm::GatewaySocketInitializationChangeId::Type) {
-					LOGF(WARNING, "Received a ChangeId Request!!");
-				} else {
-					LOGF(WARNING, "Unrecognized Message!");
-				}
-			}
+	if(script_path != "") {
+		int script_status = RunScript(session, script_path);
+		session.Flush();
+		if(KSync::Tracing::Finish() < 0) {
+			LOGF(WARNING, "There was a problem writing the trace!");
 		}
+		return script_status;
 	}
 
-	//Close gateway socket connection
-	gateway_socket.reset();
-
 	std::shared_ptr<std::thread> io_thread;
 	std::shared_ptr<std::promise<std::string>> io_result;
 	std::future<std::string> io_future;
@@ -227,79 +250,50 @@ int main(int argc, char** argv) {
 				if (message_to_send == "quit") {
 					KSync::Comm::ShutdownRequest shutdown_req;
 					std::shared_ptr<KSync::Comm::CommObject> shutdown_obj = shutdown_req.GetCommObject();
-					status = client_socket->Send(shutdown_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(WARNING, "There was an error sending the shutdown request!");
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(WARNING, "There was a timeout sending the shutdown request!");
+					std::shared_ptr<KSync::Comm::CommObject> rep_obj = WaitForReply(session.Request(shutdown_obj));
+					if((!rep_obj)||(rep_obj->GetType() != KSync::Comm::ShutdownAck::Type)) {
+						LOGF(WARNING, "Shutdown Acknowledgement not received!");
+						break;
+					}
+				} else if (message_to_send == "stats") {
+					KSync::Comm::StatsRequest stats_req;
+					std::shared_ptr<KSync::Comm::CommObject> stats_obj = stats_req.GetCommObject();
+					std::shared_ptr<KSync::Comm::CommObject> rep_obj = WaitForReply(session.Request(stats_obj));
+					if(rep_obj&&(rep_obj->GetType() == KSync::Comm::StatsReply::Type)) {
+						std::shared_ptr<KSync::Comm::StatsReply> stats_reply;
+						KSync::Comm::CommCreator(stats_reply, rep_obj);
+						printf("%s", stats_reply->c_str());
 					} else {
-						std::shared_ptr<KSync::Comm::CommObject> rep_obj;
-						status = client_socket->ForceRecv(rep_obj);
-						if(status == KSync::Comm::CommSystemSocket::Other) {
-							LOGF(WARNING, "There was a problem getting a response to the shutdown request!");
-						} else {
-							if(rep_obj->GetType() != KSync::Comm::ShutdownAck::Type) {
-								LOGF(WARNING, "Shutdown Acknowledgement not received!");
-								break;
-							}
-						}
+						LOGF(WARNING, "Stats reply not received!");
 					}
 				} else if (message_to_send.substr(0,8) == "command:") {
 					std::string extracted_command = message_to_send.substr(8);
 					extracted_command = KSync::Utilities::trim(extracted_command);
 					KSync::Comm::ExecuteCommand command = extracted_command;
 					std::shared_ptr<KSync::Comm::CommObject> send_obj = command.GetCommObject();
-					status = client_socket->Send(send_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(WARNING, "There was a problem sending the command!");
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-					} else {
-						std::shared_ptr<KSync::Comm::CommObject> ret_obj;
-						status = client_socket->ForceRecv(ret_obj);
-						if(status == KSync::Comm::CommSystemSocket::Other) {
-							LOGF(WARNING, "There was a problem receiving the reply!");
-						} else if (status == KSync::Comm::CommSystemSocket::Success) {
-							if(ret_obj->GetType() == KSync::Comm::CommandOutput::Type) {
-								std::shared_ptr<KSync::Comm::CommandOutput> com_output;
-								KSync::Comm::CommCreator(com_output, ret_obj);
-								printf("Output:\n");
-								printf("%s\n", com_output->GetStdout().c_str());
-								printf("Error:\n");
-								printf("%s\n", com_output->GetStderr().c_str());
-								printf("Return Code: (%i)\n", com_output->GetReturnCode());
-							} else {
-								LOGF(WARNING, "Other object types are not supported here");
-							}
+					std::shared_ptr<KSync::Comm::CommObject> ret_obj = WaitForReply(session.Request(send_obj));
+					if(ret_obj) {
+						if(ret_obj->GetType() == KSync::Comm::CommandOutput::Type) {
+							PrintCommandOutput(ret_obj);
+						} else if (ret_obj->GetType() == KSync::Comm::RequestRefused::Type) {
+							PrintRefusal(ret_obj);
+						} else {
+							LOGF(WARNING, "Other object types are not supported here");
 						}
 					}
 				} else {
-					std::shared_ptr<KSync::Comm::CommObject> send_obj;
 					LOGF(INFO, "Sending message: (%s)", message_to_send.c_str());
-					send_obj = message_to_send.GetCommObject();
-					status = client_socket->Send(send_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(SEVERE, "There was a problem sending the string to the server!");
-						return -1;
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(SEVERE, "Sending the message timed out!!");
-						return -2;
-					} else {
-						std::shared_ptr<KSync::Comm::CommObject> recv_obj;
-						status = client_socket->ForceRecv(recv_obj);
-						if(status == KSync::Comm::CommSystemSocket::Other) {
-							LOGF(SEVERE, "There was a problem receiving a response!");
-							return -3;
-						} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
-						} else {
-							if(recv_obj->GetType() == KSync::Comm::CommString::Type) {
-								std::shared_ptr<KSync::Comm::CommString> received_string;
-								KSync::Comm::CommCreator(received_string, recv_obj);
-								LOGF(INFO, "Received(%s)", received_string->c_str());
-								if (*received_string != message_to_send) {
-									LOGF(SEVERE, "Received message was different!");
-								}
-							}
+					std::shared_ptr<KSync::Comm::CommObject> send_obj = message_to_send.GetCommObject();
+					std::shared_ptr<KSync::Comm::CommObject> recv_obj = WaitForReply(session.Request(send_obj));
+					if(recv_obj&&(recv_obj->GetType() == KSync::Comm::CommString::Type)) {
+						std::shared_ptr<KSync::Comm::CommString> received_string;
+						KSync::Comm::CommCreator(received_string, recv_obj);
+						LOGF(INFO, "Received(%s)", received_string->c_str());
+						if (*received_string != message_to_send) {
+							LOGF(SEVERE, "Received message was different!");
 						}
+					} else if (recv_obj&&(recv_obj->GetType() == KSync::Comm::RequestRefused::Type)) {
+						PrintRefusal(recv_obj);
 					}
 				}
 				//Cleanup IO thread stuff
@@ -314,7 +308,7 @@ int main(int argc, char** argv) {
 
 		//Test broadcast socket
 		std::shared_ptr<KSync::Comm::CommObject> broad_obj;
-		status = broadcast_socket->Recv(broad_obj);
+		int status = broadcast_socket->Recv(broad_obj);
 		if(status == KSync::Comm::CommSystemSocket::Other) {
 			LOGF(WARNING, "There was a problem reading from the broadcast socket!");
 		} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
@@ -334,5 +328,9 @@ int main(int argc, char** argv) {
 			io_thread->join();
 		}
 	}
+	session.Flush();
+	if(KSync::Tracing::Finish() < 0) {
+		LOGF(WARNING, "There was a problem writing the trace!");
+	}
 	return 0;
 }
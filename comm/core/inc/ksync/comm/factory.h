@@ -24,7 +24,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 namespace KSync {
 	namespace Comm {
 		int GetNanomsgCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface);
-		int GetZeromqCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface); 
+		int GetZeromqCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface, const int io_threads = 1);
+		//In process sockets with no injected latency, bandwidth limit or loss.
+		int GetLoopbackCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface);
 	}
 }
 
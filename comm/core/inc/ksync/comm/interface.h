@@ -20,11 +20,37 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define KSYNC_COMM_SYSTEM_INT_HDR
 
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 
 #include "ksync/comm/object.h"
+#include "ksync/metrics.h"
 
 namespace KSync {
 	namespace Comm {
+		//Tuning applied to a socket when it's created. Fields left Unset take the
+		//comm system's default for the socket's role.
+		class SocketOptions {
+			public:
+				static const int Unset = -1;
+
+				SocketOptions();
+				//Fill in every Unset field from defaults.
+				SocketOptions Merge(const SocketOptions& defaults) const;
+
+				//Most messages queued in each direction before sends block or receives
+				//are left in the kernel. zeromq only, 0 means no limit.
+				int send_hwm;
+				int recv_hwm;
+				//Kernel SO_SNDBUF and SO_RCVBUF in bytes for zeromq, or nanomsg's own
+				//buffer sizes. 0 leaves the operating system's default.
+				int send_buffer;
+				int recv_buffer;
+				//Bit mask of the zeromq IO threads allowed to serve the socket, 0 means any.
+				int64_t affinity;
+		};
+
 		class CommSystemSocket {
 			public:
 				CommSystemSocket();
@@ -33,34 +59,94 @@ namespace KSync {
 				static const int Success = 0;
 				static const int Timeout = 1;
 				static const int EmptyMessage = 2;
+				static const int Woken = 3;
 				static const int Other = -1;
 
 				int Bind(const std::string& address);
 				virtual int BindImp(const std::string& address) = 0;
 				int Connect(const std::string& address);
 				virtual int ConnectImp(const std::string& address) = 0;
-				virtual int Send(const std::shared_ptr<CommObject> comm_obj) = 0;
-				virtual int Recv(std::shared_ptr<CommObject>& comm_obj) = 0;
+				int Send(const std::shared_ptr<CommObject> comm_obj);
+				virtual int SendImp(const std::shared_ptr<CommObject> comm_obj) = 0;
+				int Recv(std::shared_ptr<CommObject>& comm_obj);
+				virtual int RecvImp(std::shared_ptr<CommObject>& comm_obj) = 0;
 				virtual int ForceRecv(std::shared_ptr<CommObject>& comm_obj);
+				//Router sockets take requests from many peers at once and address each
+				//reply by the peer its request came from. Other sockets leave peer empty
+				//and behave like Recv and Send.
+				int RecvRouted(std::string& peer, std::shared_ptr<CommObject>& comm_obj);
+				virtual int RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj);
+				int SendRouted(const std::string& peer, const std::shared_ptr<CommObject> comm_obj);
+				virtual int SendRoutedImp(const std::string& peer, const std::shared_ptr<CommObject> comm_obj);
+				//Wait up to timeout ms for a message. Returns Success once Recv won't block,
+				//or Woken if wakeup_fd became readable first. A wakeup_fd < 0 is ignored.
+				virtual int Poll(const int timeout, const int wakeup_fd = -1) = 0;
 				virtual int SetSendTimeout(int timeout = -1) = 0;
 				virtual int SetRecvTimeout(int timeout = -1) = 0;
+				//Takes effect for connections made after it's called. Options the backend
+				//doesn't have are ignored.
+				virtual int SetOptions(const SocketOptions& options) = 0;
+
+				//Send and Recv latencies are recorded per message type under
+				//comm.<backend>.<socket_type>. Called by the comm system which made the socket.
+				void SetMetricsName(const std::string& backend, const std::string& socket_type);
 			protected:
 				bool bind;
 				std::string url;
+			private:
+				void RecordSend(const int status, const std::shared_ptr<CommObject>& comm_obj, const std::chrono::steady_clock::time_point& start);
+				void RecordRecv(const int status, const std::shared_ptr<CommObject>& comm_obj, const std::chrono::steady_clock::time_point& start);
+
+				class DirectionMetrics {
+					public:
+						DirectionMetrics();
+						void Init(const std::string& prefix);
+						KSync::Metrics::Histogram& GetLatency(const Type_t type);
+
+						std::string prefix;
+						KSync::Metrics::Counter* bytes;
+						KSync::Metrics::Counter* timeouts;
+						KSync::Metrics::Counter* errors;
+						std::atomic<KSync::Metrics::Histogram*> latency[256];
+				};
+
+				DirectionMetrics send_metrics;
+				DirectionMetrics recv_metrics;
 		};
 
 		class CommSystemInterface {
 			public:
+				//What a socket is used for, which decides its default options.
+				//Gateway sockets carry small, infrequent requests. Data sockets are the
+				//pair sockets under each ClientCommunicator and carry bulk transfers.
+				//Broadcast sockets are pub and sub, pipeline sockets push and pull.
+				static const int GatewayRole = 0;
+				static const int DataRole = 1;
+				static const int BroadcastRole = 2;
+				static const int PipelineRole = 3;
+				static const int NumRoles = 4;
+
 				CommSystemInterface();
 				virtual ~CommSystemInterface();
 
-				virtual int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
-				virtual int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1) = 0;
+				virtual int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				//Answers many Gateway_Req sockets concurrently through RecvRouted and SendRouted.
+				virtual int Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+				virtual int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions()) = 0;
+
+				//Set fields of options override the defaults for every socket of role created afterwards.
+				void SetRoleDefaults(const int role, const SocketOptions& options);
+				const SocketOptions& GetRoleDefaults(const int role) const;
+			protected:
+				//Set up a newly created socket with options, falling back to role's defaults.
+				int InitSocket(CommSystemSocket* socket, const int role, const int recv_timeout, const int send_timeout, const SocketOptions& options);
+			private:
+				SocketOptions role_defaults[NumRoles];
 		};
 	}
 }
@@ -4,8 +4,11 @@
 #include "ksync/types.h"
 #include "ksync/ksync_exception.h"
 #include "ksync/messages.h"
+#include "ksync/buffer_pool.h"
 
-#define CRC8 0x9B
+#include <memory>
+#include <utility>
+#include <cstdint>
 
 namespace KSync {
 	namespace Comm {
@@ -28,19 +31,63 @@ namespace KSync {
 						CommObjectConstructorException();
 				};
 
-				typedef short unsigned int message_id_t;
+				//Message ids are handed out from a process wide counter so they never
+				//repeat within the lifetime of a connection. 0 means 'no message'.
+				typedef uint64_t message_id_t;
 
 				static message_id_t GenMessageId();
 
+				//Requests being traced carry a trace id which their replies copy. 0 means not traced.
+				typedef uint64_t trace_id_t;
+
+				// Packed layout, all integers little endian:
+				//   0 uint16_t magic
+				//   2 uint8_t version
+				//   3 uint8_t flags
+				//   4 Type_t type
+				//   5 three reserved bytes, zero
+				//   8 message_id_t message_id
+				//  16 message_id_t reply_id
+				//  24 trace_id_t trace_id
+				//  32 uint32_t payload size
+				//  36 uint32_t CRC32 of the payload
+				//  40 payload
+				// Pooled buffers are 16 byte aligned, so the payload is 8 byte aligned.
+				static const size_t HeaderSize = 40;
+				static const uint16_t Magic = 0x534B;
+				static const uint8_t Version = 1;
+
+				//The trace id is meaningful. Unknown flags are refused when unpacking.
+				static const uint8_t FlagTraced = 0x01;
+				static const uint8_t KnownFlags = FlagTraced;
+
 				CommObject(const char* data, const size_t size, const bool pre_packed, const Comm::Type_t type = Comm::CommunicableObject::Type, const message_id_t reply_id = 0);
+				//Allocate a packed object with room for payload_size bytes which the caller fills
+				//in through GetWritablePayload() before calling Seal().
+				CommObject(const size_t payload_size, const Comm::Type_t type, const message_id_t reply_id = 0);
 				~CommObject();
 
+				//Construct with the same arguments as the constructors, with the object,
+				//its shared_ptr control block and its data all coming from the buffer pool.
+				template<typename... Args>
+				static std::shared_ptr<CommObject> Create(Args&&... args) {
+					return std::allocate_shared<CommObject>(KSync::BufferPool::Allocator<CommObject>(), std::forward<Args>(args)...);
+				}
+
 				int Pack() __attribute__((warn_unused_result));
 				int UnPack() __attribute__((warn_unused_result));
-				static char GenCRC8(const char* data, const size_t size);
+				static uint32_t GenCRC32(const char* data, const size_t size);
+
+				char* GetWritablePayload() {
+					return this->data + HeaderSize;
+				}
+				size_t GetPayloadCapacity() const {
+					return this->capacity;
+				}
+				int Seal(const size_t payload_size) __attribute__((warn_unused_result));
 
 				const char* GetDataPointer() const {
-					return this->data;
+					return this->data+this->offset;
 				}
 				size_t GetDataSize() const {
 					return this->size;
@@ -49,22 +96,38 @@ namespace KSync {
 				Comm::Type_t GetType() const {
 					return this->type;
 				}
+				uint8_t GetFlags() const {
+					return this->flags;
+				}
 				message_id_t GetMessageId() const  {
 					return this->message_id;
 				}
 				message_id_t GetReplyId() const {
 					return this->reply_id;
 				}
+				//Mark this object as the reply to the message with the given id.
+				void SetReplyId(const message_id_t reply_id);
+				trace_id_t GetTraceId() const {
+					return this->trace_id;
+				}
+				void SetTraceId(const trace_id_t trace_id);
 
 
 			private:
+				void WriteHeader();
+
 				bool packed;
+				uint8_t flags;
 				Comm::Type_t type;
 				message_id_t message_id;
 				message_id_t reply_id;
-				char crc;
+				trace_id_t trace_id;
+				uint32_t crc;
+				//Unpacking just steps over the header, data always points at the whole buffer.
 				char* data;
+				size_t offset;
 				size_t size;
+				size_t capacity;
 		};
 	}
 }
@@ -1,15 +1,180 @@
+#include <chrono>
+
 #include "ksync/logging.h"
 #include "ksync/comm/interface.h"
 
 namespace KSync {
 	namespace Comm {
+		SocketOptions::SocketOptions() {
+			this->send_hwm = Unset;
+			this->recv_hwm = Unset;
+			this->send_buffer = Unset;
+			this->recv_buffer = Unset;
+			this->affinity = Unset;
+		}
+
+		SocketOptions SocketOptions::Merge(const SocketOptions& defaults) const {
+			SocketOptions merged(*this);
+			if(merged.send_hwm == Unset) {
+				merged.send_hwm = defaults.send_hwm;
+			}
+			if(merged.recv_hwm == Unset) {
+				merged.recv_hwm = defaults.recv_hwm;
+			}
+			if(merged.send_buffer == Unset) {
+				merged.send_buffer = defaults.send_buffer;
+			}
+			if(merged.recv_buffer == Unset) {
+				merged.recv_buffer = defaults.recv_buffer;
+			}
+			if(merged.affinity == Unset) {
+				merged.affinity = defaults.affinity;
+			}
+			return merged;
+		}
+
 		CommSystemInterface::CommSystemInterface() {
+			//zeromq's own defaults, except that bulk transfers get big kernel buffers.
+			//The kernel caps these at net.core.wmem_max and rmem_max.
+			for(int role = 0; role < NumRoles; ++role) {
+				this->role_defaults[role].send_hwm = 1000;
+				this->role_defaults[role].recv_hwm = 1000;
+				this->role_defaults[role].send_buffer = 0;
+				this->role_defaults[role].recv_buffer = 0;
+				this->role_defaults[role].affinity = 0;
+			}
+			this->role_defaults[DataRole].send_buffer = 4 << 20;
+			this->role_defaults[DataRole].recv_buffer = 4 << 20;
+			this->role_defaults[PipelineRole].send_buffer = 4 << 20;
+			this->role_defaults[PipelineRole].recv_buffer = 4 << 20;
+		}
+
+		void CommSystemInterface::SetRoleDefaults(const int role, const SocketOptions& options) {
+			this->role_defaults[role] = options.Merge(this->role_defaults[role]);
+		}
+
+		const SocketOptions& CommSystemInterface::GetRoleDefaults(const int role) const {
+			return this->role_defaults[role];
+		}
+
+		int CommSystemInterface::InitSocket(CommSystemSocket* socket, const int role, const int recv_timeout, const int send_timeout, const SocketOptions& options) {
+			if(socket->SetOptions(options.Merge(this->role_defaults[role])) < 0) {
+				LOGF(WARNING, "Couldn't set all of the socket's options!");
+			}
+			if(socket->SetSendTimeout(send_timeout) < 0) {
+				return -1;
+			}
+			if(socket->SetRecvTimeout(recv_timeout) < 0) {
+				return -1;
+			}
+			return 0;
 		}
 
 		CommSystemInterface::~CommSystemInterface() {
 		}
 
+		CommSystemSocket::DirectionMetrics::DirectionMetrics() {
+			this->bytes = 0;
+			this->timeouts = 0;
+			this->errors = 0;
+			for(size_t i = 0; i < 256; ++i) {
+				this->latency[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		void CommSystemSocket::DirectionMetrics::Init(const std::string& prefix) {
+			this->prefix = prefix;
+			this->bytes = &KSync::Metrics::GetCounter(prefix+".bytes");
+			this->timeouts = &KSync::Metrics::GetCounter(prefix+".timeouts");
+			this->errors = &KSync::Metrics::GetCounter(prefix+".errors");
+			for(size_t i = 0; i < 256; ++i) {
+				this->latency[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		KSync::Metrics::Histogram& CommSystemSocket::DirectionMetrics::GetLatency(const Type_t type) {
+			KSync::Metrics::Histogram* histogram = this->latency[type].load(std::memory_order_relaxed);
+			if(histogram == 0) {
+				std::string type_name;
+				try {
+					type_name = GetTypeName(type);
+				} catch (TypeException& e) {
+					type_name = "Unknown";
+				}
+				histogram = &KSync::Metrics::GetHistogram(this->prefix+".latency."+type_name);
+				this->latency[type].store(histogram, std::memory_order_relaxed);
+			}
+			return *histogram;
+		}
+
 		CommSystemSocket::CommSystemSocket() {
+			this->SetMetricsName("unknown", "unknown");
+		}
+
+		void CommSystemSocket::SetMetricsName(const std::string& backend, const std::string& socket_type) {
+			const std::string prefix = "comm."+backend+"."+socket_type;
+			this->send_metrics.Init(prefix+".send");
+			this->recv_metrics.Init(prefix+".recv");
+		}
+
+		void CommSystemSocket::RecordSend(const int status, const std::shared_ptr<CommObject>& comm_obj, const std::chrono::steady_clock::time_point& start) {
+			if(status == Success) {
+				this->send_metrics.GetLatency(comm_obj->GetType()).Record((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count());
+				this->send_metrics.bytes->Add(comm_obj->GetDataSize());
+			} else if (status == Timeout) {
+				this->send_metrics.timeouts->Add();
+			} else if (status == Other) {
+				this->send_metrics.errors->Add();
+			}
+		}
+
+		//The receive latency includes any time spent waiting for the message to arrive.
+		void CommSystemSocket::RecordRecv(const int status, const std::shared_ptr<CommObject>& comm_obj, const std::chrono::steady_clock::time_point& start) {
+			if(status == Success) {
+				this->recv_metrics.GetLatency(comm_obj->GetType()).Record((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count());
+				this->recv_metrics.bytes->Add(comm_obj->GetDataSize());
+			} else if (status == Timeout) {
+				this->recv_metrics.timeouts->Add();
+			} else if (status == Other) {
+				this->recv_metrics.errors->Add();
+			}
+		}
+
+		int CommSystemSocket::Send(const std::shared_ptr<CommObject> comm_obj) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int status = this->SendImp(comm_obj);
+			this->RecordSend(status, comm_obj, start);
+			return status;
+		}
+
+		int CommSystemSocket::Recv(std::shared_ptr<CommObject>& comm_obj) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int status = this->RecvImp(comm_obj);
+			this->RecordRecv(status, comm_obj, start);
+			return status;
+		}
+
+		int CommSystemSocket::SendRouted(const std::string& peer, const std::shared_ptr<CommObject> comm_obj) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int status = this->SendRoutedImp(peer, comm_obj);
+			this->RecordSend(status, comm_obj, start);
+			return status;
+		}
+
+		int CommSystemSocket::RecvRouted(std::string& peer, std::shared_ptr<CommObject>& comm_obj) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int status = this->RecvRoutedImp(peer, comm_obj);
+			this->RecordRecv(status, comm_obj, start);
+			return status;
+		}
+
+		int CommSystemSocket::SendRoutedImp(const std::string& peer __attribute__((unused)), const std::shared_ptr<CommObject> comm_obj) {
+			return this->SendImp(comm_obj);
+		}
+
+		int CommSystemSocket::RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj) {
+			peer.clear();
+			return this->RecvImp(comm_obj);
 		}
 
 		CommSystemSocket::~CommSystemSocket() {
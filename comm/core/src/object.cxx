@@ -1,5 +1,6 @@
 #include <cstring>
 #include <sstream>
+#include <atomic>
 
 #include "ksync/logging.h"
 #include "ksync/comm/object.h"
@@ -23,22 +24,69 @@ namespace KSync {
 			SetMessage("There was a problem constructing the comm object!");
 		}
 
+		static std::atomic<CommObject::message_id_t> next_message_id(1);
+
 		CommObject::message_id_t CommObject::GenMessageId() {
-			message_id_t id = 0;
-			while(id == 0) {
-				id = KSync::Utilities::GenUniformRandom<CommObject::message_id_t>();
+			return next_message_id.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		const size_t CommObject::HeaderSize;
+		const uint16_t CommObject::Magic;
+		const uint8_t CommObject::Version;
+		const uint8_t CommObject::FlagTraced;
+		const uint8_t CommObject::KnownFlags;
+
+		static const size_t MagicOffset = 0;
+		static const size_t VersionOffset = 2;
+		static const size_t FlagsOffset = 3;
+		static const size_t TypeOffset = 4;
+		static const size_t MessageIdOffset = 8;
+		static const size_t ReplyIdOffset = 16;
+		static const size_t TraceIdOffset = 24;
+		static const size_t SizeOffset = 32;
+		static const size_t CRCOffset = 36;
+
+		//Byte at a time so it's right on any host, the compiler turns these into plain loads and stores.
+		template<typename T>
+		static void StoreLE(char* out, T value) {
+			for(size_t i = 0; i < sizeof(T); ++i) {
+				out[i] = (char) (value & 0xff);
+				value = (T) (value >> 8);
+			}
+		}
+
+		template<typename T>
+		static T LoadLE(const char* in) {
+			T value = 0;
+			for(size_t i = 0; i < sizeof(T); ++i) {
+				value = (T) (value|(((T) (uint8_t) in[i]) << (8*i)));
 			}
-			return id;
+			return value;
 		}
 
-		// Packed CommObject Layout
-		// Type_t type
-		// message_id_t message_id
-		// message_id_t reply_id
-		// char crc
-		// char data[]
+		void CommObject::SetReplyId(const message_id_t reply_id) {
+			this->reply_id = reply_id;
+			if(this->packed) {
+				StoreLE<message_id_t>(this->data+ReplyIdOffset, this->reply_id);
+			}
+		}
+
+		void CommObject::SetTraceId(const trace_id_t trace_id) {
+			this->trace_id = trace_id;
+			if(this->trace_id != 0) {
+				this->flags |= FlagTraced;
+			} else {
+				this->flags &= (uint8_t) ~FlagTraced;
+			}
+			if(this->packed) {
+				this->data[FlagsOffset] = (char) this->flags;
+				StoreLE<trace_id_t>(this->data+TraceIdOffset, this->trace_id);
+			}
+		}
 
 		CommObject::CommObject(const char* data, const size_t size, const bool pre_packed, const Type_t type, const message_id_t reply_id) {
+			this->capacity = 0;
+			this->offset = 0;
 			if(data == 0) {
 				if (size != 0) {
 					LOGF(SEVERE, "Can't use size != 0 with a null data pointer!!");
@@ -48,67 +96,125 @@ namespace KSync {
 					LOGF(SEVERE, "Can't say an object is pre-packed if using a null data input");
 					throw CommObjectConstructorException();
 				}
+				this->flags = 0;
 				this->type = type;
 				this->data = 0;
 				this->size = 0;
 				this->message_id = GenMessageId();
 				this->reply_id = reply_id;
+				this->trace_id = 0;
+				this->packed = false;
 				if(Pack() < 0) {
 					throw PackException(this->type);
 				}
-			} else {
-				this->data = new char[size];
+			} else if (pre_packed) {
+				this->data = KSync::BufferPool::Allocate(size);
 				memcpy(this->data, data, size);
 				this->size = size;
-				if (pre_packed) {
-					this->type = ((Type_t*)this->data)[0];
-					this->message_id = ((message_id_t*)(this->data + sizeof(this->type)))[0];
-					this->reply_id = ((message_id_t*)(this->data + sizeof(this->type) + sizeof(this->message_id)))[0];
-					this->crc = ((char*)(this->data + sizeof(this->type) + sizeof(this->message_id) + sizeof(this->reply_id)))[0];
-					this->packed = true;
+				//A short buffer is refused by UnPack.
+				if(size >= HeaderSize) {
+					this->flags = (uint8_t) this->data[FlagsOffset];
+					this->type = (Type_t) this->data[TypeOffset];
+					this->message_id = LoadLE<message_id_t>(this->data+MessageIdOffset);
+					this->reply_id = LoadLE<message_id_t>(this->data+ReplyIdOffset);
+					this->trace_id = LoadLE<trace_id_t>(this->data+TraceIdOffset);
+					this->crc = LoadLE<uint32_t>(this->data+CRCOffset);
 				} else {
-					this->type = type;
-					this->message_id = GenMessageId();
-					this->reply_id = reply_id;
-					if(Pack() < 0) {
-						throw PackException(this->type);
-					}
+					this->flags = 0;
+					this->type = CommunicableObject::Type;
+					this->message_id = 0;
+					this->reply_id = 0;
+					this->trace_id = 0;
+					this->crc = 0;
 				}
+				this->packed = true;
+			} else {
+				//Copy the payload straight into its packed position so it is only copied once.
+				this->flags = 0;
+				this->type = type;
+				this->message_id = GenMessageId();
+				this->reply_id = reply_id;
+				this->trace_id = 0;
+				this->data = KSync::BufferPool::Allocate(HeaderSize+size);
+				memcpy(this->data+HeaderSize, data, size);
+				this->size = HeaderSize+size;
+				this->crc = GenCRC32(this->data+HeaderSize, size);
+				WriteHeader();
+				this->packed = true;
 			}
+		}
 
+		CommObject::CommObject(const size_t payload_size, const Type_t type, const message_id_t reply_id) {
+			this->flags = 0;
+			this->type = type;
+			this->message_id = GenMessageId();
+			this->reply_id = reply_id;
+			this->trace_id = 0;
+			this->crc = 0;
+			this->data = KSync::BufferPool::Allocate(HeaderSize+payload_size);
+			this->offset = 0;
+			this->size = HeaderSize+payload_size;
+			this->capacity = payload_size;
+			this->packed = false;
 		}
 
 		CommObject::~CommObject() {
-			if (data != 0) {
-				delete[] data;
+			KSync::BufferPool::Free(this->data);
+			this->size = 0;
+		}
+
+		void CommObject::WriteHeader() {
+			StoreLE<uint16_t>(this->data+MagicOffset, Magic);
+			this->data[VersionOffset] = (char) Version;
+			this->data[FlagsOffset] = (char) this->flags;
+			this->data[TypeOffset] = (char) this->type;
+			memset(this->data+TypeOffset+1, 0, MessageIdOffset-TypeOffset-1);
+			StoreLE<message_id_t>(this->data+MessageIdOffset, this->message_id);
+			StoreLE<message_id_t>(this->data+ReplyIdOffset, this->reply_id);
+			StoreLE<trace_id_t>(this->data+TraceIdOffset, this->trace_id);
+			StoreLE<uint32_t>(this->data+SizeOffset, (uint32_t) (this->size-HeaderSize));
+			StoreLE<uint32_t>(this->data+CRCOffset, this->crc);
+		}
+
+		int CommObject::Seal(const size_t payload_size) {
+			if (this->packed) {
+				LOGF(SEVERE, "Can't seal an object which is already packed!");
+				return -1;
+			}
+			if (payload_size > this->capacity) {
+				LOGF(SEVERE, "Payload size (%lu) exceeds the allocated capacity (%lu)!", payload_size, this->capacity);
+				return -2;
+			}
+			if (payload_size > UINT32_MAX) {
+				LOGF(SEVERE, "Payload size (%lu) doesn't fit in the header!", payload_size);
+				return -3;
 			}
-			size = 0;
+			this->size = HeaderSize+payload_size;
+			this->crc = GenCRC32(this->data+HeaderSize, payload_size);
+			WriteHeader();
+			this->packed = true;
+			return 0;
 		}
 
 		int CommObject::Pack() {
-			size_t num_extra_bytes = sizeof(this->type) + sizeof(this->message_id) + sizeof(this->reply_id) + sizeof(this->crc);
-			char* new_data = new char[num_extra_bytes+this->size];
+			if (this->packed) {
+				return 0;
+			}
+			if (this->size > UINT32_MAX) {
+				LOGF(SEVERE, "Payload size (%lu) doesn't fit in the header!", this->size);
+				return -1;
+			}
 			if (this->data == 0) {
 				this->crc = 0;
-				((Type_t*)new_data)[0] = this->type;
-				((message_id_t*)(new_data+sizeof(this->type)))[0] = this->message_id;
-				((message_id_t*)(new_data+sizeof(this->type)+sizeof(this->message_id)))[0] = this->reply_id;
-				((char*)(new_data+sizeof(this->type)+sizeof(this->message_id)+sizeof(this->reply_id)))[0] = this->crc;
-				this->data = new_data;
-				this->size += num_extra_bytes;
-				this->packed = true;
+				this->data = KSync::BufferPool::Allocate(HeaderSize);
 			} else {
-				this->crc = GenCRC8(this->data, this->size);
-				((Type_t*)new_data)[0] = this->type;
-				((message_id_t*)(new_data+sizeof(this->type)))[0] = this->message_id;
-				((message_id_t*)(new_data+sizeof(this->type)+sizeof(this->message_id)))[0] = this->reply_id;
-				((char*)(new_data+sizeof(this->type)+sizeof(this->message_id)+sizeof(this->reply_id)))[0] = this->crc;
-				memcpy(new_data+num_extra_bytes, this->data, this->size);
-				delete[] this->data;
-				this->data = new_data;
-				this->size += num_extra_bytes;
-				this->packed = true;
+				//Unpacked objects still have room for the header in front of the payload.
+				this->crc = GenCRC32(this->data+this->offset, this->size);
 			}
+			this->offset = 0;
+			this->size += HeaderSize;
+			WriteHeader();
+			this->packed = true;
 			return 0;
 		}
 
@@ -116,80 +222,78 @@ namespace KSync {
 			if (!this->packed) {
 				return 0;
 			}
-			size_t num_extra_bytes = sizeof(this->type)+sizeof(this->message_id)+sizeof(this->reply_id)+sizeof(this->crc);
-			if (this->size == num_extra_bytes) {
-				if (this->crc != 0) {
-					return -1;
-				}
-				delete[] this->data;
-				this->data = 0;
-			} else {
-				char new_crc = GenCRC8(this->data+num_extra_bytes, this->size-num_extra_bytes);
-				if (new_crc != this->crc) {
-					return -1;
-				}
-				size_t new_size = this->size-num_extra_bytes;
-				char* new_data = new char[this->size-num_extra_bytes];
-				memcpy(new_data, this->data+num_extra_bytes, new_size);
-				delete[] this->data;
-				this->data = new_data;
+			if (this->size < HeaderSize) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message of (%lu) bytes is too short for a header!", this->size);
+				return -1;
+			}
+			if (LoadLE<uint16_t>(this->data+MagicOffset) != Magic) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message has a bad magic number!");
+				return -1;
+			}
+			if ((uint8_t) this->data[VersionOffset] != Version) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message has version (%u), only (%u) is understood!", (unsigned int) (uint8_t) this->data[VersionOffset], (unsigned int) Version);
+				return -1;
 			}
-			this->size -= num_extra_bytes;
+			if ((this->flags & ~KnownFlags) != 0) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message has unknown flags (0x%02x)!", (unsigned int) this->flags);
+				return -1;
+			}
+			if (LoadLE<uint32_t>(this->data+SizeOffset) != this->size-HeaderSize) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message payload size doesn't match the header!");
+				return -1;
+			}
+			if (GenCRC32(this->data+HeaderSize, this->size-HeaderSize) != this->crc) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Message failed its CRC!");
+				return -1;
+			}
+			this->offset = HeaderSize;
+			this->size -= HeaderSize;
 			this->packed = false;
 			return 0;
 		}
 
-		char CommObject::GenCRC8(const char* data, const size_t size) {
-			char out = 0;
-			int bits_read = 0;
-			int bit_flag;
-
-			if (data == 0) {
-				return 0;
-			}
-
-			size_t temp_size = size;
-
-			while(temp_size > 0) {
-				bit_flag = out >> 15;
-
-				/* Get next bit: */
-				out <<= 1;
-				out |= (*data >> bits_read) & 1; // item a) work from the least significant bits
-
-				/* Increment bit counter: */
-				bits_read++;
-				if(bits_read > 7) {
-					bits_read = 0;
-					data++;
-					temp_size--;
+		// CRC-32 (IEEE 802.3, as in zlib) eight bytes at a time, slicing-by-8.
+		class CRC32Table {
+			public:
+				CRC32Table() {
+					for(uint32_t i = 0; i < 256; ++i) {
+						uint32_t c = i;
+						for(int k = 0; k < 8; ++k) {
+							c = (c & 1) ? ((c >> 1)^0xEDB88320) : (c >> 1);
+						}
+						this->table[0][i] = c;
+					}
+					for(size_t i = 0; i < 256; ++i) {
+						for(size_t t = 1; t < 8; ++t) {
+							this->table[t][i] = (this->table[t-1][i] >> 8)^this->table[0][this->table[t-1][i] & 0xff];
+						}
+					}
 				}
+				uint32_t table[8][256];
+		};
 
-				/* Cycle check: */
-				if (bit_flag)
-					out ^= CRC8;
+		uint32_t CommObject::GenCRC32(const char* data, const size_t size) {
+			static const CRC32Table crc_table;
+			const uint32_t (*t)[256] = crc_table.table;
+			uint32_t crc = 0xFFFFFFFF;
+			if (data == 0) {
+				return ~crc;
 			}
-
-			// item b) "push out" the last 8 bits
-			for (int i = 0; i < 8; ++i) {
-				bit_flag = out >> 7;
-				out <<= 1;
-				if (bit_flag) {
-					out ^= CRC8;
-				}
+			size_t remaining = size;
+			while(remaining >= 8) {
+				const uint32_t one = LoadLE<uint32_t>(data)^crc;
+				const uint32_t two = LoadLE<uint32_t>(data+4);
+				crc = t[7][one & 0xff]^t[6][(one >> 8) & 0xff]^t[5][(one >> 16) & 0xff]^t[4][one >> 24]^
+				      t[3][two & 0xff]^t[2][(two >> 8) & 0xff]^t[1][(two >> 16) & 0xff]^t[0][two >> 24];
+				data += 8;
+				remaining -= 8;
 			}
-
-			// item c) reverse the bits
-			char crc = 0;
-			int i = 0x80;
-			int j = 0x01;
-			for (; i != 0; i >>= 1, j <<= 1) {
-				if (i & out) {
-					crc |= j;
-				}
+			while(remaining > 0) {
+				crc = (crc >> 8)^t[0][(crc^(uint8_t) *data) & 0xff];
+				++data;
+				--remaining;
 			}
-
-			return crc;
+			return ~crc;
 		}
 	}
 }
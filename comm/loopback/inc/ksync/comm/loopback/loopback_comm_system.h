@@ -0,0 +1,127 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_LOOPBACK_COMM_SYSTEM_HDR
+#define KSYNC_LOOPBACK_COMM_SYSTEM_HDR
+
+#include <vector>
+#include <chrono>
+
+#include "ksync/comm/interface.h"
+#include "ksync/comm/factory.h"
+
+namespace KSync {
+	namespace Comm {
+		// The loopback backend keeps every socket in process memory, so a server
+		// and its clients can run in one process without IPC files or a network.
+		// Bind and Connect only match up URLs within the same LoopbackCommSystem,
+		// tcp URLs by port so tcp://*:6060 serves tcp://localhost:6060.
+		//
+		// Sockets follow their zeromq namesakes: pair talks to one peer, push hands
+		// messages out round robin, pub copies them to every peer, req messages
+		// carry the sender's identity which rep and router reply to.
+		class LoopbackConditions {
+			public:
+				LoopbackConditions();
+
+				//Added to the delivery time of every message.
+				uint64_t latency_ns;
+				//Bytes per second each socket can send, 0 for no limit. A socket's
+				//messages queue behind each other like they would on a link.
+				uint64_t bandwidth;
+				//Chance from 0 to 1 that a message is silently dropped. Drops come from a
+				//generator seeded with seed, so the same sends always lose the same messages.
+				double loss;
+				uint32_t seed;
+		};
+
+		class LoopbackNetwork;
+		class LoopbackQueue;
+		class LoopbackCommSystem;
+		class LoopbackCommSystemSocket : public CommSystemSocket {
+			friend class LoopbackCommSystem;
+			public:
+				static const int PairPattern = 0;
+				static const int ReqPattern = 1;
+				static const int RepPattern = 2;
+				static const int RouterPattern = 3;
+				static const int PubPattern = 4;
+				static const int SubPattern = 5;
+				static const int PushPattern = 6;
+				static const int PullPattern = 7;
+
+				LoopbackCommSystemSocket(const std::shared_ptr<LoopbackNetwork>& network, const int pattern);
+				~LoopbackCommSystemSocket();
+
+				int BindImp(const std::string& address);
+				int ConnectImp(const std::string& address);
+				int SendImp(const std::shared_ptr<CommObject> comm_obj);
+				int RecvImp(std::shared_ptr<CommObject>& comm_obj);
+				int SendRoutedImp(const std::string& peer, const std::shared_ptr<CommObject> comm_obj);
+				int RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj);
+				int Poll(const int timeout, const int wakeup_fd = -1);
+				int SetSendTimeout(int timeout = -1);
+				int SetRecvTimeout(int timeout = -1);
+				int SetOptions(const SocketOptions& options);
+
+			private:
+				int Attach(const std::string& address, const bool bind);
+				int Deliver(const std::string& peer, const std::shared_ptr<CommObject>& comm_obj);
+				int Take(std::string& peer, std::shared_ptr<CommObject>& comm_obj);
+				int WaitReadable(const int timeout, const int wakeup_fd);
+
+				std::shared_ptr<LoopbackNetwork> network;
+				std::shared_ptr<LoopbackQueue> queue;
+				const int pattern;
+				int send_timeout;
+				int recv_timeout;
+				//Endpoints this socket is bound or connected to.
+				std::vector<std::string> endpoints;
+				//Where the next push or req goes, and who a rep socket answers.
+				size_t next_peer;
+				std::string last_peer;
+				//When this socket's simulated link is next free to send.
+				std::chrono::steady_clock::time_point link_free;
+		};
+
+		class LoopbackCommSystem : public CommSystemInterface {
+			public:
+				LoopbackCommSystem(const LoopbackConditions& conditions = LoopbackConditions());
+				~LoopbackCommSystem();
+
+				int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+
+			private:
+				int Create(std::shared_ptr<CommSystemSocket>& socket, const int pattern, const char* name, const int role, int recv_timeout, int send_timeout, const SocketOptions& options);
+
+				std::shared_ptr<LoopbackNetwork> network;
+		};
+
+		int GetLoopbackCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface, const LoopbackConditions& conditions);
+	}
+}
+
+#endif
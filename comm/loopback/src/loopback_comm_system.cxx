@@ -0,0 +1,493 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <algorithm>
+#include <condition_variable>
+
+#include "ksync/logging.h"
+#include "ksync/wakeup_signal.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+namespace KSync {
+	namespace Comm {
+		typedef std::chrono::steady_clock Clock;
+
+		class LoopbackMessage {
+			public:
+				std::shared_ptr<CommObject> comm_obj;
+				//Identity of the sending socket.
+				std::string peer;
+				Clock::time_point deliver_at;
+		};
+
+		//A socket's incoming messages in order of delivery time. Only the owning
+		//socket takes messages out. readable is signaled exactly while messages isn't
+		//empty, so it can be polled alongside a wakeup fd.
+		class LoopbackQueue {
+			public:
+				LoopbackQueue(const uint64_t id) : id(id), capacity(0) {}
+				const uint64_t id;
+				std::mutex mutex;
+				std::condition_variable room;
+				std::deque<LoopbackMessage> messages;
+				//Most messages held at once, 0 for no limit.
+				size_t capacity;
+				KSync::Utilities::WakeupSignal readable;
+		};
+
+		class LoopbackEndpoint {
+			public:
+				LoopbackEndpoint() : bound(0) {}
+				//Queue id of the bound socket, 0 if nothing is bound yet.
+				uint64_t bound;
+				std::vector<uint64_t> connected;
+		};
+
+		class LoopbackNetwork {
+			public:
+				LoopbackNetwork(const LoopbackConditions& conditions) : conditions(conditions), generator(conditions.seed), next_id(1) {}
+				std::mutex mutex;
+				//Notified whenever a socket binds or connects.
+				std::condition_variable changed;
+				std::map<std::string, LoopbackEndpoint> endpoints;
+				std::map<uint64_t, std::shared_ptr<LoopbackQueue>> queues;
+				const LoopbackConditions conditions;
+				std::mt19937 generator;
+				uint64_t next_id;
+		};
+
+		static std::string PeerName(const uint64_t id) {
+			return std::string((const char*) &id, sizeof(id));
+		}
+
+		static uint64_t PeerId(const std::string& peer) {
+			uint64_t id = 0;
+			if(peer.size() == sizeof(id)) {
+				memcpy(&id, peer.data(), sizeof(id));
+			}
+			return id;
+		}
+
+		static std::string EndpointKey(const std::string& address) {
+			if(address.compare(0, 6, "tcp://") == 0) {
+				const size_t colon = address.rfind(':');
+				if(colon > 5) {
+					return "tcp://*"+address.substr(colon);
+				}
+			}
+			return address;
+		}
+
+		template<class Predicate>
+		static bool WaitFor(std::condition_variable& condition, std::unique_lock<std::mutex>& lk, const int timeout, Predicate predicate) {
+			if(timeout < 0) {
+				condition.wait(lk, predicate);
+				return true;
+			}
+			return condition.wait_for(lk, std::chrono::milliseconds(timeout), predicate);
+		}
+
+		LoopbackConditions::LoopbackConditions() {
+			this->latency_ns = 0;
+			this->bandwidth = 0;
+			this->loss = 0.;
+			this->seed = 0;
+		}
+
+		LoopbackCommSystemSocket::LoopbackCommSystemSocket(const std::shared_ptr<LoopbackNetwork>& network, const int pattern) : network(network), pattern(pattern) {
+			this->bind = false;
+			this->send_timeout = -1;
+			this->recv_timeout = -1;
+			this->next_peer = 0;
+			std::lock_guard<std::mutex> lk(this->network->mutex);
+			this->queue.reset(new LoopbackQueue(this->network->next_id++));
+			this->network->queues[this->queue->id] = this->queue;
+		}
+
+		LoopbackCommSystemSocket::~LoopbackCommSystemSocket() {
+			{
+				std::lock_guard<std::mutex> lk(this->network->mutex);
+				for(size_t i = 0; i < this->endpoints.size(); ++i) {
+					std::map<std::string, LoopbackEndpoint>::iterator it = this->network->endpoints.find(this->endpoints[i]);
+					if(it == this->network->endpoints.end()) {
+						continue;
+					}
+					LoopbackEndpoint& endpoint = it->second;
+					if(endpoint.bound == this->queue->id) {
+						endpoint.bound = 0;
+					}
+					std::vector<uint64_t>::iterator connected = std::find(endpoint.connected.begin(), endpoint.connected.end(), this->queue->id);
+					if(connected != endpoint.connected.end()) {
+						endpoint.connected.erase(connected);
+					}
+					if((endpoint.bound == 0)&&endpoint.connected.empty()) {
+						this->network->endpoints.erase(it);
+					}
+				}
+				this->network->queues.erase(this->queue->id);
+			}
+			//Nothing was created on disk, so there's no IPC file for the base class to remove.
+			this->bind = false;
+		}
+
+		int LoopbackCommSystemSocket::Attach(const std::string& address, const bool bind) {
+			const std::string key = EndpointKey(address);
+			std::lock_guard<std::mutex> lk(this->network->mutex);
+			LoopbackEndpoint& endpoint = this->network->endpoints[key];
+			if(bind) {
+				if(endpoint.bound != 0) {
+					LOGF(SEVERE, "The address (%s) is already bound!", address.c_str());
+					return -1;
+				}
+				endpoint.bound = this->queue->id;
+			} else {
+				endpoint.connected.push_back(this->queue->id);
+			}
+			this->endpoints.push_back(key);
+			this->network->changed.notify_all();
+			return 0;
+		}
+
+		int LoopbackCommSystemSocket::BindImp(const std::string& address) {
+			return this->Attach(address, true);
+		}
+
+		int LoopbackCommSystemSocket::ConnectImp(const std::string& address) {
+			return this->Attach(address, false);
+		}
+
+		int LoopbackCommSystemSocket::Deliver(const std::string& peer, const std::shared_ptr<CommObject>& comm_obj) {
+			if((this->pattern == SubPattern)||(this->pattern == PullPattern)) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Can't send on a receive only socket!!");
+				return Other;
+			}
+			LoopbackNetwork& network = *this->network;
+			std::vector<std::shared_ptr<LoopbackQueue>> targets;
+			bool lost = false;
+			{
+				std::unique_lock<std::mutex> lk(network.mutex);
+				//Replies go to whoever asked and are dropped if they've gone, like zeromq
+				//does with unroutable messages. Everything else waits for a peer, except pub.
+				auto find_targets = [&]() -> bool {
+					if((this->pattern == RouterPattern)||(this->pattern == RepPattern)) {
+						std::map<uint64_t, std::shared_ptr<LoopbackQueue>>::iterator it = network.queues.find(PeerId(peer));
+						if(it != network.queues.end()) {
+							targets.push_back(it->second);
+						}
+						return true;
+					}
+					std::vector<uint64_t> peers;
+					for(size_t i = 0; i < this->endpoints.size(); ++i) {
+						const LoopbackEndpoint& endpoint = network.endpoints[this->endpoints[i]];
+						if(endpoint.bound == this->queue->id) {
+							peers.insert(peers.end(), endpoint.connected.begin(), endpoint.connected.end());
+						} else if (endpoint.bound != 0) {
+							peers.push_back(endpoint.bound);
+						}
+					}
+					if(this->pattern == PubPattern) {
+						for(size_t i = 0; i < peers.size(); ++i) {
+							targets.push_back(network.queues[peers[i]]);
+						}
+						return true;
+					}
+					if(peers.empty()) {
+						return false;
+					}
+					if(this->pattern == PairPattern) {
+						targets.push_back(network.queues[peers[0]]);
+					} else {
+						targets.push_back(network.queues[peers[(this->next_peer++)%peers.size()]]);
+					}
+					return true;
+				};
+				if(!WaitFor(network.changed, lk, this->send_timeout, find_targets)) {
+					LOGF_RATE_LIMITED(WARNING, 1, 1000, "Send timed out!!");
+					return Timeout;
+				}
+				if(network.conditions.loss > 0.) {
+					//mt19937's output is fixed by the standard, unlike the distributions.
+					lost = (((double) network.generator())/4294967296.) < network.conditions.loss;
+				}
+			}
+
+			Clock::time_point deliver_at = Clock::now();
+			if(network.conditions.bandwidth != 0) {
+				if(this->link_free > deliver_at) {
+					deliver_at = this->link_free;
+				}
+				deliver_at += std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds((((uint64_t) comm_obj->GetDataSize())*1000000000ULL)/network.conditions.bandwidth));
+				this->link_free = deliver_at;
+			}
+			deliver_at += std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(network.conditions.latency_ns));
+			if(lost) {
+				return Success;
+			}
+
+			LoopbackMessage message;
+			message.peer = PeerName(this->queue->id);
+			message.deliver_at = deliver_at;
+			for(size_t i = 0; i < targets.size(); ++i) {
+				LoopbackQueue& target = *targets[i];
+				//Each receiver unpacks its own copy, the same as a message off the wire.
+				message.comm_obj = CommObject::Create(comm_obj->GetDataPointer(), comm_obj->GetDataSize(), true);
+				std::unique_lock<std::mutex> lk(target.mutex);
+				if((target.capacity != 0)&&(target.messages.size() >= target.capacity)) {
+					//Like zeromq, a slow subscriber misses messages rather than holding up the others.
+					if(this->pattern == PubPattern) {
+						continue;
+					}
+					if(!WaitFor(target.room, lk, this->send_timeout, [&target]() { return (target.capacity == 0)||(target.messages.size() < target.capacity); })) {
+						LOGF_RATE_LIMITED(WARNING, 1, 1000, "Send timed out!!");
+						return Timeout;
+					}
+				}
+				//Messages from a slower link can land after later ones, usually this is the back.
+				std::deque<LoopbackMessage>::iterator it = target.messages.end();
+				while((it != target.messages.begin())&&((it-1)->deliver_at > deliver_at)) {
+					--it;
+				}
+				const bool was_empty = target.messages.empty();
+				target.messages.insert(it, message);
+				if(was_empty) {
+					target.readable.Signal();
+				}
+			}
+			return Success;
+		}
+
+		int LoopbackCommSystemSocket::WaitReadable(const int timeout, const int wakeup_fd) {
+			const bool forever = (timeout < 0);
+			const Clock::time_point deadline = Clock::now()+std::chrono::milliseconds(forever ? 0 : timeout);
+			while(true) {
+				const Clock::time_point now = Clock::now();
+				bool timed = !forever;
+				Clock::time_point wake_at = deadline;
+				bool poll_queue = true;
+				{
+					std::lock_guard<std::mutex> lk(this->queue->mutex);
+					if(!this->queue->messages.empty()) {
+						const Clock::time_point deliver_at = this->queue->messages.front().deliver_at;
+						if(deliver_at <= now) {
+							return Success;
+						}
+						//The queue is already readable, so sleep until the message lands instead.
+						poll_queue = false;
+						if((!timed)||(deliver_at < wake_at)) {
+							wake_at = deliver_at;
+							timed = true;
+						}
+					}
+				}
+				if((!forever)&&(now >= deadline)) {
+					return Timeout;
+				}
+
+				struct pollfd items[2];
+				nfds_t num_items = 0;
+				if(poll_queue) {
+					items[num_items].fd = this->queue->readable.GetFd();
+					items[num_items].events = POLLIN;
+					items[num_items].revents = 0;
+					++num_items;
+				}
+				if(wakeup_fd >= 0) {
+					items[num_items].fd = wakeup_fd;
+					items[num_items].events = POLLIN;
+					items[num_items].revents = 0;
+					++num_items;
+				}
+				struct timespec wait;
+				struct timespec* wait_ptr = 0;
+				if(timed) {
+					const int64_t wait_ns = std::max((int64_t) 0, (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(wake_at-now).count());
+					wait.tv_sec = (time_t) (wait_ns/1000000000);
+					wait.tv_nsec = (long) (wait_ns%1000000000);
+					wait_ptr = &wait;
+				}
+				if(ppoll(items, num_items, wait_ptr, 0) < 0) {
+					if(errno == EINTR) {
+						return Timeout;
+					}
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem polling!! %i (%s)", errno, strerror(errno));
+					return Other;
+				}
+				if((wakeup_fd >= 0)&&(items[num_items-1].revents & POLLIN)) {
+					return Woken;
+				}
+			}
+		}
+
+		int LoopbackCommSystemSocket::Take(std::string& peer, std::shared_ptr<CommObject>& comm_obj) {
+			if (comm_obj) {
+				printf("Please pass an empty pointer");
+				return Other;
+			}
+			const int status = this->WaitReadable(this->recv_timeout, -1);
+			if(status != Success) {
+				if(status == Timeout) {
+					//Expected whenever a poll comes up empty.
+					LOGF_RATE_LIMITED(DEBUG, 1, 10000, "Recv timed out!!");
+				}
+				return status;
+			}
+			std::lock_guard<std::mutex> lk(this->queue->mutex);
+			if(this->queue->messages.empty()) {
+				return Timeout;
+			}
+			LoopbackMessage& message = this->queue->messages.front();
+			comm_obj = std::move(message.comm_obj);
+			peer = std::move(message.peer);
+			this->queue->messages.pop_front();
+			if(this->queue->messages.empty()) {
+				this->queue->readable.Clear();
+			}
+			this->queue->room.notify_one();
+			return Success;
+		}
+
+		int LoopbackCommSystemSocket::SendImp(const std::shared_ptr<CommObject> comm_obj) {
+			return this->Deliver(this->last_peer, comm_obj);
+		}
+
+		int LoopbackCommSystemSocket::RecvImp(std::shared_ptr<CommObject>& comm_obj) {
+			std::string peer;
+			const int status = this->Take(peer, comm_obj);
+			if((status == Success)&&(this->pattern == RepPattern)) {
+				this->last_peer.swap(peer);
+			}
+			return status;
+		}
+
+		int LoopbackCommSystemSocket::SendRoutedImp(const std::string& peer, const std::shared_ptr<CommObject> comm_obj) {
+			if(this->pattern != RouterPattern) {
+				return this->SendImp(comm_obj);
+			}
+			return this->Deliver(peer, comm_obj);
+		}
+
+		int LoopbackCommSystemSocket::RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj) {
+			if(this->pattern != RouterPattern) {
+				peer.clear();
+				return this->RecvImp(comm_obj);
+			}
+			return this->Take(peer, comm_obj);
+		}
+
+		int LoopbackCommSystemSocket::Poll(const int timeout, const int wakeup_fd) {
+			return this->WaitReadable(timeout, wakeup_fd);
+		}
+
+		int LoopbackCommSystemSocket::SetSendTimeout(int timeout) {
+			this->send_timeout = timeout;
+			return 0;
+		}
+
+		int LoopbackCommSystemSocket::SetRecvTimeout(int timeout) {
+			this->recv_timeout = timeout;
+			return 0;
+		}
+
+		//There's no send side buffer, kernel buffer or IO thread, so only the receive
+		//high water mark means anything here.
+		int LoopbackCommSystemSocket::SetOptions(const SocketOptions& options) {
+			if(options.recv_hwm != SocketOptions::Unset) {
+				std::lock_guard<std::mutex> lk(this->queue->mutex);
+				this->queue->capacity = (size_t) options.recv_hwm;
+				this->queue->room.notify_all();
+			}
+			return 0;
+		}
+
+		LoopbackCommSystem::LoopbackCommSystem(const LoopbackConditions& conditions) {
+			this->network.reset(new LoopbackNetwork(conditions));
+		}
+
+		LoopbackCommSystem::~LoopbackCommSystem() {
+		}
+
+		int LoopbackCommSystem::Create(std::shared_ptr<CommSystemSocket>& socket, const int pattern, const char* name, const int role, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			if (socket) {
+				return -1;
+			}
+			try {
+				socket.reset((CommSystemSocket*) new LoopbackCommSystemSocket(this->network, pattern));
+			} catch (KSync::Utilities::WakeupSignal::WakeupSignalException& e) {
+				LOGF(SEVERE, "There was a problem creating the loopback %s socket! (%s)", name, e.GetMessage().c_str());
+				return -1;
+			}
+			socket->SetMetricsName("loopback", name);
+			return this->InitSocket(socket.get(), role, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::ReqPattern, "gateway_req", GatewayRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::RepPattern, "gateway_rep", GatewayRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::RouterPattern, "gateway_router", GatewayRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::PairPattern, "pair", DataRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::PubPattern, "pub", BroadcastRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::SubPattern, "sub", BroadcastRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::PullPattern, "pull", PipelineRole, recv_timeout, send_timeout, options);
+		}
+
+		int LoopbackCommSystem::Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			return this->Create(socket, LoopbackCommSystemSocket::PushPattern, "push", PipelineRole, recv_timeout, send_timeout, options);
+		}
+
+		int GetLoopbackCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface, const LoopbackConditions& conditions) {
+			if((conditions.loss < 0.)||(conditions.loss > 1.)) {
+				LOGF(SEVERE, "Loss must be between 0 and 1, not (%f)!", conditions.loss);
+				return -1;
+			}
+			LOGF(MESSAGE, "Starting Loopback Communication Backend");
+			comm_interface.reset(new LoopbackCommSystem(conditions));
+			return 0;
+		}
+
+		int GetLoopbackCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface) {
+			return GetLoopbackCommSystem(comm_interface, LoopbackConditions());
+		}
+	}
+}
@@ -15,10 +15,12 @@ namespace KSync {
 
 				int BindImp(const std::string& address);
 				int ConnectImp(const std::string& address);
-				int Send(const std::shared_ptr<CommObject> comm_obj);
-				int Recv(std::shared_ptr<CommObject>& comm_obj);
+				int SendImp(const std::shared_ptr<CommObject> comm_obj);
+				int RecvImp(std::shared_ptr<CommObject>& comm_obj);
+				int Poll(const int timeout, const int wakeup_fd = -1);
 				int SetSendTimeout(int timeout);
 				int SetRecvTimeout(int timeout);
+				int SetOptions(const SocketOptions& options);
 
 				int GetSocketId() const {
 					return socket;
@@ -32,13 +34,14 @@ namespace KSync {
 				NanomsgCommSystem();
 				~NanomsgCommSystem();
 
-				int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
+				int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
 		};
 	}
 }
@@ -1,3 +1,5 @@
+#include <poll.h>
+
 #include "ksync/logging.h"
 #include "ksync/comm/nanomsg/nanomsg_comm_system.h"
 
@@ -33,7 +35,7 @@ namespace KSync {
 			return 0;
 		}
 
-		int NanomsgCommSystemSocket::Send(const std::shared_ptr<CommObject> comm_obj) {
+		int NanomsgCommSystemSocket::SendImp(const std::shared_ptr<CommObject> comm_obj) {
 			if (this->socket < 0) {
 				LOGF(WARNING, "Can't send to a socket which isn't ready!");
 				return Other;
@@ -45,7 +47,7 @@ namespace KSync {
 					if(err == ETIMEDOUT) {
 						return Timeout;
 					} else {
-						LOGF(WARNING, "Problem sending data!! %i (%s)", err, nn_strerror(err));
+						LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem sending data!! %i (%s)", err, nn_strerror(err));
 						return Other;
 					}
 				} else {
@@ -56,7 +58,7 @@ namespace KSync {
 			return Success;
 		}
 
-		int NanomsgCommSystemSocket::Recv(std::shared_ptr<CommObject>& comm_obj) {
+		int NanomsgCommSystemSocket::RecvImp(std::shared_ptr<CommObject>& comm_obj) {
 			if (comm_obj) {
 				LOGF(WARNING, "Please pass a null pointer");
 				return Other;
@@ -78,14 +80,14 @@ namespace KSync {
 				if(err == ETIMEDOUT) {
 					return Timeout;
 				} else {
-					LOGF(WARNING, "Problem receiving data!! %i (%s)", err, nn_strerror(err));
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem receiving data!! %i (%s)", err, nn_strerror(err));
 					return Other;
 				}
 			}
 			if(bytes == 0) {
 				return EmptyMessage;
 			}
-			comm_obj.reset(new CommObject(buf, bytes, true));
+			comm_obj = CommObject::Create(buf, bytes, true);
 			if(nn_freemsg(buf) != 0) {
 				LOGF(WARNING, "Problem freeing message!");
 				return Other;
@@ -93,6 +95,42 @@ namespace KSync {
 			return Success;
 		}
 
+		int NanomsgCommSystemSocket::Poll(const int timeout, const int wakeup_fd) {
+			if (this->socket < 0) {
+				LOGF(WARNING, "Can't poll a socket which isn't ready!");
+				return Other;
+			}
+			int recv_fd;
+			size_t recv_fd_size = sizeof(recv_fd);
+			if(nn_getsockopt(this->socket, NN_SOL_SOCKET, NN_RCVFD, &recv_fd, &recv_fd_size) != 0) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Couldn't get the receive fd!");
+				return Other;
+			}
+			struct pollfd fds[2];
+			fds[0].fd = recv_fd;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			fds[1].fd = wakeup_fd;
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			const int num_fds = (wakeup_fd < 0) ? 1 : 2;
+			int status = poll(fds, num_fds, timeout);
+			if(status < 0) {
+				if(errno == EINTR) {
+					return Timeout;
+				}
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem polling!! %i", errno);
+				return Other;
+			}
+			if(status == 0) {
+				return Timeout;
+			}
+			if((num_fds == 2)&&(fds[1].revents & POLLIN)) {
+				return Woken;
+			}
+			return Success;
+		}
+
 		int NanomsgCommSystemSocket::SetSendTimeout(int timeout) {
 			if(nn_setsockopt(this->socket, NN_SOL_SOCKET, NN_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
 				LOGF(WARNING, "Failed to set the send timeout socket option!");
@@ -109,13 +147,32 @@ namespace KSync {
 			return 0;
 		}
 
+		//nanomsg has neither message high water marks nor IO thread affinity,
+		//its buffer sizes are what bound how much is queued.
+		int NanomsgCommSystemSocket::SetOptions(const SocketOptions& options) {
+			int status = 0;
+			if(options.send_buffer > 0) {
+				if(nn_setsockopt(this->socket, NN_SOL_SOCKET, NN_SNDBUF, &options.send_buffer, sizeof(options.send_buffer)) != 0) {
+					LOGF(WARNING, "Failed to set the send buffer socket option!");
+					status = -1;
+				}
+			}
+			if(options.recv_buffer > 0) {
+				if(nn_setsockopt(this->socket, NN_SOL_SOCKET, NN_RCVBUF, &options.recv_buffer, sizeof(options.recv_buffer)) != 0) {
+					LOGF(WARNING, "Failed to set the receive buffer socket option!");
+					status = -1;
+				}
+			}
+			return status;
+		}
+
 		NanomsgCommSystem::NanomsgCommSystem() {
 		}
 
 		NanomsgCommSystem::~NanomsgCommSystem() {
 		}
 
-		int NanomsgCommSystem::Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_REQ);
@@ -125,15 +182,33 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "gateway_req");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
+			} else {
+				return -1;
+			}
+		}
+
+		int NanomsgCommSystem::Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			if (!socket) {
+				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
+				nanomsg_socket->socket = nn_socket(AF_SP, NN_REP);
+				if (nanomsg_socket->socket < 0) {
+					LOGF(SEVERE, "There was a problem creating the NN_REP socket!");
+					return -1;
+				}
+				socket.reset((CommSystemSocket*) nanomsg_socket);
+				socket->SetMetricsName("nanomsg", "gateway_rep");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		//NN_REP already takes requests from every connected peer and remembers
+		//where each came from, so it serves as the router as long as each
+		//request is answered before the next is received.
+		int NanomsgCommSystem::Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_REP);
@@ -142,15 +217,14 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "gateway_router");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_PAIR);
@@ -159,15 +233,14 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "pair");
+				return this->InitSocket(socket.get(), DataRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_PUB);
@@ -176,15 +249,14 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "pub");
+				return this->InitSocket(socket.get(), BroadcastRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_SUB);
@@ -197,15 +269,14 @@ namespace KSync {
 					return -2;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "sub");
+				return this->InitSocket(socket.get(), BroadcastRole, recv_timeout, send_timeout, options);
 			} else {
 				return -3;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_PULL);
@@ -214,15 +285,14 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "pull");
+				return this->InitSocket(socket.get(), PipelineRole, recv_timeout, send_timeout, options);
 			} else {
 				return -3;
 			}
 		}
 
-		int NanomsgCommSystem::Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int NanomsgCommSystem::Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				NanomsgCommSystemSocket* nanomsg_socket = new NanomsgCommSystemSocket();
 				nanomsg_socket->socket = nn_socket(AF_SP, NN_PUSH);
@@ -231,9 +301,8 @@ namespace KSync {
 					return -1;
 				}
 				socket.reset((CommSystemSocket*) nanomsg_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("nanomsg", "push");
+				return this->InitSocket(socket.get(), PipelineRole, recv_timeout, send_timeout, options);
 			} else {
 				return -3;
 			}
@@ -15,29 +15,43 @@ namespace KSync {
 				ZeroMQCommSystemSocket();
 				~ZeroMQCommSystemSocket();
 
+				//Messages up to this size are copied into zeromq's own small message
+				//storage, larger ones are sent straight from the CommObject's buffer.
+				static const size_t SmallMessageSize = 64;
+
 				int BindImp(const std::string& address);
 				int ConnectImp(const std::string& address);
-				int Send(const std::shared_ptr<CommObject> comm_obj);
-				int Recv(std::shared_ptr<CommObject>& comm_obj);
+				int SendImp(const std::shared_ptr<CommObject> comm_obj);
+				int RecvImp(std::shared_ptr<CommObject>& comm_obj);
+				int SendRoutedImp(const std::string& peer, const std::shared_ptr<CommObject> comm_obj);
+				int RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj);
+				int Poll(const int timeout, const int wakeup_fd = -1);
 				int SetSendTimeout(int timeout = -1);
 				int SetRecvTimeout(int timeout = -1);
+				int SetOptions(const SocketOptions& options);
 
 			private:
+				int SendFrame(zmq::message_t& frame, const int flags);
+				int RecvFrame(zmq::message_t& frame);
+				bool MoreFrames();
+
 				zmq::socket_t* socket;
+				bool router;
 		};
 
 		class ZeroMQCommSystem : public CommSystemInterface {
 			public:
-				ZeroMQCommSystem();
+				ZeroMQCommSystem(const int io_threads = 1);
 				~ZeroMQCommSystem();
 
-				int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
-				int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1);
+				int Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
+				int Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout = -1, int send_timeout = -1, const SocketOptions& options = SocketOptions());
 				
 			private:
 				zmq::context_t* context;
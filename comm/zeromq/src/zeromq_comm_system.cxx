@@ -1,10 +1,21 @@
+#include <new>
+
 #include "ksync/logging.h"
+#include "ksync/buffer_pool.h"
 #include "ksync/comm/zeromq/zeromq_comm_system.h"
 
 namespace KSync {
 	namespace Comm {
+		//Called by zeromq, possibly on its own thread, once a zero copy message is sent.
+		static void ReleaseCommObject(void* data __attribute__((unused)), void* hint) {
+			std::shared_ptr<CommObject>* comm_obj = (std::shared_ptr<CommObject>*) hint;
+			comm_obj->~shared_ptr<CommObject>();
+			KSync::BufferPool::Free((char*) hint);
+		}
+
 		ZeroMQCommSystemSocket::ZeroMQCommSystemSocket() {
 			socket = 0;
+			router = false;
 		}
 
 		ZeroMQCommSystemSocket::~ZeroMQCommSystemSocket() {
@@ -29,29 +40,37 @@ namespace KSync {
 			return 0;
 		}
 
-		int ZeroMQCommSystemSocket::Send(const std::shared_ptr<CommObject> comm_obj) {
+		int ZeroMQCommSystemSocket::SendImp(const std::shared_ptr<CommObject> comm_obj) {
 			if (socket == 0) {
 				return Other;
 			}
 			const char* data = comm_obj->GetDataPointer();
 			size_t size = comm_obj->GetDataSize();
-			zmq::message_t send(size);
-			memcpy(send.data(), data, size);
-			int status = socket->send(send);
+			int status;
+			if(size <= SmallMessageSize) {
+				zmq::message_t send(size);
+				memcpy(send.data(), data, size);
+				status = socket->send(send);
+			} else {
+				//Hand zeromq the pooled buffer itself, holding a reference until it's sent.
+				std::shared_ptr<CommObject>* hint = new (KSync::BufferPool::Allocate(sizeof(std::shared_ptr<CommObject>))) std::shared_ptr<CommObject>(comm_obj);
+				zmq::message_t send((void*) data, size, &ReleaseCommObject, hint);
+				status = socket->send(send);
+			}
 			if(status == -1) {
 				int err = zmq_errno();
 				if(err == EAGAIN) {
-					LOGF(WARNING, "Send timed out!!");
+					LOGF_RATE_LIMITED(WARNING, 1, 1000, "Send timed out!!");
 					return Timeout;
 				} else {
-					LOGF(WARNING, "Problem sending data!! %i (%s)", err, zmq_strerror(err));
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem sending data!! %i (%s)", err, zmq_strerror(err));
 					return Other;
 				}
 			}
 			return Success;
 		}
 
-		int ZeroMQCommSystemSocket::Recv(std::shared_ptr<CommObject>& comm_obj) {
+		int ZeroMQCommSystemSocket::RecvImp(std::shared_ptr<CommObject>& comm_obj) {
 			if (comm_obj) {
 				printf("Please pass an empty pointer");
 				return Other;
@@ -64,17 +83,149 @@ namespace KSync {
 			if(status == -1) {
 				int err = zmq_errno();
 				if(err == EAGAIN) {
-					LOGF(WARNING, "Recv timed out!!");
+					//Expected whenever a poll comes up empty.
+					LOGF_RATE_LIMITED(DEBUG, 1, 10000, "Recv timed out!!");
 					return Timeout;
 				} else {
-					LOGF(WARNING, "Problem receiving data!! %i (%s)", err, zmq_strerror(err));
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem receiving data!! %i (%s)", err, zmq_strerror(err));
 					return Other;
 				}
 			}
 			if(recv.size() == 0) {
 				return EmptyMessage;
 			}
-			comm_obj.reset(new CommObject((char*) recv.data(), recv.size(), true));
+			comm_obj = CommObject::Create((char*) recv.data(), recv.size(), true);
+			return Success;
+		}
+
+		int ZeroMQCommSystemSocket::SendFrame(zmq::message_t& frame, const int flags) {
+			int status = socket->send(frame, flags);
+			if(status == -1) {
+				int err = zmq_errno();
+				if(err == EAGAIN) {
+					LOGF_RATE_LIMITED(WARNING, 1, 1000, "Send timed out!!");
+					return Timeout;
+				} else {
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem sending data!! %i (%s)", err, zmq_strerror(err));
+					return Other;
+				}
+			}
+			return Success;
+		}
+
+		int ZeroMQCommSystemSocket::RecvFrame(zmq::message_t& frame) {
+			int status = socket->recv(&frame);
+			if(status == -1) {
+				int err = zmq_errno();
+				if(err == EAGAIN) {
+					LOGF_RATE_LIMITED(DEBUG, 1, 10000, "Recv timed out!!");
+					return Timeout;
+				} else {
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem receiving data!! %i (%s)", err, zmq_strerror(err));
+					return Other;
+				}
+			}
+			return Success;
+		}
+
+		bool ZeroMQCommSystemSocket::MoreFrames() {
+			int more = 0;
+			size_t more_size = sizeof(more);
+			socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+			return more != 0;
+		}
+
+		//A REQ peer's message arrives at a ROUTER as [identity][empty delimiter][body].
+		int ZeroMQCommSystemSocket::SendRoutedImp(const std::string& peer, const std::shared_ptr<CommObject> comm_obj) {
+			if (socket == 0) {
+				return Other;
+			}
+			if (!router) {
+				return this->SendImp(comm_obj);
+			}
+			zmq::message_t identity(peer.size());
+			memcpy(identity.data(), peer.data(), peer.size());
+			int status = this->SendFrame(identity, ZMQ_SNDMORE);
+			if(status != Success) {
+				return status;
+			}
+			zmq::message_t delimiter(0);
+			status = this->SendFrame(delimiter, ZMQ_SNDMORE);
+			if(status != Success) {
+				return status;
+			}
+			zmq::message_t send(comm_obj->GetDataSize());
+			memcpy(send.data(), comm_obj->GetDataPointer(), comm_obj->GetDataSize());
+			return this->SendFrame(send, 0);
+		}
+
+		int ZeroMQCommSystemSocket::RecvRoutedImp(std::string& peer, std::shared_ptr<CommObject>& comm_obj) {
+			if (comm_obj) {
+				printf("Please pass an empty pointer");
+				return Other;
+			}
+			if (socket == 0) {
+				return Other;
+			}
+			if (!router) {
+				peer.clear();
+				return this->RecvImp(comm_obj);
+			}
+			zmq::message_t identity;
+			int status = this->RecvFrame(identity);
+			if(status != Success) {
+				return status;
+			}
+			peer.assign((const char*) identity.data(), identity.size());
+			//The rest of a multipart message is already here, so these can't time out.
+			zmq::message_t frame;
+			bool have_body = false;
+			while(this->MoreFrames()) {
+				frame.rebuild(0);
+				status = this->RecvFrame(frame);
+				if(status != Success) {
+					return status;
+				}
+				if(frame.size() != 0) {
+					have_body = true;
+				}
+			}
+			if(!have_body) {
+				return EmptyMessage;
+			}
+			comm_obj = CommObject::Create((char*) frame.data(), frame.size(), true);
+			return Success;
+		}
+
+		int ZeroMQCommSystemSocket::Poll(const int timeout, const int wakeup_fd) {
+			if (socket == 0) {
+				return Other;
+			}
+			zmq_pollitem_t items[2];
+			items[0].socket = (void*) *socket;
+			items[0].fd = 0;
+			items[0].events = ZMQ_POLLIN;
+			items[0].revents = 0;
+			items[1].socket = 0;
+			items[1].fd = wakeup_fd;
+			items[1].events = ZMQ_POLLIN;
+			items[1].revents = 0;
+			const int num_items = (wakeup_fd < 0) ? 1 : 2;
+			int status = zmq_poll(items, num_items, timeout);
+			if(status < 0) {
+				int err = zmq_errno();
+				if(err == EINTR) {
+					return Timeout;
+				}
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Problem polling!! %i (%s)", err, zmq_strerror(err));
+				return Other;
+			}
+			if(status == 0) {
+				return Timeout;
+			}
+			if((num_items == 2)&&(items[1].revents & ZMQ_POLLIN)) {
+				return Woken;
+			}
 			return Success;
 		}
 
@@ -88,109 +239,143 @@ namespace KSync {
 			return 0;
 		}
 
-		ZeroMQCommSystem::ZeroMQCommSystem() {
-			context = new zmq::context_t(1);
+		int ZeroMQCommSystemSocket::SetOptions(const SocketOptions& options) {
+			if (socket == 0) {
+				return -1;
+			}
+			if(options.send_hwm != SocketOptions::Unset) {
+				socket->setsockopt(ZMQ_SNDHWM, &options.send_hwm, sizeof(options.send_hwm));
+			}
+			if(options.recv_hwm != SocketOptions::Unset) {
+				socket->setsockopt(ZMQ_RCVHWM, &options.recv_hwm, sizeof(options.recv_hwm));
+			}
+			//Which value means the kernel's default changed between zeromq releases, so leave those alone.
+			if(options.send_buffer > 0) {
+				socket->setsockopt(ZMQ_SNDBUF, &options.send_buffer, sizeof(options.send_buffer));
+			}
+			if(options.recv_buffer > 0) {
+				socket->setsockopt(ZMQ_RCVBUF, &options.recv_buffer, sizeof(options.recv_buffer));
+			}
+			if(options.affinity != SocketOptions::Unset) {
+				const uint64_t affinity = (uint64_t) options.affinity;
+				socket->setsockopt(ZMQ_AFFINITY, &affinity, sizeof(affinity));
+			}
+			return 0;
+		}
+
+		ZeroMQCommSystem::ZeroMQCommSystem(const int io_threads) {
+			context = new zmq::context_t(io_threads);
 		}
 
 		ZeroMQCommSystem::~ZeroMQCommSystem() {
 			delete context;
 		}
 
-		int ZeroMQCommSystem::Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Gateway_Req_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_REQ);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "gateway_req");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Gateway_Rep_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_REP);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "gateway_rep");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Gateway_Router_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
+			if (!socket) {
+				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
+				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_ROUTER);
+				zmq_socket->router = true;
+				socket.reset((CommSystemSocket*) zmq_socket);
+				socket->SetMetricsName("zeromq", "gateway_router");
+				return this->InitSocket(socket.get(), GatewayRole, recv_timeout, send_timeout, options);
+			} else {
+				return -1;
+			}
+		}
+
+		int ZeroMQCommSystem::Create_Pair_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_PAIR);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "pair");
+				return this->InitSocket(socket.get(), DataRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Pub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_PUB);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "pub");
+				return this->InitSocket(socket.get(), BroadcastRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Sub_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_SUB);
 				zmq_socket->socket->setsockopt(ZMQ_SUBSCRIBE, 0, 0);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "sub");
+				return this->InitSocket(socket.get(), BroadcastRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Pull_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_PULL);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "pull");
+				return this->InitSocket(socket.get(), PipelineRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int ZeroMQCommSystem::Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout) {
+		int ZeroMQCommSystem::Create_Push_Socket(std::shared_ptr<CommSystemSocket>& socket, int recv_timeout, int send_timeout, const SocketOptions& options) {
 			if (!socket) {
 				ZeroMQCommSystemSocket* zmq_socket = new ZeroMQCommSystemSocket();
 				zmq_socket->socket = new zmq::socket_t(*this->context, ZMQ_PUSH);
 				socket.reset((CommSystemSocket*) zmq_socket);
-				socket->SetSendTimeout(send_timeout);
-				socket->SetRecvTimeout(recv_timeout);
-				return 0;
+				socket->SetMetricsName("zeromq", "push");
+				return this->InitSocket(socket.get(), PipelineRole, recv_timeout, send_timeout, options);
 			} else {
 				return -1;
 			}
 		}
 
-		int GetZeromqCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface __attribute__((unused))) {
-			LOGF(MESSAGE, "Starting ZeroMQ Communication Backend");
-			comm_interface.reset(new ZeroMQCommSystem());
+		int GetZeromqCommSystem(std::shared_ptr<CommSystemInterface>& comm_interface, const int io_threads) {
+			if(io_threads < 1) {
+				LOGF(SEVERE, "ZeroMQ needs at least one IO thread, not (%i)!", io_threads);
+				return -1;
+			}
+			LOGF(MESSAGE, "Starting ZeroMQ Communication Backend with (%i) IO threads", io_threads);
+			comm_interface.reset(new ZeroMQCommSystem(io_threads));
 			return 0;
 		}
 	}
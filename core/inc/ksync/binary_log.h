@@ -0,0 +1,150 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_BINARY_LOG_HDR
+#define KSYNC_BINARY_LOG_HDR
+
+#include <string>
+#include <atomic>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+#include <cstring>
+
+#include "ksync/logging.h"
+
+namespace KSync {
+	namespace BinaryLog {
+		// Binary logging keeps formatting off the hot path entirely. A call site
+		// registers its format string once, and each message is only the format id,
+		// a timestamp and the raw arguments, copied into a lock-free ring owned by
+		// the logging thread. A writer thread drains the rings to a file which
+		// ksync-logdecode turns back into text.
+		//
+		// File layout, all integers little endian:
+		//   Magic
+		//   'F' size id level line file_len file format_len format
+		//   'M' size timestamp_ns thread id args...
+		//   'D' size thread num_dropped
+		// where each argument is a one byte tag followed by its value.
+		static const char Magic[8] = {'K','S','B','L','O','G','0','1'};
+		static const char FormatRecord = 'F';
+		static const char MessageRecord = 'M';
+		static const char DroppedRecord = 'D';
+
+		static const char ArgInt = 'i';
+		static const char ArgUInt = 'u';
+		static const char ArgDouble = 'd';
+		static const char ArgString = 's';
+		static const char ArgPointer = 'p';
+
+		static const size_t MaxRecordSize = 4096;
+		static const size_t MessageHeaderSize = 1+4+8+4+4;
+		static const size_t DefaultRingSize = 1 << 20;
+
+		//Messages are built on the stack, then copied into the ring in one go.
+		//Arguments which don't fit in MaxRecordSize are left off.
+		class RecordBuilder {
+			public:
+				RecordBuilder(const uint32_t format_id);
+
+				void Add(const bool value) { this->AddInt(value); }
+				void Add(const char value) { this->AddInt(value); }
+				void Add(const signed char value) { this->AddInt(value); }
+				void Add(const short value) { this->AddInt(value); }
+				void Add(const int value) { this->AddInt(value); }
+				void Add(const long value) { this->AddInt(value); }
+				void Add(const long long value) { this->AddInt(value); }
+				void Add(const unsigned char value) { this->AddUInt(value); }
+				void Add(const unsigned short value) { this->AddUInt(value); }
+				void Add(const unsigned int value) { this->AddUInt(value); }
+				void Add(const unsigned long value) { this->AddUInt(value); }
+				void Add(const unsigned long long value) { this->AddUInt(value); }
+				void Add(const float value) { this->AddDouble(value); }
+				void Add(const double value) { this->AddDouble(value); }
+				void Add(const long double value) { this->AddDouble((double) value); }
+				void Add(const char* value);
+				void Add(const std::string& value);
+				void Add(const void* value);
+
+				//Fill in the size and timestamp. Returns the finished record.
+				const char* Finish(const uint32_t thread_index);
+				uint32_t GetSize() const {
+					return this->size;
+				}
+			private:
+				void AddInt(const int64_t value);
+				void AddUInt(const uint64_t value);
+				void AddDouble(const double value);
+				bool Put(const char tag, const void* value, const size_t value_size);
+
+				char data[MaxRecordSize];
+				uint32_t size;
+		};
+
+		extern std::atomic<bool> enabled;
+
+		inline bool Enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		//Returns the id for this call site's format. Called once per call site.
+		uint32_t RegisterFormat(const int level, const char* format, const char* file, const int line);
+		//Copy a finished record into the calling thread's ring, or count it as dropped if full.
+		void Write(RecordBuilder& record);
+
+		inline void Append(RecordBuilder& record __attribute__((unused))) {
+		}
+
+		template<typename T, typename... Rest>
+		void Append(RecordBuilder& record, const T& first, const Rest&... rest) {
+			record.Add(first);
+			Append(record, rest...);
+		}
+
+		template<typename... Args>
+		void Log(const uint32_t format_id, const Args&... args) {
+			if(!Enabled()) {
+				return;
+			}
+			RecordBuilder record(format_id);
+			Append(record, args...);
+			Write(record);
+		}
+
+		//Start the writer thread, logging to <log_dir>/<log_prefix>.<pid>.blog
+		int Initialize(const std::string& log_prefix, const std::string& log_dir, const size_t ring_size = DefaultRingSize) __attribute__((warn_unused_result));
+		//Drain everything still in the rings and stop the writer thread.
+		void Shutdown();
+
+		//Turn a binary log back into text, one message per line.
+		int Decode(std::istream& in, std::ostream& out) __attribute__((warn_unused_result));
+	}
+}
+
+//Like LOGF, but formatted later by ksync-logdecode. Arguments are copied, so
+//strings may be passed as std::string or const char*.
+#define BLOGF(level, format, ...) \
+	do { \
+		if(KSYNC_LOG_ENABLED(level)&&KSync::BinaryLog::Enabled()) { \
+			static const uint32_t ksync_blog_format_id = KSync::BinaryLog::RegisterFormat(KSYNC_LOG_LEVEL_##level, format, __FILE__, __LINE__); \
+			KSync::BinaryLog::Log(ksync_blog_format_id, ##__VA_ARGS__); \
+		} \
+	} while(0)
+
+#endif
@@ -0,0 +1,82 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_BLAKE3_HDR
+#define KSYNC_BLAKE3_HDR
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "ksync/digest.h"
+
+namespace KSync {
+	namespace Utilities {
+		class thread_pool;
+	}
+
+	namespace Hash {
+		// BLAKE3 with 32 byte output. Whole chunks are compressed several at a time
+		// by the widest SIMD implementation the cpu has, picked on first use, so
+		// pass big buffers to Update. Small ones are hashed a chunk at a time.
+		//
+		// UpdateParallel hashes ParallelSubtreeChunks sized subtrees on a thread
+		// pool, the digest is the same as from Update.
+		class Blake3 {
+			public:
+				static const size_t BlockLen = 64;
+				static const size_t ChunkLen = 1024;
+				//Chunks compressed together before their parents are, sized for the stack.
+				static const size_t MaxBatchChunks = 64;
+				static const size_t ParallelSubtreeChunks = 512;
+				static const size_t MaxDepth = 54;
+
+				Blake3();
+				void Update(const void* data, size_t size);
+				void UpdateParallel(const void* data, size_t size, KSync::Utilities::thread_pool& pool);
+				//Call once, the hasher is spent afterwards.
+				void Final(digest_t& digest);
+
+				static void Digest(const void* data, const size_t size, digest_t& digest);
+
+				//"avx512", "avx2" or "portable".
+				static std::string GetImplementation();
+				//Force an implementation, < 0 if the cpu doesn't have it.
+				static int SetImplementation(const std::string& name) __attribute__((warn_unused_result));
+			private:
+				size_t GetChunkLength() const {
+					return this->blocks_compressed*BlockLen+this->buffered;
+				}
+				void ChunkUpdate(const uint8_t* input, const size_t size);
+				void FinishChunk();
+				void PushCv(const uint8_t cv[32], const uint64_t counter);
+				void MergeCvStack(const uint64_t total_chunks);
+
+				uint32_t cv[8];
+				uint64_t chunk_counter;
+				uint8_t buffer[BlockLen];
+				size_t buffered;
+				size_t blocks_compressed;
+				uint8_t cv_stack[MaxDepth+1][32];
+				size_t cv_stack_len;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_BUFFER_POOL_HDR
+#define KSYNC_BUFFER_POOL_HDR
+
+#include <cstddef>
+#include <cstdint>
+
+namespace KSync {
+	namespace BufferPool {
+		// Buffers are rounded up to a power of two size class. Each thread keeps
+		// a small cache of free buffers per class and trades batches of them with
+		// a shared free list, so in steady state a buffer is reused without
+		// touching the global heap or any lock. Buffers larger than the biggest
+		// class go straight to the heap.
+		//
+		// Counts are kept per thread and folded into the buffer_pool.* metrics
+		// every FlushInterval operations, and when the thread exits.
+		static const size_t MinClassBits = 6;
+		static const size_t MaxClassBits = 16;
+		static const size_t NumClasses = MaxClassBits-MinClassBits+1;
+		static const size_t ThreadCacheSize = 64;
+		static const size_t TransferBatch = ThreadCacheSize/2;
+		static const size_t FlushInterval = 256;
+
+		//Never returns null, throws std::bad_alloc like new.
+		char* Allocate(const size_t size);
+		//Accepts null.
+		void Free(char* buffer);
+		//How many bytes the buffer can actually hold.
+		size_t Capacity(const char* buffer);
+
+		//Standard allocator over the pool, so allocate_shared can put an object
+		//and its control block in one pooled buffer.
+		template<class T>
+		class Allocator {
+			public:
+				typedef T value_type;
+
+				Allocator() {}
+				template<class U>
+				Allocator(const Allocator<U>& other __attribute__((unused))) {}
+
+				T* allocate(const size_t n) {
+					return (T*) Allocate(n*sizeof(T));
+				}
+				void deallocate(T* p, const size_t n __attribute__((unused))) {
+					Free((char*) p);
+				}
+		};
+
+		template<class T, class U>
+		bool operator==(const Allocator<T>& a __attribute__((unused)), const Allocator<U>& b __attribute__((unused))) {
+			return true;
+		}
+		template<class T, class U>
+		bool operator!=(const Allocator<T>& a __attribute__((unused)), const Allocator<U>& b __attribute__((unused))) {
+			return false;
+		}
+	}
+}
+
+#endif
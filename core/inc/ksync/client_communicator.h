@@ -3,29 +3,80 @@
 
 #include <future>
 #include <thread>
-#include <map>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include "ksync/comm/object.h"
 #include "ksync/comm/interface.h"
 #include "ksync/utilities.h"
 #include "ksync/thread_utilities.h"
 #include "ksync/ksync_exception.h"
+#include "ksync/metrics.h"
+#include "ksync/wakeup_signal.h"
 
 namespace KSync {
 	namespace Comm {
+		// Flow control: each end may only have as many messages outstanding at the
+		// other as it has been granted credit for. Both ends start with
+		// InitialWindow credits, and the receiver grants more with FlowCredit
+		// messages as get() consumes what it was sent, up to its receive window.
+		// Messages without credit wait in the push queue, and send() waits for
+		// room once SendHighWater messages are queued.
 		class ClientCommunicator {
 			public:
 				class SocketException : public KSync::Exception::BasicException {
 					public:
 						SocketException();
 				};
+				class QueueFullException : public KSync::Exception::BasicException {
+					public:
+						QueueFullException();
+				};
+
+				static const int DefaultReplyTimeout = 30000;
+				static const size_t DefaultMaxBatch = 64;
+				//Longest the watch thread waits on the socket before checking its queues.
+				static const int PollTimeout = 10;
+				//Send timeout for the messages still queued when finishing.
+				static const int FlushTimeout = 100;
+				//Credit each end starts with, part of the protocol so both ends agree.
+				static const size_t InitialWindow = 256;
+				static const size_t DefaultSendHighWater = 1024;
+				//Timeout for send() to wait for room in the push queue.
+				static const int WaitForever = -1;
+				static const int DefaultSendTimeout = WaitForever;
+
+				//Called with the reply, or a null reply and the reason there isn't one.
+				typedef std::function<void(std::shared_ptr<CommObject>, std::exception_ptr)> ReplyCallback;
 
 				ClientCommunicator(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const KSync::Utilities::client_id_t client_id, const bool bind);
 				~ClientCommunicator();
 
-				KSync::Utilities::FutureWrapper<std::shared_ptr<CommObject>> send_get_response(std::shared_ptr<CommObject>& obj);
-				void send(std::shared_ptr<CommObject>& obj);
+				//Send obj and get a future for the message whose reply id matches it.
+				//The future fails with a PendingTimeoutException if no reply arrives within timeout ms,
+				//or a QueueFullException if the push queue stays full for that long.
+				KSync::Utilities::FutureWrapper<std::shared_ptr<CommObject>> send_get_response(std::shared_ptr<CommObject>& obj, const int timeout = DefaultReplyTimeout);
+				//Like send_get_response, but callback runs on the watch thread when the reply
+				//arrives or times out, so it should be short.
+				void send_with_callback(std::shared_ptr<CommObject>& obj, ReplyCallback callback, const int timeout = DefaultReplyTimeout);
+				//Queue obj, waiting up to timeout ms for room. 0 fails straight away if the
+				//queue is full, WaitForever doesn't give up until finish(). Returns < 0 if not queued.
+				int send(std::shared_ptr<CommObject>& obj, const int timeout = DefaultSendTimeout) __attribute__((warn_unused_result));
+				//Messages which aren't replies. A reply nothing is waiting for is dropped.
 				std::shared_ptr<CommObject> get();
+				//Like get(), but sleeps on the arrival fd for up to timeout ms, or
+				//WaitForever, for something to arrive. Null if nothing did.
+				std::shared_ptr<CommObject> get(const int timeout);
+				//Readable once get() may return something, so get() can be waited on
+				//alongside other fds. Call PrepareWait first, it returns false if
+				//something already arrived, then FinishWait once done waiting.
+				int GetArrivalFd() const {
+					return this->arrival.GetFd();
+				}
+				bool PrepareWait();
+				void FinishWait();
 
 				void finish();
 
@@ -37,18 +88,81 @@ namespace KSync {
 				KSync::Utilities::client_id_t GetClientId() const {
 					return this->id;
 				}
+				//Whether anything has arrived from the other end yet.
+				bool HeardFrom() const {
+					return this->heard_from.load(std::memory_order_relaxed);
+				}
+				//Maximum number of queued messages written to the socket per pass of the watch loop.
+				void SetMaxBatch(const size_t max_batch) {
+					this->max_batch.store(max_batch);
+				}
+				//Most messages queued to send before send() waits.
+				void SetSendHighWater(const size_t high_water);
+				//Most messages the other end may have outstanding here, received but not yet
+				//taken with get(). Lowering it below InitialWindow only takes effect once the
+				//other end's initial credit is used up.
+				void SetRecvWindow(const size_t window);
 			private:
-				std::shared_ptr<Utilities::threadsafe_lock_free_queue<CommObject>> push_queue;
-				std::shared_ptr<Utilities::threadsafe_lock_free_queue<CommObject>> pull_queue;
+				class ReplyHandler {
+					public:
+						ReplyHandler() {}
+						ReplyHandler(KSync::Utilities::PromiseWrapper<std::shared_ptr<CommObject>>&& promise) : promise(std::move(promise)) {}
+						ReplyHandler(ReplyCallback callback) : callback(callback) {}
+						void set_value(const std::shared_ptr<CommObject>& value);
+						void set_exception(std::exception_ptr p);
+					private:
+						KSync::Utilities::PromiseWrapper<std::shared_ptr<CommObject>> promise;
+						ReplyCallback callback;
+				};
+
+				//Give a request a trace id when tracing, so its reply can be followed.
+				void StartTrace(std::shared_ptr<CommObject>& obj);
+				//Take a place in the push queue, waiting up to timeout ms for one.
+				int Reserve(const int timeout);
+				void Consumed();
+				//Watch thread only.
+				void SendQueued();
+				void GrantCredit();
+
+				std::shared_ptr<Utilities::epoch_lock_free_queue<CommObject>> push_queue;
+				std::shared_ptr<Utilities::epoch_lock_free_queue<CommObject>> pull_queue;
 
 				std::shared_ptr<KSync::Comm::CommSystemSocket> socket;
 				std::string socket_url;
 
-				std::map<CommObject::message_id_t,KSync::Utilities::PromiseWrapper<std::shared_ptr<CommObject>>> promise_map;
+				KSync::Utilities::lock_free_pending_table<std::shared_ptr<CommObject>, ReplyHandler> pending_replies;
+				std::atomic<size_t> max_batch;
+
+				//Messages in the push queue plus unsent.
+				std::atomic<size_t> queued;
+				std::atomic<size_t> send_high_water;
+				std::mutex room_mutex;
+				std::condition_variable room_cond;
+				std::atomic<size_t> room_waiters;
+				//Owned by the watch thread. unsent timed out and is tried again before anything else.
+				std::shared_ptr<CommObject> unsent;
+				uint64_t send_credits;
+				uint64_t granted;
+				std::atomic<uint64_t> consumed;
+				std::atomic<size_t> recv_window;
 
 				std::shared_ptr<std::thread> watch_thread;
 				std::atomic<bool> finished;
+				std::atomic<bool> heard_from;
+				KSync::Utilities::WakeupSignal wakeup;
+				//Messages in the pull queue, and whether someone is waiting on arrival for one.
+				std::atomic<size_t> arrived;
+				std::atomic<bool> getter_sleeping;
+				KSync::Utilities::WakeupSignal arrival;
 				KSync::Utilities::client_id_t id;
+				bool bound;
+
+				//Totals over every communicator in the process.
+				KSync::Metrics::Gauge& push_queue_depth;
+				KSync::Metrics::Gauge& pull_queue_depth;
+				KSync::Metrics::Gauge& pending_replies_depth;
+				KSync::Metrics::Counter& send_waits;
+				KSync::Metrics::Counter& credit_stalls;
 		};
 
 		class ClientCommunicatorList {
@@ -57,12 +171,15 @@ namespace KSync {
 				~ClientCommunicatorList() {}
 
 
-				void push_front(ClientCommunicator const& value);
+				void push_front(const std::shared_ptr<ClientCommunicator>& value);
 				std::shared_ptr<ClientCommunicator> find_first_if(KSync::Utilities::client_id_t id);
 				void remove_if(KSync::Utilities::client_id_t id);
 				template<typename Function> void for_each(Function f) {
 					list.for_each(f);
 				}
+				template<typename Function> void for_each_shared(Function f) {
+					list.for_each_shared(f);
+				}
 			private:
 				KSync::Utilities::threadsafe_list<ClientCommunicator> list;
 		};
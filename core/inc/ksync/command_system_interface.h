@@ -17,6 +17,7 @@ namespace KSync {
 				virtual Status_t GetOutputUpdate(std::string& std_out, std::string& std_err) = 0; // Nonblocking Output fetching
 				Status_t GetOutput(std::string& std_out, std::string& std_err); // Block until program finishes
 				virtual bool IsFinished() = 0; // Check whether command has completed
+				virtual int Kill(const bool force = false) = 0; // Ask a running command to stop, or force it to
 				virtual Return_t GetReturnCode() = 0;
 				virtual std::string GetCommandLaunched() = 0;
 		};
@@ -3,13 +3,18 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
+#include "ksync/utilities.h"
 #include "ksync/comm/interface.h"
 
 namespace KSync {
 	namespace Utilities {
 		int GetGatewaySocketURL(std::string& gateway_socket_url, const bool gateway_socket_url_defined);
-		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, const bool nanomsg);
+		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const bool nanomsg, const CommTuning& tuning = CommTuning());
+		//Get a comm system by backend name, one of GetCommSystemNames().
+		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string& backend);
+		const std::vector<std::string>& GetCommSystemNames();
 	}
 }
 
@@ -0,0 +1,153 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_COROUTINE_HDR
+#define KSYNC_COROUTINE_HDR
+
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "ksync/ksync_exception.h"
+#include "ksync/wakeup_signal.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/comm/object.h"
+#include "ksync/client_communicator.h"
+#include "ksync/command_system_interface.h"
+
+namespace KSync {
+	namespace Coroutine {
+		// Coroutines let a handler wait on messages, timers and commands as if it
+		// were blocking, while one thread keeps thousands of them going. Each runs
+		// on its own small stack and gives the thread back only inside the waiting
+		// calls below, so the coroutines of a scheduler never run at once and can
+		// share state without locks. Blocking work, like running a command, is
+		// offloaded to a thread pool and the coroutine resumes once it's done.
+		//
+		// Only the touched pages of a stack use memory, but deep recursion or large
+		// locals will overflow one. Each stack has an inaccessible guard page
+		// below it so an overflow faults where it happens, and a canary checked
+		// whenever the coroutine switches out catches frames which jump the guard.
+		// The guard splits each stack into two mappings, which counts against
+		// vm.max_map_count. Stacks aren't inherited by fork, so fork from a pool
+		// thread with Offload, never a coroutine.
+		class Task;
+
+		class Scheduler {
+			public:
+				class SchedulerException : public KSync::Exception::BasicException {
+					public:
+						SchedulerException();
+				};
+
+				static const size_t DefaultStackSize = 128*1024;
+				static const int MaxEvents = 64;
+				//Stacks of finished coroutines kept for new ones.
+				static const size_t MaxSpareStacks = 256;
+
+				Scheduler();
+				~Scheduler();
+
+				Scheduler(const Scheduler& other) = delete;
+				Scheduler& operator=(const Scheduler& other) = delete;
+
+				//Start fn as a coroutine, it first runs on the next pass of Run. Only
+				//call from the thread running the scheduler, or before Run.
+				int Spawn(std::function<void()> fn, const size_t stack_size = DefaultStackSize) __attribute__((warn_unused_result));
+				//Run coroutines until every one has returned or Stop is called.
+				void Run();
+				//Make Run return once the running coroutine waits, Run may be called again
+				//to carry on. Safe from any thread.
+				//Coroutines still waiting when the scheduler is destroyed are never
+				//unwound, so they should be told to return first.
+				void Stop();
+				size_t GetNumCoroutines() const {
+					return this->tasks.size();
+				}
+				//The scheduler running the calling coroutine, null outside of one.
+				static Scheduler* Current();
+
+				//Only from a coroutine of this scheduler, see the free functions below.
+				void Yield();
+				void Sleep(const int timeout);
+				int WaitFd(const int fd, const uint32_t events, const int timeout);
+				void Offload(KSync::Utilities::thread_pool& pool, std::function<void()> fn);
+			private:
+				typedef std::multimap<std::chrono::steady_clock::time_point, Task*> TimerMap;
+
+				static void Entry();
+				void Resume(Task* task);
+				void Suspend();
+				void AddTimer(Task* task, const int timeout);
+				//Stop whatever task was waiting on and queue it to run.
+				void MakeReady(Task* task);
+				//Called from pool threads.
+				void WakeRemote(Task* task);
+				void Poll(const int timeout);
+				int NextTimeout();
+				void* GetStack(const size_t size);
+				void ReleaseStack(void* stack, const size_t size);
+
+				ucontext_t main_context;
+				Task* current;
+				std::set<Task*> tasks;
+				std::map<size_t, std::vector<void*>> spare_stacks;
+				size_t num_spare_stacks;
+				std::deque<Task*> ready;
+				TimerMap timers;
+				int epoll_fd;
+				std::atomic<bool> stopped;
+
+				std::mutex remote_mutex;
+				std::vector<Task*> remote_ready;
+				KSync::Utilities::WakeupSignal remote_wakeup;
+		};
+
+		//Start another coroutine on the calling coroutine's scheduler.
+		int Spawn(std::function<void()> fn, const size_t stack_size = Scheduler::DefaultStackSize) __attribute__((warn_unused_result));
+		//Let every other ready coroutine run first.
+		void Yield();
+		void Sleep(const int timeout);
+		//Wait up to timeout ms (-1 for ever) for events (EPOLLIN, EPOLLOUT) on fd.
+		//Returns the events which happened, 0 on timeout or < 0 on error. Only one
+		//coroutine may wait on a given fd at a time.
+		int WaitFd(const int fd, const uint32_t events, const int timeout);
+		//Run fn on pool, resuming once it returns. Exceptions are rethrown here.
+		void Offload(KSync::Utilities::thread_pool& pool, std::function<void()> fn);
+
+		//Next message from communicator, or null if none arrived within timeout ms.
+		std::shared_ptr<KSync::Comm::CommObject> Recv(KSync::Comm::ClientCommunicator& communicator, const int timeout);
+		//Queue obj on communicator, waiting up to timeout ms for room. Returns < 0 if not queued.
+		int Send(KSync::Comm::ClientCommunicator& communicator, std::shared_ptr<KSync::Comm::CommObject>& obj, const int timeout) __attribute__((warn_unused_result));
+		//Wait up to timeout ms for a launched command to exit. Returns < 0 if it hasn't.
+		//Its output isn't read, so use it for commands which don't write much.
+		int WaitExit(KSync::Commanding::ExecutionContext& context, const int timeout) __attribute__((warn_unused_result));
+	}
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef KSYNC_DIGEST_HDR
+#define KSYNC_DIGEST_HDR
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace KSync {
+	namespace Hash {
+		//Every digest ksync stores or sends, whichever hash produced it.
+		static const size_t DigestSize = 32;
+		typedef std::array<uint8_t, DigestSize> digest_t;
+	}
+}
+
+#endif
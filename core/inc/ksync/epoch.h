@@ -0,0 +1,78 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_EPOCH_HDR
+#define KSYNC_EPOCH_HDR
+
+#include <cstddef>
+#include <cstdint>
+
+namespace KSync {
+	namespace Epoch {
+		// Epoch based reclamation for the lock-free containers. A thread pins the
+		// current epoch while it may hold pointers into a container, and nodes
+		// unlinked from a container are retired instead of deleted. The global
+		// epoch only advances once every pinned thread has seen it, so anything
+		// retired two epochs ago can no longer be reached and is freed.
+		//
+		// Pins nest, and a pinned thread must not block on another pinned thread
+		// or reclamation stalls until it unpins.
+		typedef void (*deleter_t)(void*);
+
+		//Retired objects a thread collects before it tries to advance the epoch.
+		static const size_t RetireThreshold = 64;
+
+		void Pin();
+		void Unpin();
+
+		//Free object with deleter once no pinned thread can still see it.
+		void Retire(void* object, deleter_t deleter);
+
+		template<class T>
+		void DeleteObject(void* object) {
+			delete static_cast<T*>(object);
+		}
+
+		template<class T>
+		void Retire(T* object) {
+			Retire(static_cast<void*>(object), &DeleteObject<T>);
+		}
+
+		//Try to advance the epoch and free whatever is safe. Returns the number freed.
+		size_t Collect();
+		uint64_t GetEpoch();
+		//Objects retired by any thread and not yet freed.
+		size_t GetNumRetired();
+
+		class Guard {
+			public:
+				Guard() {
+					Pin();
+				}
+				~Guard() {
+					Unpin();
+				}
+			private:
+				Guard(const Guard&) = delete;
+				Guard& operator=(const Guard&) = delete;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_HASH_CACHE_HDR
+#define KSYNC_HASH_CACHE_HDR
+
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "ksync/digest.h"
+#include "ksync/metrics.h"
+
+namespace KSync {
+	namespace Utilities {
+		class thread_pool;
+	}
+
+	namespace Hash {
+		// Files are hashed with Blake3 in fixed size blocks, and the whole file
+		// digest is the hash of the block digests, so either can be checked
+		// without rereading.
+		class FileHashes {
+			public:
+				digest_t digest;
+				std::vector<digest_t> blocks;
+		};
+
+		//Blocks read ahead and hashed at once when given a pool.
+		static const size_t ParallelBatchSize = 8*1024*1024;
+
+		//Hash everything read from fd in blocks of block_size, spread over pool if there is one.
+		int HashFile(const int fd, const uint32_t block_size, FileHashes& hashes, KSync::Utilities::thread_pool* pool = nullptr) __attribute__((warn_unused_result));
+		//The same for a file already in memory.
+		void HashBuffer(const char* data, const size_t size, const uint32_t block_size, FileHashes& hashes, KSync::Utilities::thread_pool* pool = nullptr);
+
+		// Remembers the hashes of files under a root so unchanged files are never
+		// read again. Entries are found by (dev, inode) in an open addressed table
+		// and are only used while size, mtime and ctime still match, so a lookup
+		// is one probe sequence in the mapped file.
+		//
+		// File layout, host byte order since the cache never leaves the machine:
+		//   Header
+		//   Slot[num_slots]
+		//   digest_t[blocks_capacity]   block digests, referenced by the slots
+		//
+		// The table is rebuilt into a bigger file when it fills up, dropping
+		// entries which weren't used in the last MaxIdleGenerations opens. A cache
+		// which wasn't closed cleanly is thrown away rather than trusted.
+		//
+		// With xattrs enabled, hashes are also stored on the file itself as
+		// XattrName, so they survive the cache file being lost. Setting the xattr
+		// changes ctime, so those are only checked against size and mtime.
+		class HashCache {
+			public:
+				static const uint32_t DefaultBlockSize = 64*1024;
+				static const uint64_t MinSlots = 1024;
+				static const uint64_t MinBlocks = 4096;
+				static const uint64_t MaxIdleGenerations = 16;
+				//Files changed this recently may change again within the same timestamp, so aren't cached. (ns)
+				static const int64_t RacyWindow = 2000000000;
+				static const char* const DefaultFileName;
+				static const char* const XattrName;
+
+				static const int Hashed = 0;
+				static const int Cached = 1;
+
+				HashCache();
+				~HashCache();
+				HashCache(const HashCache& rhs) = delete;
+				HashCache& operator=(const HashCache& rhs) = delete;
+
+				//Map the cache at path, creating it if needed. Only one process may have it open.
+				int Open(const std::string& path, const uint32_t block_size = DefaultBlockSize) __attribute__((warn_unused_result));
+				int Close() __attribute__((warn_unused_result));
+				bool IsOpen() const {
+					return this->header != nullptr;
+				}
+				void SetUseXattr(const bool use_xattr) {
+					this->use_xattr = use_xattr;
+				}
+				//Hash files which miss on pool, which must outlive the cache.
+				void SetThreadPool(KSync::Utilities::thread_pool* pool) {
+					this->pool = pool;
+				}
+
+				//Hashes of the file at path. Returns Cached or Hashed, < 0 on error.
+				//Works without an open cache, it just never hits.
+				int GetHashes(const std::string& path, FileHashes& hashes) __attribute__((warn_unused_result));
+
+				bool Lookup(const struct stat& st, FileHashes& hashes);
+				int Store(const struct stat& st, const FileHashes& hashes) __attribute__((warn_unused_result));
+				//Whether hashes of a file read between stats before and after may be stored.
+				static bool Storable(const struct stat& before, const struct stat& after);
+
+				size_t GetNumEntries();
+				uint32_t GetBlockSize() const {
+					return this->block_size;
+				}
+			private:
+				class Header;
+				class Slot;
+
+				int Map(const int new_fd, const size_t new_size) __attribute__((warn_unused_result));
+				void Unmap();
+				int Create() __attribute__((warn_unused_result));
+				int Rebuild(const uint64_t extra_blocks) __attribute__((warn_unused_result));
+				//The slot holding (dev, ino), or the empty slot it would go in. nullptr if there is neither.
+				static Slot* Find(Slot* slots, const uint64_t num_slots, const uint64_t dev, const uint64_t ino);
+				//Whether a used slot's blocks lie within those handed out, which a corrupt file may not.
+				static bool InBounds(const Header& header, const Slot& slot);
+				Slot* GetSlots();
+				digest_t* GetBlocks();
+
+				bool LookupXattr(const int fd, const struct stat& st, FileHashes& hashes);
+				void StoreXattr(const int fd, const struct stat& st, const FileHashes& hashes);
+
+				std::mutex mutex;
+				std::string path;
+				int fd;
+				char* map;
+				size_t map_size;
+				Header* header;
+				uint32_t block_size;
+				bool use_xattr;
+				KSync::Utilities::thread_pool* pool;
+
+				KSync::Metrics::Counter& hits;
+				KSync::Metrics::Counter& xattr_hits;
+				KSync::Metrics::Counter& misses;
+				KSync::Metrics::Counter& bytes_hashed;
+		};
+	}
+}
+
+#endif
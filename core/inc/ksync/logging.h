@@ -21,6 +21,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <string>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 
 #include "g3log/g3log.hpp"
 #include "g3log/logworker.hpp"
@@ -32,4 +35,92 @@ namespace KSync {
 const LEVELS MESSAGE { (INFO.value+DEBUG.value)/2, {""}};
 const LEVELS SEVERE { (FATAL.value-1), {"SEVERE"}};
 
+//Numeric level values for the preprocessor, matching g3log's and the two above.
+#define KSYNC_LOG_LEVEL_DEBUG 0
+#define KSYNC_LOG_LEVEL_MESSAGE 50
+#define KSYNC_LOG_LEVEL_INFO 100
+#define KSYNC_LOG_LEVEL_WARNING 500
+#define KSYNC_LOG_LEVEL_SEVERE 999
+#define KSYNC_LOG_LEVEL_FATAL 1000
+
+//KLOGF and the limited variants below compile to nothing for levels under this.
+#ifndef KSYNC_LOG_MIN_LEVEL
+#define KSYNC_LOG_MIN_LEVEL 0
+#endif
+
+#define KSYNC_LOG_ENABLED(level) (KSYNC_LOG_LEVEL_##level >= KSYNC_LOG_MIN_LEVEL)
+
+namespace KSync {
+	//Lets at most max_per_period messages through per period, counting the rest.
+	class LogRateLimiter {
+		public:
+			LogRateLimiter(const uint64_t max_per_period, const int period_ms) : max_per_period(max_per_period), period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::milliseconds(period_ms)).count()), window_start(0), count(0), suppressed(0) {}
+			//suppressed is set to the number of messages dropped since the last one allowed.
+			bool Allow(uint64_t& suppressed) {
+				const std::chrono::steady_clock::rep now = std::chrono::steady_clock::now().time_since_epoch().count();
+				std::chrono::steady_clock::rep start = this->window_start.load(std::memory_order_relaxed);
+				if((now-start >= this->period)&&(this->window_start.compare_exchange_strong(start, now, std::memory_order_relaxed))) {
+					this->count.store(0, std::memory_order_relaxed);
+				}
+				if(this->count.fetch_add(1, std::memory_order_relaxed) < this->max_per_period) {
+					suppressed = this->suppressed.exchange(0, std::memory_order_relaxed);
+					return true;
+				}
+				this->suppressed.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		private:
+			const uint64_t max_per_period;
+			const std::chrono::steady_clock::rep period;
+			std::atomic<std::chrono::steady_clock::rep> window_start;
+			std::atomic<uint64_t> count;
+			std::atomic<uint64_t> suppressed;
+	};
+
+	//Lets one in every n messages through.
+	class LogSampler {
+		public:
+			LogSampler(const uint64_t n) : n(n ? n : 1), count(0) {}
+			bool Allow(uint64_t& suppressed) {
+				const uint64_t i = this->count.fetch_add(1, std::memory_order_relaxed);
+				if(i%this->n != 0) {
+					return false;
+				}
+				suppressed = (i == 0) ? 0 : this->n-1;
+				return true;
+			}
+		private:
+			const uint64_t n;
+			std::atomic<uint64_t> count;
+	};
+}
+
+#define KSYNC_LOGF_LIMITED(limiter_type, limiter_args, level, format, ...) \
+	do { \
+		if(KSYNC_LOG_ENABLED(level)) { \
+			static KSync::limiter_type ksync_log_limiter limiter_args; \
+			uint64_t ksync_log_suppressed = 0; \
+			if(ksync_log_limiter.Allow(ksync_log_suppressed)) { \
+				if(ksync_log_suppressed != 0) { \
+					LOGF(level, format " [%lu similar messages suppressed]", ##__VA_ARGS__, (unsigned long) ksync_log_suppressed); \
+				} else { \
+					LOGF(level, format, ##__VA_ARGS__); \
+				} \
+			} \
+		} \
+	} while(0)
+
+//LOGF which can be compiled out with KSYNC_LOG_MIN_LEVEL.
+#define KLOGF(level, ...) \
+	do { \
+		if(KSYNC_LOG_ENABLED(level)) { \
+			LOGF(level, __VA_ARGS__); \
+		} \
+	} while(0)
+
+//For call sites which can fire on every message or every poll. Each call site has
+//its own limit, and the next message let through says how many were dropped.
+#define LOGF_RATE_LIMITED(level, max_per_period, period_ms, format, ...) KSYNC_LOGF_LIMITED(LogRateLimiter, (max_per_period, period_ms), level, format, ##__VA_ARGS__)
+#define LOGF_EVERY_N(level, n, format, ...) KSYNC_LOGF_LIMITED(LogSampler, (n), level, format, ##__VA_ARGS__)
+
 #endif
@@ -24,8 +24,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <memory>
 
 #include "ksync/utilities.h"
+#include "ksync/string_view.h"
 #include "ksync/ksync_exception.h"
 #include "ksync/command_system_interface.h"
+#include "ksync/digest.h"
 
 namespace KSync {
 	namespace Comm {
@@ -99,13 +101,60 @@ namespace KSync {
 				}
 		};
 
-		class CommStringArray : public CommunicableObject, public std::vector<std::string> {
+		// Wire format is a varint count followed by a varint length and the bytes
+		// of each string. Received arrays aren't decoded up front, strings are
+		// handed out as views into the receive buffer which stay valid as long as
+		// the array does. Lengths are walked on first indexed access, for_each
+		// walks them without building an index.
+		class CommStringArray : public CommunicableObject {
 			public:
 				static const Type_t Type;
-				CommStringArray() {};
-				CommStringArray(const std::vector<std::string>& strings) : std::vector<std::string>(strings) {};
+				CommStringArray() : count(0), first(0) {};
+				CommStringArray(const std::vector<std::string>& strings) : strings(strings), count(strings.size()), first(0) {};
 				CommStringArray(const std::shared_ptr<CommObject>& comm_obj);
 				std::shared_ptr<CommObject> GetCommObject();
+
+				size_t size() const {
+					return this->count;
+				}
+				bool empty() const {
+					return this->count == 0;
+				}
+				//Received arrays are only checked as they're read, so Get and for_each
+				//throw UnPackException on a malformed or out of range string.
+				Utilities::StringView Get(const size_t i) const;
+				Utilities::StringView operator[](const size_t i) const {
+					return this->Get(i);
+				}
+				template<class F> void for_each(F f) const {
+					if(!this->source) {
+						for(size_t s_i = 0; s_i < this->strings.size(); ++s_i) {
+							f(Utilities::StringView(this->strings[s_i]));
+						}
+						return;
+					}
+					size_t d_i = this->first;
+					Utilities::StringView view;
+					for(size_t s_i = 0; s_i < this->count; ++s_i) {
+						d_i = this->Next(d_i, view);
+						f(view);
+					}
+				}
+
+				//Modifying a received array copies its strings out first.
+				void Set(const size_t i, const std::string& in);
+				void push_back(const std::string& in);
+				void resize(const size_t n);
+				void clear();
+			private:
+				void Materialize();
+				size_t Next(const size_t d_i, Utilities::StringView& view) const;
+
+				std::vector<std::string> strings;
+				std::shared_ptr<CommObject> source;
+				size_t count;
+				size_t first;
+				mutable std::vector<size_t> offsets;
 		};
 
 		class GatewaySocketInitializationRequest : public CommunicableObject {
@@ -144,17 +193,17 @@ namespace KSync {
 				virtual Type_t GetType() const {
 					return this->Type;
 				}
-				const std::string& GetBroadcastUrl() const {
-					return (*this)[0];
+				Utilities::StringView GetBroadcastUrl() const {
+					return this->Get(0);
 				}
 				void SetBroadcastUrl(const std::string& in) {
-					(*this)[0] = in;
+					this->Set(0, in);
 				}
-				const std::string& GetClientUrl() const {
-					return (*this)[1];
+				Utilities::StringView GetClientUrl() const {
+					return this->Get(1);
 				}
 				void SetClientUrl(const std::string& in) {
-					(*this)[1] = in;
+					this->Set(1, in);
 				}
 		};
 
@@ -251,6 +300,229 @@ namespace KSync {
 				std::string std_err;
 				KSync::Commanding::ExecutionContext::Return_t return_code;
 		};
+
+		class StatsRequest : public SimpleCommunicableObject {
+			public:
+				static const Type_t Type;
+				StatsRequest() {};
+				StatsRequest(const std::shared_ptr<CommObject>& comm_obj) : SimpleCommunicableObject(comm_obj) {};
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+		};
+
+		//The server's metrics as JSON.
+		class StatsReply : public CommString {
+			public:
+				static const Type_t Type;
+				StatsReply() {};
+				StatsReply(const std::string& in) : CommString(in) {};
+				StatsReply(const std::shared_ptr<CommObject>& comm_obj) : CommString(comm_obj) {};
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+		};
+
+		//Sent instead of a reply when the server won't handle a request, with the reason.
+		class RequestRefused : public CommString {
+			public:
+				static const Type_t Type;
+				RequestRefused() {};
+				RequestRefused(const std::string& in) : CommString(in) {};
+				RequestRefused(const std::shared_ptr<CommObject>& comm_obj) : CommString(comm_obj) {};
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+		};
+
+		//Lets the other end of a ClientCommunicator send this many more messages.
+		class FlowCredit : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				FlowCredit(const uint64_t credits) {
+					this->credits = credits;
+				}
+				FlowCredit(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				uint64_t GetCredits() const {
+					return this->credits;
+				}
+			private:
+				uint64_t credits;
+		};
+
+		typedef uint64_t stream_id_t;
+		typedef uint64_t stream_seq_t;
+
+		class StreamStart : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				StreamStart(const stream_id_t stream_id, const uint64_t total_size, const uint32_t chunk_size, const uint32_t window) {
+					this->stream_id = stream_id;
+					this->total_size = total_size;
+					this->chunk_size = chunk_size;
+					this->window = window;
+				}
+				StreamStart(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				stream_id_t GetStreamId() const {
+					return this->stream_id;
+				}
+				uint64_t GetTotalSize() const {
+					return this->total_size;
+				}
+				uint32_t GetChunkSize() const {
+					return this->chunk_size;
+				}
+				uint32_t GetWindow() const {
+					return this->window;
+				}
+			private:
+				stream_id_t stream_id;
+				uint64_t total_size;
+				uint32_t chunk_size;
+				uint32_t window;
+		};
+
+		//A single sequence numbered piece of a stream. When received, the chunk data
+		//points into the CommObject it was decoded from rather than being copied out.
+		class StreamChunk : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				static const size_t HeaderSize;
+				StreamChunk(const stream_id_t stream_id, const stream_seq_t sequence, const char* data, const size_t size) {
+					this->stream_id = stream_id;
+					this->sequence = sequence;
+					this->data = data;
+					this->size = size;
+				}
+				StreamChunk(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				//Write the chunk header into the start of a payload buffer of at least HeaderSize bytes
+				static void WriteHeader(char* payload, const stream_id_t stream_id, const stream_seq_t sequence);
+				stream_id_t GetStreamId() const {
+					return this->stream_id;
+				}
+				stream_seq_t GetSequence() const {
+					return this->sequence;
+				}
+				const char* GetData() const {
+					return this->data;
+				}
+				size_t GetSize() const {
+					return this->size;
+				}
+			private:
+				std::shared_ptr<CommObject> source;
+				stream_id_t stream_id;
+				stream_seq_t sequence;
+				const char* data;
+				size_t size;
+		};
+
+		//Sent by the receiver of a stream. Acknowledges every chunk below acked
+		//and allows the sender to transmit every chunk below limit.
+		class StreamCredit : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				StreamCredit(const stream_id_t stream_id, const stream_seq_t acked, const stream_seq_t limit) {
+					this->stream_id = stream_id;
+					this->acked = acked;
+					this->limit = limit;
+				}
+				StreamCredit(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				stream_id_t GetStreamId() const {
+					return this->stream_id;
+				}
+				stream_seq_t GetAcked() const {
+					return this->acked;
+				}
+				stream_seq_t GetLimit() const {
+					return this->limit;
+				}
+			private:
+				stream_id_t stream_id;
+				stream_seq_t acked;
+				stream_seq_t limit;
+		};
+
+		class StreamEnd : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				StreamEnd(const stream_id_t stream_id, const stream_seq_t num_chunks, const uint64_t total_size) {
+					this->stream_id = stream_id;
+					this->num_chunks = num_chunks;
+					this->total_size = total_size;
+				}
+				StreamEnd(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				stream_id_t GetStreamId() const {
+					return this->stream_id;
+				}
+				stream_seq_t GetNumChunks() const {
+					return this->num_chunks;
+				}
+				uint64_t GetTotalSize() const {
+					return this->total_size;
+				}
+			private:
+				stream_id_t stream_id;
+				stream_seq_t num_chunks;
+				uint64_t total_size;
+		};
+
+		//Precedes the stream carrying a file's contents. The digest is Blake3
+		//over blocks of block_size as computed by HashFile, so the receiver can
+		//check what it wrote.
+		class TransferFile : public CommunicableObject {
+			public:
+				static const Type_t Type;
+				TransferFile(const std::string& path, const uint64_t size, const uint32_t block_size, const KSync::Hash::digest_t& digest) {
+					this->path = path;
+					this->size = size;
+					this->block_size = block_size;
+					this->digest = digest;
+				}
+				TransferFile(const std::shared_ptr<CommObject>& comm_obj);
+				std::shared_ptr<CommObject> GetCommObject();
+				virtual Type_t GetType() const {
+					return this->Type;
+				}
+				//Relative to the root the files are sent from.
+				const std::string& GetPath() const {
+					return this->path;
+				}
+				uint64_t GetSize() const {
+					return this->size;
+				}
+				uint32_t GetBlockSize() const {
+					return this->block_size;
+				}
+				const KSync::Hash::digest_t& GetDigest() const {
+					return this->digest;
+				}
+			private:
+				std::string path;
+				uint64_t size;
+				uint32_t block_size;
+				KSync::Hash::digest_t digest;
+		};
 	}
 }
 
@@ -0,0 +1,118 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_METRICS_HDR
+#define KSYNC_METRICS_HDR
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+namespace KSync {
+	namespace Metrics {
+		class Counter {
+			public:
+				Counter() : value(0) {}
+				void Add(const uint64_t amount = 1) {
+					this->value.fetch_add(amount, std::memory_order_relaxed);
+				}
+				uint64_t Get() const {
+					return this->value.load(std::memory_order_relaxed);
+				}
+			private:
+				std::atomic<uint64_t> value;
+		};
+
+		class Gauge {
+			public:
+				Gauge() : value(0) {}
+				void Set(const int64_t value) {
+					this->value.store(value, std::memory_order_relaxed);
+				}
+				void Add(const int64_t amount) {
+					this->value.fetch_add(amount, std::memory_order_relaxed);
+				}
+				int64_t Get() const {
+					return this->value.load(std::memory_order_relaxed);
+				}
+			private:
+				std::atomic<int64_t> value;
+		};
+
+		//HDR style histogram. Values below 2*SubBucketCount are exact, above that
+		//each power of two is split into SubBucketCount buckets, so any recorded
+		//value is reported to within 1/SubBucketCount of itself.
+		class Histogram {
+			public:
+				static const int SubBucketBits = 5;
+				static const size_t SubBucketCount = 1 << SubBucketBits;
+				static const size_t NumBuckets = (64-SubBucketBits+1)*SubBucketCount;
+
+				Histogram();
+
+				void Record(const uint64_t value);
+
+				uint64_t GetCount() const {
+					return this->count.load(std::memory_order_relaxed);
+				}
+				uint64_t GetMin() const;
+				uint64_t GetMax() const {
+					return this->max.load(std::memory_order_relaxed);
+				}
+				double GetMean() const;
+				//Highest value equivalent to the value at percentile (0-100).
+				uint64_t GetPercentile(const double percentile) const;
+
+				static size_t BucketIndex(const uint64_t value);
+				static uint64_t BucketUpperBound(const size_t index);
+			private:
+				std::atomic<uint64_t> buckets[NumBuckets];
+				std::atomic<uint64_t> count;
+				std::atomic<uint64_t> sum;
+				std::atomic<uint64_t> min;
+				std::atomic<uint64_t> max;
+		};
+
+		//Records the nanoseconds it was alive for into a histogram.
+		class ScopedTimer {
+			public:
+				ScopedTimer(Histogram& histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+				~ScopedTimer() {
+					this->histogram.Record((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-this->start).count());
+				}
+			private:
+				Histogram& histogram;
+				std::chrono::steady_clock::time_point start;
+		};
+
+		//Metrics live for the rest of the process once created, so callers should
+		//look them up once and keep the reference rather than on every update.
+		Counter& GetCounter(const std::string& name);
+		Gauge& GetGauge(const std::string& name);
+		Histogram& GetHistogram(const std::string& name);
+
+		//Everything as a JSON object, histograms in nanoseconds.
+		void WriteJson(std::ostream& out);
+		std::string Dump();
+		int DumpToFile(const std::string& path) __attribute__((warn_unused_result));
+	}
+}
+
+#endif
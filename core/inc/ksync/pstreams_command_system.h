@@ -1,6 +1,8 @@
 #ifndef KSYNC_PSTREAMS_COMMAND_SYSTEM_HDR
 #define KSYNC_PSTREAMS_COMMAND_SYSTEM_HDR
 
+#include <mutex>
+
 #include "ksync/command_system_interface.h"
 #include "ksync/pstream.h"
 
@@ -11,10 +13,12 @@ namespace KSync {
 				int LaunchCommand(const std::string& command); // Launch command
 				Status_t GetOutputUpdate(std::string& std_out, std::string& std_err); // Nonblocking Output fetching
 				bool IsFinished(); // Check whether command has completed
+				int Kill(const bool force = false); // SIGTERM, or SIGKILL with force. May be called from another thread
 				Return_t GetReturnCode();
 				std::string GetCommandLaunched();
 			protected:
 				std::shared_ptr<redi::pstream> process_stream;
+				std::mutex launch_mutex;
 		};
 
 		class PSCommandSystem : public SystemInterface {
@@ -0,0 +1,51 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_SHA256_HDR
+#define KSYNC_SHA256_HDR
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ksync/digest.h"
+
+namespace KSync {
+	namespace Hash {
+		//FIPS 180-4 SHA-256.
+		class Sha256 {
+			public:
+				static const size_t BlockSize = 64;
+
+				Sha256();
+				void Update(const void* data, size_t size);
+				void Final(digest_t& digest);
+
+				static void Digest(const void* data, const size_t size, digest_t& digest);
+			private:
+				void Compress(const uint8_t* block);
+
+				uint32_t state[8];
+				uint8_t buffer[BlockSize];
+				size_t buffered;
+				uint64_t total;
+		};
+	}
+}
+
+#endif
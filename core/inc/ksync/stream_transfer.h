@@ -0,0 +1,127 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_STREAM_TRANSFER_HDR
+#define KSYNC_STREAM_TRANSFER_HDR
+
+#include <string>
+#include <memory>
+#include <deque>
+#include <ostream>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+
+namespace KSync {
+	namespace Comm {
+		// Streams a large payload as sequence numbered StreamChunk messages.
+		// The sender may only have chunks below the receiver's credit limit
+		// outstanding, so at most window*chunk_size bytes are in memory at once.
+		//
+		// Sender                      Receiver
+		// StreamStart     ------->
+		//                 <-------    StreamCredit(0, window)
+		// StreamChunk 0..n ------>
+		//                 <-------    StreamCredit(acked, acked+window)
+		// StreamEnd       ------->
+		//                 <-------    StreamCredit(num_chunks, ...)
+		class StreamSender {
+			public:
+				static const uint32_t DefaultChunkSize = 256*1024;
+				static const uint32_t DefaultWindow = 16;
+
+				StreamSender(std::shared_ptr<ClientCommunicator>& communicator, const uint32_t chunk_size = DefaultChunkSize, const uint32_t window = DefaultWindow);
+
+				int SendFile(const std::string& path) __attribute__((warn_unused_result));
+				int SendFileDescriptor(const int fd, const uint64_t total_size) __attribute__((warn_unused_result));
+				//Copies straight from memory, such as a mapped file, into the chunks.
+				int SendBuffer(const char* data, const uint64_t total_size) __attribute__((warn_unused_result));
+
+				//Give up if the receiver stays silent for this long. (ms)
+				void SetIdleTimeout(const int timeout) {
+					this->idle_timeout = timeout;
+				}
+				stream_id_t GetStreamId() const {
+					return this->stream_id;
+				}
+				//Messages which arrived during the transfer but weren't part of it.
+				std::deque<std::shared_ptr<CommObject>>& GetDeferred() {
+					return this->deferred;
+				}
+			private:
+				//Chunks are filled from data when it isn't null, otherwise read from fd.
+				int Send(const int fd, const char* data, const uint64_t total_size) __attribute__((warn_unused_result));
+				int WaitForCredit() __attribute__((warn_unused_result));
+
+				std::shared_ptr<ClientCommunicator> communicator;
+				std::deque<std::shared_ptr<CommObject>> deferred;
+				stream_id_t stream_id;
+				uint32_t chunk_size;
+				uint32_t window;
+				int idle_timeout;
+				stream_seq_t acked;
+				stream_seq_t limit;
+		};
+
+		class StreamReceiver {
+			public:
+				static const int Continue = 0;
+				static const int Finished = 1;
+				static const uint32_t MaxWindow = 64;
+				static const uint32_t MaxChunkSize = 16*1024*1024;
+
+				StreamReceiver(std::shared_ptr<ClientCommunicator>& communicator);
+
+				//Feed a received message to the receiver. Returns Continue, Finished
+				//or < 0 if the stream is broken. Writes go to out in sequence order.
+				int HandleMessage(const std::shared_ptr<CommObject>& comm_obj, std::ostream& out) __attribute__((warn_unused_result));
+
+				//Block until a complete stream has been written to path.
+				int ReceiveFile(const std::string& path) __attribute__((warn_unused_result));
+
+				void SetIdleTimeout(const int timeout) {
+					this->idle_timeout = timeout;
+				}
+				bool IsStarted() const {
+					return this->started;
+				}
+				uint64_t GetBytesReceived() const {
+					return this->bytes_received;
+				}
+				std::deque<std::shared_ptr<CommObject>>& GetDeferred() {
+					return this->deferred;
+				}
+			private:
+				int SendCredit() __attribute__((warn_unused_result));
+
+				std::shared_ptr<ClientCommunicator> communicator;
+				std::deque<std::shared_ptr<CommObject>> deferred;
+				bool started;
+				stream_id_t stream_id;
+				uint64_t total_size;
+				uint32_t chunk_size;
+				uint32_t window;
+				int idle_timeout;
+				stream_seq_t next_sequence;
+				stream_seq_t granted_limit;
+				uint64_t bytes_received;
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_STRING_VIEW_HDR
+#define KSYNC_STRING_VIEW_HDR
+
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+namespace KSync {
+	namespace Utilities {
+		//A pointer and length into characters owned by someone else, in the
+		//spirit of C++17's std::string_view.
+		class StringView {
+			public:
+				StringView() : ptr(0), length(0) {}
+				StringView(const char* ptr, const size_t length) : ptr(ptr), length(length) {}
+				StringView(const char* str) : ptr(str), length(strlen(str)) {}
+				StringView(const std::string& str) : ptr(str.data()), length(str.size()) {}
+
+				const char* data() const {
+					return this->ptr;
+				}
+				size_t size() const {
+					return this->length;
+				}
+				bool empty() const {
+					return this->length == 0;
+				}
+				const char* begin() const {
+					return this->ptr;
+				}
+				const char* end() const {
+					return this->ptr+this->length;
+				}
+				char operator[](const size_t i) const {
+					return this->ptr[i];
+				}
+
+				std::string str() const {
+					return std::string(this->ptr, this->length);
+				}
+				operator std::string() const {
+					return this->str();
+				}
+
+				int compare(const StringView& other) const {
+					const int result = memcmp(this->ptr, other.ptr, std::min(this->length, other.length));
+					if(result != 0) {
+						return result;
+					}
+					if(this->length == other.length) {
+						return 0;
+					}
+					return (this->length < other.length) ? -1 : 1;
+				}
+			private:
+				const char* ptr;
+				size_t length;
+		};
+
+		inline bool operator==(const StringView& a, const StringView& b) {
+			return (a.size() == b.size())&&(memcmp(a.data(), b.data(), a.size()) == 0);
+		}
+		inline bool operator!=(const StringView& a, const StringView& b) {
+			return !(a == b);
+		}
+		inline bool operator<(const StringView& a, const StringView& b) {
+			return a.compare(b) < 0;
+		}
+		inline std::ostream& operator<<(std::ostream& out, const StringView& view) {
+			return out.write(view.data(), view.size());
+		}
+	}
+}
+
+#endif
@@ -2,10 +2,24 @@
 #define KSYNC_THREAD_UTILITIES_HDR
 
 #include <memory>
+#include <algorithm>
 #include <atomic>
 #include <future>
 #include <mutex>
 #include <utility>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+
+#include "ksync/epoch.h"
+#include "ksync/ksync_exception.h"
+#include "ksync/wakeup_signal.h"
 
 namespace KSync {
 	namespace Utilities {
@@ -25,13 +39,13 @@ namespace KSync {
 			public:
 				void push(const T& data) {
 					const std::shared_ptr<node> new_node = std::make_shared<node>(data);
-					new_node->next = std::atomic_load(head);
-					while(!std::atomic_compare_exchange_weak(head, new_node->next, new_node));
+					new_node->next = std::atomic_load(&head);
+					while(!std::atomic_compare_exchange_weak(&head, &new_node->next, new_node));
 				}
 				std::shared_ptr<T> pop() {
-					std::shared_ptr<node> old_head = std::atomic_load(head);
-					while(old_head && !std::atomic_compare_exchange_weak(head,
-						old_head, old_head->next));
+					std::shared_ptr<node> old_head = std::atomic_load(&head);
+					while(old_head && !std::atomic_compare_exchange_weak(&head,
+						&old_head, old_head->next));
 					return old_head ? old_head->data : std::shared_ptr<T>();
 				}
 		};
@@ -47,6 +61,7 @@ namespace KSync {
 					node(const T& data_):
 						data(std::make_shared<T>(data_)) {
 					}
+					node() {}
 				};
 
 				std::shared_ptr<node> head;
@@ -61,28 +76,28 @@ namespace KSync {
 					return old_head;
 				}*/
 			public:
-				spsc_threadsafe_lock_free_queue() : head(std::move(std::make_shared(new node))) , tail(std::atomic_load(head)) {
+				spsc_threadsafe_lock_free_queue() : head(std::make_shared<node>()) , tail(head) {
 				}
 				spsc_threadsafe_lock_free_queue(const spsc_threadsafe_lock_free_queue& rhs) = delete;
 				spsc_threadsafe_lock_free_queue& operator=(const spsc_threadsafe_lock_free_queue& rhs) = delete;
 				~spsc_threadsafe_lock_free_queue() {
-					while(const std::shared_ptr<node> old_head = std::atomic_load(head)) {
-						std::atomic_store(head, old_head->next);
+					while(const std::shared_ptr<node> old_head = std::atomic_load(&head)) {
+						std::atomic_store(&head, old_head->next);
 						//std::atomic_store(old_head, nullptr);
 					}
 				}
 
 				std::shared_ptr<T> pop() {
 					//Load head
-					std::shared_ptr<node> old_head = std::atomic_load(head);
+					std::shared_ptr<node> old_head = std::atomic_load(&head);
 					//Check that head isn't same as tail
-					if(old_head == std::atomic_load(tail)) {
+					if(old_head == std::atomic_load(&tail)) {
 						return std::shared_ptr<T>();
 					}
 
 					// Since this is SPSC queue, 
 					// can simply move head
-					std::atomic_store(head, old_head->next);
+					std::atomic_store(&head, old_head->next);
 					// and remove data from old_head
 					std::shared_ptr<T> res(std::move(old_head->data));
 					//old_head will delete itself automatically since we took it's data.
@@ -96,7 +111,7 @@ namespace KSync {
 					//Create new empty node for end of queue.
 					std::shared_ptr<node> p(new node);
 					//Get current tail.
-					const std::shared_ptr<node> old_tail = std::atomic_load(tail);
+					const std::shared_ptr<node> old_tail = std::atomic_load(&tail);
 					while (true) {
 						//Create emtpy data pointer
 						std::shared_ptr<T> old_data;
@@ -104,11 +119,11 @@ namespace KSync {
 						//It should be empty since tail should point to an empty node.
 						//Exchange it's content for the new data we created.
 						//We do this first so that node's data is prepared.
-						if(std::atomic_compare_exchange_strong(old_tail->data, old_data, new_data)) {
+						if(std::atomic_compare_exchange_strong(&old_tail->data, &old_data, new_data)) {
 							//Set tail's next pointer to new empty node.
 							old_tail->next = p;
 							//atomically store empty node as new tail..
-							std::atomic_store(tail, p);
+							std::atomic_store(&tail, p);
 							//old version:
 							//old_tail = std::atomic_exchange(tail, p);
 							break;
@@ -128,6 +143,7 @@ namespace KSync {
 					node(const T& data_):
 						data(std::make_shared<T>(data_)) {
 					}
+					node() {}
 				};
 
 				std::shared_ptr<node> head;
@@ -142,23 +158,29 @@ namespace KSync {
 					return old_head;
 				}*/
 			public:
-				threadsafe_queue() : head(std::move(std::make_shared(new node))) , tail(std::atomic_load(head)) {
+				threadsafe_queue() : head(std::make_shared<node>()) , tail(head) {
 				}
 				threadsafe_queue(const threadsafe_queue& rhs) = delete;
 				threadsafe_queue& operator=(const threadsafe_queue& rhs) = delete;
 				~threadsafe_queue() {
-					while(const std::shared_ptr<node> old_head = std::atomic_load(head)) {
-						std::atomic_store(head, old_head->next);
+					while(const std::shared_ptr<node> old_head = std::atomic_load(&head)) {
+						std::atomic_store(&head, old_head->next);
 						//std::atomic_store(old_head, nullptr);
 					}
 				}
 
 				std::shared_ptr<T> pop() {
-					//Same solution as in lock-free stack for pop.
-					std::shared_ptr<node> old_head = std::atomic_load(head);
-					while(old_head && !std::atomic_compare_exchange_weak(head,
-						old_head, old_head->next));
-					return old_head ? old_head->data : std::shared_ptr<T>();
+					//Same solution as in lock-free stack for pop, except the
+					//dummy tail node must never be popped.
+					std::shared_ptr<node> old_head = std::atomic_load(&head);
+					while(true) {
+						if(old_head == std::atomic_load(&tail)) {
+							return std::shared_ptr<T>();
+						}
+						if(std::atomic_compare_exchange_weak(&head, &old_head, old_head->next)) {
+							return old_head->data;
+						}
+					}
 				}
 
 				void push(std::shared_ptr<T>& new_value) {
@@ -166,20 +188,20 @@ namespace KSync {
 					std::shared_ptr<T> new_data(std::move(new_value));
 					//Create new empty node for end of queue.
 					std::shared_ptr<node> p(new node);
-					//Create emtpy data pointer
-					std::shared_ptr<T> expected_old_data;
 					while (true) {
+						//Create emtpy data pointer
+						std::shared_ptr<T> expected_old_data;
 						//Get current tail.
-						const std::shared_ptr<node> old_tail = std::atomic_load(tail);
+						const std::shared_ptr<node> old_tail = std::atomic_load(&tail);
 						//Compare that empty data pointer to that stored in tail.
 						//It should be empty since tail should point to an empty node.
 						//Exchange it's content for the new data we created.
 						//We do this first so that node's data is prepared.
-						if(std::atomic_compare_exchange_strong(old_tail->data, expected_old_data, new_data)) {
+						if(std::atomic_compare_exchange_strong(&old_tail->data, &expected_old_data, new_data)) {
 							//Set tail's next pointer to new empty node.
 							old_tail->next = p;
 							//atomically store empty node as new tail..
-							std::atomic_store(tail, p);
+							std::atomic_store(&tail, p);
 							//old version:
 							//old_tail = std::atomic_exchange(tail, p);
 							break;
@@ -205,9 +227,10 @@ namespace KSync {
 				std::shared_ptr<node> head;
 				std::shared_ptr<node> tail;
 
-				void set_new_tail(std::shared_ptr<node>& old_tail, const std::shared_ptr<node>& new_tail) {
+				//Give up once any thread has moved tail past old_tail.
+				void set_new_tail(std::shared_ptr<node> old_tail, const std::shared_ptr<node>& new_tail) {
 					const std::shared_ptr<node> current_tail = old_tail;
-					while(!std::atomic_compare_exchange_weak(tail, old_tail, new_tail) && old_tail == current_tail);
+					while(!std::atomic_compare_exchange_weak(&tail, &old_tail, new_tail) && old_tail == current_tail);
 				}
 				/*std::shared_ptr<node> pop_head() {
 					const std::shared_ptr<node> old_head = std::atomic_load(head);
@@ -218,13 +241,13 @@ namespace KSync {
 					return old_head;
 				}*/
 			public:
-				threadsafe_lock_free_queue() : head(std::move(std::make_shared(new node))) , tail(std::atomic_load(head)) {
+				threadsafe_lock_free_queue() : head(std::make_shared<node>()) , tail(head) {
 				}
 				threadsafe_lock_free_queue(const threadsafe_lock_free_queue& rhs) = delete;
 				threadsafe_lock_free_queue& operator=(const threadsafe_lock_free_queue& rhs) = delete;
 				~threadsafe_lock_free_queue() {
-					while(const std::shared_ptr<node> old_head = std::atomic_load(head)) {
-						std::atomic_store(head, old_head->next);
+					while(const std::shared_ptr<node> old_head = std::atomic_load(&head)) {
+						std::atomic_store(&head, old_head->next);
 						//std::atomic_store(old_head, nullptr);
 					}
 				}
@@ -233,16 +256,17 @@ namespace KSync {
 				std::shared_ptr<T> pop() {
 					//Same solution as in lock-free stack for pop.
 					while (true) {
-						std::shared_ptr<node> old_head = std::atomic_load(head);
-						if(old_head == std::atomic_load(tail)) {
+						std::shared_ptr<node> old_head = std::atomic_load(&head);
+						if(old_head == std::atomic_load(&tail)) {
 							return std::shared_ptr<T>();
 						}
 						//Load head's next node pointer
-						std::shared_ptr<node> next = std::atomic_load(old_head->next);
+						std::shared_ptr<node> next = std::atomic_load(&old_head->next);
 						//Move head's pointer to next node
-						if(std::atomic_compare_exchange_strong(head, old_head, next)) {
-							//Success! return data
-							return std::move(next->data);
+						if(std::atomic_compare_exchange_strong(&head, &old_head, next)) {
+							//Success! The data lives in the node we just unlinked. Leave it
+							//there, a stale push must still see that node as occupied.
+							return std::atomic_load(&old_head->data);
 						}
 						//Failure, try again!
 					}
@@ -254,92 +278,829 @@ namespace KSync {
 					std::shared_ptr<T> new_data(std::move(new_value));
 					//Create new empty node for end of queue.
 					std::shared_ptr<node> p(new node);
-					bool finished = false;
-					while (!finished) {
+					while (true) {
 						//Create emtpy data pointer
 						std::shared_ptr<T> expected_old_data;
 						//Get current tail.
-						const std::shared_ptr<node> old_tail = std::atomic_load(tail);
+						const std::shared_ptr<node> old_tail = std::atomic_load(&tail);
 						//Compare that empty data pointer to that stored in tail.
 						//It should be empty since tail should point to an empty node.
 						//Exchange it's content for the new data we created.
 						//We do this first so that node's data is prepared.
-						if(std::atomic_compare_exchange_strong(old_tail->data, expected_old_data, new_data)) {
-							//Success! we can exit this pass through the loop!
-							finished = true;
+						if(std::atomic_compare_exchange_strong(&old_tail->data, &expected_old_data, new_data)) {
+							//Link the new empty node, unless a helper already linked one.
+							std::shared_ptr<node> old_next;
+							if(!std::atomic_compare_exchange_strong(&old_tail->next, &old_next, p)) {
+								p = old_next;
+							}
+							set_new_tail(old_tail, p);
 							break;
 						}
-						//Create empty node pointer
-						std::shared_ptr<node> null_next;
-						//Point tail's next to new empty node if it has a null pointer
-						std::atomic_compare_exchange_strong(old_tail->next, null_next, p);
-						//Set tail to new empty node.
-						set_new_tail(old_tail, p);
+						//Another push owns tail, help it finish so we aren't stuck behind it.
+						std::shared_ptr<node> old_next;
+						if(std::atomic_compare_exchange_strong(&old_tail->next, &old_next, p)) {
+							old_next = p;
+							//Our empty node is now part of the queue, make another.
+							p = std::make_shared<node>();
+						}
+						set_new_tail(old_tail, old_next);
+					}
+				}
+		};
+
+		//Same interface as threadsafe_lock_free_stack, but the nodes are plain
+		//pointers reclaimed through KSync::Epoch instead of atomic shared_ptrs.
+		//Nodes can't be freed while a pop holds them, so there is no ABA either.
+		template<typename T>
+		class epoch_lock_free_stack {
+			private:
+				struct node {
+					std::shared_ptr<T> data;
+					node* next;
+					node(const T& data_):
+						data(std::make_shared<T>(data_)), next(nullptr) {
+					}
+				};
+
+				std::atomic<node*> head;
+			public:
+				epoch_lock_free_stack() : head(nullptr) {
+				}
+				epoch_lock_free_stack(const epoch_lock_free_stack& rhs) = delete;
+				epoch_lock_free_stack& operator=(const epoch_lock_free_stack& rhs) = delete;
+				~epoch_lock_free_stack() {
+					node* old_head = this->head.load(std::memory_order_relaxed);
+					while(old_head != nullptr) {
+						node* next = old_head->next;
+						delete old_head;
+						old_head = next;
+					}
+				}
+
+				void push(const T& data) {
+					//We never look inside another node, so no pin is needed.
+					node* new_node = new node(data);
+					new_node->next = this->head.load(std::memory_order_relaxed);
+					while(!this->head.compare_exchange_weak(new_node->next, new_node, std::memory_order_release, std::memory_order_relaxed));
+				}
+				std::shared_ptr<T> pop() {
+					KSync::Epoch::Guard guard;
+					node* old_head = this->head.load(std::memory_order_acquire);
+					while(old_head && !this->head.compare_exchange_weak(old_head,
+						old_head->next, std::memory_order_acquire, std::memory_order_acquire));
+					if(old_head == nullptr) {
+						return std::shared_ptr<T>();
+					}
+					std::shared_ptr<T> data(std::move(old_head->data));
+					KSync::Epoch::Retire(old_head);
+					return data;
+				}
+		};
+
+		//Michael-Scott queue with the same interface as threadsafe_lock_free_queue.
+		//Nodes are plain pointers reclaimed through KSync::Epoch.
+		template<typename T>
+		class epoch_lock_free_queue {
+			private:
+				struct node {
+					std::shared_ptr<T> data;
+					std::atomic<node*> next;
+					node() : next(nullptr) {
+					}
+				};
+
+				//Padded rather than aligned so the queue can be allocated with new.
+				static const size_t CacheLineSize = 64;
+				std::atomic<node*> head;
+				char padding[CacheLineSize-sizeof(std::atomic<node*>)];
+				std::atomic<node*> tail;
+			public:
+				epoch_lock_free_queue() {
+					node* dummy = new node;
+					this->head.store(dummy, std::memory_order_relaxed);
+					this->tail.store(dummy, std::memory_order_relaxed);
+				}
+				epoch_lock_free_queue(const epoch_lock_free_queue& rhs) = delete;
+				epoch_lock_free_queue& operator=(const epoch_lock_free_queue& rhs) = delete;
+				~epoch_lock_free_queue() {
+					node* old_head = this->head.load(std::memory_order_relaxed);
+					while(old_head != nullptr) {
+						node* next = old_head->next.load(std::memory_order_relaxed);
+						delete old_head;
+						old_head = next;
+					}
+				}
+
+				std::shared_ptr<T> pop() {
+					KSync::Epoch::Guard guard;
+					while(true) {
+						node* old_head = this->head.load(std::memory_order_acquire);
+						node* old_tail = this->tail.load(std::memory_order_acquire);
+						node* next = old_head->next.load(std::memory_order_acquire);
+						if(old_head != this->head.load(std::memory_order_acquire)) {
+							continue;
+						}
+						if(next == nullptr) {
+							return std::shared_ptr<T>();
+						}
+						if(old_head == old_tail) {
+							//A push linked its node but hasn't moved tail yet, help it.
+							this->tail.compare_exchange_strong(old_tail, next, std::memory_order_release, std::memory_order_relaxed);
+							continue;
+						}
+						if(this->head.compare_exchange_strong(old_head, next, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+							//next is the new dummy, only we may take its data.
+							std::shared_ptr<T> data(std::move(next->data));
+							KSync::Epoch::Retire(old_head);
+							return data;
+						}
+					}
+				}
 
+				void push(std::shared_ptr<T>& new_value) {
+					node* p = new node;
+					p->data = std::move(new_value);
+					KSync::Epoch::Guard guard;
+					while(true) {
+						node* old_tail = this->tail.load(std::memory_order_acquire);
+						node* next = old_tail->next.load(std::memory_order_acquire);
+						if(old_tail != this->tail.load(std::memory_order_acquire)) {
+							continue;
+						}
+						if(next == nullptr) {
+							if(old_tail->next.compare_exchange_weak(next, p, std::memory_order_release, std::memory_order_relaxed)) {
+								//Failing is fine, someone helped us along.
+								this->tail.compare_exchange_strong(old_tail, p, std::memory_order_release, std::memory_order_relaxed);
+								return;
+							}
+						} else {
+							//Another push owns tail, help it finish so we aren't stuck behind it.
+							this->tail.compare_exchange_strong(old_tail, next, std::memory_order_release, std::memory_order_relaxed);
+						}
 					}
 				}
 		};
 
+		class PendingTimeoutException : public KSync::Exception::BasicException {
+			public:
+				PendingTimeoutException() : BasicException("Timed out waiting for a reply!") {}
+		};
+
+		class FutureCancelledException : public KSync::Exception::BasicException {
+			public:
+				FutureCancelledException() : BasicException("The future was cancelled!") {}
+		};
+
+		//Somewhere to run tasks, like continuations of futures.
+		class executor {
+			public:
+				virtual ~executor() {}
+				virtual void execute(std::function<void()> task) = 0;
+		};
+
+		//Runs tasks straight away. A continuation run this way runs on whichever
+		//thread completed its future, so it should be short.
+		class inline_executor : public executor {
+			public:
+				void execute(std::function<void()> task) override {
+					task();
+				}
+		};
+
+		inline executor& GetInlineExecutor() {
+			static inline_executor the_executor;
+			return the_executor;
+		}
+
+		//One thread running callbacks once their deadlines pass.
+		class deadline_timer {
+			public:
+				typedef std::chrono::steady_clock clock;
+				typedef std::pair<clock::time_point, uint64_t> key_t;
+
+				deadline_timer() : next_id(0), done(false) {
+					this->thread = std::thread(&deadline_timer::run, this);
+				}
+				~deadline_timer() {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						this->done = true;
+					}
+					this->cond.notify_all();
+					this->thread.join();
+				}
+
+				deadline_timer(const deadline_timer& other) = delete;
+				deadline_timer& operator=(const deadline_timer& other) = delete;
+
+				key_t schedule(const clock::time_point deadline, std::function<void()> callback) {
+					std::lock_guard<std::mutex> lk(this->m);
+					const key_t key(deadline, this->next_id++);
+					this->timers[key] = std::move(callback);
+					if(this->timers.begin()->first == key) {
+						this->cond.notify_all();
+					}
+					return key;
+				}
+				//Returns false if the callback already ran.
+				bool cancel(const key_t& key) {
+					std::lock_guard<std::mutex> lk(this->m);
+					return this->timers.erase(key) != 0;
+				}
+			private:
+				void run() {
+					std::unique_lock<std::mutex> lk(this->m);
+					while(!this->done) {
+						if(this->timers.empty()) {
+							this->cond.wait(lk);
+							continue;
+						}
+						auto first = this->timers.begin();
+						//A copy, the entry may be cancelled while we wait.
+						const clock::time_point deadline = first->first.first;
+						if(deadline > clock::now()) {
+							this->cond.wait_until(lk, deadline);
+							continue;
+						}
+						std::function<void()> callback = std::move(first->second);
+						this->timers.erase(first);
+						lk.unlock();
+						callback();
+						lk.lock();
+					}
+				}
+
+				std::mutex m;
+				std::condition_variable cond;
+				std::map<key_t, std::function<void()>> timers;
+				uint64_t next_id;
+				bool done;
+				std::thread thread;
+		};
+
+		//Leaked on purpose so deadlines can be set from static destructors.
+		inline deadline_timer& GetDeadlineTimer() {
+			static deadline_timer* timer = new deadline_timer();
+			return *timer;
+		}
+
+		//What a promise and its future share. It's completed once, by a value,
+		//an exception, cancellation or a deadline, whichever comes first, and
+		//anything after that is ignored.
+		template<class T>
+		class future_state {
+			public:
+				future_state() : ready(false), retrieved(false), has_deadline(false) {}
+
+				bool set_value(T&& value) {
+					std::unique_lock<std::mutex> lk(this->m);
+					if(this->ready) {
+						return false;
+					}
+					this->value.reset(new T(std::move(value)));
+					this->complete(lk);
+					return true;
+				}
+				bool set_exception(std::exception_ptr p) {
+					std::unique_lock<std::mutex> lk(this->m);
+					if(this->ready) {
+						return false;
+					}
+					this->error = p;
+					this->complete(lk);
+					return true;
+				}
+				//Fail with p and run the cancel handler, unless already completed.
+				bool cancel(std::exception_ptr p) {
+					std::function<void()> handler;
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						if(this->ready) {
+							return false;
+						}
+						handler = std::move(this->cancel_handler);
+					}
+					if(!this->set_exception(p)) {
+						return false;
+					}
+					if(handler) {
+						handler();
+					}
+					return true;
+				}
+
+				bool is_ready() {
+					std::lock_guard<std::mutex> lk(this->m);
+					return this->ready;
+				}
+				void wait() {
+					std::unique_lock<std::mutex> lk(this->m);
+					this->cond.wait(lk, [this]() { return this->ready; });
+				}
+				template<class Clock, class Duration>
+				bool wait_until(const std::chrono::time_point<Clock,Duration>& timeout_time) {
+					std::unique_lock<std::mutex> lk(this->m);
+					return this->cond.wait_until(lk, timeout_time, [this]() { return this->ready; });
+				}
+				T get() {
+					std::unique_lock<std::mutex> lk(this->m);
+					this->cond.wait(lk, [this]() { return this->ready; });
+					if(this->error) {
+						std::rethrow_exception(this->error);
+					}
+					return std::move(*this->value);
+				}
+
+				//Run fn once completed, straight away if it already is.
+				void add_continuation(std::function<void()> fn) {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						if(!this->ready) {
+							this->continuations.push_back(std::move(fn));
+							return;
+						}
+					}
+					fn();
+				}
+				void set_cancel_handler(std::function<void()> handler) {
+					std::lock_guard<std::mutex> lk(this->m);
+					if(!this->ready) {
+						this->cancel_handler = std::move(handler);
+					}
+				}
+				void set_deadline(const deadline_timer::clock::time_point deadline, std::function<void()> on_deadline) {
+					std::lock_guard<std::mutex> lk(this->m);
+					if(this->ready) {
+						return;
+					}
+					if(this->has_deadline) {
+						GetDeadlineTimer().cancel(this->deadline_key);
+					}
+					this->deadline_key = GetDeadlineTimer().schedule(deadline, std::move(on_deadline));
+					this->has_deadline = true;
+				}
+				//Whether a future was taken, so a broken promise has someone to tell.
+				bool mark_retrieved() {
+					std::lock_guard<std::mutex> lk(this->m);
+					const bool was_retrieved = this->retrieved;
+					this->retrieved = true;
+					return was_retrieved;
+				}
+				bool was_retrieved() {
+					std::lock_guard<std::mutex> lk(this->m);
+					return this->retrieved;
+				}
+			private:
+				void complete(std::unique_lock<std::mutex>& lk) {
+					this->ready = true;
+					std::vector<std::function<void()>> to_run;
+					to_run.swap(this->continuations);
+					this->cancel_handler = nullptr;
+					const bool had_deadline = this->has_deadline;
+					this->has_deadline = false;
+					lk.unlock();
+					this->cond.notify_all();
+					if(had_deadline) {
+						GetDeadlineTimer().cancel(this->deadline_key);
+					}
+					for(size_t i = 0; i < to_run.size(); ++i) {
+						to_run[i]();
+					}
+				}
+
+				std::mutex m;
+				std::condition_variable cond;
+				bool ready;
+				bool retrieved;
+				std::unique_ptr<T> value;
+				std::exception_ptr error;
+				std::vector<std::function<void()>> continuations;
+				std::function<void()> cancel_handler;
+				bool has_deadline;
+				deadline_timer::key_t deadline_key;
+		};
+
+		template<class T> class FutureWrapper;
+		template<class T> FutureWrapper<std::vector<T>> when_all(std::vector<FutureWrapper<T>>&& futures);
+		template<class T> FutureWrapper<std::pair<size_t, T>> when_any(std::vector<FutureWrapper<T>>&& futures);
+
+		template<class T>
+		class PromiseWrapper {
+			public:
+				//The shared state is only made once needed, so idle promises cost nothing.
+				PromiseWrapper() {
+				}
+				PromiseWrapper(PromiseWrapper<T>&& rhs) : state(std::move(rhs.state)) {}
+				PromiseWrapper& operator=(PromiseWrapper<T>&& rhs) {
+					this->abandon();
+					this->state = std::move(rhs.state);
+					return *this;
+				}
+				//Like std::promise, a future left without a value fails with broken_promise.
+				~PromiseWrapper() {
+					this->abandon();
+				}
+
+				PromiseWrapper(const PromiseWrapper<T>& rhs) = delete;
+				PromiseWrapper& operator=(const PromiseWrapper<T>& rhs) = delete;
+
+				FutureWrapper<T> get_future() {
+					if(this->get_state()->mark_retrieved()) {
+						throw std::future_error(std::future_errc::future_already_retrieved);
+					}
+					return FutureWrapper<T>(this->state);
+				}
+				//Each returns false if the future was already completed, say by being cancelled.
+				bool set_value(const T& value) {
+					return this->get_state()->set_value(T(value));
+				}
+				bool set_value(T&& value) {
+					return this->get_state()->set_value(std::move(value));
+				}
+				bool set_exception(std::exception_ptr p) {
+					return this->get_state()->set_exception(p);
+				}
+				//Called if the future is cancelled or misses its deadline before it has a
+				//value, so whoever is producing it can stop. Runs on the cancelling thread.
+				void set_cancel_handler(std::function<void()> handler) {
+					this->get_state()->set_cancel_handler(std::move(handler));
+				}
+			private:
+				std::shared_ptr<future_state<T>>& get_state() {
+					if(!this->state) {
+						this->state = std::make_shared<future_state<T>>();
+					}
+					return this->state;
+				}
+				void abandon() {
+					if(this->state&&this->state->was_retrieved()) {
+						this->state->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+					}
+				}
+
+				std::shared_ptr<future_state<T>> state;
+		};
+
+		//A future which can be waited on like std::future, or given continuations,
+		//a deadline, or be cancelled, so dependent requests chain without blocking.
 		template<class T>
 		class FutureWrapper {
 			public:
-				FutureWrapper(std::shared_ptr<std::atomic<bool>> grabbed, std::future<T>&& in) : value_grabbed(grabbed), the_future(in) {}
-				FutureWrapper(FutureWrapper<T>&& rhs) : value_grabbed(std::move(rhs.value_grabbed)), the_future(std::move(rhs.the_future)) {}
+				FutureWrapper() {}
+				FutureWrapper(std::shared_ptr<future_state<T>> state) : state(std::move(state)) {}
+				FutureWrapper(FutureWrapper<T>&& rhs) : state(std::move(rhs.state)) {}
+				FutureWrapper& operator=(FutureWrapper<T>&& rhs) {
+					this->state = std::move(rhs.state);
+					return *this;
+				}
+
+				FutureWrapper(const FutureWrapper<T>& rhs) = delete;
+				FutureWrapper& operator=(const FutureWrapper<T>& rhs) = delete;
+
+				//False once the future has been handed to then() or a combinator.
+				bool valid() const {
+					return (bool) this->state;
+				}
+				bool is_ready() const {
+					return this->state->is_ready();
+				}
 				T get() {
-					T answer = the_future.get();
-					value_grabbed->store(true);
-					return answer;
+					return this->state->get();
 				}
-				void wait() {
-					the_future.wait();
+				void wait() const {
+					this->state->wait();
 				}
 				template<class Rep, class Period>
 				std::future_status wait_for(const std::chrono::duration<Rep,Period>& timeout_duration) const {
-					return the_future.wait_for(timeout_duration);
+					return this->wait_until(std::chrono::steady_clock::now()+timeout_duration);
 				}
 				template<class Clock, class Duration>
 				std::future_status wait_until(const std::chrono::time_point<Clock,Duration>& timeout_time) const {
-					return the_future.wait_until(timeout_time);
+					return this->state->wait_until(timeout_time) ? std::future_status::ready : std::future_status::timeout;
+				}
+
+				//Fail with a FutureCancelledException and run the promise's cancel handler.
+				//Returns false, without running the handler, if it had already completed.
+				bool cancel() {
+					return this->state->cancel(std::make_exception_ptr(FutureCancelledException()));
+				}
+				//Fail with a PendingTimeoutException if not completed by deadline.
+				void set_deadline(const std::chrono::steady_clock::time_point deadline) {
+					std::weak_ptr<future_state<T>> weak_state = this->state;
+					this->state->set_deadline(deadline, [weak_state]() {
+						std::shared_ptr<future_state<T>> the_state = weak_state.lock();
+						if(the_state) {
+							the_state->cancel(std::make_exception_ptr(PendingTimeoutException()));
+						}
+					});
+				}
+				template<class Rep, class Period>
+				void set_timeout(const std::chrono::duration<Rep,Period>& timeout_duration) {
+					this->set_deadline(std::chrono::steady_clock::now()+std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout_duration));
+				}
+
+				//Once this completes run f on the_executor, passing it this future, now ready.
+				//The returned future gets whatever f returns, or throws. This future is left
+				//invalid, and cancelling the returned one cancels it too.
+				template<class F>
+				auto then(executor& the_executor, F f) -> FutureWrapper<decltype(f(std::declval<FutureWrapper<T>>()))> {
+					typedef decltype(f(std::declval<FutureWrapper<T>>())) R;
+					std::shared_ptr<PromiseWrapper<R>> promise = std::make_shared<PromiseWrapper<R>>();
+					FutureWrapper<R> result = promise->get_future();
+					std::shared_ptr<future_state<T>> source = std::move(this->state);
+					std::weak_ptr<future_state<T>> weak_source = source;
+					promise->set_cancel_handler([weak_source]() {
+						std::shared_ptr<future_state<T>> the_source = weak_source.lock();
+						if(the_source) {
+							the_source->cancel(std::make_exception_ptr(FutureCancelledException()));
+						}
+					});
+					executor* ex = &the_executor;
+					future_state<T>* raw_source = source.get();
+					raw_source->add_continuation([source, promise, ex, f]() {
+						ex->execute([source, promise, f]() {
+							try {
+								promise->set_value(f(FutureWrapper<T>(source)));
+							} catch (...) {
+								promise->set_exception(std::current_exception());
+							}
+						});
+					});
+					return result;
+				}
+				template<class F>
+				auto then(F f) -> FutureWrapper<decltype(f(std::declval<FutureWrapper<T>>()))> {
+					return this->then(GetInlineExecutor(), f);
 				}
 			private:
-				std::shared_ptr<std::atomic<bool>> value_grabbed;
-				std::future<T> the_future;
+				template<class U> friend FutureWrapper<std::vector<U>> when_all(std::vector<FutureWrapper<U>>&& futures);
+				template<class U> friend FutureWrapper<std::pair<size_t, U>> when_any(std::vector<FutureWrapper<U>>&& futures);
+
+				std::shared_ptr<future_state<T>> state;
 		};
 
+		//Completes with every value, in order, once all of futures have, or with the
+		//first exception. Cancelling it cancels all of futures.
 		template<class T>
-		class PromiseWrapper {
-			public:
-				PromiseWrapper() {
-					value_grabbed->store(false);
+		FutureWrapper<std::vector<T>> when_all(std::vector<FutureWrapper<T>>&& futures) {
+			class gather {
+				public:
+					std::mutex m;
+					std::vector<std::unique_ptr<T>> values;
+					size_t remaining;
+					PromiseWrapper<std::vector<T>> promise;
+			};
+			std::shared_ptr<gather> all = std::make_shared<gather>();
+			FutureWrapper<std::vector<T>> result = all->promise.get_future();
+			all->values.resize(futures.size());
+			all->remaining = futures.size();
+			if(futures.empty()) {
+				all->promise.set_value(std::vector<T>());
+				return result;
+			}
+			std::vector<std::weak_ptr<future_state<T>>> sources;
+			for(size_t i = 0; i < futures.size(); ++i) {
+				sources.push_back(futures[i].state);
+			}
+			all->promise.set_cancel_handler([sources]() {
+				for(size_t i = 0; i < sources.size(); ++i) {
+					std::shared_ptr<future_state<T>> the_source = sources[i].lock();
+					if(the_source) {
+						the_source->cancel(std::make_exception_ptr(FutureCancelledException()));
+					}
 				}
-				bool grabbed() {
-					return value_grabbed->load();
+			});
+			for(size_t i = 0; i < futures.size(); ++i) {
+				std::shared_ptr<future_state<T>> source = std::move(futures[i].state);
+				future_state<T>* raw_source = source.get();
+				raw_source->add_continuation([all, source, i]() {
+					std::unique_ptr<T> value;
+					try {
+						value.reset(new T(source->get()));
+					} catch (...) {
+						all->promise.set_exception(std::current_exception());
+						return;
+					}
+					std::unique_lock<std::mutex> lk(all->m);
+					all->values[i] = std::move(value);
+					if(--all->remaining != 0) {
+						return;
+					}
+					std::vector<T> values;
+					values.reserve(all->values.size());
+					for(size_t j = 0; j < all->values.size(); ++j) {
+						values.push_back(std::move(*all->values[j]));
+					}
+					lk.unlock();
+					all->promise.set_value(std::move(values));
+				});
+			}
+			return result;
+		}
+
+		//Completes with the index and value of whichever of futures completes first,
+		//or its exception. The others are left running, cancelling it cancels them all.
+		template<class T>
+		FutureWrapper<std::pair<size_t, T>> when_any(std::vector<FutureWrapper<T>>&& futures) {
+			std::shared_ptr<PromiseWrapper<std::pair<size_t, T>>> promise = std::make_shared<PromiseWrapper<std::pair<size_t, T>>>();
+			FutureWrapper<std::pair<size_t, T>> result = promise->get_future();
+			if(futures.empty()) {
+				promise->set_exception(std::make_exception_ptr(std::invalid_argument("when_any needs at least one future")));
+				return result;
+			}
+			std::vector<std::weak_ptr<future_state<T>>> sources;
+			for(size_t i = 0; i < futures.size(); ++i) {
+				sources.push_back(futures[i].state);
+			}
+			promise->set_cancel_handler([sources]() {
+				for(size_t i = 0; i < sources.size(); ++i) {
+					std::shared_ptr<future_state<T>> the_source = sources[i].lock();
+					if(the_source) {
+						the_source->cancel(std::make_exception_ptr(FutureCancelledException()));
+					}
 				}
-				FutureWrapper<T>&& get_future() {
-					return std::move(FutureWrapper<T>(value_grabbed, std::move(the_promise.get_future())));
+			});
+			for(size_t i = 0; i < futures.size(); ++i) {
+				std::shared_ptr<future_state<T>> source = std::move(futures[i].state);
+				future_state<T>* raw_source = source.get();
+				raw_source->add_continuation([promise, source, i]() {
+					//Only the first to get here completes the promise, the rest are ignored.
+					try {
+						promise->set_value(std::make_pair(i, source->get()));
+					} catch (...) {
+						promise->set_exception(std::current_exception());
+					}
+				});
+			}
+			return result;
+		}
+
+		//Lock-free open addressing table of promises waiting on a reply, keyed by message id.
+		//Keys are expected to be monotonic so key & mask spreads consecutive keys over
+		//consecutive slots. Each operation looks at no more than MaxProbe slots.
+		//Ids are global, so a communicator sees sparse keys that can cluster; an entry
+		//that finds no free slot goes to a locked overflow map instead of failing.
+		//Handler can be anything default constructible and movable with set_value and set_exception.
+		template<class T, class Handler = PromiseWrapper<T>>
+		class lock_free_pending_table {
+			public:
+				typedef uint64_t key_t;
+				typedef std::chrono::steady_clock clock;
+				static const size_t MaxProbe = 16;
+
+				lock_free_pending_table(const size_t min_capacity = 4096) : num_pending(0), num_overflow(0) {
+					size_t capacity = MaxProbe;
+					while(capacity < min_capacity) {
+						capacity <<= 1;
+					}
+					this->mask = capacity-1;
+					this->slots.reset(new slot[capacity]);
 				}
-				void set_value(const T& value) {
-					the_promise.set_value(value);
+				lock_free_pending_table(const lock_free_pending_table& rhs) = delete;
+				lock_free_pending_table& operator=(const lock_free_pending_table& rhs) = delete;
+
+				//Entries that find no free slot near their home slot go to the overflow map.
+				void insert(const key_t key, Handler&& promise, const clock::time_point deadline = clock::time_point::max()) {
+					for(size_t i = 0; i < MaxProbe; ++i) {
+						slot& the_slot = this->slots[(key+i)&this->mask];
+						int expected = Free;
+						if(the_slot.state.compare_exchange_strong(expected, Busy, std::memory_order_acquire)) {
+							the_slot.key.store(key, std::memory_order_relaxed);
+							the_slot.deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+							the_slot.promise = std::move(promise);
+							the_slot.state.store(Pending, std::memory_order_release);
+							this->num_pending.fetch_add(1, std::memory_order_relaxed);
+							return;
+						}
+					}
+					std::lock_guard<std::mutex> lk(this->overflow_mutex);
+					overflow_entry& entry = this->overflow[key];
+					entry.promise = std::move(promise);
+					entry.deadline = deadline;
+					this->num_overflow.store(this->overflow.size(), std::memory_order_release);
+					this->num_pending.fetch_add(1, std::memory_order_relaxed);
 				}
-				void set_value(T&& value) {
-					the_promise.set_value(value);
+
+				bool fulfill(const key_t key, const T& value) {
+					Handler promise;
+					if(!this->take(key, promise)) {
+						return false;
+					}
+					promise.set_value(value);
+					return true;
 				}
-				void set_value_at_thread_exit(const T& value) {
-					the_promise.set_value_at_thread_exit(value);
+
+				bool fail(const key_t key, std::exception_ptr p) {
+					Handler promise;
+					if(!this->take(key, promise)) {
+						return false;
+					}
+					promise.set_exception(p);
+					return true;
 				}
-				void set_value_at_thread_exit(T&& value) {
-					the_promise.set_value_at_thread_exit(value);
+
+				//Fail every entry whose deadline has passed. This walks the whole table,
+				//so call it periodically rather than for every message.
+				size_t expire(const clock::time_point now = clock::now()) {
+					size_t num_expired = 0;
+					const clock::rep now_count = now.time_since_epoch().count();
+					for(size_t i = 0; i <= this->mask; ++i) {
+						slot& the_slot = this->slots[i];
+						if((the_slot.state.load(std::memory_order_acquire) == Pending)&&
+						   (the_slot.deadline.load(std::memory_order_relaxed) <= now_count)) {
+							if(this->fail(the_slot.key.load(std::memory_order_relaxed), std::make_exception_ptr(PendingTimeoutException()))) {
+								++num_expired;
+							}
+						}
+					}
+					if(this->num_overflow.load(std::memory_order_acquire) != 0) {
+						//Fail outside the lock, a handler may well insert again.
+						std::vector<Handler> expired;
+						{
+							std::lock_guard<std::mutex> lk(this->overflow_mutex);
+							for(auto it = this->overflow.begin(); it != this->overflow.end();) {
+								if(it->second.deadline <= now) {
+									expired.push_back(std::move(it->second.promise));
+									it = this->overflow.erase(it);
+								} else {
+									++it;
+								}
+							}
+							this->num_overflow.store(this->overflow.size(), std::memory_order_release);
+						}
+						this->num_pending.fetch_sub(expired.size(), std::memory_order_relaxed);
+						for(Handler& promise : expired) {
+							promise.set_exception(std::make_exception_ptr(PendingTimeoutException()));
+						}
+						num_expired += expired.size();
+					}
+					return num_expired;
 				}
-				void set_exception(std::exception_ptr p) {
-					the_promise.set_exception(p);
+
+				size_t size() const {
+					return this->num_pending.load(std::memory_order_relaxed);
 				}
-				void set_exception_at_thread_exit(std::exception_ptr p) {
-					the_promise.set_exception_at_thread_exit(p);
+			private:
+				static const int Free = 0;
+				static const int Busy = 1;
+				static const int Pending = 2;
+
+				struct slot {
+					std::atomic<int> state;
+					std::atomic<key_t> key;
+					std::atomic<clock::rep> deadline;
+					Handler promise;
+					slot() : state(Free), key(0), deadline(0) {}
+				};
+
+				struct overflow_entry {
+					Handler promise;
+					clock::time_point deadline;
+				};
+
+				bool take(const key_t key, Handler& promise) {
+					for(size_t i = 0; i < MaxProbe; ++i) {
+						slot& the_slot = this->slots[(key+i)&this->mask];
+						if((the_slot.state.load(std::memory_order_acquire) != Pending)||
+						   (the_slot.key.load(std::memory_order_relaxed) != key)) {
+							continue;
+						}
+						int expected = Pending;
+						if(!the_slot.state.compare_exchange_strong(expected, Busy, std::memory_order_acquire)) {
+							continue;
+						}
+						//The slot may have been recycled between the check and the claim.
+						if(the_slot.key.load(std::memory_order_relaxed) != key) {
+							the_slot.state.store(Pending, std::memory_order_release);
+							continue;
+						}
+						promise = std::move(the_slot.promise);
+						the_slot.state.store(Free, std::memory_order_release);
+						this->num_pending.fetch_sub(1, std::memory_order_relaxed);
+						return true;
+					}
+					if(this->num_overflow.load(std::memory_order_acquire) == 0) {
+						return false;
+					}
+					std::lock_guard<std::mutex> lk(this->overflow_mutex);
+					auto it = this->overflow.find(key);
+					if(it == this->overflow.end()) {
+						return false;
+					}
+					promise = std::move(it->second.promise);
+					this->overflow.erase(it);
+					this->num_overflow.store(this->overflow.size(), std::memory_order_release);
+					this->num_pending.fetch_sub(1, std::memory_order_relaxed);
+					return true;
 				}
 
-			private:
-				std::shared_ptr<std::atomic<bool>> value_grabbed;
-				std::promise<T> the_promise;
+				std::unique_ptr<slot[]> slots;
+				size_t mask;
+				std::atomic<size_t> num_pending;
+				std::mutex overflow_mutex;
+				std::map<key_t, overflow_entry> overflow;
+				//Lets the common path skip the lock while nothing has overflowed.
+				std::atomic<size_t> num_overflow;
 		};
 
 		// Implementation taken from C++ Concurrency in Action page 176
@@ -363,7 +1124,7 @@ namespace KSync {
 				}
 
 				~threadsafe_list() {
-					remove_if([](node const&){return true;});
+					remove_if([](T const&){return true;});
 				}
 
 				threadsafe_list(threadsafe_list const& other) = delete;
@@ -376,11 +1137,19 @@ namespace KSync {
 					head.next = std::move(new_node);
 				}
 
+				void push_front(const std::shared_ptr<T>& value) {
+					std::unique_ptr<node> new_node(new node());
+					new_node->data = value;
+					std::lock_guard<std::mutex> lk(head.m);
+					new_node->next = std::move(head.next);
+					head.next = std::move(new_node);
+				}
+
 				template<typename Function>
 				void for_each(Function f) {
 					node* current = &head;
 					std::unique_lock<std::mutex> lk(head.m);
-					while(const node* next = current->next.get()) {
+					while(node* next = current->next.get()) {
 						std::unique_lock<std::mutex> next_lk(next->m);
 						lk.unlock();
 						f(*next->data);
@@ -389,11 +1158,25 @@ namespace KSync {
 					}
 				}
 
+				//Like for_each, but f gets shared ownership of each item so it may keep it.
+				template<typename Function>
+				void for_each_shared(Function f) {
+					node* current = &head;
+					std::unique_lock<std::mutex> lk(head.m);
+					while(node* next = current->next.get()) {
+						std::unique_lock<std::mutex> next_lk(next->m);
+						lk.unlock();
+						f(next->data);
+						current = next;
+						lk=std::move(next_lk);
+					}
+				}
+
 				template<typename Predicate>
 				std::shared_ptr<T> find_first_if(Predicate p) {
 					node* current = &head;
 					std::unique_lock<std::mutex> lk(head.m);
-					while(const node* next = current->next.get()) {
+					while(node* next = current->next.get()) {
 						std::unique_lock<std::mutex> next_lk(next->m);
 						lk.unlock();
 						if(p(*next->data)) {
@@ -409,10 +1192,10 @@ namespace KSync {
 				void remove_if(Predicate p) {
 					node* current = &head;
 					std::unique_lock<std::mutex> lk(head.m);
-					while(const node* next = current->next.get()) {
+					while(node* next = current->next.get()) {
 						std::unique_lock<std::mutex> next_lk(next->m);
 						if(p(*next->data)) {
-							std::unique_ptr<node> old_next = std::move(current->next);
+							std::shared_ptr<node> old_next = std::move(current->next);
 							current->next = std::move(next->next);
 							next_lk.unlock();
 						} else {
@@ -423,6 +1206,301 @@ namespace KSync {
 					}
 				}
 		};
+
+		//Fixed set of worker threads running submitted tasks in order. The
+		//destructor runs every task already submitted before joining.
+		class thread_pool : public executor {
+			public:
+				thread_pool(const size_t num_threads = std::max(1u, std::thread::hardware_concurrency())) : done(false) {
+					for(size_t i = 0; i < num_threads; ++i) {
+						this->workers.push_back(std::thread(&thread_pool::worker, this));
+					}
+				}
+				~thread_pool() {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						this->done = true;
+					}
+					this->cond.notify_all();
+					for(size_t i = 0; i < this->workers.size(); ++i) {
+						this->workers[i].join();
+					}
+				}
+
+				thread_pool(const thread_pool& other) = delete;
+				thread_pool& operator=(const thread_pool& other) = delete;
+
+				void submit(std::function<void()> task) {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						this->tasks.push_back(std::move(task));
+					}
+					this->cond.notify_one();
+				}
+				void execute(std::function<void()> task) override {
+					this->submit(std::move(task));
+				}
+
+				size_t size() const {
+					return this->workers.size();
+				}
+			private:
+				void worker() {
+					while(true) {
+						std::function<void()> task;
+						{
+							std::unique_lock<std::mutex> lk(this->m);
+							this->cond.wait(lk, [this] { return this->done||!this->tasks.empty(); });
+							if(this->tasks.empty()) {
+								return;
+							}
+							task = std::move(this->tasks.front());
+							this->tasks.pop_front();
+						}
+						task();
+					}
+				}
+
+				std::mutex m;
+				std::condition_variable cond;
+				std::deque<std::function<void()>> tasks;
+				std::vector<std::thread> workers;
+				bool done;
+		};
+
+		//Run fn(0) to fn(n-1) on the pool and the calling thread, returning once
+		//all have finished. Indices are claimed one at a time, so uneven work
+		//still balances, and workers which get to it late find nothing left.
+		inline void parallel_for(thread_pool& pool, const size_t n, const std::function<void(size_t)>& fn) {
+			class state {
+				public:
+					state(const size_t n, const std::function<void(size_t)>& fn) : n(n), fn(fn), next(0), num_done(0) {}
+					void run() {
+						size_t i;
+						while((i = this->next.fetch_add(1)) < this->n) {
+							this->fn(i);
+							std::lock_guard<std::mutex> lk(this->m);
+							if(++this->num_done == this->n) {
+								this->cond.notify_all();
+							}
+						}
+					}
+					const size_t n;
+					const std::function<void(size_t)>& fn;
+					std::atomic<size_t> next;
+					std::mutex m;
+					std::condition_variable cond;
+					size_t num_done;
+			};
+			if(n == 0) {
+				return;
+			}
+			std::shared_ptr<state> the_state = std::make_shared<state>(n, fn);
+			const size_t num_helpers = std::min(pool.size(), n-1);
+			for(size_t i = 0; i < num_helpers; ++i) {
+				pool.submit([the_state]() {
+					the_state->run();
+				});
+			}
+			the_state->run();
+			std::unique_lock<std::mutex> lk(the_state->m);
+			the_state->cond.wait(lk, [&the_state] { return the_state->num_done == the_state->n; });
+		}
+
+		//Blocking multi producer multi consumer queue of at most capacity values.
+		//push waits while it is full, which is how a slow consumer holds back its
+		//producers. Once closed, pop drains what is left then returns false.
+		template<typename T>
+		class bounded_queue {
+			public:
+				bounded_queue(const size_t capacity) : capacity(std::max((size_t) 1, capacity)), closed(false) {}
+				bounded_queue(const bounded_queue& rhs) = delete;
+				bounded_queue& operator=(const bounded_queue& rhs) = delete;
+
+				//False if the queue was closed, the value is dropped.
+				bool push(T value) {
+					std::unique_lock<std::mutex> lk(this->m);
+					this->not_full.wait(lk, [this] { return this->closed||(this->values.size() < this->capacity); });
+					if(this->closed) {
+						return false;
+					}
+					this->values.push_back(std::move(value));
+					lk.unlock();
+					this->not_empty.notify_one();
+					return true;
+				}
+				bool pop(T& value) {
+					std::unique_lock<std::mutex> lk(this->m);
+					this->not_empty.wait(lk, [this] { return this->closed||!this->values.empty(); });
+					if(this->values.empty()) {
+						return false;
+					}
+					value = std::move(this->values.front());
+					this->values.pop_front();
+					lk.unlock();
+					this->not_full.notify_one();
+					return true;
+				}
+				void close() {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						this->closed = true;
+					}
+					this->not_full.notify_all();
+					this->not_empty.notify_all();
+				}
+				size_t size() {
+					std::lock_guard<std::mutex> lk(this->m);
+					return this->values.size();
+				}
+			private:
+				const size_t capacity;
+				std::mutex m;
+				std::condition_variable not_full;
+				std::condition_variable not_empty;
+				std::deque<T> values;
+				bool closed;
+		};
+
+		//Caps how many bytes, such as of buffered files, are held at once.
+		//acquire waits until the amount fits, but lets it through whenever
+		//nothing else is held so one amount over the capacity can't wait forever.
+		class byte_budget {
+			public:
+				byte_budget(const uint64_t capacity) : capacity(capacity), used(0) {}
+				byte_budget(const byte_budget& rhs) = delete;
+				byte_budget& operator=(const byte_budget& rhs) = delete;
+
+				void acquire(const uint64_t amount) {
+					std::unique_lock<std::mutex> lk(this->m);
+					this->released.wait(lk, [this, amount] { return (this->used == 0)||(this->used+amount <= this->capacity); });
+					this->used += amount;
+				}
+				void release(const uint64_t amount) {
+					{
+						std::lock_guard<std::mutex> lk(this->m);
+						this->used -= amount;
+					}
+					this->released.notify_all();
+				}
+				uint64_t in_use() {
+					std::lock_guard<std::mutex> lk(this->m);
+					return this->used;
+				}
+			private:
+				const uint64_t capacity;
+				std::mutex m;
+				std::condition_variable released;
+				uint64_t used;
+		};
+
+		//Bounded single producer single consumer channel between two threads.
+		//Values are moved through a ring, so nothing is allocated or copied per
+		//message. GetFd becomes readable when values arrive for a consumer which
+		//said it was about to sleep, so it can be polled next to sockets.
+		//Capacity is rounded up to a power of two.
+		template<typename T>
+		class spsc_channel {
+			public:
+				static const size_t CacheLineSize = 64;
+
+				spsc_channel(const size_t capacity = 1024) : head(0), cached_tail(0), tail(0), cached_head(0), consumer_sleeping(false) {
+					size_t size = 2;
+					while(size < capacity) {
+						size <<= 1;
+					}
+					this->mask = size-1;
+					this->slots.reset(new T[size]);
+				}
+
+				spsc_channel(const spsc_channel& other) = delete;
+				spsc_channel& operator=(const spsc_channel& other) = delete;
+
+				//Producer only. Returns false, leaving value alone, if the channel is full.
+				bool try_push(T& value) {
+					const size_t current_tail = this->tail.load(std::memory_order_relaxed);
+					if(current_tail-this->cached_head > this->mask) {
+						this->cached_head = this->head.load(std::memory_order_acquire);
+						if(current_tail-this->cached_head > this->mask) {
+							return false;
+						}
+					}
+					this->slots[current_tail & this->mask] = std::move(value);
+					this->tail.store(current_tail+1, std::memory_order_release);
+					//Pairs with the fence in prepare_wait, one of us sees the other.
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if(this->consumer_sleeping.load(std::memory_order_relaxed)&&this->consumer_sleeping.exchange(false)) {
+						this->wakeup.Signal();
+					}
+					return true;
+				}
+				bool try_push(T&& value) {
+					return this->try_push(value);
+				}
+
+				//Consumer only. Returns false if the channel is empty.
+				bool try_pop(T& value) {
+					const size_t current_head = this->head.load(std::memory_order_relaxed);
+					if(current_head == this->cached_tail) {
+						this->cached_tail = this->tail.load(std::memory_order_acquire);
+						if(current_head == this->cached_tail) {
+							return false;
+						}
+					}
+					value = std::move(this->slots[current_head & this->mask]);
+					this->slots[current_head & this->mask] = T();
+					this->head.store(current_head+1, std::memory_order_release);
+					return true;
+				}
+
+				//Consumer only. Call before blocking on GetFd. Returns false if values
+				//are already waiting, in which case the consumer shouldn't block.
+				bool prepare_wait() {
+					this->consumer_sleeping.store(true, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if(this->head.load(std::memory_order_relaxed) != this->tail.load(std::memory_order_acquire)) {
+						this->consumer_sleeping.store(false, std::memory_order_relaxed);
+						return false;
+					}
+					return true;
+				}
+				//Consumer only. Call after waking up from GetFd.
+				void finish_wait() {
+					//A producer which took the flag may not have signaled yet, so drain
+					//on every wake. A signal landing after this costs one spurious wake.
+					this->consumer_sleeping.store(false, std::memory_order_relaxed);
+					this->wakeup.Clear();
+				}
+				//Consumer only. Block until values may be waiting or timeout ms pass.
+				bool wait(const int timeout) {
+					if(!this->prepare_wait()) {
+						return true;
+					}
+					const bool signaled = this->wakeup.Wait(timeout);
+					this->finish_wait();
+					return signaled;
+				}
+
+				int GetFd() const {
+					return this->wakeup.GetFd();
+				}
+			private:
+				//Each side's index lives on its own cache line along with its
+				//private copy of the other side's index. Padded rather than aligned
+				//so the channel can be allocated with new, a whole line between the
+				//groups keeps them apart wherever the channel lands.
+				char head_padding[CacheLineSize];
+				std::atomic<size_t> head;
+				size_t cached_tail;
+				char tail_padding[CacheLineSize];
+				std::atomic<size_t> tail;
+				size_t cached_head;
+				char sleeping_padding[CacheLineSize];
+				std::atomic<bool> consumer_sleeping;
+				WakeupSignal wakeup;
+				std::unique_ptr<T[]> slots;
+				size_t mask;
+		};
 	}
 }
 
@@ -0,0 +1,88 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_TRACING_HDR
+#define KSYNC_TRACING_HDR
+
+#include <string>
+#include <atomic>
+#include <ostream>
+#include <cstdint>
+
+namespace KSync {
+	namespace Tracing {
+		// Requests carry a trace id in the CommObject header from the client's
+		// send to its reply. Each process records spans against that id and
+		// writes them out as Chrome trace_event JSON, which chrome://tracing and
+		// Perfetto load directly. Trace ids are unique across processes so the
+		// files of a client and server can be correlated.
+		//
+		// Event names are stored by pointer and must be string literals.
+		typedef uint64_t trace_id_t;
+
+		static const size_t MaxEventsPerThread = 1 << 20;
+
+		extern std::atomic<bool> enabled;
+
+		inline bool Enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		//A new trace id, never 0.
+		trace_id_t GenTraceId();
+		//Nanoseconds since the epoch, so traces from several processes line up.
+		uint64_t Now();
+
+		void RecordSpan(const char* name, const trace_id_t trace_id, const uint64_t start, const uint64_t end);
+		void RecordInstant(const char* name, const trace_id_t trace_id);
+		//Async events may begin and end on different threads.
+		void RecordBegin(const char* name, const trace_id_t trace_id);
+		void RecordEnd(const char* name, const trace_id_t trace_id);
+
+		//Records the lifetime of the span as name, when tracing and trace_id != 0.
+		class Span {
+			public:
+				Span(const char* name, const trace_id_t trace_id) : name(name), trace_id(trace_id) {
+					if(Enabled()&&(trace_id != 0)) {
+						this->start = Now();
+					} else {
+						this->trace_id = 0;
+					}
+				}
+				~Span() {
+					if(this->trace_id != 0) {
+						RecordSpan(this->name, this->trace_id, this->start, Now());
+					}
+				}
+			private:
+				Span(const Span&) = delete;
+				Span& operator=(const Span&) = delete;
+
+				const char* name;
+				trace_id_t trace_id;
+				uint64_t start;
+		};
+
+		//Start recording. Finish writes everything recorded to path.
+		int Enable(const std::string& path, const std::string& process_name) __attribute__((warn_unused_result));
+		int Finish() __attribute__((warn_unused_result));
+		int Write(std::ostream& out) __attribute__((warn_unused_result));
+	}
+}
+
+#endif
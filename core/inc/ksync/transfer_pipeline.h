@@ -0,0 +1,178 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_TRANSFER_PIPELINE_HDR
+#define KSYNC_TRANSFER_PIPELINE_HDR
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <atomic>
+#include <cstdint>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/stream_transfer.h"
+#include "ksync/hash_cache.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/metrics.h"
+
+namespace KSync {
+	namespace Transfer {
+		class StageConfig {
+			public:
+				StageConfig(const size_t num_threads = 1, const size_t queue_depth = 16) : num_threads(num_threads), queue_depth(queue_depth) {}
+				size_t num_threads;
+				//Files which may wait in front of the stage.
+				size_t queue_depth;
+		};
+
+		class PipelineConfig {
+			public:
+				PipelineConfig();
+				StageConfig read;
+				StageConfig hash;
+				StageConfig filter;
+				//There is one send thread per communicator, this is only the queue in front of them.
+				size_t send_queue_depth;
+				uint32_t block_size;
+				uint32_t chunk_size;
+				uint32_t window;
+				//Files up to this size are read into memory, bigger ones are hashed and sent from the file.
+				uint64_t max_buffered_size;
+				//Bytes of files read into memory across the whole pipeline at once.
+				uint64_t max_buffered_bytes;
+				//Digests the receiver already has, by relative path. Matching files aren't sent.
+				std::map<std::string, KSync::Hash::digest_t> known;
+				//Consulted before hashing when set. Must use block_size and outlive the pipeline.
+				KSync::Hash::HashCache* cache;
+		};
+
+		// Sends a list of files under a root through four stages, each with its
+		// own threads and a bounded queue in front of it:
+		//
+		//   read    read the file into memory, or just open it if it's big
+		//   hash    Blake3 over the contents, or the hash cache's entry
+		//   filter  drop files whose digest the receiver already has
+		//   send    a TransferFile then the contents as a stream
+		//
+		// A full queue blocks the stage feeding it, so a slow link holds back
+		// hashing and hashing holds back reading while all of them keep working.
+		// Files read into memory may hold at most max_buffered_bytes between
+		// them, files over max_buffered_size are read a block at a time by the
+		// hash and send stages instead. Each communicator gets its own send
+		// thread since a StreamSender owns the replies on its communicator.
+		class Pipeline {
+			public:
+				Pipeline(const PipelineConfig& config, const std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>>& communicators);
+				Pipeline(const Pipeline& rhs) = delete;
+				Pipeline& operator=(const Pipeline& rhs) = delete;
+
+				//Send root/path for each of paths. A file which fails is counted and
+				//the rest are still sent. A communicator is dropped after a send on it
+				//fails, and once none are left the remaining files fail. Returns < 0
+				//if any failed.
+				int Run(const std::string& root, const std::vector<std::string>& paths) __attribute__((warn_unused_result));
+
+				uint64_t GetFilesSent() const {
+					return this->files_sent.load();
+				}
+				uint64_t GetFilesSkipped() const {
+					return this->files_skipped.load();
+				}
+				uint64_t GetBytesSent() const {
+					return this->bytes_sent.load();
+				}
+				uint64_t GetNumErrors() const {
+					return this->num_errors.load();
+				}
+			private:
+				class Job;
+				typedef KSync::Utilities::bounded_queue<std::shared_ptr<Job>> job_queue;
+
+				void Read(const std::string& root, job_queue& in, job_queue& out, KSync::Utilities::byte_budget& budget);
+				void Hash(job_queue& in, job_queue& out);
+				void Filter(job_queue& in, job_queue& out);
+				void Send(std::shared_ptr<KSync::Comm::ClientCommunicator> communicator, job_queue& in, std::atomic<size_t>& live_senders);
+				void Fail();
+
+				PipelineConfig config;
+				std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>> communicators;
+				std::atomic<uint64_t> files_sent;
+				std::atomic<uint64_t> files_skipped;
+				std::atomic<uint64_t> bytes_sent;
+				std::atomic<uint64_t> num_errors;
+
+				KSync::Metrics::Counter& files_sent_counter;
+				KSync::Metrics::Counter& files_skipped_counter;
+				KSync::Metrics::Counter& bytes_sent_counter;
+				KSync::Metrics::Counter& errors_counter;
+		};
+
+		// Writes the files sent by a Pipeline under root. Each file is streamed
+		// to a temporary name beside it, checked against the sender's digest and
+		// only then renamed into place, so a failed transfer never leaves a
+		// partial file behind. Paths leaving root are refused.
+		class Receiver {
+			public:
+				static const int Continue = 0;
+				static const int Finished = 1;
+				static const uint32_t MaxBlockSize = 64*1024*1024;
+				static const char* const PartSuffix;
+
+				Receiver(std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator, const std::string& root);
+
+				//Feed a received message to the receiver. Returns Continue, Finished
+				//once a file is in place, or < 0 if the file couldn't be received.
+				int HandleMessage(const std::shared_ptr<KSync::Comm::CommObject>& comm_obj) __attribute__((warn_unused_result));
+
+				//Block until the next file is in place.
+				int ReceiveFile() __attribute__((warn_unused_result));
+
+				void SetIdleTimeout(const int timeout) {
+					this->idle_timeout = timeout;
+					this->stream_receiver.SetIdleTimeout(timeout);
+				}
+				uint64_t GetFilesReceived() const {
+					return this->files_received;
+				}
+				std::deque<std::shared_ptr<KSync::Comm::CommObject>>& GetDeferred() {
+					return this->stream_receiver.GetDeferred();
+				}
+			private:
+				int Start(const std::shared_ptr<KSync::Comm::CommObject>& comm_obj) __attribute__((warn_unused_result));
+				int Finish() __attribute__((warn_unused_result));
+				void Abort();
+
+				std::shared_ptr<KSync::Comm::ClientCommunicator> communicator;
+				KSync::Comm::StreamReceiver stream_receiver;
+				std::string root;
+				std::shared_ptr<KSync::Comm::TransferFile> current;
+				std::string part_path;
+				std::string final_path;
+				std::ofstream out;
+				int idle_timeout;
+				uint64_t files_received;
+		};
+	}
+}
+
+#endif
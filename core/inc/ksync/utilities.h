@@ -28,7 +28,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 namespace KSync {
 	namespace Utilities {
-		void set_up_common_arguments_and_defaults(ArgParse::ArgParser& Parser, std::string& log_dir, std::string& gateway_socket_url, bool& gateway_socket_url_defined, bool& nanomsg);
+		//Comm system tuning from the command line, values < 0 keep the defaults.
+		//The socket options apply to the data sockets under each client communicator.
+		class CommTuning {
+			public:
+				CommTuning() : io_threads(1), send_hwm(-1), recv_hwm(-1), send_buffer(-1), recv_buffer(-1), affinity(-1) {}
+				int io_threads;
+				int send_hwm;
+				int recv_hwm;
+				int send_buffer;
+				int recv_buffer;
+				long affinity;
+		};
+
+		void set_up_common_arguments_and_defaults(ArgParse::ArgParser& Parser, std::string& log_dir, std::string& gateway_socket_url, bool& gateway_socket_url_defined, bool& nanomsg, CommTuning& tuning);
 		int get_user_ksync_dir(std::string& dir);
 		int get_socket_dir(std::string& dir);
 		int get_default_ipc_connection_url(std::string& connection_url);
@@ -0,0 +1,67 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_VARINT_HDR
+#define KSYNC_VARINT_HDR
+
+#include <cstddef>
+#include <cstdint>
+
+namespace KSync {
+	namespace Utilities {
+		// Unsigned LEB128: seven bits per byte, least significant group first,
+		// high bit set on every byte but the last. The encoding is the same on
+		// every architecture and small values take a single byte.
+		static const size_t MaxVarintSize = 10;
+
+		inline size_t VarintSize(uint64_t value) {
+			size_t size = 1;
+			while(value >= 0x80) {
+				value >>= 7;
+				++size;
+			}
+			return size;
+		}
+
+		//Returns the number of bytes written, at most MaxVarintSize.
+		inline size_t WriteVarint(char* out, uint64_t value) {
+			size_t i = 0;
+			while(value >= 0x80) {
+				out[i++] = (char) ((value & 0x7f)|0x80);
+				value >>= 7;
+			}
+			out[i++] = (char) value;
+			return i;
+		}
+
+		//Returns the number of bytes read, or 0 if data ends mid varint or it's too long.
+		inline size_t ReadVarint(const char* data, const size_t size, uint64_t& value) {
+			value = 0;
+			for(size_t i = 0; (i < size)&&(i < MaxVarintSize); ++i) {
+				const uint8_t byte = (uint8_t) data[i];
+				value |= ((uint64_t) (byte & 0x7f)) << (7*i);
+				if((byte & 0x80) == 0) {
+					return i+1;
+				}
+			}
+			return 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_WAKEUP_SIGNAL_HDR
+#define KSYNC_WAKEUP_SIGNAL_HDR
+
+#include "ksync/ksync_exception.h"
+
+namespace KSync {
+	namespace Utilities {
+		//An eventfd which becomes readable when signaled, so a thread polling a
+		//socket can also be woken by another thread.
+		class WakeupSignal {
+			public:
+				class WakeupSignalException : public KSync::Exception::BasicException {
+					public:
+						WakeupSignalException();
+				};
+
+				WakeupSignal();
+				~WakeupSignal();
+
+				WakeupSignal(const WakeupSignal& other) = delete;
+				WakeupSignal& operator=(const WakeupSignal& other) = delete;
+
+				void Signal();
+				//Make the fd unreadable again.
+				void Clear();
+				//Block until signaled or timeout ms pass. Doesn't clear the signal.
+				bool Wait(const int timeout);
+				int GetFd() const {
+					return this->fd;
+				}
+			private:
+				int fd;
+		};
+	}
+}
+
+#endif
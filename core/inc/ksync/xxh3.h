@@ -0,0 +1,41 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_XXH3_HDR
+#define KSYNC_XXH3_HDR
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace KSync {
+	namespace Hash {
+		// XXH3, 64 bit. Fast but not cryptographic, for hash tables and quick
+		// change checks where a collision only costs a rehash. Anything another
+		// side relies on to tell files apart should use Blake3.
+		uint64_t Xxh3Hash64(const void* data, const size_t size, const uint64_t seed = 0);
+
+		//"avx2" or "portable", used for inputs over 240 bytes.
+		std::string Xxh3GetImplementation();
+		//Force an implementation, < 0 if the cpu doesn't have it.
+		int Xxh3SetImplementation(const std::string& name) __attribute__((warn_unused_result));
+	}
+}
+
+#endif
@@ -0,0 +1,606 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "ksync/binary_log.h"
+
+namespace KSync {
+	namespace BinaryLog {
+		std::atomic<bool> enabled(false);
+
+		RecordBuilder::RecordBuilder(const uint32_t format_id) {
+			this->data[0] = MessageRecord;
+			memcpy(this->data+1+4+8+4, &format_id, sizeof(format_id));
+			this->size = MessageHeaderSize;
+		}
+
+		bool RecordBuilder::Put(const char tag, const void* value, const size_t value_size) {
+			if(this->size+1+value_size > MaxRecordSize) {
+				return false;
+			}
+			this->data[this->size] = tag;
+			memcpy(this->data+this->size+1, value, value_size);
+			this->size += 1+value_size;
+			return true;
+		}
+
+		void RecordBuilder::AddInt(const int64_t value) {
+			this->Put(ArgInt, &value, sizeof(value));
+		}
+
+		void RecordBuilder::AddUInt(const uint64_t value) {
+			this->Put(ArgUInt, &value, sizeof(value));
+		}
+
+		void RecordBuilder::AddDouble(const double value) {
+			this->Put(ArgDouble, &value, sizeof(value));
+		}
+
+		void RecordBuilder::Add(const void* value) {
+			const uint64_t address = (uint64_t) (uintptr_t) value;
+			this->Put(ArgPointer, &address, sizeof(address));
+		}
+
+		void RecordBuilder::Add(const char* value) {
+			if(value == 0) {
+				value = "(null)";
+			}
+			const size_t room = MaxRecordSize-std::min<size_t>(MaxRecordSize, this->size+1+4);
+			const uint32_t length = (uint32_t) std::min(strlen(value), room);
+			if(this->size+1+4+length > MaxRecordSize) {
+				return;
+			}
+			this->data[this->size] = ArgString;
+			memcpy(this->data+this->size+1, &length, sizeof(length));
+			memcpy(this->data+this->size+1+4, value, length);
+			this->size += 1+4+length;
+		}
+
+		void RecordBuilder::Add(const std::string& value) {
+			this->Add(value.c_str());
+		}
+
+		const char* RecordBuilder::Finish(const uint32_t thread_index) {
+			const uint64_t timestamp = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			memcpy(this->data+1, &this->size, sizeof(this->size));
+			memcpy(this->data+1+4, &timestamp, sizeof(timestamp));
+			memcpy(this->data+1+4+8, &thread_index, sizeof(thread_index));
+			return this->data;
+		}
+
+		//Single producer (the owning thread) single consumer (the writer) byte ring.
+		class Ring {
+			public:
+				Ring(const uint32_t index, const size_t capacity) : index(index), mask(capacity-1), buffer(new char[capacity]), head(0), tail(0), dropped(0), retired(false) {}
+
+				bool Push(const char* record, const uint32_t record_size) {
+					const uint64_t the_tail = this->tail.load(std::memory_order_relaxed);
+					if((this->mask+1)-(the_tail-this->head.load(std::memory_order_acquire)) < record_size) {
+						this->dropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+					const size_t start = (size_t) (the_tail&this->mask);
+					const size_t first = std::min<size_t>(record_size, this->mask+1-start);
+					memcpy(this->buffer.get()+start, record, first);
+					memcpy(this->buffer.get(), record+first, record_size-first);
+					this->tail.store(the_tail+record_size, std::memory_order_release);
+					return true;
+				}
+
+				//Append every complete record to out.
+				void Drain(std::string& out) {
+					const uint64_t the_head = this->head.load(std::memory_order_relaxed);
+					const uint64_t the_tail = this->tail.load(std::memory_order_acquire);
+					const size_t length = (size_t) (the_tail-the_head);
+					const size_t start = (size_t) (the_head&this->mask);
+					const size_t first = std::min<size_t>(length, this->mask+1-start);
+					out.append(this->buffer.get()+start, first);
+					out.append(this->buffer.get(), length-first);
+					this->head.store(the_tail, std::memory_order_release);
+				}
+
+				const uint32_t index;
+				const uint64_t mask;
+				std::unique_ptr<char[]> buffer;
+				std::atomic<uint64_t> head;
+				std::atomic<uint64_t> tail;
+				std::atomic<uint64_t> dropped;
+				std::atomic<bool> retired;
+		};
+
+		class FormatInfo {
+			public:
+				int level;
+				int line;
+				std::string file;
+				std::string format;
+		};
+
+		//Leaked on purpose so thread_local destructors can run after static destruction.
+		class Registry {
+			public:
+				Registry() : ring_size(DefaultRingSize), next_thread_index(0) {}
+				std::mutex mutex;
+				std::vector<std::shared_ptr<Ring>> rings;
+				std::vector<FormatInfo> formats;
+				size_t ring_size;
+				uint32_t next_thread_index;
+		};
+
+		static Registry& GetRegistry() {
+			static Registry* registry = new Registry();
+			return *registry;
+		}
+
+		class ThreadRing {
+			public:
+				~ThreadRing() {
+					if(this->ring) {
+						this->ring->retired.store(true, std::memory_order_release);
+					}
+				}
+				std::shared_ptr<Ring> ring;
+		};
+
+		static thread_local ThreadRing thread_ring;
+
+		static Ring* GetThreadRing() {
+			if(!thread_ring.ring) {
+				Registry& registry = GetRegistry();
+				std::lock_guard<std::mutex> lk(registry.mutex);
+				thread_ring.ring.reset(new Ring(registry.next_thread_index++, registry.ring_size));
+				registry.rings.push_back(thread_ring.ring);
+			}
+			return thread_ring.ring.get();
+		}
+
+		uint32_t RegisterFormat(const int level, const char* format, const char* file, const int line) {
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			FormatInfo info;
+			info.level = level;
+			info.line = line;
+			info.file = file;
+			info.format = format;
+			registry.formats.push_back(info);
+			return (uint32_t) registry.formats.size()-1;
+		}
+
+		void Write(RecordBuilder& record) {
+			Ring* ring = GetThreadRing();
+			const char* data = record.Finish(ring->index);
+			ring->Push(data, record.GetSize());
+		}
+
+		static void PutString(std::string& out, const std::string& value) {
+			const uint32_t length = (uint32_t) value.size();
+			out.append((const char*) &length, sizeof(length));
+			out.append(value);
+		}
+
+		template<class T>
+		static void PutValue(std::string& out, const T value) {
+			out.append((const char*) &value, sizeof(value));
+		}
+
+		class Writer {
+			public:
+				Writer(const std::string& path) : out(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc), formats_written(0) {
+					this->finished.store(false);
+				}
+
+				bool Good() const {
+					return (bool) this->out;
+				}
+
+				void Start() {
+					this->out.write(Magic, sizeof(Magic));
+					this->thread = std::thread(&Writer::Run, this);
+				}
+
+				void Stop() {
+					this->finished.store(true);
+					if(this->thread.joinable()) {
+						this->thread.join();
+					}
+				}
+			private:
+				void Run() {
+					while(!this->finished.load()) {
+						this->Flush();
+						std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					}
+					this->Flush();
+				}
+
+				void Flush() {
+					Registry& registry = GetRegistry();
+					std::vector<std::shared_ptr<Ring>> rings;
+					{
+						std::lock_guard<std::mutex> lk(registry.mutex);
+						rings = registry.rings;
+					}
+					//Drain before looking at the formats, every format a drained
+					//message refers to was registered before it was pushed.
+					std::string messages;
+					std::vector<std::shared_ptr<Ring>> retired;
+					for(size_t i = 0; i < rings.size(); ++i) {
+						const bool is_retired = rings[i]->retired.load(std::memory_order_acquire);
+						rings[i]->Drain(messages);
+						const uint64_t dropped = rings[i]->dropped.exchange(0, std::memory_order_relaxed);
+						if(dropped != 0) {
+							messages.push_back(DroppedRecord);
+							PutValue<uint32_t>(messages, 1+4+4+8);
+							PutValue<uint32_t>(messages, rings[i]->index);
+							PutValue<uint64_t>(messages, dropped);
+						}
+						if(is_retired) {
+							retired.push_back(rings[i]);
+						}
+					}
+
+					std::string formats;
+					{
+						std::lock_guard<std::mutex> lk(registry.mutex);
+						for(; this->formats_written < registry.formats.size(); ++this->formats_written) {
+							const FormatInfo& info = registry.formats[this->formats_written];
+							std::string record;
+							PutValue<uint32_t>(record, (uint32_t) this->formats_written);
+							PutValue<int32_t>(record, info.level);
+							PutValue<int32_t>(record, info.line);
+							PutString(record, info.file);
+							PutString(record, info.format);
+							formats.push_back(FormatRecord);
+							PutValue<uint32_t>(formats, (uint32_t) (1+4+record.size()));
+							formats.append(record);
+						}
+						for(size_t i = 0; i < retired.size(); ++i) {
+							registry.rings.erase(std::remove(registry.rings.begin(), registry.rings.end(), retired[i]), registry.rings.end());
+						}
+					}
+
+					if(formats.size()+messages.size() != 0) {
+						this->out.write(formats.data(), formats.size());
+						this->out.write(messages.data(), messages.size());
+						this->out.flush();
+					}
+				}
+
+				std::ofstream out;
+				std::thread thread;
+				std::atomic<bool> finished;
+				size_t formats_written;
+		};
+
+		static std::mutex writer_mutex;
+		static std::unique_ptr<Writer> writer;
+
+		int Initialize(const std::string& log_prefix, const std::string& log_dir, const size_t ring_size) {
+			std::lock_guard<std::mutex> lk(writer_mutex);
+			if(writer) {
+				LOGF(WARNING, "The binary log is already running!");
+				return -1;
+			}
+			if((ring_size < 2*MaxRecordSize)||((ring_size&(ring_size-1)) != 0)) {
+				LOGF(SEVERE, "The binary log ring size must be a power of two of at least (%lu)!", 2*MaxRecordSize);
+				return -2;
+			}
+			std::string prefix = log_prefix;
+			std::replace(prefix.begin(), prefix.end(), ' ', '_');
+			std::stringstream path;
+			path << log_dir << "/" << prefix << "." << getpid() << ".blog";
+			writer.reset(new Writer(path.str()));
+			if(!writer->Good()) {
+				LOGF(SEVERE, "Couldn't open the binary log (%s)!", path.str().c_str());
+				writer.reset();
+				return -3;
+			}
+			{
+				Registry& registry = GetRegistry();
+				std::lock_guard<std::mutex> registry_lk(registry.mutex);
+				registry.ring_size = ring_size;
+			}
+			writer->Start();
+			enabled.store(true);
+			printf("Now writing binary log to (%s)\n", path.str().c_str());
+			return 0;
+		}
+
+		void Shutdown() {
+			std::lock_guard<std::mutex> lk(writer_mutex);
+			enabled.store(false);
+			if(writer) {
+				writer->Stop();
+				writer.reset();
+			}
+		}
+
+		//Decoding
+
+		class Arg {
+			public:
+				char tag;
+				int64_t i;
+				uint64_t u;
+				double d;
+				std::string s;
+
+				long long AsInt() const {
+					if(this->tag == ArgDouble) {
+						return (long long) this->d;
+					} else if (this->tag == ArgInt) {
+						return (long long) this->i;
+					}
+					return (long long) this->u;
+				}
+				unsigned long long AsUInt() const {
+					return (unsigned long long) this->AsInt();
+				}
+				double AsDouble() const {
+					if(this->tag == ArgDouble) {
+						return this->d;
+					}
+					return (double) this->AsInt();
+				}
+		};
+
+		static const char* LevelName(const int level) {
+			if(level >= KSYNC_LOG_LEVEL_FATAL) {
+				return "FATAL";
+			} else if (level >= KSYNC_LOG_LEVEL_SEVERE) {
+				return "SEVERE";
+			} else if (level >= KSYNC_LOG_LEVEL_WARNING) {
+				return "WARNING";
+			} else if (level >= KSYNC_LOG_LEVEL_INFO) {
+				return "INFO";
+			} else if (level >= KSYNC_LOG_LEVEL_MESSAGE) {
+				return "";
+			}
+			return "DEBUG";
+		}
+
+		//printf the arguments into format, one conversion at a time.
+		static std::string FormatMessage(const std::string& format, const std::vector<Arg>& args) {
+			std::string out;
+			size_t arg_i = 0;
+			size_t i = 0;
+			char buffer[MaxRecordSize+64];
+			while(i < format.size()) {
+				if(format[i] != '%') {
+					out.push_back(format[i++]);
+					continue;
+				}
+				if((i+1 < format.size())&&(format[i+1] == '%')) {
+					out.push_back('%');
+					i += 2;
+					continue;
+				}
+				const size_t start = i++;
+				while((i < format.size())&&(strchr("-+ #0", format[i]) != 0)) {
+					++i;
+				}
+				while((i < format.size())&&isdigit(format[i])) {
+					++i;
+				}
+				if((i < format.size())&&(format[i] == '.')) {
+					++i;
+					while((i < format.size())&&isdigit(format[i])) {
+						++i;
+					}
+				}
+				std::string spec = format.substr(start, i-start);
+				while((i < format.size())&&(strchr("hljztLq", format[i]) != 0)) {
+					++i;
+				}
+				if(i >= format.size()) {
+					out += spec;
+					break;
+				}
+				const char conversion = format[i++];
+				if(arg_i >= args.size()) {
+					out += "<missing>";
+					continue;
+				}
+				const Arg& arg = args[arg_i++];
+				switch(conversion) {
+					case 'd':
+					case 'i':
+						spec += "lld";
+						snprintf(buffer, sizeof(buffer), spec.c_str(), arg.AsInt());
+						break;
+					case 'u':
+					case 'x':
+					case 'X':
+					case 'o':
+						spec += "ll";
+						spec.push_back(conversion);
+						snprintf(buffer, sizeof(buffer), spec.c_str(), arg.AsUInt());
+						break;
+					case 'c':
+						spec.push_back(conversion);
+						snprintf(buffer, sizeof(buffer), spec.c_str(), (int) arg.AsInt());
+						break;
+					case 'f':
+					case 'F':
+					case 'e':
+					case 'E':
+					case 'g':
+					case 'G':
+					case 'a':
+					case 'A':
+						spec.push_back(conversion);
+						snprintf(buffer, sizeof(buffer), spec.c_str(), arg.AsDouble());
+						break;
+					case 's':
+						spec.push_back(conversion);
+						if(arg.tag == ArgString) {
+							snprintf(buffer, sizeof(buffer), spec.c_str(), arg.s.c_str());
+						} else {
+							snprintf(buffer, sizeof(buffer), spec.c_str(), "<not a string>");
+						}
+						break;
+					case 'p':
+						spec.push_back(conversion);
+						snprintf(buffer, sizeof(buffer), spec.c_str(), (void*) (uintptr_t) arg.u);
+						break;
+					default:
+						snprintf(buffer, sizeof(buffer), "%s%c", spec.c_str(), conversion);
+						break;
+				}
+				out += buffer;
+			}
+			return out;
+		}
+
+		static std::string FormatTimestamp(const uint64_t timestamp) {
+			const time_t seconds = (time_t) (timestamp/1000000000ULL);
+			struct tm local;
+			localtime_r(&seconds, &local);
+			char date[64];
+			strftime(date, sizeof(date), "%Y/%m/%d %H:%M:%S", &local);
+			char full[96];
+			snprintf(full, sizeof(full), "%s.%06llu", date, (unsigned long long) ((timestamp%1000000000ULL)/1000));
+			return full;
+		}
+
+		template<class T>
+		static bool GetValue(const std::string& record, size_t& pos, T& value) {
+			if(pos+sizeof(T) > record.size()) {
+				return false;
+			}
+			memcpy(&value, record.data()+pos, sizeof(T));
+			pos += sizeof(T);
+			return true;
+		}
+
+		static bool GetString(const std::string& record, size_t& pos, std::string& value) {
+			uint32_t length = 0;
+			if((!GetValue(record, pos, length))||(pos+length > record.size())) {
+				return false;
+			}
+			value.assign(record.data()+pos, length);
+			pos += length;
+			return true;
+		}
+
+		int Decode(std::istream& in, std::ostream& out) {
+			char magic[sizeof(Magic)];
+			if((!in.read(magic, sizeof(magic)))||(memcmp(magic, Magic, sizeof(Magic)) != 0)) {
+				LOGF(SEVERE, "Not a KSync binary log!");
+				return -1;
+			}
+			std::vector<FormatInfo> formats;
+			while(true) {
+				char type;
+				uint32_t size;
+				if(!in.get(type)) {
+					return 0;
+				}
+				if((!in.read((char*) &size, sizeof(size)))||(size < 1+4)||(size > MaxRecordSize+1024)) {
+					LOGF(SEVERE, "Truncated or corrupt record!");
+					return -2;
+				}
+				std::string record(size-1-4, '\0');
+				if(!in.read(&record[0], record.size())) {
+					LOGF(SEVERE, "Truncated record!");
+					return -2;
+				}
+				size_t pos = 0;
+				if(type == FormatRecord) {
+					uint32_t id;
+					FormatInfo info;
+					int32_t level;
+					int32_t line;
+					if(!(GetValue(record, pos, id)&&GetValue(record, pos, level)&&GetValue(record, pos, line)&&GetString(record, pos, info.file)&&GetString(record, pos, info.format))) {
+						LOGF(SEVERE, "Corrupt format record!");
+						return -3;
+					}
+					info.level = level;
+					info.line = line;
+					if(formats.size() <= id) {
+						formats.resize(id+1);
+					}
+					formats[id] = info;
+				} else if (type == MessageRecord) {
+					uint64_t timestamp;
+					uint32_t thread_index;
+					uint32_t id;
+					if(!(GetValue(record, pos, timestamp)&&GetValue(record, pos, thread_index)&&GetValue(record, pos, id))||(id >= formats.size())) {
+						LOGF(SEVERE, "Corrupt message record!");
+						return -4;
+					}
+					std::vector<Arg> args;
+					while(pos < record.size()) {
+						Arg arg;
+						arg.tag = record[pos++];
+						arg.i = 0;
+						arg.u = 0;
+						arg.d = 0.;
+						bool good;
+						if(arg.tag == ArgInt) {
+							good = GetValue(record, pos, arg.i);
+						} else if ((arg.tag == ArgUInt)||(arg.tag == ArgPointer)) {
+							good = GetValue(record, pos, arg.u);
+						} else if (arg.tag == ArgDouble) {
+							good = GetValue(record, pos, arg.d);
+						} else if (arg.tag == ArgString) {
+							good = GetString(record, pos, arg.s);
+						} else {
+							good = false;
+						}
+						if(!good) {
+							LOGF(SEVERE, "Corrupt message argument!");
+							return -5;
+						}
+						args.push_back(arg);
+					}
+					const FormatInfo& info = formats[id];
+					std::string file = info.file;
+					size_t slash = file.find_last_of('/');
+					if(slash != std::string::npos) {
+						file = file.substr(slash+1);
+					}
+					out << FormatTimestamp(timestamp) << " " << LevelName(info.level) << " [" << thread_index << " " << file << ":" << info.line << "] " << FormatMessage(info.format, args) << std::endl;
+				} else if (type == DroppedRecord) {
+					uint32_t thread_index;
+					uint64_t dropped;
+					if(!(GetValue(record, pos, thread_index)&&GetValue(record, pos, dropped))) {
+						LOGF(SEVERE, "Corrupt dropped record!");
+						return -6;
+					}
+					out << "*** " << dropped << " messages from thread " << thread_index << " were dropped, its ring was full ***" << std::endl;
+				} else {
+					LOGF(SEVERE, "Unknown record type (%c)!", type);
+					return -7;
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,622 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <atomic>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstring>
+
+#include "ksync/thread_utilities.h"
+#include "ksync/blake3.h"
+
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#define KSYNC_BLAKE3_X86 1
+#endif
+
+namespace KSync {
+	namespace Hash {
+		static const uint32_t IV[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+
+		//Message word order for each of the seven rounds.
+		static const uint8_t MsgSchedule[7][16] = {
+			{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+			{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+			{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+			{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+			{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+			{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+			{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+		};
+
+		static const uint8_t ChunkStart = 1;
+		static const uint8_t ChunkEnd = 2;
+		static const uint8_t Parent = 4;
+		static const uint8_t Root = 8;
+
+		//Hash num_inputs inputs of blocks whole blocks each into 32 byte chaining values at out.
+		typedef void (*hash_many_t)(const uint8_t* const* inputs, const size_t num_inputs, const size_t blocks, const uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out);
+
+		static inline uint32_t Load32(const uint8_t* p) {
+			return ((uint32_t) p[0])|(((uint32_t) p[1]) << 8)|(((uint32_t) p[2]) << 16)|(((uint32_t) p[3]) << 24);
+		}
+
+		static inline void Store32(uint8_t* p, const uint32_t value) {
+			p[0] = (uint8_t) value;
+			p[1] = (uint8_t) (value >> 8);
+			p[2] = (uint8_t) (value >> 16);
+			p[3] = (uint8_t) (value >> 24);
+		}
+
+		static inline uint32_t RotateRight(const uint32_t x, const int n) {
+			return (x >> n)|(x << (32-n));
+		}
+
+		static inline void G(uint32_t* v, const size_t a, const size_t b, const size_t c, const size_t d, const uint32_t mx, const uint32_t my) {
+			v[a] = v[a]+v[b]+mx;
+			v[d] = RotateRight(v[d]^v[a], 16);
+			v[c] = v[c]+v[d];
+			v[b] = RotateRight(v[b]^v[c], 12);
+			v[a] = v[a]+v[b]+my;
+			v[d] = RotateRight(v[d]^v[a], 8);
+			v[c] = v[c]+v[d];
+			v[b] = RotateRight(v[b]^v[c], 7);
+		}
+
+		static __attribute__((always_inline)) inline void Round(uint32_t* v, const uint32_t* m, const size_t r) {
+			const uint8_t* s = MsgSchedule[r];
+			G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		//Every round spelled out so the message schedule folds into constant indices.
+		static __attribute__((always_inline)) inline void Rounds(uint32_t* v, const uint32_t* m) {
+			Round(v, m, 0);
+			Round(v, m, 1);
+			Round(v, m, 2);
+			Round(v, m, 3);
+			Round(v, m, 4);
+			Round(v, m, 5);
+			Round(v, m, 6);
+		}
+
+		static void CompressInPlace(uint32_t cv[8], const uint8_t block[Blake3::BlockLen], const uint32_t block_len, const uint64_t counter, const uint32_t flags) {
+			uint32_t m[16];
+			for(size_t i = 0; i < 16; ++i) {
+				m[i] = Load32(block+4*i);
+			}
+			uint32_t v[16] = {
+				cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+				IV[0], IV[1], IV[2], IV[3], (uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags
+			};
+			Rounds(v, m);
+			for(size_t i = 0; i < 8; ++i) {
+				cv[i] = v[i]^v[i+8];
+			}
+		}
+
+		static void StoreCv(uint8_t* out, const uint32_t cv[8]) {
+			for(size_t i = 0; i < 8; ++i) {
+				Store32(out+4*i, cv[i]);
+			}
+		}
+
+		static void HashManyPortable(const uint8_t* const* inputs, const size_t num_inputs, const size_t blocks, uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out) {
+			for(size_t i = 0; i < num_inputs; ++i) {
+				uint32_t cv[8];
+				memcpy(cv, IV, sizeof(cv));
+				for(size_t b = 0; b < blocks; ++b) {
+					const uint8_t block_flags = flags|((b == 0) ? flags_start : 0)|((b+1 == blocks) ? flags_end : 0);
+					CompressInPlace(cv, inputs[i]+b*Blake3::BlockLen, Blake3::BlockLen, counter, block_flags);
+				}
+				StoreCv(out+32*i, cv);
+				if(increment_counter) {
+					++counter;
+				}
+			}
+		}
+
+#ifdef KSYNC_BLAKE3_X86
+		//AVX2, eight inputs at once, one per 32 bit lane.
+		#define KSYNC_AVX2 __attribute__((target("avx2"), always_inline)) inline
+
+		static KSYNC_AVX2 __m256i Rotate16Avx2(const __m256i x) {
+			return _mm256_shuffle_epi8(x, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+		}
+
+		static KSYNC_AVX2 __m256i Rotate8Avx2(const __m256i x) {
+			return _mm256_shuffle_epi8(x, _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1, 12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+		}
+
+		static KSYNC_AVX2 void GAvx2(__m256i* v, const size_t a, const size_t b, const size_t c, const size_t d, const __m256i mx, const __m256i my) {
+			v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), mx);
+			v[d] = Rotate16Avx2(_mm256_xor_si256(v[d], v[a]));
+			v[c] = _mm256_add_epi32(v[c], v[d]);
+			v[b] = _mm256_xor_si256(v[b], v[c]);
+			v[b] = _mm256_or_si256(_mm256_srli_epi32(v[b], 12), _mm256_slli_epi32(v[b], 20));
+			v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), my);
+			v[d] = Rotate8Avx2(_mm256_xor_si256(v[d], v[a]));
+			v[c] = _mm256_add_epi32(v[c], v[d]);
+			v[b] = _mm256_xor_si256(v[b], v[c]);
+			v[b] = _mm256_or_si256(_mm256_srli_epi32(v[b], 7), _mm256_slli_epi32(v[b], 25));
+		}
+
+		static KSYNC_AVX2 void RoundAvx2(__m256i* v, const __m256i* m, const size_t r) {
+			const uint8_t* s = MsgSchedule[r];
+			GAvx2(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			GAvx2(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			GAvx2(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			GAvx2(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			GAvx2(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			GAvx2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			GAvx2(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			GAvx2(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		static KSYNC_AVX2 void RoundsAvx2(__m256i* v, const __m256i* m) {
+			RoundAvx2(v, m, 0);
+			RoundAvx2(v, m, 1);
+			RoundAvx2(v, m, 2);
+			RoundAvx2(v, m, 3);
+			RoundAvx2(v, m, 4);
+			RoundAvx2(v, m, 5);
+			RoundAvx2(v, m, 6);
+		}
+
+		//Rows become columns, so word i of every lane ends up in v[i] and back.
+		static KSYNC_AVX2 void Transpose8x8Avx2(__m256i* v) {
+			const __m256i ab_0145 = _mm256_unpacklo_epi32(v[0], v[1]);
+			const __m256i ab_2367 = _mm256_unpackhi_epi32(v[0], v[1]);
+			const __m256i cd_0145 = _mm256_unpacklo_epi32(v[2], v[3]);
+			const __m256i cd_2367 = _mm256_unpackhi_epi32(v[2], v[3]);
+			const __m256i ef_0145 = _mm256_unpacklo_epi32(v[4], v[5]);
+			const __m256i ef_2367 = _mm256_unpackhi_epi32(v[4], v[5]);
+			const __m256i gh_0145 = _mm256_unpacklo_epi32(v[6], v[7]);
+			const __m256i gh_2367 = _mm256_unpackhi_epi32(v[6], v[7]);
+			const __m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+			const __m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+			const __m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+			const __m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+			const __m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+			const __m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+			const __m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+			const __m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+			v[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+			v[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+			v[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+			v[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+			v[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+			v[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+			v[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+			v[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+		}
+
+		__attribute__((target("avx2"))) static void Hash8Avx2(const uint8_t* const* inputs, const size_t blocks, const uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out) {
+			uint32_t counter_low[8];
+			uint32_t counter_high[8];
+			for(size_t i = 0; i < 8; ++i) {
+				const uint64_t lane_counter = counter+(increment_counter ? i : 0);
+				counter_low[i] = (uint32_t) lane_counter;
+				counter_high[i] = (uint32_t) (lane_counter >> 32);
+			}
+			__m256i h[8];
+			for(size_t i = 0; i < 8; ++i) {
+				h[i] = _mm256_set1_epi32((int) IV[i]);
+			}
+			for(size_t b = 0; b < blocks; ++b) {
+				const uint8_t block_flags = flags|((b == 0) ? flags_start : 0)|((b+1 == blocks) ? flags_end : 0);
+				__m256i m[16];
+				for(size_t i = 0; i < 8; ++i) {
+					m[i] = _mm256_loadu_si256((const __m256i*) (inputs[i]+b*Blake3::BlockLen));
+					m[i+8] = _mm256_loadu_si256((const __m256i*) (inputs[i]+b*Blake3::BlockLen+32));
+				}
+				Transpose8x8Avx2(m);
+				Transpose8x8Avx2(m+8);
+				__m256i v[16] = {
+					h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+					_mm256_set1_epi32((int) IV[0]), _mm256_set1_epi32((int) IV[1]), _mm256_set1_epi32((int) IV[2]), _mm256_set1_epi32((int) IV[3]),
+					_mm256_loadu_si256((const __m256i*) counter_low), _mm256_loadu_si256((const __m256i*) counter_high),
+					_mm256_set1_epi32((int) Blake3::BlockLen), _mm256_set1_epi32((int) block_flags)
+				};
+				RoundsAvx2(v, m);
+				for(size_t i = 0; i < 8; ++i) {
+					h[i] = _mm256_xor_si256(v[i], v[i+8]);
+				}
+			}
+			Transpose8x8Avx2(h);
+			for(size_t i = 0; i < 8; ++i) {
+				_mm256_storeu_si256((__m256i*) (out+32*i), h[i]);
+			}
+		}
+
+		static void HashManyAvx2(const uint8_t* const* inputs, size_t num_inputs, const size_t blocks, uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out) {
+			while(num_inputs >= 8) {
+				Hash8Avx2(inputs, blocks, counter, increment_counter, flags, flags_start, flags_end, out);
+				if(increment_counter) {
+					counter += 8;
+				}
+				inputs += 8;
+				num_inputs -= 8;
+				out += 8*32;
+			}
+			HashManyPortable(inputs, num_inputs, blocks, counter, increment_counter, flags, flags_start, flags_end, out);
+		}
+
+		//AVX-512, sixteen inputs at once. gcc warns about the intrinsics' own
+		//deliberately undefined values once they're inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+		#define KSYNC_AVX512 __attribute__((target("avx512f"), always_inline)) inline
+
+		static KSYNC_AVX512 void GAvx512(__m512i* v, const size_t a, const size_t b, const size_t c, const size_t d, const __m512i mx, const __m512i my) {
+			v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), mx);
+			v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 16);
+			v[c] = _mm512_add_epi32(v[c], v[d]);
+			v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 12);
+			v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), my);
+			v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 8);
+			v[c] = _mm512_add_epi32(v[c], v[d]);
+			v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 7);
+		}
+
+		static KSYNC_AVX512 void RoundAvx512(__m512i* v, const __m512i* m, const size_t r) {
+			const uint8_t* s = MsgSchedule[r];
+			GAvx512(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			GAvx512(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			GAvx512(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			GAvx512(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			GAvx512(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			GAvx512(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			GAvx512(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			GAvx512(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		static KSYNC_AVX512 void RoundsAvx512(__m512i* v, const __m512i* m) {
+			RoundAvx512(v, m, 0);
+			RoundAvx512(v, m, 1);
+			RoundAvx512(v, m, 2);
+			RoundAvx512(v, m, 3);
+			RoundAvx512(v, m, 4);
+			RoundAvx512(v, m, 5);
+			RoundAvx512(v, m, 6);
+		}
+
+		static KSYNC_AVX512 void Transpose16x16Avx512(__m512i* v) {
+			//Within each 128 bit lane k, u[4*g+j] ends up holding word 4*k+j of rows 4*g to 4*g+3.
+			__m512i t[16];
+			for(size_t i = 0; i < 8; ++i) {
+				t[2*i] = _mm512_unpacklo_epi32(v[2*i], v[2*i+1]);
+				t[2*i+1] = _mm512_unpackhi_epi32(v[2*i], v[2*i+1]);
+			}
+			__m512i u[16];
+			for(size_t g = 0; g < 4; ++g) {
+				u[4*g] = _mm512_unpacklo_epi64(t[4*g], t[4*g+2]);
+				u[4*g+1] = _mm512_unpackhi_epi64(t[4*g], t[4*g+2]);
+				u[4*g+2] = _mm512_unpacklo_epi64(t[4*g+1], t[4*g+3]);
+				u[4*g+3] = _mm512_unpackhi_epi64(t[4*g+1], t[4*g+3]);
+			}
+			//Then gather lane k of each group into word 4*k+j.
+			for(size_t j = 0; j < 4; ++j) {
+				const __m512i lo_even = _mm512_shuffle_i32x4(u[j], u[4+j], _MM_SHUFFLE(2, 0, 2, 0));
+				const __m512i lo_odd = _mm512_shuffle_i32x4(u[j], u[4+j], _MM_SHUFFLE(3, 1, 3, 1));
+				const __m512i hi_even = _mm512_shuffle_i32x4(u[8+j], u[12+j], _MM_SHUFFLE(2, 0, 2, 0));
+				const __m512i hi_odd = _mm512_shuffle_i32x4(u[8+j], u[12+j], _MM_SHUFFLE(3, 1, 3, 1));
+				v[j] = _mm512_shuffle_i32x4(lo_even, hi_even, _MM_SHUFFLE(2, 0, 2, 0));
+				v[8+j] = _mm512_shuffle_i32x4(lo_even, hi_even, _MM_SHUFFLE(3, 1, 3, 1));
+				v[4+j] = _mm512_shuffle_i32x4(lo_odd, hi_odd, _MM_SHUFFLE(2, 0, 2, 0));
+				v[12+j] = _mm512_shuffle_i32x4(lo_odd, hi_odd, _MM_SHUFFLE(3, 1, 3, 1));
+			}
+		}
+
+		__attribute__((target("avx512f"))) static void Hash16Avx512(const uint8_t* const* inputs, const size_t blocks, const uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out) {
+			uint32_t counter_low[16];
+			uint32_t counter_high[16];
+			for(size_t i = 0; i < 16; ++i) {
+				const uint64_t lane_counter = counter+(increment_counter ? i : 0);
+				counter_low[i] = (uint32_t) lane_counter;
+				counter_high[i] = (uint32_t) (lane_counter >> 32);
+			}
+			__m512i h[8];
+			for(size_t i = 0; i < 8; ++i) {
+				h[i] = _mm512_set1_epi32((int) IV[i]);
+			}
+			for(size_t b = 0; b < blocks; ++b) {
+				const uint8_t block_flags = flags|((b == 0) ? flags_start : 0)|((b+1 == blocks) ? flags_end : 0);
+				__m512i m[16];
+				for(size_t i = 0; i < 16; ++i) {
+					m[i] = _mm512_loadu_si512((const void*) (inputs[i]+b*Blake3::BlockLen));
+				}
+				Transpose16x16Avx512(m);
+				__m512i v[16] = {
+					h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+					_mm512_set1_epi32((int) IV[0]), _mm512_set1_epi32((int) IV[1]), _mm512_set1_epi32((int) IV[2]), _mm512_set1_epi32((int) IV[3]),
+					_mm512_loadu_si512((const void*) counter_low), _mm512_loadu_si512((const void*) counter_high),
+					_mm512_set1_epi32((int) Blake3::BlockLen), _mm512_set1_epi32((int) block_flags)
+				};
+				RoundsAvx512(v, m);
+				for(size_t i = 0; i < 8; ++i) {
+					h[i] = _mm512_xor_si512(v[i], v[i+8]);
+				}
+			}
+			//Only eight words per lane, not worth a transpose.
+			uint32_t words[8][16];
+			for(size_t i = 0; i < 8; ++i) {
+				_mm512_storeu_si512((void*) words[i], h[i]);
+			}
+			for(size_t lane = 0; lane < 16; ++lane) {
+				for(size_t i = 0; i < 8; ++i) {
+					Store32(out+32*lane+4*i, words[i][lane]);
+				}
+			}
+		}
+
+		static void HashManyAvx512(const uint8_t* const* inputs, size_t num_inputs, const size_t blocks, uint64_t counter, const bool increment_counter, const uint8_t flags, const uint8_t flags_start, const uint8_t flags_end, uint8_t* out) {
+			while(num_inputs >= 16) {
+				Hash16Avx512(inputs, blocks, counter, increment_counter, flags, flags_start, flags_end, out);
+				if(increment_counter) {
+					counter += 16;
+				}
+				inputs += 16;
+				num_inputs -= 16;
+				out += 16*32;
+			}
+			HashManyAvx2(inputs, num_inputs, blocks, counter, increment_counter, flags, flags_start, flags_end, out);
+		}
+#pragma GCC diagnostic pop
+#endif
+
+		static hash_many_t SelectHashMany() {
+#ifdef KSYNC_BLAKE3_X86
+			__builtin_cpu_init();
+			if(__builtin_cpu_supports("avx512f")) {
+				return &HashManyAvx512;
+			}
+			if(__builtin_cpu_supports("avx2")) {
+				return &HashManyAvx2;
+			}
+#endif
+			return &HashManyPortable;
+		}
+
+		static std::atomic<hash_many_t>& GetHashManySlot() {
+			static std::atomic<hash_many_t> hash_many(SelectHashMany());
+			return hash_many;
+		}
+
+		static inline hash_many_t GetHashMany() {
+			return GetHashManySlot().load(std::memory_order_relaxed);
+		}
+
+		std::string Blake3::GetImplementation() {
+			const hash_many_t hash_many = GetHashMany();
+#ifdef KSYNC_BLAKE3_X86
+			if(hash_many == &HashManyAvx512) {
+				return "avx512";
+			}
+			if(hash_many == &HashManyAvx2) {
+				return "avx2";
+			}
+#endif
+			return "portable";
+		}
+
+		int Blake3::SetImplementation(const std::string& name) {
+			if(name == "portable") {
+				GetHashManySlot().store(&HashManyPortable);
+				return 0;
+			}
+#ifdef KSYNC_BLAKE3_X86
+			__builtin_cpu_init();
+			if((name == "avx2")&&__builtin_cpu_supports("avx2")) {
+				GetHashManySlot().store(&HashManyAvx2);
+				return 0;
+			}
+			if((name == "avx512")&&__builtin_cpu_supports("avx512f")) {
+				GetHashManySlot().store(&HashManyAvx512);
+				return 0;
+			}
+#endif
+			return -1;
+		}
+
+		//Chaining value of num_chunks whole chunks starting at counter. num_chunks is a
+		//power of two, so this is a complete subtree and never the root.
+		static void HashSubtree(const uint8_t* input, const size_t num_chunks, const uint64_t counter, uint8_t out[32]) {
+			if(num_chunks > Blake3::MaxBatchChunks) {
+				uint8_t children[64];
+				const size_t half = num_chunks/2;
+				HashSubtree(input, half, counter, children);
+				HashSubtree(input+half*Blake3::ChunkLen, half, counter+half, children+32);
+				uint32_t cv[8];
+				memcpy(cv, IV, sizeof(cv));
+				CompressInPlace(cv, children, Blake3::BlockLen, 0, Parent);
+				StoreCv(out, cv);
+				return;
+			}
+			const hash_many_t hash_many = GetHashMany();
+			const uint8_t* inputs[Blake3::MaxBatchChunks];
+			uint8_t cvs[Blake3::MaxBatchChunks*32];
+			for(size_t i = 0; i < num_chunks; ++i) {
+				inputs[i] = input+i*Blake3::ChunkLen;
+			}
+			hash_many(inputs, num_chunks, Blake3::ChunkLen/Blake3::BlockLen, counter, true, 0, ChunkStart, ChunkEnd, cvs);
+			//Reduce a level at a time, parent i overwrites child i which is never read again.
+			for(size_t count = num_chunks; count > 1; count /= 2) {
+				for(size_t i = 0; i < count/2; ++i) {
+					inputs[i] = cvs+64*i;
+				}
+				hash_many(inputs, count/2, 1, 0, false, Parent, 0, 0, cvs);
+			}
+			memcpy(out, cvs, 32);
+		}
+
+		Blake3::Blake3() : chunk_counter(0), buffered(0), blocks_compressed(0), cv_stack_len(0) {
+			memcpy(this->cv, IV, sizeof(this->cv));
+		}
+
+		void Blake3::ChunkUpdate(const uint8_t* input, const size_t size) {
+			size_t remaining = size;
+			while(remaining > 0) {
+				if(this->buffered == BlockLen) {
+					CompressInPlace(this->cv, this->buffer, BlockLen, this->chunk_counter, (this->blocks_compressed == 0) ? ChunkStart : 0);
+					++this->blocks_compressed;
+					this->buffered = 0;
+				}
+				const size_t take = std::min(BlockLen-this->buffered, remaining);
+				memcpy(this->buffer+this->buffered, input, take);
+				this->buffered += take;
+				input += take;
+				remaining -= take;
+			}
+		}
+
+		//Only once more input is known to follow, a full chunk might be the root.
+		void Blake3::FinishChunk() {
+			const uint8_t flags = ((this->blocks_compressed == 0) ? ChunkStart : 0)|ChunkEnd;
+			CompressInPlace(this->cv, this->buffer, (uint32_t) this->buffered, this->chunk_counter, flags);
+			uint8_t chunk_cv[32];
+			StoreCv(chunk_cv, this->cv);
+			this->PushCv(chunk_cv, this->chunk_counter);
+			++this->chunk_counter;
+			memcpy(this->cv, IV, sizeof(this->cv));
+			this->buffered = 0;
+			this->blocks_compressed = 0;
+		}
+
+		//Merging is lazy, subtrees are only joined once the next one arrives, so
+		//the last one on the stack can still become the root.
+		void Blake3::MergeCvStack(const uint64_t total_chunks) {
+			const size_t merged_len = (size_t) __builtin_popcountll(total_chunks);
+			while(this->cv_stack_len > merged_len) {
+				uint32_t parent[8];
+				memcpy(parent, IV, sizeof(parent));
+				CompressInPlace(parent, this->cv_stack[this->cv_stack_len-2], BlockLen, 0, Parent);
+				StoreCv(this->cv_stack[this->cv_stack_len-2], parent);
+				--this->cv_stack_len;
+			}
+		}
+
+		void Blake3::PushCv(const uint8_t new_cv[32], const uint64_t counter) {
+			this->MergeCvStack(counter);
+			memcpy(this->cv_stack[this->cv_stack_len], new_cv, 32);
+			++this->cv_stack_len;
+		}
+
+		void Blake3::Update(const void* data, size_t size) {
+			const uint8_t* input = (const uint8_t*) data;
+			while(size > 0) {
+				if(this->GetChunkLength() == ChunkLen) {
+					this->FinishChunk();
+				}
+				//Whole chunks go through hash_many, as long as at least a byte is left for the last chunk.
+				if((this->GetChunkLength() == 0)&&(size > ChunkLen)) {
+					size_t num_chunks = std::min((size-1)/ChunkLen, (size_t) MaxBatchChunks);
+					num_chunks = ((size_t) 1) << (63-__builtin_clzll((unsigned long long) num_chunks));
+					while((this->chunk_counter&(num_chunks-1)) != 0) {
+						num_chunks /= 2;
+					}
+					uint8_t subtree_cv[32];
+					HashSubtree(input, num_chunks, this->chunk_counter, subtree_cv);
+					this->PushCv(subtree_cv, this->chunk_counter);
+					this->chunk_counter += num_chunks;
+					input += num_chunks*ChunkLen;
+					size -= num_chunks*ChunkLen;
+					continue;
+				}
+				const size_t take = std::min(ChunkLen-this->GetChunkLength(), size);
+				this->ChunkUpdate(input, take);
+				input += take;
+				size -= take;
+			}
+		}
+
+		void Blake3::UpdateParallel(const void* data, size_t size, KSync::Utilities::thread_pool& pool) {
+			static const size_t SubtreeLen = ParallelSubtreeChunks*ChunkLen;
+			const uint8_t* input = (const uint8_t*) data;
+			//Get to a subtree boundary on this thread.
+			const uint64_t position = this->chunk_counter*ChunkLen+this->GetChunkLength();
+			const size_t prefix = (size_t) std::min((uint64_t) size, (SubtreeLen-position%SubtreeLen)%SubtreeLen);
+			this->Update(input, prefix);
+			input += prefix;
+			size -= prefix;
+
+			//Again leave at least a byte for the last chunk.
+			const size_t num_subtrees = (size > 0) ? (size-1)/SubtreeLen : 0;
+			if(num_subtrees < 2) {
+				this->Update(input, size);
+				return;
+			}
+			if(this->GetChunkLength() == ChunkLen) {
+				this->FinishChunk();
+			}
+			std::vector<std::array<uint8_t, 32>> cvs(num_subtrees);
+			const uint64_t counter = this->chunk_counter;
+			KSync::Utilities::parallel_for(pool, num_subtrees, [input, counter, &cvs](const size_t i) {
+				HashSubtree(input+i*SubtreeLen, ParallelSubtreeChunks, counter+i*ParallelSubtreeChunks, cvs[i].data());
+			});
+			for(size_t i = 0; i < num_subtrees; ++i) {
+				this->PushCv(cvs[i].data(), this->chunk_counter);
+				this->chunk_counter += ParallelSubtreeChunks;
+			}
+			this->Update(input+num_subtrees*SubtreeLen, size-num_subtrees*SubtreeLen);
+		}
+
+		void Blake3::Final(digest_t& digest) {
+			//A last chunk follows everything on the stack, so those merges aren't the root.
+			this->MergeCvStack(this->chunk_counter);
+			uint32_t block_cv[8];
+			memcpy(block_cv, this->cv, sizeof(block_cv));
+			uint8_t block[BlockLen];
+			memset(block, 0, sizeof(block));
+			memcpy(block, this->buffer, this->buffered);
+			uint32_t block_len = (uint32_t) this->buffered;
+			uint64_t counter = this->chunk_counter;
+			uint8_t flags = ((this->blocks_compressed == 0) ? ChunkStart : 0)|ChunkEnd;
+			//Fold the stack into parents from the top, the last one is the root.
+			for(size_t i = this->cv_stack_len; i > 0; --i) {
+				CompressInPlace(block_cv, block, block_len, counter, flags);
+				memcpy(block, this->cv_stack[i-1], 32);
+				StoreCv(block+32, block_cv);
+				memcpy(block_cv, IV, sizeof(block_cv));
+				block_len = BlockLen;
+				counter = 0;
+				flags = Parent;
+			}
+			CompressInPlace(block_cv, block, block_len, counter, flags|Root);
+			for(size_t i = 0; i < 8; ++i) {
+				Store32(digest.data()+4*i, block_cv[i]);
+			}
+		}
+
+		void Blake3::Digest(const void* data, const size_t size, digest_t& digest) {
+			Blake3 blake3;
+			blake3.Update(data, size);
+			blake3.Final(digest);
+		}
+	}
+}
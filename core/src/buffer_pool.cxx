@@ -0,0 +1,270 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <new>
+#include <mutex>
+#include <vector>
+
+#include "ksync/logging.h"
+#include "ksync/metrics.h"
+#include "ksync/buffer_pool.h"
+
+namespace KSync {
+	namespace BufferPool {
+		//Sits in front of every buffer so Free knows where it goes.
+		class BlockHeader {
+			public:
+				uint64_t capacity;
+				uint32_t size_class;
+				uint32_t magic;
+		};
+
+		static const size_t HeaderSize = 16;
+		static const size_t LargeClass = NumClasses;
+		static const uint32_t Magic = 0x4b53424c;
+		//Past this many free buffers in a class the shared list gives them back to the heap.
+		static const size_t MaxCentralBlocks = 4096;
+
+		static_assert(sizeof(BlockHeader) <= HeaderSize, "The block header must fit in front of the buffer");
+
+		static size_t ClassCapacity(const size_t size_class) {
+			return (((size_t) 1) << (size_class+MinClassBits))-HeaderSize;
+		}
+
+		static size_t SizeClass(const size_t size) {
+			size_t size_class = 0;
+			while((size_class < NumClasses)&&(ClassCapacity(size_class) < size)) {
+				++size_class;
+			}
+			return size_class;
+		}
+
+		class Stats {
+			public:
+				Stats() : allocations(0), frees(0), heap_allocations(0), heap_frees(0) {}
+				uint64_t allocations;
+				uint64_t frees;
+				uint64_t heap_allocations;
+				uint64_t heap_frees;
+		};
+
+		//Leaked on purpose so thread caches can flush into it during exit.
+		class Central {
+			public:
+				Central() :
+					allocations(KSync::Metrics::GetCounter("buffer_pool.allocations")),
+					frees(KSync::Metrics::GetCounter("buffer_pool.frees")),
+					heap_allocations(KSync::Metrics::GetCounter("buffer_pool.heap_allocations")),
+					heap_frees(KSync::Metrics::GetCounter("buffer_pool.heap_frees")) {
+				}
+
+				void Flush(Stats& stats) {
+					this->allocations.Add(stats.allocations);
+					this->frees.Add(stats.frees);
+					this->heap_allocations.Add(stats.heap_allocations);
+					this->heap_frees.Add(stats.heap_frees);
+					stats = Stats();
+				}
+
+				std::mutex mutex[NumClasses];
+				std::vector<char*> free_blocks[NumClasses];
+
+				KSync::Metrics::Counter& allocations;
+				KSync::Metrics::Counter& frees;
+				KSync::Metrics::Counter& heap_allocations;
+				KSync::Metrics::Counter& heap_frees;
+		};
+
+		static Central& GetCentral() {
+			static Central* central = new Central();
+			return *central;
+		}
+
+		static char* HeapAllocate(const size_t size_class, const size_t capacity, Stats& stats) {
+			BlockHeader* header = (BlockHeader*) ::operator new(HeaderSize+capacity);
+			header->capacity = capacity;
+			header->size_class = (uint32_t) size_class;
+			header->magic = Magic;
+			++stats.heap_allocations;
+			return ((char*) header)+HeaderSize;
+		}
+
+		static void HeapFree(char* block, Stats& stats) {
+			::operator delete(block-HeaderSize);
+			++stats.heap_frees;
+		}
+
+		//Move up to count blocks of a class out of the shared list. Returns how many moved.
+		static size_t TakeFromCentral(const size_t size_class, char** blocks, const size_t count) {
+			Central& central = GetCentral();
+			std::lock_guard<std::mutex> lk(central.mutex[size_class]);
+			std::vector<char*>& free_blocks = central.free_blocks[size_class];
+			size_t moved = 0;
+			while((moved < count)&&!free_blocks.empty()) {
+				blocks[moved++] = free_blocks.back();
+				free_blocks.pop_back();
+			}
+			return moved;
+		}
+
+		static void GiveToCentral(const size_t size_class, char** blocks, const size_t count, Stats& stats) {
+			Central& central = GetCentral();
+			std::lock_guard<std::mutex> lk(central.mutex[size_class]);
+			std::vector<char*>& free_blocks = central.free_blocks[size_class];
+			for(size_t i = 0; i < count; ++i) {
+				if(free_blocks.size() < MaxCentralBlocks) {
+					free_blocks.push_back(blocks[i]);
+				} else {
+					HeapFree(blocks[i], stats);
+				}
+			}
+		}
+
+		class ThreadCache {
+			public:
+				ThreadCache() : num_ops(0) {
+					for(size_t i = 0; i < NumClasses; ++i) {
+						this->count[i] = 0;
+					}
+				}
+
+				char* Allocate(const size_t size_class) {
+					++this->stats.allocations;
+					if(this->count[size_class] == 0) {
+						this->count[size_class] = TakeFromCentral(size_class, this->blocks[size_class], TransferBatch);
+					}
+					char* block;
+					if(this->count[size_class] == 0) {
+						block = HeapAllocate(size_class, ClassCapacity(size_class), this->stats);
+					} else {
+						block = this->blocks[size_class][--this->count[size_class]];
+					}
+					this->Tick();
+					return block;
+				}
+
+				void Free(char* block, const size_t size_class) {
+					++this->stats.frees;
+					if(this->count[size_class] == ThreadCacheSize) {
+						this->count[size_class] -= TransferBatch;
+						GiveToCentral(size_class, this->blocks[size_class]+this->count[size_class], TransferBatch, this->stats);
+					}
+					this->blocks[size_class][this->count[size_class]++] = block;
+					this->Tick();
+				}
+
+				void Release() {
+					for(size_t i = 0; i < NumClasses; ++i) {
+						GiveToCentral(i, this->blocks[i], this->count[i], this->stats);
+						this->count[i] = 0;
+					}
+					GetCentral().Flush(this->stats);
+				}
+
+				Stats stats;
+			private:
+				void Tick() {
+					if(++this->num_ops == FlushInterval) {
+						this->num_ops = 0;
+						GetCentral().Flush(this->stats);
+					}
+				}
+
+				char* blocks[NumClasses][ThreadCacheSize];
+				size_t count[NumClasses];
+				size_t num_ops;
+		};
+
+		//Hands the cache back when the thread exits. Buffers freed after that,
+		//by other thread_local destructors, skip the cache.
+		class ThreadCacheOwner {
+			public:
+				~ThreadCacheOwner();
+				ThreadCache cache;
+		};
+
+		static thread_local ThreadCache* thread_cache = 0;
+		static thread_local bool thread_cache_released = false;
+		static thread_local ThreadCacheOwner thread_cache_owner;
+
+		ThreadCacheOwner::~ThreadCacheOwner() {
+			thread_cache_released = true;
+			thread_cache = 0;
+			this->cache.Release();
+		}
+
+		static ThreadCache* GetThreadCache() {
+			if((thread_cache == 0)&&!thread_cache_released) {
+				thread_cache = &thread_cache_owner.cache;
+			}
+			return thread_cache;
+		}
+
+		static BlockHeader* GetHeader(const char* buffer) {
+			return (BlockHeader*) (buffer-HeaderSize);
+		}
+
+		char* Allocate(const size_t size) {
+			const size_t size_class = SizeClass(size);
+			ThreadCache* cache = GetThreadCache();
+			if((size_class != LargeClass)&&(cache != 0)) {
+				return cache->Allocate(size_class);
+			}
+			Stats stats;
+			++stats.allocations;
+			char* block;
+			if(size_class == LargeClass) {
+				block = HeapAllocate(LargeClass, size, stats);
+			} else {
+				block = HeapAllocate(size_class, ClassCapacity(size_class), stats);
+			}
+			GetCentral().Flush(stats);
+			return block;
+		}
+
+		void Free(char* buffer) {
+			if(buffer == 0) {
+				return;
+			}
+			const BlockHeader* header = GetHeader(buffer);
+			if(header->magic != Magic) {
+				//Leaking it beats corrupting the free lists.
+				LOGF_RATE_LIMITED(SEVERE, 10, 1000, "Asked to free a buffer which didn't come from the pool!");
+				return;
+			}
+			const size_t size_class = header->size_class;
+			ThreadCache* cache = GetThreadCache();
+			if((size_class != LargeClass)&&(cache != 0)) {
+				cache->Free(buffer, size_class);
+				return;
+			}
+			Stats stats;
+			++stats.frees;
+			if(size_class == LargeClass) {
+				HeapFree(buffer, stats);
+			} else {
+				GiveToCentral(size_class, &buffer, 1, stats);
+			}
+			GetCentral().Flush(stats);
+		}
+
+		size_t Capacity(const char* buffer) {
+			return (size_t) GetHeader(buffer)->capacity;
+		}
+	}
+}
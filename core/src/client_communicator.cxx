@@ -1,4 +1,11 @@
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
 #include "ksync/logging.h"
+#include "ksync/tracing.h"
 #include "ksync/client_communicator.h"
 
 namespace KSync {
@@ -7,9 +14,34 @@ namespace KSync {
 			this->SetMessage("Socket problem during construction of client communicator");
 		};
 
-		ClientCommunicator::ClientCommunicator(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const KSync::Utilities::client_id_t client_id, const bool bind) {
+		ClientCommunicator::QueueFullException::QueueFullException() {
+			this->SetMessage("The send queue stayed full");
+		};
+
+		const size_t ClientCommunicator::InitialWindow;
+
+		ClientCommunicator::ClientCommunicator(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const KSync::Utilities::client_id_t client_id, const bool bind) :
+			push_queue_depth(KSync::Metrics::GetGauge("client_communicator.push_queue")),
+			pull_queue_depth(KSync::Metrics::GetGauge("client_communicator.pull_queue")),
+			pending_replies_depth(KSync::Metrics::GetGauge("client_communicator.pending_replies")),
+			send_waits(KSync::Metrics::GetCounter("client_communicator.send_waits")),
+			credit_stalls(KSync::Metrics::GetCounter("client_communicator.credit_stalls")) {
 			this->id = client_id;
+			this->bound = bind;
 			this->finished.store(false);
+			this->heard_from.store(false);
+			this->arrived.store(0);
+			this->getter_sleeping.store(false);
+			this->max_batch.store(DefaultMaxBatch);
+			this->queued.store(0);
+			this->send_high_water.store(DefaultSendHighWater);
+			this->room_waiters.store(0);
+			this->send_credits = InitialWindow;
+			this->granted = InitialWindow;
+			this->consumed.store(0);
+			this->recv_window.store(InitialWindow);
+			this->push_queue.reset(new Utilities::epoch_lock_free_queue<CommObject>());
+			this->pull_queue.reset(new Utilities::epoch_lock_free_queue<CommObject>());
 			//Get client socket URL
 			if(KSync::Utilities::get_client_socket_url(this->socket_url, this->id) < 0) {
 				throw SocketException();
@@ -43,80 +75,351 @@ namespace KSync {
 			}
 		}
 
-		Utilities::FutureWrapper<std::shared_ptr<CommObject>> ClientCommunicator::send_get_response(std::shared_ptr<CommObject>& obj) {
+		void ClientCommunicator::StartTrace(std::shared_ptr<CommObject>& obj) {
+			if(KSync::Tracing::Enabled()&&(obj->GetTraceId() == 0)) {
+				obj->SetTraceId(KSync::Tracing::GenTraceId());
+				KSync::Tracing::RecordBegin("request", obj->GetTraceId());
+			}
+		}
+
+		Utilities::FutureWrapper<std::shared_ptr<CommObject>> ClientCommunicator::send_get_response(std::shared_ptr<CommObject>& obj, const int timeout) {
+			this->StartTrace(obj);
 			CommObject::message_id_t message_id = obj->GetMessageId();
 			Utilities::PromiseWrapper<std::shared_ptr<CommObject>> promise;
 			Utilities::FutureWrapper<std::shared_ptr<CommObject>> future_comm_obj = promise.get_future();
-			promise_map[message_id] = std::move(promise);
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			ReplyHandler handler(std::move(promise));
+			if(this->Reserve(timeout) < 0) {
+				handler.set_exception(std::make_exception_ptr(QueueFullException()));
+				return future_comm_obj;
+			}
+			//Register before sending so the reply can't beat us to the table.
+			this->pending_replies.insert(message_id, std::move(handler), deadline);
+			this->pending_replies_depth.Add(1);
+			this->push_queue_depth.Add(1);
+			this->push_queue->push(obj);
 			return future_comm_obj;
 		}
 
-		void ClientCommunicator::send(std::shared_ptr<CommObject>& obj) {
+		void ClientCommunicator::send_with_callback(std::shared_ptr<CommObject>& obj, ReplyCallback callback, const int timeout) {
+			this->StartTrace(obj);
+			CommObject::message_id_t message_id = obj->GetMessageId();
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			ReplyHandler handler(callback);
+			if(this->Reserve(timeout) < 0) {
+				handler.set_exception(std::make_exception_ptr(QueueFullException()));
+				return;
+			}
+			this->pending_replies.insert(message_id, std::move(handler), deadline);
+			this->pending_replies_depth.Add(1);
+			this->push_queue_depth.Add(1);
+			this->push_queue->push(obj);
+		}
+
+		void ClientCommunicator::ReplyHandler::set_value(const std::shared_ptr<CommObject>& value) {
+			if(this->callback) {
+				this->callback(value, std::exception_ptr());
+			} else {
+				this->promise.set_value(value);
+			}
+		}
+
+		void ClientCommunicator::ReplyHandler::set_exception(std::exception_ptr p) {
+			if(this->callback) {
+				this->callback(std::shared_ptr<CommObject>(), p);
+			} else {
+				this->promise.set_exception(p);
+			}
+		}
+
+		int ClientCommunicator::Reserve(const int timeout) {
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(std::max(timeout, 0));
+			size_t current = this->queued.load();
+			bool waited = false;
+			while(true) {
+				if(current < this->send_high_water.load()) {
+					if(this->queued.compare_exchange_weak(current, current+1)) {
+						return 0;
+					}
+					continue;
+				}
+				if((timeout == 0)||this->finished.load()) {
+					return -1;
+				}
+				if(!waited) {
+					this->send_waits.Add();
+					waited = true;
+				}
+				//The watch thread only notifies when it sees a waiter, so count ourselves before checking again.
+				std::unique_lock<std::mutex> lk(this->room_mutex);
+				this->room_waiters.fetch_add(1);
+				auto has_room = [this]() {
+					return (this->queued.load() < this->send_high_water.load())||this->finished.load();
+				};
+				bool ready = true;
+				if(timeout == WaitForever) {
+					this->room_cond.wait(lk, has_room);
+				} else {
+					ready = this->room_cond.wait_until(lk, deadline, has_room);
+				}
+				this->room_waiters.fetch_sub(1);
+				if(!ready||this->finished.load()) {
+					return -1;
+				}
+				current = this->queued.load();
+			}
+		}
+
+		int ClientCommunicator::send(std::shared_ptr<CommObject>& obj, const int timeout) {
+			if(this->Reserve(timeout) < 0) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "The send queue of (%lu) is full!", this->id);
+				return -1;
+			}
+			this->push_queue_depth.Add(1);
 			this->push_queue->push(obj);
+			return 0;
+		}
+
+		void ClientCommunicator::Consumed() {
+			const uint64_t now_consumed = this->consumed.fetch_add(1)+1;
+			//Wake the watch thread as soon as there's a batch of credit to hand back.
+			const uint64_t step = std::max<uint64_t>(this->recv_window.load()/4, 1);
+			if((now_consumed % step) == 0) {
+				this->wakeup.Signal();
+			}
 		}
 
 		std::shared_ptr<CommObject> ClientCommunicator::get() {
-			return this->pull_queue->pop();
+			std::shared_ptr<CommObject> obj = this->pull_queue->pop();
+			if(obj) {
+				this->arrived.fetch_sub(1);
+				this->pull_queue_depth.Add(-1);
+				this->Consumed();
+			}
+			return obj;
+		}
+
+		std::shared_ptr<CommObject> ClientCommunicator::get(const int timeout) {
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(std::max(0, timeout));
+			while(true) {
+				std::shared_ptr<CommObject> obj = this->get();
+				if(obj) {
+					return obj;
+				}
+				int left = -1;
+				if(timeout != WaitForever) {
+					left = (int) std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count());
+					if(left == 0) {
+						return obj;
+					}
+				}
+				if(this->PrepareWait()) {
+					struct pollfd arrival_fd;
+					arrival_fd.fd = this->GetArrivalFd();
+					arrival_fd.events = POLLIN;
+					arrival_fd.revents = 0;
+					const int status = poll(&arrival_fd, 1, left);
+					this->FinishWait();
+					if((status < 0)&&(errno != EINTR)) {
+						LOGF(SEVERE, "Couldn't wait for a message! (%s)", strerror(errno));
+						return obj;
+					}
+				}
+			}
+		}
+
+		bool ClientCommunicator::PrepareWait() {
+			//Same handshake as spsc_channel, the watch thread only signals a sleeper.
+			this->getter_sleeping.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(this->arrived.load() != 0) {
+				this->getter_sleeping.store(false);
+				return false;
+			}
+			return true;
+		}
+
+		void ClientCommunicator::FinishWait() {
+			//The watch thread may take the flag and signal after we woke, so drain
+			//on every wake. A signal landing after this costs one spurious wake.
+			this->getter_sleeping.store(false);
+			this->arrival.Clear();
+		}
+
+		void ClientCommunicator::SetSendHighWater(const size_t high_water) {
+			this->send_high_water.store(std::max<size_t>(high_water, 1));
+			std::lock_guard<std::mutex> lk(this->room_mutex);
+			this->room_cond.notify_all();
+		}
+
+		void ClientCommunicator::SetRecvWindow(const size_t window) {
+			this->recv_window.store(std::max<size_t>(window, 1));
+			this->wakeup.Signal();
 		}
 
 		void ClientCommunicator::finish() {
 			this->finished.store(true);
+			this->wakeup.Signal();
+			std::lock_guard<std::mutex> lk(this->room_mutex);
+			this->room_cond.notify_all();
+		}
+
+		void ClientCommunicator::GrantCredit() {
+			//Hand back credit in batches rather than a message per message consumed.
+			const uint64_t window = this->recv_window.load();
+			const uint64_t outstanding = this->granted-this->consumed.load();
+			if((outstanding >= window)||(window-outstanding < std::max<uint64_t>(window/4, 1))) {
+				return;
+			}
+			const uint64_t credits = window-outstanding;
+			FlowCredit credit(credits);
+			std::shared_ptr<CommObject> credit_obj = credit.GetCommObject();
+			const int status = this->socket->Send(credit_obj);
+			if(status == KSync::Comm::CommSystemSocket::Success) {
+				this->granted += credits;
+			} else if (status == KSync::Comm::CommSystemSocket::Other) {
+				LOGF_RATE_LIMITED(SEVERE, 10, 1000, "Couldn't send flow credit!");
+			}
+		}
+
+		void ClientCommunicator::SendQueued() {
+			//Drain a batch of messages from the push queue so bursts of small
+			//requests aren't limited to one per receive timeout.
+			const size_t batch = this->max_batch.load();
+			size_t num_done = 0;
+			for(size_t num_sent = 0; num_sent < batch; ++num_sent) {
+				if(!this->unsent) {
+					if(this->send_credits == 0) {
+						if(this->queued.load() != 0) {
+							this->credit_stalls.Add();
+						}
+						break;
+					}
+					this->unsent = this->push_queue->pop();
+					if(!this->unsent) {
+						break;
+					}
+					this->push_queue_depth.Add(-1);
+				}
+				int status;
+				{
+					KSync::Tracing::Span span("socket_send", this->unsent->GetTraceId());
+					status = this->socket->Send(this->unsent);
+				}
+				if (status == KSync::Comm::CommSystemSocket::Timeout) {
+					//Keep it for the next pass rather than losing it.
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Timeout sending message, will retry!");
+					break;
+				}
+				if(status == KSync::Comm::CommSystemSocket::Other) {
+					LOGF_RATE_LIMITED(SEVERE, 10, 1000, "Couldn't send message! message lost!");
+					//No reply will ever come, so release whoever is waiting on one now
+					//rather than at its deadline.
+					if(this->pending_replies.fail(this->unsent->GetMessageId(), std::make_exception_ptr(SocketException()))) {
+						this->pending_replies_depth.Add(-1);
+					}
+				} else {
+					--this->send_credits;
+				}
+				this->unsent.reset();
+				++num_done;
+			}
+			if(num_done != 0) {
+				this->queued.fetch_sub(num_done);
+				if(this->room_waiters.load() != 0) {
+					std::lock_guard<std::mutex> lk(this->room_mutex);
+					this->room_cond.notify_all();
+				}
+			}
 		}
 
 		void ClientCommunicator::watch_function() {
 			std::shared_ptr<KSync::Comm::CommObject> recv_obj;
 			int status;
+			std::chrono::steady_clock::time_point next_expire = std::chrono::steady_clock::now();
 			while (!this->finished.load()) {
-				//Check socket for new messages
+				//Check socket for new messages, finish() wakes us early.
 				recv_obj.reset();
-				status = this->socket->Recv(recv_obj);
+				status = this->socket->Poll(PollTimeout, this->wakeup.GetFd());
+				if(status == KSync::Comm::CommSystemSocket::Woken) {
+					this->wakeup.Clear();
+				} else if (status == KSync::Comm::CommSystemSocket::Success) {
+					status = this->socket->Recv(recv_obj);
+				}
 				if(status == KSync::Comm::CommSystemSocket::Other) {
 					LOGF(SEVERE, "There was a problem checking for new messages!");
 				} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
 				} else if (status == KSync::Comm::CommSystemSocket::EmptyMessage) {
+				} else if ((status == KSync::Comm::CommSystemSocket::Success)&&(recv_obj->GetType() == FlowCredit::Type)) {
+					this->heard_from.store(true, std::memory_order_relaxed);
+					std::shared_ptr<FlowCredit> credit;
+					CommCreator(credit, recv_obj);
+					this->send_credits += credit->GetCredits();
 				} else if (status == KSync::Comm::CommSystemSocket::Success) {
 					//there's a new message
-					//Check whether there's a promise waiting
-					bool stored = false;
+					this->heard_from.store(true, std::memory_order_relaxed);
+					const CommObject::trace_id_t trace_id = recv_obj->GetTraceId();
+					if(this->bound) {
+						KSync::Tracing::RecordInstant("gateway_receive", trace_id);
+					}
+					//Replies go to the promise waiting for them. One which expired, or was
+					//never asked for, is dropped here rather than holding a unit of the
+					//receive window in the pull queue until someone calls get().
 					if(recv_obj->GetReplyId() > 0) {
-						try {
-							auto& obj_i = promise_map.at(recv_obj->GetReplyId());
-							obj_i.set_value(recv_obj);
-							stored = true;
-						} catch (std::out_of_range) {
-							LOGF(SEVERE, "Couldn't find promise for reply_id!");
+						KSync::Tracing::Span span("client_receive", trace_id);
+						if(this->pending_replies.fulfill(recv_obj->GetReplyId(), recv_obj)) {
+							this->pending_replies_depth.Add(-1);
+							KSync::Tracing::RecordEnd("request", trace_id);
+						} else {
+							LOGF_RATE_LIMITED(WARNING, 10, 1000, "Dropping reply_id (%lu), nothing is waiting for it!", recv_obj->GetReplyId());
 						}
-					}
-					if (!stored) {
-						//Store unmatched promises in the pull queue.
+						this->Consumed();
+					} else {
+						this->pull_queue_depth.Add(1);
 						this->pull_queue->push(recv_obj);
+						this->arrived.fetch_add(1);
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+						if(this->getter_sleeping.load(std::memory_order_relaxed)&&this->getter_sleeping.exchange(false)) {
+							this->arrival.Signal();
+						}
 					}
 				}
 
-				//Check promise map for finished promises
-				for(auto promise_map_i = promise_map.begin(); promise_map_i != promise_map.end();) {
-					if(promise_map_i->second.grabbed()) {
-						promise_map_i = promise_map.erase(promise_map_i);
-					} else {
-						++promise_map_i;
+				//Fail requests whose replies never came
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if(now >= next_expire) {
+					size_t num_expired = this->pending_replies.expire(now);
+					if(num_expired != 0) {
+						this->pending_replies_depth.Add(-(int64_t) num_expired);
+						LOGF(WARNING, "%lu requests timed out waiting for a reply!", num_expired);
 					}
+					next_expire = now+std::chrono::milliseconds(100);
 				}
 
-				//Get message from the push queue
-				std::shared_ptr<CommObject> send_obj = this->push_queue->pop();
-				if(send_obj) {
-					//We have a non-null object
-					status = this->socket->Send(send_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(SEVERE, "Couldn't send message! message lost!");
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(SEVERE, "Timeout sending message! message lost!");
-					}
+				this->GrantCredit();
+				this->SendQueued();
+			}
+
+			//Replies may still be queued, send them without waiting forever on a peer which is gone,
+			//or on credit it may never grant.
+			this->socket->SetSendTimeout(FlushTimeout);
+			size_t num_lost = 0;
+			if(this->unsent&&(this->socket->Send(this->unsent) != KSync::Comm::CommSystemSocket::Success)) {
+				++num_lost;
+			}
+			this->unsent.reset();
+			while(std::shared_ptr<CommObject> send_obj = this->push_queue->pop()) {
+				this->push_queue_depth.Add(-1);
+				if((num_lost != 0)||(this->socket->Send(send_obj) != KSync::Comm::CommSystemSocket::Success)) {
+					++num_lost;
 				}
 			}
+			if(num_lost != 0) {
+				LOGF(WARNING, "%lu queued messages couldn't be sent before closing!", num_lost);
+			}
 		}
 
-		void ClientCommunicatorList::push_front(ClientCommunicator const& value) {
+		void ClientCommunicatorList::push_front(const std::shared_ptr<ClientCommunicator>& value) {
 			list.push_front(value);
 		}
 
@@ -20,9 +20,9 @@ namespace KSync {
 			}
 			return 0;
 		}
-		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, const bool nanomsg) {
+		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const bool nanomsg, const CommTuning& tuning) {
 			if (!nanomsg) {
-				if (KSync::Comm::GetZeromqCommSystem(comm_system) < 0) {
+				if (KSync::Comm::GetZeromqCommSystem(comm_system, tuning.io_threads) < 0) {
 					LOGF(SEVERE, "There was a problem initializing the ZeroMQ communication system!");
 					return -1;
 				}
@@ -32,7 +32,35 @@ namespace KSync {
 					return -1;
 				}
 			}
+			KSync::Comm::SocketOptions options;
+			options.send_hwm = (tuning.send_hwm < 0) ? KSync::Comm::SocketOptions::Unset : tuning.send_hwm;
+			options.recv_hwm = (tuning.recv_hwm < 0) ? KSync::Comm::SocketOptions::Unset : tuning.recv_hwm;
+			options.send_buffer = (tuning.send_buffer < 0) ? KSync::Comm::SocketOptions::Unset : tuning.send_buffer;
+			options.recv_buffer = (tuning.recv_buffer < 0) ? KSync::Comm::SocketOptions::Unset : tuning.recv_buffer;
+			options.affinity = (tuning.affinity < 0) ? KSync::Comm::SocketOptions::Unset : tuning.affinity;
+			comm_system->SetRoleDefaults(KSync::Comm::CommSystemInterface::DataRole, options);
 			return 0;
 		}
+
+		const std::vector<std::string>& GetCommSystemNames() {
+			static const std::vector<std::string> names = {"zeromq", "nanomsg", "loopback"};
+			return names;
+		}
+
+		int GetCommSystem(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string& backend) {
+			if(backend == "zeromq") {
+				return GetCommSystem(comm_system, false);
+			} else if (backend == "nanomsg") {
+				return GetCommSystem(comm_system, true);
+			} else if (backend == "loopback") {
+				if (KSync::Comm::GetLoopbackCommSystem(comm_system) < 0) {
+					LOGF(SEVERE, "There was a problem initializing the Loopback communication system!");
+					return -1;
+				}
+				return 0;
+			}
+			LOGF(SEVERE, "Unknown comm system (%s)!", backend.c_str());
+			return -2;
+		}
 	}
 }
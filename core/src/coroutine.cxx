@@ -0,0 +1,424 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <exception>
+
+#include "ksync/logging.h"
+#include "ksync/coroutine.h"
+
+namespace KSync {
+	namespace Coroutine {
+		class Task {
+			public:
+				Task() : stack(nullptr), stack_size(0), done(false), fd(-1), revents(0), timer_set(false) {}
+
+				ucontext_t context;
+				std::function<void()> fn;
+				void* stack;
+				size_t stack_size;
+				bool done;
+				//What the task is waiting on, if anything.
+				int fd;
+				uint32_t revents;
+				bool timer_set;
+				std::multimap<std::chrono::steady_clock::time_point, Task*>::iterator timer;
+		};
+
+		static thread_local Scheduler* running_scheduler = nullptr;
+
+		//Written at the bottom of every stack, just above the guard page, for frames big enough to skip the guard.
+		static const uint64_t StackCanary = 0x6b73796e63636f72ULL;
+
+		static size_t PageSize() {
+			static const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+			return page_size;
+		}
+
+		//Stacks are mapped with a guard page below them.
+		static void UnmapStack(void* stack, const size_t size) {
+			munmap(((char*) stack)-PageSize(), size+PageSize());
+		}
+
+		Scheduler::SchedulerException::SchedulerException() {
+			this->SetMessage("Couldn't create the scheduler's epoll instance!");
+		}
+
+		const size_t Scheduler::DefaultStackSize;
+
+		Scheduler::Scheduler() : current(nullptr), num_spare_stacks(0) {
+			this->stopped.store(false);
+			this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if(this->epoll_fd < 0) {
+				throw SchedulerException();
+			}
+			//Remote wakeups are the only event without a task.
+			struct epoll_event event;
+			event.events = EPOLLIN;
+			event.data.ptr = nullptr;
+			if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->remote_wakeup.GetFd(), &event) < 0) {
+				close(this->epoll_fd);
+				throw SchedulerException();
+			}
+		}
+
+		Scheduler::~Scheduler() {
+			if(!this->tasks.empty()) {
+				LOGF(WARNING, "Destroying a scheduler with (%lu) coroutines still waiting!", this->tasks.size());
+			}
+			for(auto it = this->tasks.begin(); it != this->tasks.end(); ++it) {
+				UnmapStack((*it)->stack, (*it)->stack_size);
+				delete *it;
+			}
+			for(auto it = this->spare_stacks.begin(); it != this->spare_stacks.end(); ++it) {
+				for(size_t i = 0; i < it->second.size(); ++i) {
+					UnmapStack(it->second[i], it->first);
+				}
+			}
+			close(this->epoll_fd);
+		}
+
+		void* Scheduler::GetStack(const size_t size) {
+			auto it = this->spare_stacks.find(size);
+			if((it != this->spare_stacks.end())&&!it->second.empty()) {
+				void* stack = it->second.back();
+				it->second.pop_back();
+				--this->num_spare_stacks;
+				return stack;
+			}
+			void* mapping = mmap(nullptr, size+PageSize(), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+			if(mapping == MAP_FAILED) {
+				LOGF(SEVERE, "Couldn't map a coroutine stack! (%s)", strerror(errno));
+				return nullptr;
+			}
+			//Stacks grow down, so running off the end hits the guard and faults straight away.
+			if(mprotect(mapping, PageSize(), PROT_NONE) < 0) {
+				LOGF(SEVERE, "Couldn't protect the guard page of a coroutine stack! (%s)", strerror(errno));
+				munmap(mapping, size+PageSize());
+				return nullptr;
+			}
+			//Children of a fork don't need the stacks, and copying thousands of them makes fork slow.
+			if(madvise(mapping, size+PageSize(), MADV_DONTFORK) < 0) {
+				LOGF(SEVERE, "Couldn't keep a coroutine stack out of forks! (%s)", strerror(errno));
+				munmap(mapping, size+PageSize());
+				return nullptr;
+			}
+			return ((char*) mapping)+PageSize();
+		}
+
+		void Scheduler::ReleaseStack(void* stack, const size_t size) {
+			if(this->num_spare_stacks < MaxSpareStacks) {
+				this->spare_stacks[size].push_back(stack);
+				++this->num_spare_stacks;
+			} else {
+				UnmapStack(stack, size);
+			}
+		}
+
+		int Scheduler::Spawn(std::function<void()> fn, const size_t stack_size) {
+			const size_t mapped_size = ((stack_size+PageSize()-1)/PageSize())*PageSize();
+			std::unique_ptr<Task> task(new Task());
+			if(getcontext(&task->context) < 0) {
+				LOGF(SEVERE, "Couldn't get a context for a coroutine! (%s)", strerror(errno));
+				return -1;
+			}
+			task->stack = this->GetStack(mapped_size);
+			if(task->stack == nullptr) {
+				return -2;
+			}
+			task->stack_size = mapped_size;
+			*((uint64_t*) task->stack) = StackCanary;
+			task->context.uc_stack.ss_sp = task->stack;
+			task->context.uc_stack.ss_size = mapped_size;
+			task->context.uc_link = &this->main_context;
+			makecontext(&task->context, &Scheduler::Entry, 0);
+			task->fn = std::move(fn);
+			this->tasks.insert(task.get());
+			this->ready.push_back(task.release());
+			return 0;
+		}
+
+		void Scheduler::Entry() {
+			Task* task = running_scheduler->current;
+			try {
+				task->fn();
+			} catch (std::exception& e) {
+				LOGF(SEVERE, "A coroutine threw an exception! (%s)", e.what());
+			} catch (...) {
+				LOGF(SEVERE, "A coroutine threw an exception!");
+			}
+			//Free what fn captured now, while its stack is still around.
+			task->fn = nullptr;
+			task->done = true;
+			//Returning switches to uc_link, back into Resume.
+		}
+
+		void Scheduler::Resume(Task* task) {
+			this->current = task;
+			swapcontext(&this->main_context, &task->context);
+			this->current = nullptr;
+			if(*((uint64_t*) task->stack) != StackCanary) {
+				LOGF(FATAL, "A coroutine overflowed its (%lu) byte stack!", task->stack_size);
+			}
+			if(task->done) {
+				this->tasks.erase(task);
+				this->ReleaseStack(task->stack, task->stack_size);
+				delete task;
+			}
+		}
+
+		void Scheduler::Suspend() {
+			swapcontext(&this->current->context, &this->main_context);
+		}
+
+		void Scheduler::Run() {
+			Scheduler* previous = running_scheduler;
+			running_scheduler = this;
+			while(!this->stopped.load()&&!this->tasks.empty()) {
+				//Coroutines made ready during this pass run on the next one.
+				std::deque<Task*> running;
+				running.swap(this->ready);
+				while(!running.empty()&&!this->stopped.load()) {
+					Task* task = running.front();
+					running.pop_front();
+					this->Resume(task);
+				}
+				this->ready.insert(this->ready.begin(), running.begin(), running.end());
+				if(!this->tasks.empty()) {
+					this->Poll(this->ready.empty() ? this->NextTimeout() : 0);
+				}
+			}
+			//A Stop only ends this Run.
+			this->stopped.store(false);
+			running_scheduler = previous;
+		}
+
+		void Scheduler::Stop() {
+			this->stopped.store(true);
+			this->remote_wakeup.Signal();
+		}
+
+		Scheduler* Scheduler::Current() {
+			if((running_scheduler == nullptr)||(running_scheduler->current == nullptr)) {
+				return nullptr;
+			}
+			return running_scheduler;
+		}
+
+		int Scheduler::NextTimeout() {
+			if(this->timers.empty()) {
+				return -1;
+			}
+			const std::chrono::steady_clock::duration left = this->timers.begin()->first-std::chrono::steady_clock::now();
+			if(left <= std::chrono::steady_clock::duration::zero()) {
+				return 0;
+			}
+			//Round up, waking early would only mean another pass.
+			return (int) std::chrono::duration_cast<std::chrono::milliseconds>(left+std::chrono::milliseconds(1)-std::chrono::nanoseconds(1)).count();
+		}
+
+		void Scheduler::Poll(const int timeout) {
+			struct epoll_event events[MaxEvents];
+			const int num_events = epoll_wait(this->epoll_fd, events, MaxEvents, timeout);
+			if((num_events < 0)&&(errno != EINTR)) {
+				LOGF(SEVERE, "There was a problem waiting for events! (%s)", strerror(errno));
+			}
+			for(int i = 0; i < num_events; ++i) {
+				Task* task = (Task*) events[i].data.ptr;
+				if(task == nullptr) {
+					this->remote_wakeup.Clear();
+					std::lock_guard<std::mutex> lk(this->remote_mutex);
+					this->ready.insert(this->ready.end(), this->remote_ready.begin(), this->remote_ready.end());
+					this->remote_ready.clear();
+				} else {
+					task->revents = events[i].events;
+					this->MakeReady(task);
+				}
+			}
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			while(!this->timers.empty()&&(this->timers.begin()->first <= now)) {
+				this->MakeReady(this->timers.begin()->second);
+			}
+		}
+
+		void Scheduler::AddTimer(Task* task, const int timeout) {
+			task->timer = this->timers.insert(std::make_pair(std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout), task));
+			task->timer_set = true;
+		}
+
+		void Scheduler::MakeReady(Task* task) {
+			if(task->fd >= 0) {
+				if(epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, task->fd, nullptr) < 0) {
+					LOGF_RATE_LIMITED(WARNING, 10, 1000, "Couldn't stop watching fd (%i)! (%s)", task->fd, strerror(errno));
+				}
+				task->fd = -1;
+			}
+			if(task->timer_set) {
+				this->timers.erase(task->timer);
+				task->timer_set = false;
+			}
+			this->ready.push_back(task);
+		}
+
+		void Scheduler::WakeRemote(Task* task) {
+			//Signal under the lock, the scheduler may be gone as soon as it's released.
+			std::lock_guard<std::mutex> lk(this->remote_mutex);
+			this->remote_ready.push_back(task);
+			this->remote_wakeup.Signal();
+		}
+
+		void Scheduler::Yield() {
+			this->ready.push_back(this->current);
+			this->Suspend();
+		}
+
+		void Scheduler::Sleep(const int timeout) {
+			this->AddTimer(this->current, std::max(timeout, 0));
+			this->Suspend();
+		}
+
+		int Scheduler::WaitFd(const int fd, const uint32_t events, const int timeout) {
+			Task* task = this->current;
+			struct epoll_event event;
+			event.events = events;
+			event.data.ptr = task;
+			if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+				LOGF(SEVERE, "Couldn't watch fd (%i)! (%s)", fd, strerror(errno));
+				return -1;
+			}
+			task->fd = fd;
+			task->revents = 0;
+			if(timeout >= 0) {
+				this->AddTimer(task, timeout);
+			}
+			this->Suspend();
+			return (int) task->revents;
+		}
+
+		void Scheduler::Offload(KSync::Utilities::thread_pool& pool, std::function<void()> fn) {
+			Task* task = this->current;
+			std::exception_ptr error;
+			pool.submit([this, task, &fn, &error]() {
+				try {
+					fn();
+				} catch (...) {
+					error = std::current_exception();
+				}
+				this->WakeRemote(task);
+			});
+			this->Suspend();
+			if(error) {
+				std::rethrow_exception(error);
+			}
+		}
+
+		static Scheduler& GetCurrent() {
+			Scheduler* scheduler = Scheduler::Current();
+			if(scheduler == nullptr) {
+				LOGF(FATAL, "Coroutine operation called outside of a coroutine!");
+			}
+			return *scheduler;
+		}
+
+		int Spawn(std::function<void()> fn, const size_t stack_size) {
+			return GetCurrent().Spawn(std::move(fn), stack_size);
+		}
+
+		void Yield() {
+			GetCurrent().Yield();
+		}
+
+		void Sleep(const int timeout) {
+			GetCurrent().Sleep(timeout);
+		}
+
+		int WaitFd(const int fd, const uint32_t events, const int timeout) {
+			return GetCurrent().WaitFd(fd, events, timeout);
+		}
+
+		void Offload(KSync::Utilities::thread_pool& pool, std::function<void()> fn) {
+			GetCurrent().Offload(pool, std::move(fn));
+		}
+
+		//Milliseconds left until deadline, never negative.
+		static int Remaining(const std::chrono::steady_clock::time_point& deadline) {
+			const std::chrono::steady_clock::duration left = deadline-std::chrono::steady_clock::now();
+			if(left <= std::chrono::steady_clock::duration::zero()) {
+				return 0;
+			}
+			//Round up so waits never end before the deadline.
+			return (int) std::chrono::duration_cast<std::chrono::milliseconds>(left+std::chrono::milliseconds(1)-std::chrono::nanoseconds(1)).count();
+		}
+
+		std::shared_ptr<KSync::Comm::CommObject> Recv(KSync::Comm::ClientCommunicator& communicator, const int timeout) {
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			while(true) {
+				std::shared_ptr<KSync::Comm::CommObject> obj = communicator.get();
+				if(obj) {
+					return obj;
+				}
+				const int left = Remaining(deadline);
+				if(left == 0) {
+					return obj;
+				}
+				if(communicator.PrepareWait()) {
+					const int status = WaitFd(communicator.GetArrivalFd(), EPOLLIN, left);
+					communicator.FinishWait();
+					if(status < 0) {
+						return obj;
+					}
+				}
+			}
+		}
+
+		int Send(KSync::Comm::ClientCommunicator& communicator, std::shared_ptr<KSync::Comm::CommObject>& obj, const int timeout) {
+			//send() only blocks for room, so back off while the queue is full.
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			int backoff = 1;
+			while(communicator.send(obj, 0) < 0) {
+				const int left = Remaining(deadline);
+				if(left == 0) {
+					return -1;
+				}
+				Sleep(std::min(backoff, left));
+				backoff = std::min(backoff*2, 50);
+			}
+			return 0;
+		}
+
+		int WaitExit(KSync::Commanding::ExecutionContext& context, const int timeout) {
+			//There's no fd for the process, so poll with a backoff.
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			int backoff = 1;
+			while(!context.IsFinished()) {
+				const int left = Remaining(deadline);
+				if(left == 0) {
+					return -1;
+				}
+				Sleep(std::min(backoff, left));
+				backoff = std::min(backoff*2, 50);
+			}
+			return 0;
+		}
+	}
+}
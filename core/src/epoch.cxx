@@ -0,0 +1,235 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+#include "ksync/epoch.h"
+
+namespace KSync {
+	namespace Epoch {
+		static const size_t CacheLineSize = 64;
+		//A bag holds what one thread retired during one epoch. Three are enough
+		//since a bag is safe to free two epochs after it was filled.
+		static const size_t NumBags = 3;
+		//A record's state is (epoch << 1)|PinnedBit while its thread is pinned, 0 otherwise.
+		static const uint64_t PinnedBit = 1;
+
+		class Retired {
+			public:
+				Retired(void* object, deleter_t deleter) : object(object), deleter(deleter) {}
+				void* object;
+				deleter_t deleter;
+		};
+
+		//Records are never freed, a thread which exits leaves its record for the next one.
+		class ThreadRecord {
+			public:
+				ThreadRecord() : state(0), in_use(true), next(nullptr) {}
+				//Pinning writes state on every operation, keep it off its neighbours' lines.
+				std::atomic<uint64_t> state;
+				char padding[CacheLineSize-sizeof(std::atomic<uint64_t>)];
+				std::atomic<bool> in_use;
+				ThreadRecord* next;
+		};
+
+		//Leaked on purpose so thread_local destructors can run after static destruction.
+		class Registry {
+			public:
+				Registry() : epoch(0), records(nullptr), num_retired(0) {}
+				std::atomic<uint64_t> epoch;
+				char padding[CacheLineSize-sizeof(std::atomic<uint64_t>)];
+				std::atomic<ThreadRecord*> records;
+				std::atomic<size_t> num_retired;
+				//Bags of threads which exited before they could be freed, with their epoch.
+				std::mutex orphans_mutex;
+				std::vector<std::pair<uint64_t, Retired>> orphans;
+		};
+
+		static Registry& GetRegistry() {
+			static Registry* registry = new Registry();
+			return *registry;
+		}
+
+		static ThreadRecord* AcquireRecord(Registry& registry) {
+			for(ThreadRecord* record = registry.records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+				bool expected = false;
+				if(!record->in_use.load(std::memory_order_relaxed)&&record->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+					return record;
+				}
+			}
+			ThreadRecord* record = new ThreadRecord();
+			record->next = registry.records.load(std::memory_order_relaxed);
+			while(!registry.records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {
+			}
+			return record;
+		}
+
+		class LocalState {
+			public:
+				LocalState() : registry(GetRegistry()), record(AcquireRecord(registry)), depth(0), since_collect(0) {
+					for(size_t i = 0; i < NumBags; ++i) {
+						this->bag_epochs[i] = 0;
+					}
+				}
+				~LocalState() {
+					{
+						std::lock_guard<std::mutex> lk(this->registry.orphans_mutex);
+						for(size_t i = 0; i < NumBags; ++i) {
+							for(size_t j = 0; j < this->bags[i].size(); ++j) {
+								this->registry.orphans.push_back(std::make_pair(this->bag_epochs[i], this->bags[i][j]));
+							}
+						}
+					}
+					this->record->state.store(0, std::memory_order_release);
+					this->record->in_use.store(false, std::memory_order_release);
+				}
+
+				Registry& registry;
+				ThreadRecord* record;
+				size_t depth;
+				size_t since_collect;
+				std::vector<Retired> bags[NumBags];
+				uint64_t bag_epochs[NumBags];
+		};
+
+		static thread_local LocalState local;
+
+		//The epoch may only move on once every pinned thread has seen it.
+		static void TryAdvance(Registry& registry) {
+			uint64_t epoch = registry.epoch.load();
+			for(ThreadRecord* record = registry.records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+				const uint64_t state = record->state.load();
+				if((state&PinnedBit)&&((state >> 1) != epoch)) {
+					return;
+				}
+			}
+			registry.epoch.compare_exchange_strong(epoch, epoch+1);
+		}
+
+		static size_t FreeAll(std::vector<Retired>& objects) {
+			for(size_t i = 0; i < objects.size(); ++i) {
+				objects[i].deleter(objects[i].object);
+			}
+			return objects.size();
+		}
+
+		static size_t FreeBag(LocalState& state, const size_t index) {
+			//Deleters may retire more objects, so take the bag out before running them.
+			std::vector<Retired> objects;
+			objects.swap(state.bags[index]);
+			const size_t freed = FreeAll(objects);
+			if(state.bags[index].empty()) {
+				//Keep the capacity for the next epoch.
+				objects.clear();
+				objects.swap(state.bags[index]);
+			}
+			state.registry.num_retired.fetch_sub(freed, std::memory_order_relaxed);
+			return freed;
+		}
+
+		static size_t FreeOrphans(Registry& registry, const uint64_t epoch) {
+			std::vector<Retired> objects;
+			{
+				std::unique_lock<std::mutex> lk(registry.orphans_mutex, std::try_to_lock);
+				if(!lk.owns_lock()) {
+					return 0;
+				}
+				size_t kept = 0;
+				for(size_t i = 0; i < registry.orphans.size(); ++i) {
+					if(registry.orphans[i].first+2 <= epoch) {
+						objects.push_back(registry.orphans[i].second);
+					} else {
+						registry.orphans[kept++] = registry.orphans[i];
+					}
+				}
+				registry.orphans.erase(registry.orphans.begin()+kept, registry.orphans.end());
+			}
+			const size_t freed = FreeAll(objects);
+			registry.num_retired.fetch_sub(freed, std::memory_order_relaxed);
+			return freed;
+		}
+
+		static size_t CollectLocal(LocalState& state) {
+			TryAdvance(state.registry);
+			const uint64_t epoch = state.registry.epoch.load();
+			size_t freed = 0;
+			for(size_t i = 0; i < NumBags; ++i) {
+				if(!state.bags[i].empty()&&(state.bag_epochs[i]+2 <= epoch)) {
+					freed += FreeBag(state, i);
+				}
+			}
+			return freed+FreeOrphans(state.registry, epoch);
+		}
+
+		void Pin() {
+			LocalState& state = local;
+			if(state.depth++ != 0) {
+				return;
+			}
+			//Sequentially consistent so the pin is visible before we load any node.
+			state.record->state.store((state.registry.epoch.load() << 1)|PinnedBit);
+		}
+
+		void Unpin() {
+			LocalState& state = local;
+			if(--state.depth != 0) {
+				return;
+			}
+			state.record->state.store(0, std::memory_order_release);
+		}
+
+		void Retire(void* object, deleter_t deleter) {
+			LocalState& state = local;
+			const uint64_t epoch = state.registry.epoch.load();
+			const size_t index = (size_t) (epoch%NumBags);
+			if(state.bag_epochs[index] != epoch) {
+				//Whatever is left in this bag is from NumBags epochs ago at least.
+				FreeBag(state, index);
+				state.bag_epochs[index] = epoch;
+			}
+			state.bags[index].push_back(Retired(object, deleter));
+			state.registry.num_retired.fetch_add(1, std::memory_order_relaxed);
+			if(++state.since_collect >= RetireThreshold) {
+				state.since_collect = 0;
+				CollectLocal(state);
+			}
+		}
+
+		size_t Collect() {
+			LocalState& state = local;
+			//Objects retired just now need the epoch to advance twice.
+			size_t freed = 0;
+			for(size_t i = 0; i < NumBags; ++i) {
+				freed += CollectLocal(state);
+			}
+			return freed;
+		}
+
+		uint64_t GetEpoch() {
+			return GetRegistry().epoch.load();
+		}
+
+		size_t GetNumRetired() {
+			return GetRegistry().num_retired.load(std::memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,615 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+#include <algorithm>
+
+#include "ksync/logging.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/blake3.h"
+#include "ksync/hash_cache.h"
+
+namespace KSync {
+	namespace Hash {
+		static const char Magic[8] = {'K','S','H','C','A','C','H','E'};
+		static const uint32_t Version = 1;
+		//Digest algorithm of the entries, a cache made with another one is thrown away.
+		//1 was Sha256.
+		static const uint32_t AlgorithmBlake3 = 2;
+		//Most filesystems allow one block for all of a file's xattrs.
+		static const size_t MaxXattrSize = 4000;
+		static const size_t HeaderSize = 64;
+		static const size_t SlotSize = 96;
+
+		const char* const HashCache::DefaultFileName = ".ksync-hash-cache";
+		const char* const HashCache::XattrName = "user.ksync.hashes";
+
+		class HashCache::Header {
+			public:
+				char magic[8];
+				uint32_t version;
+				uint32_t algorithm;
+				uint32_t block_size;
+				//Set while open, a cache found dirty wasn't closed cleanly.
+				uint32_t dirty;
+				uint64_t num_slots;
+				uint64_t num_entries;
+				uint64_t blocks_used;
+				uint64_t blocks_capacity;
+				//Bumped on every open, slots remember the last one they were used in.
+				uint64_t generation;
+		};
+
+		class HashCache::Slot {
+			public:
+				uint64_t dev;
+				uint64_t ino;
+				uint64_t size;
+				int64_t mtime_ns;
+				int64_t ctime_ns;
+				uint64_t first_block;
+				uint32_t num_blocks;
+				uint32_t used;
+				uint64_t generation;
+				digest_t digest;
+		};
+
+		class XattrHeader {
+			public:
+				uint32_t version;
+				uint32_t algorithm;
+				uint32_t block_size;
+				uint32_t num_blocks;
+				uint64_t size;
+				int64_t mtime_ns;
+				digest_t digest;
+		};
+
+		static_assert(sizeof(digest_t) == DigestSize, "Block digests must be packed in the cache");
+
+		static int64_t ToNs(const struct timespec& ts) {
+			return ((int64_t) ts.tv_sec)*1000000000+(int64_t) ts.tv_nsec;
+		}
+
+		static size_t TableSize(const uint64_t num_slots, const uint64_t blocks_capacity) {
+			return HeaderSize+num_slots*SlotSize+blocks_capacity*sizeof(digest_t);
+		}
+
+		static bool Unchanged(const struct stat& before, const struct stat& after) {
+			return (before.st_size == after.st_size)&&(ToNs(before.st_mtim) == ToNs(after.st_mtim))&&(ToNs(before.st_ctim) == ToNs(after.st_ctim));
+		}
+
+		static bool IsRacy(const struct stat& st) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			return ToNs(now)-std::max(ToNs(st.st_mtim), ToNs(st.st_ctim)) < HashCache::RacyWindow;
+		}
+
+		//Append the digests of the blocks in data, side by side if there is a pool.
+		static void HashBlocks(const char* data, const size_t size, const uint32_t block_size, FileHashes& hashes, KSync::Utilities::thread_pool* pool) {
+			const size_t first = hashes.blocks.size();
+			const size_t num_blocks = (size+block_size-1)/block_size;
+			hashes.blocks.resize(first+num_blocks);
+			std::function<void(size_t)> hash_block = [&](const size_t i) {
+				Blake3::Digest(data+i*block_size, std::min((size_t) block_size, size-i*block_size), hashes.blocks[first+i]);
+			};
+			if((pool != nullptr)&&(num_blocks > 1)) {
+				KSync::Utilities::parallel_for(*pool, num_blocks, hash_block);
+			} else {
+				for(size_t i = 0; i < num_blocks; ++i) {
+					hash_block(i);
+				}
+			}
+		}
+
+		static void FinishFileDigest(FileHashes& hashes) {
+			Blake3 file_hash;
+			for(size_t i = 0; i < hashes.blocks.size(); ++i) {
+				file_hash.Update(hashes.blocks[i].data(), hashes.blocks[i].size());
+			}
+			file_hash.Final(hashes.digest);
+		}
+
+		int HashFile(const int fd, const uint32_t block_size, FileHashes& hashes, KSync::Utilities::thread_pool* pool) {
+			//Read several blocks at a time when they can be hashed side by side,
+			//but no more than the file has.
+			size_t batch_blocks = 1;
+			struct stat st;
+			if((pool != nullptr)&&(fstat(fd, &st) == 0)) {
+				batch_blocks = std::max((size_t) 1, std::min(ParallelBatchSize/block_size, ((size_t) st.st_size+block_size-1)/block_size));
+			}
+			std::vector<char> buffer(batch_blocks*block_size);
+			hashes.blocks.clear();
+			while(true) {
+				size_t filled = 0;
+				while(filled < buffer.size()) {
+					const ssize_t n = read(fd, buffer.data()+filled, buffer.size()-filled);
+					if(n < 0) {
+						if(errno == EINTR) {
+							continue;
+						}
+						LOGF(SEVERE, "Couldn't read a file for hashing! (%s)", strerror(errno));
+						return -1;
+					}
+					if(n == 0) {
+						break;
+					}
+					filled += (size_t) n;
+				}
+				if(filled == 0) {
+					break;
+				}
+				HashBlocks(buffer.data(), filled, block_size, hashes, pool);
+				if(filled < buffer.size()) {
+					break;
+				}
+			}
+			FinishFileDigest(hashes);
+			return 0;
+		}
+
+		void HashBuffer(const char* data, const size_t size, const uint32_t block_size, FileHashes& hashes, KSync::Utilities::thread_pool* pool) {
+			hashes.blocks.clear();
+			HashBlocks(data, size, block_size, hashes, pool);
+			FinishFileDigest(hashes);
+		}
+
+		HashCache::HashCache() :
+			fd(-1),
+			map(nullptr),
+			map_size(0),
+			header(nullptr),
+			block_size(DefaultBlockSize),
+			use_xattr(false),
+			pool(nullptr),
+			hits(KSync::Metrics::GetCounter("hash_cache.hits")),
+			xattr_hits(KSync::Metrics::GetCounter("hash_cache.xattr_hits")),
+			misses(KSync::Metrics::GetCounter("hash_cache.misses")),
+			bytes_hashed(KSync::Metrics::GetCounter("hash_cache.bytes_hashed")) {
+			static_assert(sizeof(Header) == HeaderSize, "The hash cache header layout changed");
+			static_assert(sizeof(Slot) == SlotSize, "The hash cache slot layout changed");
+		}
+
+		HashCache::~HashCache() {
+			if(this->Close() < 0) {
+				LOGF(SEVERE, "There was a problem closing the hash cache!");
+			}
+		}
+
+		HashCache::Slot* HashCache::GetSlots() {
+			return (Slot*) (this->map+sizeof(Header));
+		}
+
+		digest_t* HashCache::GetBlocks() {
+			return (digest_t*) (this->map+sizeof(Header)+this->header->num_slots*sizeof(Slot));
+		}
+
+		HashCache::Slot* HashCache::Find(Slot* slots, const uint64_t num_slots, const uint64_t dev, const uint64_t ino) {
+			uint64_t x = (dev*0x9e3779b97f4a7c15ULL)^ino;
+			x = (x^(x >> 30))*0xbf58476d1ce4e5b9ULL;
+			x = (x^(x >> 27))*0x94d049bb133111ebULL;
+			x ^= x >> 31;
+			//The table is kept under 3/4 full, but a corrupt one may have no empty slot at all.
+			uint64_t i = x&(num_slots-1);
+			for(uint64_t probes = 0; probes < num_slots; ++probes) {
+				if(!slots[i].used||((slots[i].dev == dev)&&(slots[i].ino == ino))) {
+					return &slots[i];
+				}
+				i = (i+1)&(num_slots-1);
+			}
+			return nullptr;
+		}
+
+		int HashCache::Map(const int new_fd, const size_t new_size) {
+			void* new_map = mmap(nullptr, new_size, PROT_READ|PROT_WRITE, MAP_SHARED, new_fd, 0);
+			if(new_map == MAP_FAILED) {
+				LOGF(SEVERE, "Couldn't map the hash cache (%s)! (%s)", this->path.c_str(), strerror(errno));
+				return -1;
+			}
+			this->Unmap();
+			this->map = (char*) new_map;
+			this->map_size = new_size;
+			this->header = (Header*) this->map;
+			return 0;
+		}
+
+		void HashCache::Unmap() {
+			if(this->map != nullptr) {
+				munmap(this->map, this->map_size);
+			}
+			this->map = nullptr;
+			this->map_size = 0;
+			this->header = nullptr;
+		}
+
+		int HashCache::Create() {
+			const size_t size = TableSize(MinSlots, MinBlocks);
+			if((ftruncate(this->fd, 0) < 0)||(ftruncate(this->fd, (off_t) size) < 0)) {
+				LOGF(SEVERE, "Couldn't size the hash cache (%s)! (%s)", this->path.c_str(), strerror(errno));
+				return -1;
+			}
+			if(this->Map(this->fd, size) < 0) {
+				return -2;
+			}
+			memcpy(this->header->magic, Magic, sizeof(Magic));
+			this->header->version = Version;
+			this->header->algorithm = AlgorithmBlake3;
+			this->header->block_size = this->block_size;
+			this->header->dirty = 1;
+			this->header->num_slots = MinSlots;
+			this->header->num_entries = 0;
+			this->header->blocks_used = 0;
+			this->header->blocks_capacity = MinBlocks;
+			this->header->generation = 1;
+			return 0;
+		}
+
+		int HashCache::Open(const std::string& path, const uint32_t block_size) {
+			std::lock_guard<std::mutex> lk(this->mutex);
+			if(this->IsOpen()) {
+				LOGF(SEVERE, "The hash cache is already open!");
+				return -1;
+			}
+			if(block_size == 0) {
+				LOGF(SEVERE, "The hash cache block size must be positive!");
+				return -2;
+			}
+			this->path = path;
+			this->block_size = block_size;
+			this->fd = open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+			if(this->fd < 0) {
+				LOGF(SEVERE, "Couldn't open the hash cache (%s)! (%s)", path.c_str(), strerror(errno));
+				return -3;
+			}
+			//The inode check catches a cache another process replaced while we waited for it.
+			struct stat st;
+			struct stat path_st;
+			if((flock(this->fd, LOCK_EX|LOCK_NB) < 0)||(fstat(this->fd, &st) < 0)||(stat(path.c_str(), &path_st) < 0)||(st.st_ino != path_st.st_ino)) {
+				LOGF(SEVERE, "The hash cache (%s) is in use by another process!", path.c_str());
+				close(this->fd);
+				this->fd = -1;
+				return -4;
+			}
+			if((size_t) st.st_size >= sizeof(Header)) {
+				if(this->Map(this->fd, (size_t) st.st_size) < 0) {
+					close(this->fd);
+					this->fd = -1;
+					return -5;
+				}
+				const Header* h = this->header;
+				const bool matches = (memcmp(h->magic, Magic, sizeof(Magic)) == 0)&&(h->version == Version)&&(h->algorithm == AlgorithmBlake3)&&(h->block_size == block_size);
+				const bool sane = (h->num_slots != 0)&&((h->num_slots&(h->num_slots-1)) == 0)&&(h->num_slots < ((uint64_t) 1 << 40))&&(h->blocks_capacity < ((uint64_t) 1 << 40))&&(TableSize(h->num_slots, h->blocks_capacity) == (size_t) st.st_size)&&(h->blocks_used <= h->blocks_capacity)&&(4*h->num_entries <= 3*h->num_slots);
+				if(matches&&sane&&(h->dirty == 0)) {
+					this->header->dirty = 1;
+					this->header->generation += 1;
+					//Get dirty on disk before any slot changes can be.
+					if(msync(this->map, sizeof(Header), MS_SYNC) < 0) {
+						LOGF(WARNING, "Couldn't sync the hash cache header (%s)! (%s)", path.c_str(), strerror(errno));
+					}
+					return 0;
+				}
+				if(matches&&(h->dirty != 0)) {
+					LOGF(WARNING, "The hash cache (%s) wasn't closed cleanly, starting over.", path.c_str());
+				} else {
+					LOGF(INFO, "The hash cache (%s) doesn't match, starting over.", path.c_str());
+				}
+				this->Unmap();
+			}
+			if(this->Create() < 0) {
+				close(this->fd);
+				this->fd = -1;
+				return -6;
+			}
+			return 0;
+		}
+
+		bool HashCache::InBounds(const Header& header, const Slot& slot) {
+			return (slot.first_block <= header.blocks_used)&&(slot.num_blocks <= header.blocks_used-slot.first_block);
+		}
+
+		int HashCache::Rebuild(const uint64_t extra_blocks) {
+			const Header old = *this->header;
+			Slot* old_slots = this->GetSlots();
+			digest_t* old_blocks = this->GetBlocks();
+
+			uint64_t num_live = 0;
+			uint64_t live_blocks = 0;
+			for(uint64_t i = 0; i < old.num_slots; ++i) {
+				if(old_slots[i].used&&(old_slots[i].generation+MaxIdleGenerations >= old.generation)&&InBounds(old, old_slots[i])) {
+					++num_live;
+					live_blocks += old_slots[i].num_blocks;
+				}
+			}
+			//Rebuild to half full so it takes a while to fill again.
+			uint64_t num_slots = MinSlots;
+			while(num_slots < 2*(num_live+1)) {
+				num_slots *= 2;
+			}
+			const uint64_t blocks_capacity = std::max((uint64_t) MinBlocks, 2*(live_blocks+extra_blocks));
+			const size_t size = TableSize(num_slots, blocks_capacity);
+
+			const std::string tmp_path = this->path+".tmp";
+			const int new_fd = open(tmp_path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+			if(new_fd < 0) {
+				LOGF(SEVERE, "Couldn't create (%s) to rebuild the hash cache! (%s)", tmp_path.c_str(), strerror(errno));
+				return -1;
+			}
+			if((flock(new_fd, LOCK_EX|LOCK_NB) < 0)||(ftruncate(new_fd, (off_t) size) < 0)) {
+				LOGF(SEVERE, "Couldn't prepare (%s) to rebuild the hash cache! (%s)", tmp_path.c_str(), strerror(errno));
+				close(new_fd);
+				unlink(tmp_path.c_str());
+				return -2;
+			}
+			void* new_map = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, new_fd, 0);
+			if(new_map == MAP_FAILED) {
+				LOGF(SEVERE, "Couldn't map (%s) to rebuild the hash cache! (%s)", tmp_path.c_str(), strerror(errno));
+				close(new_fd);
+				unlink(tmp_path.c_str());
+				return -3;
+			}
+
+			Header* new_header = (Header*) new_map;
+			*new_header = old;
+			new_header->num_slots = num_slots;
+			new_header->num_entries = num_live;
+			new_header->blocks_used = 0;
+			new_header->blocks_capacity = blocks_capacity;
+			Slot* new_slots = (Slot*) (((char*) new_map)+sizeof(Header));
+			digest_t* new_blocks = (digest_t*) (((char*) new_map)+sizeof(Header)+num_slots*sizeof(Slot));
+			for(uint64_t i = 0; i < old.num_slots; ++i) {
+				const Slot& old_slot = old_slots[i];
+				if(!old_slot.used||(old_slot.generation+MaxIdleGenerations < old.generation)||!InBounds(old, old_slot)) {
+					continue;
+				}
+				Slot* slot = Find(new_slots, num_slots, old_slot.dev, old_slot.ino);
+				*slot = old_slot;
+				slot->first_block = new_header->blocks_used;
+				memcpy(new_blocks+slot->first_block, old_blocks+old_slot.first_block, old_slot.num_blocks*sizeof(digest_t));
+				new_header->blocks_used += old_slot.num_blocks;
+			}
+
+			if(rename(tmp_path.c_str(), this->path.c_str()) < 0) {
+				LOGF(SEVERE, "Couldn't replace the hash cache (%s)! (%s)", this->path.c_str(), strerror(errno));
+				munmap(new_map, size);
+				close(new_fd);
+				unlink(tmp_path.c_str());
+				return -4;
+			}
+			//The old file is gone now, nobody will check whether it was left dirty.
+			this->Unmap();
+			close(this->fd);
+			this->fd = new_fd;
+			this->map = (char*) new_map;
+			this->map_size = size;
+			this->header = new_header;
+			return 0;
+		}
+
+		int HashCache::Close() {
+			std::lock_guard<std::mutex> lk(this->mutex);
+			if(!this->IsOpen()) {
+				return 0;
+			}
+			//Only call it clean once everything else has reached the disk.
+			int status = 0;
+			if(msync(this->map, this->map_size, MS_SYNC) < 0) {
+				LOGF(SEVERE, "Couldn't sync the hash cache (%s)! (%s)", this->path.c_str(), strerror(errno));
+				status = -1;
+			} else {
+				this->header->dirty = 0;
+				if(msync(this->map, sizeof(Header), MS_SYNC) < 0) {
+					LOGF(SEVERE, "Couldn't sync the hash cache header (%s)! (%s)", this->path.c_str(), strerror(errno));
+					status = -2;
+				}
+			}
+			this->Unmap();
+			close(this->fd);
+			this->fd = -1;
+			return status;
+		}
+
+		size_t HashCache::GetNumEntries() {
+			std::lock_guard<std::mutex> lk(this->mutex);
+			if(!this->IsOpen()) {
+				return 0;
+			}
+			return (size_t) this->header->num_entries;
+		}
+
+		bool HashCache::Lookup(const struct stat& st, FileHashes& hashes) {
+			std::lock_guard<std::mutex> lk(this->mutex);
+			if(!this->IsOpen()) {
+				return false;
+			}
+			Slot* slot = Find(this->GetSlots(), this->header->num_slots, (uint64_t) st.st_dev, (uint64_t) st.st_ino);
+			if(slot == nullptr) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "The hash cache (%s) has no free slots!", this->path.c_str());
+				return false;
+			}
+			if(!slot->used||(slot->size != (uint64_t) st.st_size)||(slot->mtime_ns != ToNs(st.st_mtim))||(slot->ctime_ns != ToNs(st.st_ctim))) {
+				return false;
+			}
+			if(!InBounds(*this->header, *slot)) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "The hash cache (%s) has an entry pointing outside its blocks!", this->path.c_str());
+				return false;
+			}
+			const digest_t* blocks = this->GetBlocks()+slot->first_block;
+			hashes.digest = slot->digest;
+			hashes.blocks.assign(blocks, blocks+slot->num_blocks);
+			slot->generation = this->header->generation;
+			return true;
+		}
+
+		int HashCache::Store(const struct stat& st, const FileHashes& hashes) {
+			std::lock_guard<std::mutex> lk(this->mutex);
+			if(!this->IsOpen()) {
+				return 0;
+			}
+			const uint64_t num_blocks = hashes.blocks.size();
+			Slot* slot = Find(this->GetSlots(), this->header->num_slots, (uint64_t) st.st_dev, (uint64_t) st.st_ino);
+			//Rebuilding counts the slots actually used, so it also fixes a table with none free.
+			const bool full = (slot == nullptr)||(!slot->used&&(4*(this->header->num_entries+1) > 3*this->header->num_slots));
+			const bool needs_blocks = full||!slot->used||(num_blocks > slot->num_blocks)||!InBounds(*this->header, *slot);
+			if(full||(needs_blocks&&(this->header->blocks_used+num_blocks > this->header->blocks_capacity))) {
+				if(this->Rebuild(num_blocks) < 0) {
+					return -1;
+				}
+				slot = Find(this->GetSlots(), this->header->num_slots, (uint64_t) st.st_dev, (uint64_t) st.st_ino);
+				if(slot == nullptr) {
+					LOGF(SEVERE, "The rebuilt hash cache (%s) has no free slots!", this->path.c_str());
+					return -2;
+				}
+			}
+			//A slot which changed in place reuses its blocks when they are enough.
+			if(!slot->used||(num_blocks > slot->num_blocks)||!InBounds(*this->header, *slot)) {
+				if(!slot->used) {
+					++this->header->num_entries;
+				}
+				slot->first_block = this->header->blocks_used;
+				this->header->blocks_used += num_blocks;
+			}
+			if(num_blocks != 0) {
+				memcpy(this->GetBlocks()+slot->first_block, hashes.blocks.data(), num_blocks*sizeof(digest_t));
+			}
+			slot->dev = (uint64_t) st.st_dev;
+			slot->ino = (uint64_t) st.st_ino;
+			slot->size = (uint64_t) st.st_size;
+			slot->mtime_ns = ToNs(st.st_mtim);
+			slot->ctime_ns = ToNs(st.st_ctim);
+			slot->num_blocks = (uint32_t) num_blocks;
+			slot->generation = this->header->generation;
+			slot->digest = hashes.digest;
+			slot->used = 1;
+			return 0;
+		}
+
+		bool HashCache::LookupXattr(const int fd, const struct stat& st, FileHashes& hashes) {
+			char value[MaxXattrSize];
+			const ssize_t size = fgetxattr(fd, XattrName, value, sizeof(value));
+			if(size < (ssize_t) sizeof(XattrHeader)) {
+				return false;
+			}
+			XattrHeader xattr_header;
+			memcpy(&xattr_header, value, sizeof(xattr_header));
+			if((xattr_header.version != Version)||(xattr_header.algorithm != AlgorithmBlake3)||(xattr_header.block_size != this->block_size)||(xattr_header.size != (uint64_t) st.st_size)||(xattr_header.mtime_ns != ToNs(st.st_mtim))) {
+				return false;
+			}
+			if((size_t) size != sizeof(XattrHeader)+xattr_header.num_blocks*sizeof(digest_t)) {
+				return false;
+			}
+			hashes.digest = xattr_header.digest;
+			hashes.blocks.resize(xattr_header.num_blocks);
+			if(xattr_header.num_blocks != 0) {
+				memcpy(hashes.blocks.data(), value+sizeof(XattrHeader), xattr_header.num_blocks*sizeof(digest_t));
+			}
+			return true;
+		}
+
+		void HashCache::StoreXattr(const int fd, const struct stat& st, const FileHashes& hashes) {
+			const size_t size = sizeof(XattrHeader)+hashes.blocks.size()*sizeof(digest_t);
+			if(size > MaxXattrSize) {
+				return;
+			}
+			char value[MaxXattrSize];
+			XattrHeader xattr_header;
+			xattr_header.version = Version;
+			xattr_header.algorithm = AlgorithmBlake3;
+			xattr_header.block_size = this->block_size;
+			xattr_header.num_blocks = (uint32_t) hashes.blocks.size();
+			xattr_header.size = (uint64_t) st.st_size;
+			xattr_header.mtime_ns = ToNs(st.st_mtim);
+			xattr_header.digest = hashes.digest;
+			memcpy(value, &xattr_header, sizeof(xattr_header));
+			if(!hashes.blocks.empty()) {
+				memcpy(value+sizeof(XattrHeader), hashes.blocks.data(), hashes.blocks.size()*sizeof(digest_t));
+			}
+			//Read only files and filesystems without user xattrs just go without.
+			if(fsetxattr(fd, XattrName, value, size, 0) < 0) {
+				LOGF(DEBUG, "Couldn't store hashes as an xattr! (%s)", strerror(errno));
+			}
+		}
+
+		bool HashCache::Storable(const struct stat& before, const struct stat& after) {
+			return Unchanged(before, after)&&!IsRacy(after);
+		}
+
+		int HashCache::GetHashes(const std::string& path, FileHashes& hashes) {
+			const int file_fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+			if(file_fd < 0) {
+				LOGF(SEVERE, "Couldn't open (%s) for hashing! (%s)", path.c_str(), strerror(errno));
+				return -1;
+			}
+			struct stat before;
+			if(fstat(file_fd, &before) < 0) {
+				LOGF(SEVERE, "Couldn't stat (%s) for hashing! (%s)", path.c_str(), strerror(errno));
+				close(file_fd);
+				return -2;
+			}
+			if(this->Lookup(before, hashes)) {
+				this->hits.Add();
+				close(file_fd);
+				return Cached;
+			}
+			if(this->use_xattr&&this->LookupXattr(file_fd, before, hashes)) {
+				this->xattr_hits.Add();
+				const int status = this->Store(before, hashes);
+				close(file_fd);
+				return (status < 0) ? -3 : Cached;
+			}
+
+			this->misses.Add();
+			posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			if(HashFile(file_fd, this->block_size, hashes, this->pool) < 0) {
+				LOGF(SEVERE, "There was a problem hashing (%s)!", path.c_str());
+				close(file_fd);
+				return -4;
+			}
+			this->bytes_hashed.Add((uint64_t) before.st_size);
+			struct stat after;
+			if(fstat(file_fd, &after) < 0) {
+				LOGF(SEVERE, "Couldn't stat (%s) after hashing! (%s)", path.c_str(), strerror(errno));
+				close(file_fd);
+				return -5;
+			}
+			//Only remember hashes of a file which held still while we read it.
+			int status = 0;
+			if(Storable(before, after)) {
+				if(this->use_xattr) {
+					this->StoreXattr(file_fd, after, hashes);
+					//The xattr bumped ctime.
+					if(fstat(file_fd, &after) < 0) {
+						LOGF(SEVERE, "Couldn't stat (%s) after storing its hashes! (%s)", path.c_str(), strerror(errno));
+						close(file_fd);
+						return -6;
+					}
+				}
+				status = this->Store(after, hashes);
+			}
+			close(file_fd);
+			return (status < 0) ? -7 : Hashed;
+		}
+	}
+}
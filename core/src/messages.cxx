@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "ksync/logging.h"
 #include "ksync/messages.h"
+#include "ksync/varint.h"
 #include "ksync/comm/object.h"
 
 namespace KSync {
@@ -43,6 +44,15 @@ namespace KSync {
 		const Type_t ServerShuttingDown::Type = 11;
 		const Type_t ExecuteCommand::Type = 12;
 		const Type_t CommandOutput::Type = 13;
+		const Type_t StreamStart::Type = 14;
+		const Type_t StreamChunk::Type = 15;
+		const Type_t StreamCredit::Type = 16;
+		const Type_t StreamEnd::Type = 17;
+		const Type_t StatsRequest::Type = 18;
+		const Type_t StatsReply::Type = 19;
+		const Type_t RequestRefused::Type = 20;
+		const Type_t FlowCredit::Type = 21;
+		const Type_t TransferFile::Type = 22;
 
 		const char* GetTypeName(const Type_t type) {
 			if (type == CommunicableObject::Type) {
@@ -67,6 +77,30 @@ namespace KSync {
 				return "ShutdownAck";
 			} else if (type == ServerShuttingDown::Type) {
 				return "ServerShuttingDown";
+			} else if (type == ClientSocketCreation::Type) {
+				return "ClientSocketCreation";
+			} else if (type == ExecuteCommand::Type) {
+				return "ExecuteCommand";
+			} else if (type == CommandOutput::Type) {
+				return "CommandOutput";
+			} else if (type == StreamStart::Type) {
+				return "StreamStart";
+			} else if (type == StreamChunk::Type) {
+				return "StreamChunk";
+			} else if (type == StreamCredit::Type) {
+				return "StreamCredit";
+			} else if (type == StreamEnd::Type) {
+				return "StreamEnd";
+			} else if (type == StatsRequest::Type) {
+				return "StatsRequest";
+			} else if (type == StatsReply::Type) {
+				return "StatsReply";
+			} else if (type == RequestRefused::Type) {
+				return "RequestRefused";
+			} else if (type == FlowCredit::Type) {
+				return "FlowCredit";
+			} else if (type == TransferFile::Type) {
+				return "TransferFile";
 			} else {
 				LOGF(SEVERE, "Here (%i)\n", type);
 				throw TypeException(type);
@@ -98,7 +132,7 @@ namespace KSync {
 		}
 
 		std::shared_ptr<CommObject> SimpleCommunicableObject::GetCommObject() {
-			return std::shared_ptr<CommObject>(new CommObject(0, 0, false, this->GetType()));
+			return CommObject::Create(nullptr, 0, false, this->GetType());
 		}
 
 		CommData::CommData(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj){
@@ -109,65 +143,134 @@ namespace KSync {
 
 		CommData::~CommData() {
 			if (this->data != 0) {
-				delete this->data;
+				delete[] this->data;
 			}
 		}
 		std::shared_ptr<CommObject> CommData::GetCommObject() {
-			return std::shared_ptr<CommObject>(new CommObject(this->data, this->size, false, this->GetType()));
+			return CommObject::Create(this->data, this->size, false, this->GetType());
 		}
 
 		CommString::CommString(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
-			this->clear();
-			this->reserve(comm_obj->GetDataSize());
-			for(size_t i=0; i < comm_obj->GetDataSize(); ++i) {
-				this->push_back(comm_obj->GetDataPointer()[i]);
-			}
+			this->assign(comm_obj->GetDataPointer(), comm_obj->GetDataSize());
 		}
 
 		std::shared_ptr<CommObject> CommString::GetCommObject() {
-			size_t size = this->size();
-			char* data = new char[size];
-			memcpy(data, this->c_str(), size);
-			std::shared_ptr<CommObject> new_obj(new CommObject(data, size, false, this->GetType()));
-			delete[] data;
-			return new_obj;
+			return CommObject::Create(this->data(), this->size(), false, this->GetType());
 		}
 
-		CommStringArray::CommStringArray(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
-			const char* data = comm_obj->GetDataPointer();
-			size_t d_i = 0;
-			const size_t n_s = *((size_t*)(data+d_i));
-			d_i += sizeof(size_t);
-			this->resize(n_s);
-			for(size_t s_i = 0; s_i < n_s; ++s_i) {
-				const size_t s_i_n = *((size_t*)(data+d_i));
-				d_i += sizeof(size_t);
-				(*this)[s_i].assign(data+d_i, s_i_n);
-				d_i += s_i_n;
+		CommStringArray::CommStringArray(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj), source(comm_obj) {
+			const size_t size = comm_obj->GetDataSize();
+			uint64_t n_s = 0;
+			const size_t n = Utilities::ReadVarint(comm_obj->GetDataPointer(), size, n_s);
+			//Every string takes at least a byte for its length.
+			if((n == 0)||(n_s > size-n)) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			this->count = (size_t) n_s;
+			this->first = n;
+		}
+
+		size_t CommStringArray::Next(const size_t d_i, Utilities::StringView& view) const {
+			const char* data = this->source->GetDataPointer();
+			const size_t size = this->source->GetDataSize();
+			uint64_t s_n = 0;
+			const size_t n = Utilities::ReadVarint(data+d_i, size-d_i, s_n);
+			if((n == 0)||(s_n > size-d_i-n)) {
+				throw CommObject::UnPackException(this->source->GetType());
+			}
+			view = Utilities::StringView(data+d_i+n, (size_t) s_n);
+			return d_i+n+(size_t) s_n;
+		}
+
+		Utilities::StringView CommStringArray::Get(const size_t i) const {
+			if(i >= this->count) {
+				throw CommObject::UnPackException(this->GetType());
+			}
+			if(!this->source) {
+				return Utilities::StringView(this->strings[i]);
 			}
+			if(this->offsets.empty()) {
+				std::vector<size_t> new_offsets;
+				new_offsets.reserve(this->count);
+				size_t d_i = this->first;
+				Utilities::StringView view;
+				for(size_t s_i = 0; s_i < this->count; ++s_i) {
+					new_offsets.push_back(d_i);
+					d_i = this->Next(d_i, view);
+				}
+				this->offsets.swap(new_offsets);
+			}
+			Utilities::StringView view;
+			this->Next(this->offsets[i], view);
+			return view;
+		}
+
+		void CommStringArray::Materialize() {
+			if(!this->source) {
+				return;
+			}
+			std::vector<std::string> copied;
+			copied.reserve(this->count);
+			this->for_each([&copied](const Utilities::StringView& view) {
+				copied.push_back(view.str());
+			});
+			this->strings.swap(copied);
+			this->source.reset();
+			this->offsets.clear();
+		}
+
+		void CommStringArray::Set(const size_t i, const std::string& in) {
+			this->Materialize();
+			this->strings[i] = in;
+		}
+
+		void CommStringArray::push_back(const std::string& in) {
+			this->Materialize();
+			this->strings.push_back(in);
+			this->count = this->strings.size();
+		}
+
+		void CommStringArray::resize(const size_t n) {
+			this->Materialize();
+			this->strings.resize(n);
+			this->count = n;
+		}
+
+		void CommStringArray::clear() {
+			this->source.reset();
+			this->offsets.clear();
+			this->strings.clear();
+			this->count = 0;
 		}
 
 		std::shared_ptr<CommObject> CommStringArray::GetCommObject() {
-			size_t total_new_size = 0;
-			total_new_size += sizeof(size_t);
-			for(size_t s_i = 0; s_i < this->size(); ++s_i) {
-				total_new_size += sizeof(size_t);
-				total_new_size += (*this)[s_i].size();
+			if(this->source) {
+				//Still exactly what was received.
+				const size_t size = this->source->GetDataSize();
+				std::shared_ptr<CommObject> new_obj = CommObject::Create(size, this->GetType());
+				memcpy(new_obj->GetWritablePayload(), this->source->GetDataPointer(), size);
+				if(new_obj->Seal(size) < 0) {
+					throw CommObject::PackException(this->GetType());
+				}
+				return new_obj;
+			}
+			//Size everything first so the payload is written in one pass.
+			size_t total_new_size = Utilities::VarintSize(this->count);
+			for(size_t s_i = 0; s_i < this->strings.size(); ++s_i) {
+				total_new_size += Utilities::VarintSize(this->strings[s_i].size());
+				total_new_size += this->strings[s_i].size();
+			}
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			size_t d_i = Utilities::WriteVarint(new_data, this->count);
+			for(size_t s_i = 0; s_i < this->strings.size(); ++s_i) {
+				d_i += Utilities::WriteVarint(new_data+d_i, this->strings[s_i].size());
+				memcpy(new_data+d_i, this->strings[s_i].data(), this->strings[s_i].size());
+				d_i += this->strings[s_i].size();
+			}
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
 			}
-			char* new_data = new char[total_new_size];
-			size_t d_i = 0;
-			//Write number of strings
-			*((size_t*)(new_data + d_i)) = this->size();
-			d_i += sizeof(size_t);
-			for(size_t s_i = 0; s_i < this->size(); ++s_i) {
-				//Write strings
-				*((size_t*)(new_data + d_i)) = (*this)[s_i].size();
-				d_i += sizeof(size_t);
-				memcpy(new_data+d_i, (*this)[s_i].data(), (*this)[s_i].size());
-				d_i += (*this)[s_i].size();
-			}
-			std::shared_ptr<CommObject> new_obj(new CommObject(new_data, total_new_size, false, this->GetType()));
-			delete[] new_data;
 			return new_obj;
 		}
 
@@ -176,16 +279,16 @@ namespace KSync {
 		}
 
 		std::shared_ptr<CommObject> GatewaySocketInitializationRequest::GetCommObject() {
-			char* new_data = new char[sizeof(Utilities::client_id_t)];
-			((Utilities::client_id_t*) new_data)[0] = this->ClientId;
-			size_t size = sizeof(Utilities::client_id_t);
-			std::shared_ptr<CommObject> new_obj(new CommObject(new_data, size, false, this->GetType()));
-			delete[] new_data;
+			const size_t size = sizeof(Utilities::client_id_t);
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(size, this->GetType());
+			((Utilities::client_id_t*) new_obj->GetWritablePayload())[0] = this->ClientId;
+			if(new_obj->Seal(size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
 			return new_obj;
 		}
 
-		ClientSocketCreation::ClientSocketCreation() {
-			this->resize(2);
+		ClientSocketCreation::ClientSocketCreation() : CommStringArray(std::vector<std::string>(2)) {
 		}
 
 		CommandOutput::CommandOutput(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
@@ -210,7 +313,8 @@ namespace KSync {
 			total_new_size += this->std_err.size();
 			total_new_size += sizeof(this->return_code);
 
-			char* new_data = new char[total_new_size];
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
 			size_t d_i = 0;
 
 			//Write strings
@@ -224,8 +328,190 @@ namespace KSync {
 			d_i += this->std_err.size();
 			*((KSync::Commanding::ExecutionContext::Return_t*) (new_data+d_i)) = this->return_code;
 
-			std::shared_ptr<CommObject> new_obj(new CommObject(new_data, total_new_size, false, this->GetType()));
-			delete[] new_data;
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		StreamStart::StreamStart(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			if(comm_obj->GetDataSize() < sizeof(stream_id_t)+sizeof(uint64_t)+sizeof(uint32_t)+sizeof(uint32_t)) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			const char* data = comm_obj->GetDataPointer();
+			size_t d_i = 0;
+			this->stream_id = *((stream_id_t*)(data+d_i));
+			d_i += sizeof(stream_id_t);
+			this->total_size = *((uint64_t*)(data+d_i));
+			d_i += sizeof(uint64_t);
+			this->chunk_size = *((uint32_t*)(data+d_i));
+			d_i += sizeof(uint32_t);
+			this->window = *((uint32_t*)(data+d_i));
+		}
+
+		std::shared_ptr<CommObject> StreamStart::GetCommObject() {
+			const size_t total_new_size = sizeof(stream_id_t)+sizeof(uint64_t)+sizeof(uint32_t)+sizeof(uint32_t);
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			size_t d_i = 0;
+			*((stream_id_t*)(new_data+d_i)) = this->stream_id;
+			d_i += sizeof(stream_id_t);
+			*((uint64_t*)(new_data+d_i)) = this->total_size;
+			d_i += sizeof(uint64_t);
+			*((uint32_t*)(new_data+d_i)) = this->chunk_size;
+			d_i += sizeof(uint32_t);
+			*((uint32_t*)(new_data+d_i)) = this->window;
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		const size_t StreamChunk::HeaderSize = sizeof(stream_id_t)+sizeof(stream_seq_t);
+
+		StreamChunk::StreamChunk(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			if(comm_obj->GetDataSize() < HeaderSize) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			this->source = comm_obj;
+			const char* data = comm_obj->GetDataPointer();
+			this->stream_id = *((stream_id_t*)(data));
+			this->sequence = *((stream_seq_t*)(data+sizeof(stream_id_t)));
+			this->data = data+HeaderSize;
+			this->size = comm_obj->GetDataSize()-HeaderSize;
+		}
+
+		void StreamChunk::WriteHeader(char* payload, const stream_id_t stream_id, const stream_seq_t sequence) {
+			*((stream_id_t*)(payload)) = stream_id;
+			*((stream_seq_t*)(payload+sizeof(stream_id_t))) = sequence;
+		}
+
+		std::shared_ptr<CommObject> StreamChunk::GetCommObject() {
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(HeaderSize+this->size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			WriteHeader(new_data, this->stream_id, this->sequence);
+			if(this->size != 0) {
+				memcpy(new_data+HeaderSize, this->data, this->size);
+			}
+			if(new_obj->Seal(HeaderSize+this->size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		FlowCredit::FlowCredit(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			if(comm_obj->GetDataSize() < sizeof(uint64_t)) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			this->credits = ((uint64_t*) comm_obj->GetDataPointer())[0];
+		}
+
+		std::shared_ptr<CommObject> FlowCredit::GetCommObject() {
+			const size_t size = sizeof(uint64_t);
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(size, this->GetType());
+			((uint64_t*) new_obj->GetWritablePayload())[0] = this->credits;
+			if(new_obj->Seal(size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		StreamCredit::StreamCredit(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			if(comm_obj->GetDataSize() < sizeof(stream_id_t)+2*sizeof(stream_seq_t)) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			const char* data = comm_obj->GetDataPointer();
+			size_t d_i = 0;
+			this->stream_id = *((stream_id_t*)(data+d_i));
+			d_i += sizeof(stream_id_t);
+			this->acked = *((stream_seq_t*)(data+d_i));
+			d_i += sizeof(stream_seq_t);
+			this->limit = *((stream_seq_t*)(data+d_i));
+		}
+
+		std::shared_ptr<CommObject> StreamCredit::GetCommObject() {
+			const size_t total_new_size = sizeof(stream_id_t)+2*sizeof(stream_seq_t);
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			size_t d_i = 0;
+			*((stream_id_t*)(new_data+d_i)) = this->stream_id;
+			d_i += sizeof(stream_id_t);
+			*((stream_seq_t*)(new_data+d_i)) = this->acked;
+			d_i += sizeof(stream_seq_t);
+			*((stream_seq_t*)(new_data+d_i)) = this->limit;
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		StreamEnd::StreamEnd(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			if(comm_obj->GetDataSize() < sizeof(stream_id_t)+sizeof(stream_seq_t)+sizeof(uint64_t)) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			const char* data = comm_obj->GetDataPointer();
+			size_t d_i = 0;
+			this->stream_id = *((stream_id_t*)(data+d_i));
+			d_i += sizeof(stream_id_t);
+			this->num_chunks = *((stream_seq_t*)(data+d_i));
+			d_i += sizeof(stream_seq_t);
+			this->total_size = *((uint64_t*)(data+d_i));
+		}
+
+		std::shared_ptr<CommObject> StreamEnd::GetCommObject() {
+			const size_t total_new_size = sizeof(stream_id_t)+sizeof(stream_seq_t)+sizeof(uint64_t);
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			size_t d_i = 0;
+			*((stream_id_t*)(new_data+d_i)) = this->stream_id;
+			d_i += sizeof(stream_id_t);
+			*((stream_seq_t*)(new_data+d_i)) = this->num_chunks;
+			d_i += sizeof(stream_seq_t);
+			*((uint64_t*)(new_data+d_i)) = this->total_size;
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
+			return new_obj;
+		}
+
+		TransferFile::TransferFile(const std::shared_ptr<CommObject>& comm_obj) : CommunicableObject(comm_obj) {
+			const size_t fixed_size = sizeof(uint64_t)+sizeof(uint32_t)+KSync::Hash::DigestSize+sizeof(uint32_t);
+			if(comm_obj->GetDataSize() < fixed_size) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			const char* data = comm_obj->GetDataPointer();
+			size_t d_i = 0;
+			this->size = *((uint64_t*)(data+d_i));
+			d_i += sizeof(uint64_t);
+			this->block_size = *((uint32_t*)(data+d_i));
+			d_i += sizeof(uint32_t);
+			memcpy(this->digest.data(), data+d_i, KSync::Hash::DigestSize);
+			d_i += KSync::Hash::DigestSize;
+			const uint32_t path_size = *((uint32_t*)(data+d_i));
+			d_i += sizeof(uint32_t);
+			if(comm_obj->GetDataSize() < fixed_size+path_size) {
+				throw CommObject::UnPackException(comm_obj->GetType());
+			}
+			this->path.assign(data+d_i, path_size);
+		}
+
+		std::shared_ptr<CommObject> TransferFile::GetCommObject() {
+			const size_t total_new_size = sizeof(uint64_t)+sizeof(uint32_t)+KSync::Hash::DigestSize+sizeof(uint32_t)+this->path.size();
+			std::shared_ptr<CommObject> new_obj = CommObject::Create(total_new_size, this->GetType());
+			char* new_data = new_obj->GetWritablePayload();
+			size_t d_i = 0;
+			*((uint64_t*)(new_data+d_i)) = this->size;
+			d_i += sizeof(uint64_t);
+			*((uint32_t*)(new_data+d_i)) = this->block_size;
+			d_i += sizeof(uint32_t);
+			memcpy(new_data+d_i, this->digest.data(), KSync::Hash::DigestSize);
+			d_i += KSync::Hash::DigestSize;
+			*((uint32_t*)(new_data+d_i)) = (uint32_t) this->path.size();
+			d_i += sizeof(uint32_t);
+			memcpy(new_data+d_i, this->path.data(), this->path.size());
+			if(new_obj->Seal(total_new_size) < 0) {
+				throw CommObject::PackException(this->GetType());
+			}
 			return new_obj;
 		}
 
@@ -242,5 +528,14 @@ namespace KSync {
 		template void CommCreator(std::shared_ptr<ServerShuttingDown>& message, const std::shared_ptr<CommObject>& comm_obj);
 		template void CommCreator(std::shared_ptr<ExecuteCommand>& message, const std::shared_ptr<CommObject>& comm_obj);
 		template void CommCreator(std::shared_ptr<CommandOutput>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StreamStart>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StreamChunk>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StreamCredit>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StreamEnd>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StatsRequest>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<StatsReply>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<RequestRefused>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<FlowCredit>& message, const std::shared_ptr<CommObject>& comm_obj);
+		template void CommCreator(std::shared_ptr<TransferFile>& message, const std::shared_ptr<CommObject>& comm_obj);
 	}
 }
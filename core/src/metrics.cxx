@@ -0,0 +1,201 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <limits>
+#include <sstream>
+#include <fstream>
+
+#include "ksync/logging.h"
+#include "ksync/metrics.h"
+
+namespace KSync {
+	namespace Metrics {
+		Histogram::Histogram() : count(0), sum(0), min(std::numeric_limits<uint64_t>::max()), max(0) {
+			for(size_t i = 0; i < NumBuckets; ++i) {
+				this->buckets[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		size_t Histogram::BucketIndex(const uint64_t value) {
+			if(value < 2*SubBucketCount) {
+				return (size_t) value;
+			}
+			const int shift = (63-__builtin_clzll(value))-SubBucketBits;
+			return (size_t) shift*SubBucketCount+(size_t) (value >> shift);
+		}
+
+		uint64_t Histogram::BucketUpperBound(const size_t index) {
+			if(index < 2*SubBucketCount) {
+				return (uint64_t) index;
+			}
+			const size_t shift = index/SubBucketCount-1;
+			const uint64_t lower = ((uint64_t) (index-shift*SubBucketCount)) << shift;
+			return lower+((((uint64_t) 1) << shift)-1);
+		}
+
+		void Histogram::Record(const uint64_t value) {
+			this->buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+			this->count.fetch_add(1, std::memory_order_relaxed);
+			this->sum.fetch_add(value, std::memory_order_relaxed);
+			uint64_t current = this->max.load(std::memory_order_relaxed);
+			while((value > current)&&!this->max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+			}
+			current = this->min.load(std::memory_order_relaxed);
+			while((value < current)&&!this->min.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+			}
+		}
+
+		uint64_t Histogram::GetMin() const {
+			if(this->GetCount() == 0) {
+				return 0;
+			}
+			return this->min.load(std::memory_order_relaxed);
+		}
+
+		double Histogram::GetMean() const {
+			const uint64_t the_count = this->GetCount();
+			if(the_count == 0) {
+				return 0.;
+			}
+			return ((double) this->sum.load(std::memory_order_relaxed))/((double) the_count);
+		}
+
+		uint64_t Histogram::GetPercentile(const double percentile) const {
+			//Snapshot the buckets first, records may land while we walk them.
+			uint64_t total = 0;
+			std::unique_ptr<uint64_t[]> snapshot(new uint64_t[NumBuckets]);
+			for(size_t i = 0; i < NumBuckets; ++i) {
+				snapshot[i] = this->buckets[i].load(std::memory_order_relaxed);
+				total += snapshot[i];
+			}
+			if(total == 0) {
+				return 0;
+			}
+			uint64_t rank = (uint64_t) ((percentile/100.)*((double) total)+0.5);
+			if(rank < 1) {
+				rank = 1;
+			} else if (rank > total) {
+				rank = total;
+			}
+			uint64_t seen = 0;
+			for(size_t i = 0; i < NumBuckets; ++i) {
+				seen += snapshot[i];
+				if(seen >= rank) {
+					return std::min(BucketUpperBound(i), this->GetMax());
+				}
+			}
+			return this->GetMax();
+		}
+
+		//Leaked on purpose so metrics outlive anything which caches a reference.
+		class Registry {
+			public:
+				std::mutex mutex;
+				std::map<std::string, std::unique_ptr<Counter>> counters;
+				std::map<std::string, std::unique_ptr<Gauge>> gauges;
+				std::map<std::string, std::unique_ptr<Histogram>> histograms;
+		};
+
+		static Registry& GetRegistry() {
+			static Registry* registry = new Registry();
+			return *registry;
+		}
+
+		template<class T>
+		static T& GetMetric(std::map<std::string, std::unique_ptr<T>>& metrics, const std::string& name) {
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			std::unique_ptr<T>& metric = metrics[name];
+			if(!metric) {
+				metric.reset(new T());
+			}
+			return *metric;
+		}
+
+		Counter& GetCounter(const std::string& name) {
+			return GetMetric(GetRegistry().counters, name);
+		}
+
+		Gauge& GetGauge(const std::string& name) {
+			return GetMetric(GetRegistry().gauges, name);
+		}
+
+		Histogram& GetHistogram(const std::string& name) {
+			return GetMetric(GetRegistry().histograms, name);
+		}
+
+		void WriteJson(std::ostream& out) {
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			out << "{\"counters\":{";
+			for(auto it = registry.counters.begin(); it != registry.counters.end(); ++it) {
+				if(it != registry.counters.begin()) {
+					out << ",";
+				}
+				out << "\n\t\"" << it->first << "\":" << it->second->Get();
+			}
+			out << "},\n\"gauges\":{";
+			for(auto it = registry.gauges.begin(); it != registry.gauges.end(); ++it) {
+				if(it != registry.gauges.begin()) {
+					out << ",";
+				}
+				out << "\n\t\"" << it->first << "\":" << it->second->Get();
+			}
+			out << "},\n\"histograms\":{";
+			for(auto it = registry.histograms.begin(); it != registry.histograms.end(); ++it) {
+				if(it != registry.histograms.begin()) {
+					out << ",";
+				}
+				const Histogram& histogram = *it->second;
+				out << "\n\t\"" << it->first << "\":{\"count\":" << histogram.GetCount();
+				out << ",\"min\":" << histogram.GetMin();
+				out << ",\"mean\":" << histogram.GetMean();
+				out << ",\"p50\":" << histogram.GetPercentile(50.);
+				out << ",\"p90\":" << histogram.GetPercentile(90.);
+				out << ",\"p99\":" << histogram.GetPercentile(99.);
+				out << ",\"p999\":" << histogram.GetPercentile(99.9);
+				out << ",\"max\":" << histogram.GetMax() << "}";
+			}
+			out << "}}\n";
+		}
+
+		std::string Dump() {
+			std::stringstream ss;
+			WriteJson(ss);
+			return ss.str();
+		}
+
+		int DumpToFile(const std::string& path) {
+			std::ofstream out(path.c_str());
+			if(!out) {
+				LOGF(SEVERE, "Couldn't open (%s) to dump metrics!", path.c_str());
+				return -1;
+			}
+			WriteJson(out);
+			if(!out) {
+				LOGF(SEVERE, "There was a problem writing metrics to (%s)!", path.c_str());
+				return -2;
+			}
+			return 0;
+		}
+	}
+}
@@ -4,10 +4,23 @@
 namespace KSync {
 	namespace Commanding {
 		int PSExecutionContext::LaunchCommand(const std::string& command) {
+			std::lock_guard<std::mutex> lk(this->launch_mutex);
 			process_stream.reset(new redi::pstream(command.c_str(), redi::pstreams::pstdout|redi::pstreams::pstderr));
 			return 0;
 		}
 
+		int PSExecutionContext::Kill(const bool force) {
+			std::lock_guard<std::mutex> lk(this->launch_mutex);
+			if(!process_stream) {
+				return -1;
+			}
+			if(process_stream->rdbuf()->kill(force ? SIGKILL : SIGTERM) == 0) {
+				LOGF(WARNING, "Couldn't kill (%s)!", process_stream->command().c_str());
+				return -2;
+			}
+			return 0;
+		}
+
 		ExecutionContext::Status_t PSExecutionContext::GetOutputUpdate(std::string& std_out, std::string& std_err) {
 			std_out.clear();
 			std_err.clear();
@@ -0,0 +1,136 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+#include <algorithm>
+
+#include "ksync/sha256.h"
+
+namespace KSync {
+	namespace Hash {
+		static const uint32_t RoundConstants[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		static inline uint32_t RotateRight(const uint32_t x, const int n) {
+			return (x >> n)|(x << (32-n));
+		}
+
+		Sha256::Sha256() : buffered(0), total(0) {
+			static const uint32_t initial[8] = {
+				0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+			};
+			memcpy(this->state, initial, sizeof(initial));
+		}
+
+		void Sha256::Compress(const uint8_t* block) {
+			uint32_t w[64];
+			for(size_t i = 0; i < 16; ++i) {
+				w[i] = (((uint32_t) block[4*i]) << 24)|(((uint32_t) block[4*i+1]) << 16)|(((uint32_t) block[4*i+2]) << 8)|((uint32_t) block[4*i+3]);
+			}
+			for(size_t i = 16; i < 64; ++i) {
+				const uint32_t s0 = RotateRight(w[i-15], 7)^RotateRight(w[i-15], 18)^(w[i-15] >> 3);
+				const uint32_t s1 = RotateRight(w[i-2], 17)^RotateRight(w[i-2], 19)^(w[i-2] >> 10);
+				w[i] = w[i-16]+s0+w[i-7]+s1;
+			}
+			uint32_t a = this->state[0];
+			uint32_t b = this->state[1];
+			uint32_t c = this->state[2];
+			uint32_t d = this->state[3];
+			uint32_t e = this->state[4];
+			uint32_t f = this->state[5];
+			uint32_t g = this->state[6];
+			uint32_t h = this->state[7];
+			for(size_t i = 0; i < 64; ++i) {
+				const uint32_t t1 = h+(RotateRight(e, 6)^RotateRight(e, 11)^RotateRight(e, 25))+((e&f)^(~e&g))+RoundConstants[i]+w[i];
+				const uint32_t t2 = (RotateRight(a, 2)^RotateRight(a, 13)^RotateRight(a, 22))+((a&b)^(a&c)^(b&c));
+				h = g;
+				g = f;
+				f = e;
+				e = d+t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1+t2;
+			}
+			this->state[0] += a;
+			this->state[1] += b;
+			this->state[2] += c;
+			this->state[3] += d;
+			this->state[4] += e;
+			this->state[5] += f;
+			this->state[6] += g;
+			this->state[7] += h;
+		}
+
+		void Sha256::Update(const void* data, size_t size) {
+			const uint8_t* in = (const uint8_t*) data;
+			this->total += size;
+			if(this->buffered != 0) {
+				const size_t n = std::min(size, BlockSize-this->buffered);
+				memcpy(this->buffer+this->buffered, in, n);
+				this->buffered += n;
+				in += n;
+				size -= n;
+				if(this->buffered < BlockSize) {
+					return;
+				}
+				this->Compress(this->buffer);
+				this->buffered = 0;
+			}
+			while(size >= BlockSize) {
+				this->Compress(in);
+				in += BlockSize;
+				size -= BlockSize;
+			}
+			memcpy(this->buffer, in, size);
+			this->buffered = size;
+		}
+
+		void Sha256::Final(digest_t& digest) {
+			const uint64_t bits = this->total*8;
+			static const uint8_t padding[BlockSize] = {0x80};
+			this->Update(padding, 1+((2*BlockSize-9-this->buffered)%BlockSize));
+			uint8_t length[8];
+			for(size_t i = 0; i < 8; ++i) {
+				length[i] = (uint8_t) (bits >> (56-8*i));
+			}
+			this->Update(length, 8);
+			for(size_t i = 0; i < 8; ++i) {
+				digest[4*i] = (uint8_t) (this->state[i] >> 24);
+				digest[4*i+1] = (uint8_t) (this->state[i] >> 16);
+				digest[4*i+2] = (uint8_t) (this->state[i] >> 8);
+				digest[4*i+3] = (uint8_t) this->state[i];
+			}
+		}
+
+		void Sha256::Digest(const void* data, const size_t size, digest_t& digest) {
+			Sha256 sha;
+			sha.Update(data, size);
+			sha.Final(digest);
+		}
+	}
+}
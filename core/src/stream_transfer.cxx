@@ -0,0 +1,299 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+#include "ksync/logging.h"
+#include "ksync/stream_transfer.h"
+#include "ksync/comm/object.h"
+
+namespace KSync {
+	namespace Comm {
+		StreamSender::StreamSender(std::shared_ptr<ClientCommunicator>& communicator, const uint32_t chunk_size, const uint32_t window) {
+			this->communicator = communicator;
+			this->chunk_size = chunk_size;
+			this->window = window;
+			this->idle_timeout = 10000;
+			this->stream_id = 0;
+			this->acked = 0;
+			this->limit = 0;
+		}
+
+		int StreamSender::SendFile(const std::string& path) {
+			int fd = open(path.c_str(), O_RDONLY);
+			if(fd < 0) {
+				LOGF(SEVERE, "Couldn't open (%s) for streaming!", path.c_str());
+				return -1;
+			}
+			struct stat file_stat;
+			if(fstat(fd, &file_stat) < 0) {
+				LOGF(SEVERE, "Couldn't stat (%s)!", path.c_str());
+				close(fd);
+				return -1;
+			}
+			int status = this->SendFileDescriptor(fd, (uint64_t) file_stat.st_size);
+			close(fd);
+			return status;
+		}
+
+		int StreamSender::SendFileDescriptor(const int fd, const uint64_t total_size) {
+			return this->Send(fd, nullptr, total_size);
+		}
+
+		int StreamSender::SendBuffer(const char* data, const uint64_t total_size) {
+			return this->Send(-1, data, total_size);
+		}
+
+		int StreamSender::Send(const int fd, const char* data, const uint64_t total_size) {
+			//Empty chunks would never get through the payload.
+			if(this->chunk_size == 0) {
+				LOGF(SEVERE, "Can't stream with a chunk size of 0!");
+				return -7;
+			}
+			this->stream_id = 0;
+			while(this->stream_id == 0) {
+				this->stream_id = KSync::Utilities::GenUniformRandom<stream_id_t>();
+			}
+			this->acked = 0;
+			this->limit = 0;
+
+			StreamStart start(this->stream_id, total_size, this->chunk_size, this->window);
+			std::shared_ptr<CommObject> start_obj = start.GetCommObject();
+			if(this->communicator->send(start_obj) < 0) {
+				LOGF(SEVERE, "Couldn't send the stream start!");
+				return -1;
+			}
+
+			stream_seq_t sequence = 0;
+			uint64_t bytes_sent = 0;
+			bool end_sent = false;
+			while(true) {
+				//Fill the window. Each chunk is read directly into the buffer which goes on the wire.
+				while((!end_sent)&&(sequence < this->limit)&&(bytes_sent < total_size)) {
+					const size_t to_read = (size_t) std::min<uint64_t>(this->chunk_size, total_size-bytes_sent);
+					std::shared_ptr<CommObject> chunk_obj = CommObject::Create(StreamChunk::HeaderSize+to_read, StreamChunk::Type);
+					char* payload = chunk_obj->GetWritablePayload();
+					StreamChunk::WriteHeader(payload, this->stream_id, sequence);
+					size_t num_read = 0;
+					if(data != nullptr) {
+						memcpy(payload+StreamChunk::HeaderSize, data+bytes_sent, to_read);
+						num_read = to_read;
+					}
+					while(num_read < to_read) {
+						ssize_t status = read(fd, payload+StreamChunk::HeaderSize+num_read, to_read-num_read);
+						if(status < 0) {
+							if(errno == EINTR) {
+								continue;
+							}
+							LOGF(SEVERE, "There was a problem reading from the stream source!");
+							return -2;
+						} else if (status == 0) {
+							LOGF(SEVERE, "Stream source ended early! (%lu of %lu bytes)", bytes_sent+num_read, total_size);
+							return -3;
+						}
+						num_read += (size_t) status;
+					}
+					if(chunk_obj->Seal(StreamChunk::HeaderSize+num_read) < 0) {
+						LOGF(SEVERE, "Couldn't seal stream chunk!");
+						return -4;
+					}
+					if(this->communicator->send(chunk_obj) < 0) {
+						LOGF(SEVERE, "Couldn't send stream chunk (%lu)!", sequence);
+						return -6;
+					}
+					bytes_sent += num_read;
+					++sequence;
+				}
+
+				if((!end_sent)&&(bytes_sent == total_size)) {
+					StreamEnd end(this->stream_id, sequence, bytes_sent);
+					std::shared_ptr<CommObject> end_obj = end.GetCommObject();
+					if(this->communicator->send(end_obj) < 0) {
+						LOGF(SEVERE, "Couldn't send the stream end!");
+						return -6;
+					}
+					end_sent = true;
+				}
+
+				if(end_sent&&(this->limit > 0)&&(this->acked >= sequence)) {
+					return 0;
+				}
+
+				if(this->WaitForCredit() < 0) {
+					LOGF(SEVERE, "Timed out waiting for stream credit! (%lu chunks acknowledged)", this->acked);
+					return -5;
+				}
+			}
+		}
+
+		//Time left until deadline for a blocking get, never negative.
+		static int RemainingMs(const std::chrono::steady_clock::time_point& deadline) {
+			return (int) std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count());
+		}
+
+		int StreamSender::WaitForCredit() {
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(this->idle_timeout);
+			while(true) {
+				std::shared_ptr<CommObject> recv_obj = this->communicator->get(RemainingMs(deadline));
+				if(!recv_obj) {
+					return -1;
+				}
+				if(recv_obj->GetType() == StreamCredit::Type) {
+					std::shared_ptr<StreamCredit> credit;
+					CommCreator(credit, recv_obj);
+					if(credit->GetStreamId() == this->stream_id) {
+						this->acked = std::max(this->acked, credit->GetAcked());
+						this->limit = std::max(this->limit, credit->GetLimit());
+						return 0;
+					}
+				}
+				this->deferred.push_back(recv_obj);
+			}
+		}
+
+		const uint32_t StreamReceiver::MaxWindow;
+		const uint32_t StreamReceiver::MaxChunkSize;
+
+		StreamReceiver::StreamReceiver(std::shared_ptr<ClientCommunicator>& communicator) {
+			this->communicator = communicator;
+			this->started = false;
+			this->stream_id = 0;
+			this->total_size = 0;
+			this->chunk_size = 0;
+			this->window = 0;
+			this->idle_timeout = 10000;
+			this->next_sequence = 0;
+			this->granted_limit = 0;
+			this->bytes_received = 0;
+		}
+
+		int StreamReceiver::SendCredit() {
+			this->granted_limit = this->next_sequence+this->window;
+			StreamCredit credit(this->stream_id, this->next_sequence, this->granted_limit);
+			std::shared_ptr<CommObject> credit_obj = credit.GetCommObject();
+			if(this->communicator->send(credit_obj) < 0) {
+				LOGF(SEVERE, "Couldn't send stream credit!");
+				return -1;
+			}
+			return 0;
+		}
+
+		int StreamReceiver::HandleMessage(const std::shared_ptr<CommObject>& comm_obj, std::ostream& out) {
+			if((comm_obj->GetType() == StreamStart::Type)&&(!this->started)) {
+				std::shared_ptr<StreamStart> start;
+				CommCreator(start, comm_obj);
+				if((start->GetChunkSize() == 0)||(start->GetChunkSize() > MaxChunkSize)) {
+					LOGF(SEVERE, "Requested stream chunk size (%u) is invalid!", start->GetChunkSize());
+					return -1;
+				}
+				this->started = true;
+				this->stream_id = start->GetStreamId();
+				this->total_size = start->GetTotalSize();
+				this->chunk_size = start->GetChunkSize();
+				this->window = std::max<uint32_t>(1, std::min(start->GetWindow(), MaxWindow));
+				this->next_sequence = 0;
+				this->bytes_received = 0;
+				return this->SendCredit();
+			} else if (comm_obj->GetType() == StreamChunk::Type) {
+				std::shared_ptr<StreamChunk> chunk;
+				CommCreator(chunk, comm_obj);
+				if((!this->started)||(chunk->GetStreamId() != this->stream_id)) {
+					this->deferred.push_back(comm_obj);
+					return Continue;
+				}
+				if(chunk->GetSequence() != this->next_sequence) {
+					LOGF(SEVERE, "Stream chunk out of sequence! expected (%lu) got (%lu)", this->next_sequence, chunk->GetSequence());
+					return -2;
+				}
+				//A peer ignoring its credit or its own sizes would have us buffer and write without bound.
+				if(chunk->GetSequence() >= this->granted_limit) {
+					LOGF(SEVERE, "Stream chunk (%lu) is past the credit granted (%lu)!", chunk->GetSequence(), this->granted_limit);
+					return -6;
+				}
+				if(chunk->GetSize() > this->chunk_size) {
+					LOGF(SEVERE, "Stream chunk of (%lu) bytes is over the chunk size (%u)!", (uint64_t) chunk->GetSize(), this->chunk_size);
+					return -7;
+				}
+				if(chunk->GetSize() > this->total_size-this->bytes_received) {
+					LOGF(SEVERE, "Stream chunk runs past the (%lu) bytes announced!", this->total_size);
+					return -8;
+				}
+				out.write(chunk->GetData(), chunk->GetSize());
+				if(!out) {
+					LOGF(SEVERE, "There was a problem writing the stream chunk!");
+					return -3;
+				}
+				this->bytes_received += chunk->GetSize();
+				++this->next_sequence;
+				//Grant credit in batches of half a window to keep credit traffic low.
+				if(this->granted_limit-this->next_sequence <= this->window/2) {
+					return this->SendCredit();
+				}
+				return Continue;
+			} else if (comm_obj->GetType() == StreamEnd::Type) {
+				std::shared_ptr<StreamEnd> end;
+				CommCreator(end, comm_obj);
+				if((!this->started)||(end->GetStreamId() != this->stream_id)) {
+					this->deferred.push_back(comm_obj);
+					return Continue;
+				}
+				if((end->GetNumChunks() != this->next_sequence)||(end->GetTotalSize() != this->bytes_received)||(this->bytes_received != this->total_size)) {
+					LOGF(SEVERE, "Stream ended incomplete! (%lu of %lu chunks, %lu of %lu bytes)", this->next_sequence, end->GetNumChunks(), this->bytes_received, this->total_size);
+					return -4;
+				}
+				out.flush();
+				if(this->SendCredit() < 0) {
+					return -5;
+				}
+				this->started = false;
+				return Finished;
+			}
+			this->deferred.push_back(comm_obj);
+			return Continue;
+		}
+
+		int StreamReceiver::ReceiveFile(const std::string& path) {
+			std::ofstream out(path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+			if(!out) {
+				LOGF(SEVERE, "Couldn't open (%s) to receive the stream!", path.c_str());
+				return -1;
+			}
+			while(true) {
+				std::shared_ptr<CommObject> recv_obj = this->communicator->get(this->idle_timeout);
+				if(!recv_obj) {
+					LOGF(SEVERE, "Timed out waiting for stream data!");
+					return -2;
+				}
+				int status = this->HandleMessage(recv_obj, out);
+				if(status < 0) {
+					return status;
+				} else if (status == Finished) {
+					return 0;
+				}
+			}
+		}
+	}
+}
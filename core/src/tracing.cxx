@@ -0,0 +1,239 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <random>
+#include <fstream>
+
+#include "ksync/logging.h"
+#include "ksync/tracing.h"
+
+namespace KSync {
+	namespace Tracing {
+		std::atomic<bool> enabled(false);
+
+		class Event {
+			public:
+				char phase;
+				const char* name;
+				trace_id_t trace_id;
+				uint64_t timestamp;
+				uint64_t duration;
+		};
+
+		//Each thread appends to its own buffer, the lock is only contended while writing out.
+		class ThreadBuffer {
+			public:
+				ThreadBuffer(const uint32_t tid) : tid(tid), dropped(0) {}
+				std::mutex mutex;
+				std::vector<Event> events;
+				const uint32_t tid;
+				size_t dropped;
+		};
+
+		//Leaked on purpose so thread_local destructors can run after static destruction.
+		class Registry {
+			public:
+				Registry() : next_tid(1) {}
+				std::mutex mutex;
+				std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+				std::string path;
+				std::string process_name;
+				uint32_t next_tid;
+		};
+
+		static Registry& GetRegistry() {
+			static Registry* registry = new Registry();
+			return *registry;
+		}
+
+		static thread_local std::shared_ptr<ThreadBuffer> thread_buffer;
+
+		static ThreadBuffer& GetThreadBuffer() {
+			if(!thread_buffer) {
+				Registry& registry = GetRegistry();
+				std::lock_guard<std::mutex> lk(registry.mutex);
+				thread_buffer.reset(new ThreadBuffer(registry.next_tid++));
+				registry.buffers.push_back(thread_buffer);
+			}
+			return *thread_buffer;
+		}
+
+		static void Record(const char phase, const char* name, const trace_id_t trace_id, const uint64_t timestamp, const uint64_t duration) {
+			ThreadBuffer& buffer = GetThreadBuffer();
+			std::lock_guard<std::mutex> lk(buffer.mutex);
+			if(buffer.events.size() >= MaxEventsPerThread) {
+				++buffer.dropped;
+				return;
+			}
+			Event event;
+			event.phase = phase;
+			event.name = name;
+			event.trace_id = trace_id;
+			event.timestamp = timestamp;
+			event.duration = duration;
+			buffer.events.push_back(event);
+		}
+
+		trace_id_t GenTraceId() {
+			//Random high bits keep ids from different processes apart.
+			static const trace_id_t process_salt = ((trace_id_t) std::random_device()()) << 32;
+			static std::atomic<uint32_t> next_id(1);
+			return process_salt|next_id.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		uint64_t Now() {
+			return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		void RecordSpan(const char* name, const trace_id_t trace_id, const uint64_t start, const uint64_t end) {
+			if(!Enabled()||(trace_id == 0)) {
+				return;
+			}
+			Record('X', name, trace_id, start, end-start);
+		}
+
+		void RecordInstant(const char* name, const trace_id_t trace_id) {
+			if(!Enabled()||(trace_id == 0)) {
+				return;
+			}
+			Record('i', name, trace_id, Now(), 0);
+		}
+
+		void RecordBegin(const char* name, const trace_id_t trace_id) {
+			if(!Enabled()||(trace_id == 0)) {
+				return;
+			}
+			Record('b', name, trace_id, Now(), 0);
+		}
+
+		void RecordEnd(const char* name, const trace_id_t trace_id) {
+			if(!Enabled()||(trace_id == 0)) {
+				return;
+			}
+			Record('e', name, trace_id, Now(), 0);
+		}
+
+		int Enable(const std::string& path, const std::string& process_name) {
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			if(Enabled()) {
+				LOGF(WARNING, "Tracing is already enabled!");
+				return -1;
+			}
+			registry.path = path;
+			registry.process_name = process_name;
+			enabled.store(true);
+			return 0;
+		}
+
+		//Chrome wants microseconds, keep the nanoseconds as a fraction.
+		static void WriteMicroseconds(std::ostream& out, const uint64_t ns) {
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), "%llu.%03llu", (unsigned long long) (ns/1000), (unsigned long long) (ns%1000));
+			out << buffer;
+		}
+
+		static void WriteEscaped(std::ostream& out, const std::string& value) {
+			for(size_t i = 0; i < value.size(); ++i) {
+				const char c = value[i];
+				if((c == '"')||(c == '\\')) {
+					out << '\\' << c;
+				} else if ((unsigned char) c < 0x20) {
+					char buffer[8];
+					snprintf(buffer, sizeof(buffer), "\\u%04x", (unsigned int) c);
+					out << buffer;
+				} else {
+					out << c;
+				}
+			}
+		}
+
+		int Write(std::ostream& out) {
+			Registry& registry = GetRegistry();
+			std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+			std::string process_name;
+			{
+				std::lock_guard<std::mutex> lk(registry.mutex);
+				buffers = registry.buffers;
+				process_name = registry.process_name;
+			}
+			const pid_t pid = getpid();
+			out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+			out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":0,\"args\":{\"name\":\"";
+			WriteEscaped(out, process_name);
+			out << "\"}}";
+			char id[32];
+			for(size_t i = 0; i < buffers.size(); ++i) {
+				std::lock_guard<std::mutex> lk(buffers[i]->mutex);
+				if(buffers[i]->dropped != 0) {
+					LOGF(WARNING, "Trace buffer of thread (%u) was full, (%lu) events were dropped!", buffers[i]->tid, buffers[i]->dropped);
+				}
+				for(size_t j = 0; j < buffers[i]->events.size(); ++j) {
+					const Event& event = buffers[i]->events[j];
+					snprintf(id, sizeof(id), "0x%016llx", (unsigned long long) event.trace_id);
+					out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"ksync\",\"ph\":\"" << event.phase << "\",\"ts\":";
+					WriteMicroseconds(out, event.timestamp);
+					if(event.phase == 'X') {
+						out << ",\"dur\":";
+						WriteMicroseconds(out, event.duration);
+					} else if (event.phase == 'i') {
+						out << ",\"s\":\"t\"";
+					} else {
+						out << ",\"id\":\"" << id << "\"";
+					}
+					out << ",\"pid\":" << pid << ",\"tid\":" << buffers[i]->tid << ",\"args\":{\"trace_id\":\"" << id << "\"}}";
+				}
+			}
+			out << "\n]}\n";
+			if(!out) {
+				return -1;
+			}
+			return 0;
+		}
+
+		int Finish() {
+			if(!Enabled()) {
+				return 0;
+			}
+			enabled.store(false);
+			std::string path;
+			{
+				Registry& registry = GetRegistry();
+				std::lock_guard<std::mutex> lk(registry.mutex);
+				path = registry.path;
+			}
+			std::ofstream out(path.c_str());
+			if(!out) {
+				LOGF(SEVERE, "Couldn't open the trace file (%s)!", path.c_str());
+				return -1;
+			}
+			if(Write(out) < 0) {
+				LOGF(SEVERE, "There was a problem writing the trace file (%s)!", path.c_str());
+				return -2;
+			}
+			LOGF(INFO, "Wrote trace to (%s)", path.c_str());
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,459 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <thread>
+#include <functional>
+
+#include "ksync/logging.h"
+#include "ksync/transfer_pipeline.h"
+
+namespace KSync {
+	namespace Transfer {
+		PipelineConfig::PipelineConfig() : read(2, 16), hash(std::max(1u, std::thread::hardware_concurrency()), 16), filter(1, 16) {
+			this->send_queue_depth = 16;
+			this->block_size = KSync::Hash::HashCache::DefaultBlockSize;
+			this->chunk_size = KSync::Comm::StreamSender::DefaultChunkSize;
+			this->window = KSync::Comm::StreamSender::DefaultWindow;
+			this->max_buffered_size = 8*1024*1024;
+			this->max_buffered_bytes = 256*1024*1024;
+			this->cache = nullptr;
+		}
+
+		//A file on its way through the pipeline. Small ones are read into data,
+		//charged to the budget until the job goes away, bigger ones stay open.
+		//Stages let go of each job before waiting for the next so the budget
+		//isn't held by a thread sitting idle.
+		class Pipeline::Job {
+			public:
+				Job(const std::string& path) : path(path), fd(-1), storable(false), budget(nullptr) {}
+				~Job() {
+					if(this->fd >= 0) {
+						close(this->fd);
+					}
+					if(this->budget != nullptr) {
+						this->budget->release(this->data.size());
+					}
+				}
+				uint64_t GetSize() const {
+					return (uint64_t) this->st.st_size;
+				}
+				std::string path;
+				std::vector<char> data;
+				int fd;
+				struct stat st;
+				//The file held still while it was read, so its hashes may be cached.
+				bool storable;
+				KSync::Hash::FileHashes hashes;
+				KSync::Utilities::byte_budget* budget;
+		};
+
+		//The last thread of a stage to finish closes the queue behind it, which lets the next stage drain and stop.
+		template<class Queue>
+		static void StartStage(std::vector<std::thread>& threads, const size_t num_threads, const std::function<void()>& work, Queue& next) {
+			std::shared_ptr<std::atomic<size_t>> remaining(new std::atomic<size_t>(std::max((size_t) 1, num_threads)));
+			for(size_t i = 0; i < remaining->load(); ++i) {
+				threads.push_back(std::thread([work, remaining, &next]() {
+					work();
+					if(remaining->fetch_sub(1) == 1) {
+						next.close();
+					}
+				}));
+			}
+		}
+
+		Pipeline::Pipeline(const PipelineConfig& config, const std::vector<std::shared_ptr<KSync::Comm::ClientCommunicator>>& communicators) :
+			config(config),
+			communicators(communicators),
+			files_sent(0),
+			files_skipped(0),
+			bytes_sent(0),
+			num_errors(0),
+			files_sent_counter(KSync::Metrics::GetCounter("transfer.files_sent")),
+			files_skipped_counter(KSync::Metrics::GetCounter("transfer.files_skipped")),
+			bytes_sent_counter(KSync::Metrics::GetCounter("transfer.bytes_sent")),
+			errors_counter(KSync::Metrics::GetCounter("transfer.errors")) {
+		}
+
+		void Pipeline::Fail() {
+			this->num_errors.fetch_add(1);
+			this->errors_counter.Add();
+		}
+
+		void Pipeline::Read(const std::string& root, job_queue& in, job_queue& out, KSync::Utilities::byte_budget& budget) {
+			for(std::shared_ptr<Job> job; in.pop(job); job.reset()) {
+				const std::string full_path = root+"/"+job->path;
+				job->fd = open(full_path.c_str(), O_RDONLY|O_CLOEXEC);
+				if(job->fd < 0) {
+					LOGF(SEVERE, "Couldn't open (%s) to send! (%s)", full_path.c_str(), strerror(errno));
+					this->Fail();
+					continue;
+				}
+				if((fstat(job->fd, &job->st) < 0)||!S_ISREG(job->st.st_mode)) {
+					LOGF(SEVERE, "(%s) isn't a regular file!", full_path.c_str());
+					this->Fail();
+					continue;
+				}
+				posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+				if(job->GetSize() > this->config.max_buffered_size) {
+					//Hashed and sent straight from the file a block at a time.
+					if(!out.push(job)) {
+						return;
+					}
+					continue;
+				}
+				//Read into memory of our own, a mapping would fault if the file shrank under a later stage.
+				budget.acquire(job->GetSize());
+				job->budget = &budget;
+				job->data.resize((size_t) job->GetSize());
+				size_t filled = 0;
+				int read_error = 0;
+				while(filled < job->data.size()) {
+					const ssize_t n = pread(job->fd, job->data.data()+filled, job->data.size()-filled, (off_t) filled);
+					if(n < 0) {
+						if(errno == EINTR) {
+							continue;
+						}
+						read_error = errno;
+						break;
+					}
+					if(n == 0) {
+						break;
+					}
+					filled += (size_t) n;
+				}
+				if(filled != job->data.size()) {
+					LOGF(SEVERE, "Couldn't read all of (%s)! (%s)", full_path.c_str(), (read_error != 0) ? strerror(read_error) : "it was truncated");
+					this->Fail();
+					continue;
+				}
+				if(this->config.cache != nullptr) {
+					struct stat after;
+					job->storable = (fstat(job->fd, &after) == 0)&&KSync::Hash::HashCache::Storable(job->st, after);
+				}
+				close(job->fd);
+				job->fd = -1;
+				if(!out.push(job)) {
+					return;
+				}
+			}
+		}
+
+		void Pipeline::Hash(job_queue& in, job_queue& out) {
+			for(std::shared_ptr<Job> job; in.pop(job); job.reset()) {
+				if((this->config.cache == nullptr)||!this->config.cache->Lookup(job->st, job->hashes)) {
+					if(job->fd < 0) {
+						KSync::Hash::HashBuffer(job->data.data(), job->data.size(), this->config.block_size, job->hashes);
+					} else {
+						struct stat after;
+						if((KSync::Hash::HashFile(job->fd, this->config.block_size, job->hashes) < 0)||(fstat(job->fd, &after) < 0)) {
+							LOGF(SEVERE, "There was a problem hashing (%s)!", job->path.c_str());
+							this->Fail();
+							continue;
+						}
+						//Whatever was hashed has to be what gets sent.
+						if(after.st_size != job->st.st_size) {
+							LOGF(SEVERE, "(%s) changed size while it was hashed!", job->path.c_str());
+							this->Fail();
+							continue;
+						}
+						job->storable = (this->config.cache != nullptr)&&KSync::Hash::HashCache::Storable(job->st, after);
+					}
+					if(job->storable&&(this->config.cache->Store(job->st, job->hashes) < 0)) {
+						LOGF_RATE_LIMITED(WARNING, 10, 1000, "Couldn't cache the hashes of (%s)!", job->path.c_str());
+					}
+				}
+				if(!out.push(job)) {
+					return;
+				}
+			}
+		}
+
+		void Pipeline::Filter(job_queue& in, job_queue& out) {
+			for(std::shared_ptr<Job> job; in.pop(job); job.reset()) {
+				std::map<std::string, KSync::Hash::digest_t>::const_iterator known_it = this->config.known.find(job->path);
+				if((known_it != this->config.known.end())&&(known_it->second == job->hashes.digest)) {
+					this->files_skipped.fetch_add(1);
+					this->files_skipped_counter.Add();
+					continue;
+				}
+				if(!out.push(job)) {
+					return;
+				}
+			}
+		}
+
+		void Pipeline::Send(std::shared_ptr<KSync::Comm::ClientCommunicator> communicator, job_queue& in, std::atomic<size_t>& live_senders) {
+			KSync::Comm::StreamSender sender(communicator, this->config.chunk_size, this->config.window);
+			bool failed = false;
+			for(std::shared_ptr<Job> job; !failed&&in.pop(job); job.reset()) {
+				KSync::Comm::TransferFile header(job->path, job->GetSize(), this->config.block_size, job->hashes.digest);
+				std::shared_ptr<KSync::Comm::CommObject> header_obj = header.GetCommObject();
+				if(communicator->send(header_obj) < 0) {
+					LOGF(SEVERE, "Couldn't send the header of (%s)!", job->path.c_str());
+					failed = true;
+					continue;
+				}
+				int status = 0;
+				if(job->fd < 0) {
+					status = sender.SendBuffer(job->data.data(), job->data.size());
+				} else if(lseek(job->fd, 0, SEEK_SET) < 0) {
+					status = -1;
+				} else {
+					status = sender.SendFileDescriptor(job->fd, job->GetSize());
+				}
+				if(status < 0) {
+					LOGF(SEVERE, "There was a problem sending (%s)!", job->path.c_str());
+					failed = true;
+					continue;
+				}
+				//Nothing else is expected from the receiver.
+				sender.GetDeferred().clear();
+				this->files_sent.fetch_add(1);
+				this->files_sent_counter.Add();
+				this->bytes_sent.fetch_add(job->GetSize());
+				this->bytes_sent_counter.Add(job->GetSize());
+			}
+			if(!failed) {
+				return;
+			}
+			//The receiver may still be inside the broken stream, so this communicator is done.
+			this->Fail();
+			if(live_senders.fetch_sub(1) != 1) {
+				return;
+			}
+			//Nothing is left to send with, fail the rest so the stages before us can finish.
+			LOGF(SEVERE, "Every connection failed, giving up on the remaining files!");
+			for(std::shared_ptr<Job> job; in.pop(job); job.reset()) {
+				this->Fail();
+			}
+		}
+
+		int Pipeline::Run(const std::string& root, const std::vector<std::string>& paths) {
+			if(this->communicators.empty()) {
+				LOGF(SEVERE, "The pipeline needs at least one communicator to send with!");
+				return -1;
+			}
+			if((this->config.cache != nullptr)&&(this->config.cache->GetBlockSize() != this->config.block_size)) {
+				LOGF(SEVERE, "The hash cache uses blocks of (%u) but the pipeline (%u)!", this->config.cache->GetBlockSize(), this->config.block_size);
+				return -2;
+			}
+			const uint64_t errors_before = this->num_errors.load();
+
+			job_queue read_queue(this->config.read.queue_depth);
+			job_queue hash_queue(this->config.hash.queue_depth);
+			job_queue filter_queue(this->config.filter.queue_depth);
+			job_queue send_queue(this->config.send_queue_depth);
+			//Never used, the send stage has no queue behind it.
+			job_queue done_queue(1);
+
+			KSync::Utilities::byte_budget budget(this->config.max_buffered_bytes);
+
+			std::vector<std::thread> threads;
+			StartStage(threads, this->config.read.num_threads, [this, &root, &read_queue, &hash_queue, &budget]() {
+				this->Read(root, read_queue, hash_queue, budget);
+			}, hash_queue);
+			StartStage(threads, this->config.hash.num_threads, [this, &hash_queue, &filter_queue]() {
+				this->Hash(hash_queue, filter_queue);
+			}, filter_queue);
+			StartStage(threads, this->config.filter.num_threads, [this, &filter_queue, &send_queue]() {
+				this->Filter(filter_queue, send_queue);
+			}, send_queue);
+			std::atomic<size_t> live_senders(this->communicators.size());
+			for(size_t i = 0; i < this->communicators.size(); ++i) {
+				std::shared_ptr<KSync::Comm::ClientCommunicator> communicator = this->communicators[i];
+				StartStage(threads, 1, [this, communicator, &send_queue, &live_senders]() {
+					this->Send(communicator, send_queue, live_senders);
+				}, done_queue);
+			}
+
+			for(size_t i = 0; i < paths.size(); ++i) {
+				if(!read_queue.push(std::make_shared<Job>(paths[i]))) {
+					break;
+				}
+			}
+			read_queue.close();
+			for(size_t i = 0; i < threads.size(); ++i) {
+				threads[i].join();
+			}
+
+			const uint64_t errors = this->num_errors.load()-errors_before;
+			if(errors != 0) {
+				LOGF(SEVERE, "(%lu) of (%lu) files couldn't be sent!", errors, paths.size());
+				return -3;
+			}
+			return 0;
+		}
+
+		const char* const Receiver::PartSuffix = ".ksync-part";
+		const uint32_t Receiver::MaxBlockSize;
+
+		Receiver::Receiver(std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator, const std::string& root) : communicator(communicator), stream_receiver(communicator), root(root) {
+			this->idle_timeout = 10000;
+			this->files_received = 0;
+		}
+
+		//Relative, and never climbing out of the root.
+		static bool IsSafePath(const std::string& path) {
+			if(path.empty()||(path[0] == '/')) {
+				return false;
+			}
+			size_t begin = 0;
+			while(begin <= path.size()) {
+				size_t end = path.find('/', begin);
+				if(end == std::string::npos) {
+					end = path.size();
+				}
+				if(path.compare(begin, end-begin, "..") == 0) {
+					return false;
+				}
+				begin = end+1;
+			}
+			return true;
+		}
+
+		int Receiver::Start(const std::shared_ptr<KSync::Comm::CommObject>& comm_obj) {
+			std::shared_ptr<KSync::Comm::TransferFile> file;
+			KSync::Comm::CommCreator(file, comm_obj);
+			if(!IsSafePath(file->GetPath())) {
+				LOGF(SEVERE, "Refusing to receive (%s) outside of the root!", file->GetPath().c_str());
+				return -1;
+			}
+			if((file->GetBlockSize() == 0)||(file->GetBlockSize() > MaxBlockSize)) {
+				LOGF(SEVERE, "Invalid block size (%u) for (%s)!", file->GetBlockSize(), file->GetPath().c_str());
+				return -2;
+			}
+			//Create the directories leading up to the file.
+			size_t slash = file->GetPath().find('/');
+			while(slash != std::string::npos) {
+				const std::string dir = this->root+"/"+file->GetPath().substr(0, slash);
+				if((mkdir(dir.c_str(), 0755) < 0)&&(errno != EEXIST)) {
+					LOGF(SEVERE, "Couldn't create the directory (%s)! (%s)", dir.c_str(), strerror(errno));
+					return -3;
+				}
+				slash = file->GetPath().find('/', slash+1);
+			}
+			this->final_path = this->root+"/"+file->GetPath();
+			this->part_path = this->final_path+PartSuffix;
+			this->out.open(this->part_path.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+			if(!this->out) {
+				LOGF(SEVERE, "Couldn't open (%s) to receive into!", this->part_path.c_str());
+				this->out.clear();
+				return -4;
+			}
+			this->current = file;
+			return Continue;
+		}
+
+		int Receiver::Finish() {
+			this->out.close();
+			if(!this->out) {
+				LOGF(SEVERE, "There was a problem writing (%s)!", this->part_path.c_str());
+				this->Abort();
+				return -5;
+			}
+			if(this->stream_receiver.GetBytesReceived() != this->current->GetSize()) {
+				LOGF(SEVERE, "Received (%lu) bytes of (%s), expected (%lu)!", this->stream_receiver.GetBytesReceived(), this->current->GetPath().c_str(), this->current->GetSize());
+				this->Abort();
+				return -6;
+			}
+			const int fd = open(this->part_path.c_str(), O_RDONLY|O_CLOEXEC);
+			if(fd < 0) {
+				LOGF(SEVERE, "Couldn't open (%s) to check it! (%s)", this->part_path.c_str(), strerror(errno));
+				this->Abort();
+				return -7;
+			}
+			KSync::Hash::FileHashes hashes;
+			const int status = KSync::Hash::HashFile(fd, this->current->GetBlockSize(), hashes);
+			close(fd);
+			if(status < 0) {
+				LOGF(SEVERE, "There was a problem hashing (%s)!", this->part_path.c_str());
+				this->Abort();
+				return -8;
+			}
+			if(hashes.digest != this->current->GetDigest()) {
+				LOGF(SEVERE, "(%s) doesn't match the digest it was sent with!", this->current->GetPath().c_str());
+				this->Abort();
+				return -9;
+			}
+			if(rename(this->part_path.c_str(), this->final_path.c_str()) < 0) {
+				LOGF(SEVERE, "Couldn't move (%s) into place! (%s)", this->final_path.c_str(), strerror(errno));
+				this->Abort();
+				return -10;
+			}
+			++this->files_received;
+			this->current.reset();
+			return Finished;
+		}
+
+		void Receiver::Abort() {
+			if(this->out.is_open()) {
+				this->out.close();
+			}
+			this->out.clear();
+			unlink(this->part_path.c_str());
+			this->current.reset();
+		}
+
+		int Receiver::HandleMessage(const std::shared_ptr<KSync::Comm::CommObject>& comm_obj) {
+			if(comm_obj->GetType() == KSync::Comm::TransferFile::Type) {
+				if(this->current) {
+					LOGF(SEVERE, "(%s) started before (%s) finished!", KSync::Comm::TransferFile(comm_obj).GetPath().c_str(), this->current->GetPath().c_str());
+					this->Abort();
+					return -11;
+				}
+				return this->Start(comm_obj);
+			}
+			if(!this->current) {
+				this->stream_receiver.GetDeferred().push_back(comm_obj);
+				return Continue;
+			}
+			const int status = this->stream_receiver.HandleMessage(comm_obj, this->out);
+			if(status < 0) {
+				LOGF(SEVERE, "There was a problem receiving (%s)!", this->current->GetPath().c_str());
+				this->Abort();
+				return status;
+			} else if (status == KSync::Comm::StreamReceiver::Finished) {
+				return this->Finish();
+			}
+			return Continue;
+		}
+
+		int Receiver::ReceiveFile() {
+			while(true) {
+				std::shared_ptr<KSync::Comm::CommObject> recv_obj = this->communicator->get(this->idle_timeout);
+				if(!recv_obj) {
+					LOGF(SEVERE, "Timed out waiting for a file!");
+					if(this->current) {
+						this->Abort();
+					}
+					return -12;
+				}
+				const int status = this->HandleMessage(recv_obj);
+				if(status != Continue) {
+					return status;
+				}
+			}
+		}
+	}
+}
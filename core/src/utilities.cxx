@@ -10,15 +10,24 @@
 
 namespace KSync {
 	namespace Utilities {
-		void set_up_common_arguments_and_defaults(ArgParse::ArgParser& Parser, std::string& log_dir, std::string& gateway_socket_url, bool& gateway_socket_url_defined, bool& nanomsg) {
+		void set_up_common_arguments_and_defaults(ArgParse::ArgParser& Parser, std::string& log_dir, std::string& gateway_socket_url, bool& gateway_socket_url_defined, bool& nanomsg, CommTuning& tuning) {
 			log_dir = "";
 			gateway_socket_url = "";
 			gateway_socket_url_defined = false;
 			nanomsg = false;
+			tuning = CommTuning();
 
 			Parser.AddArgument("--log-dir", "Use this directory for logging.", &log_dir);
 			Parser.AddArgument("--nanomsg", "Use nanomsg comm backend. Deafult is zeromq", &nanomsg);
 			Parser.AddArgument("gateway-socket", "Socket to use to negotiate new client connections. Default is : ipc:///tmp/ksync/<user>/ksync-connect.ipc", &gateway_socket_url, ArgParse::Argument::Optional, &gateway_socket_url_defined);
+
+			//Tuning
+			Parser.AddArgument("--io-threads", "Number of zeromq IO threads. Default is 1.", &tuning.io_threads);
+			Parser.AddArgument("--send-hwm", "Messages queued to send per data socket before sends block. zeromq only, default is 1000.", &tuning.send_hwm);
+			Parser.AddArgument("--recv-hwm", "Messages queued on receipt per data socket before the rest wait in the kernel. zeromq only, default is 1000.", &tuning.recv_hwm);
+			Parser.AddArgument("--send-buffer", "Send buffer size of data sockets in bytes, 0 is the kernel's default. Default is 4MiB.", &tuning.send_buffer);
+			Parser.AddArgument("--recv-buffer", "Receive buffer size of data sockets in bytes, 0 is the kernel's default. Default is 4MiB.", &tuning.recv_buffer);
+			Parser.AddArgument("--affinity", "Bit mask of the zeromq IO threads serving data sockets. Default is 0, any thread.", &tuning.affinity);
 		}
 		int get_user_ksync_dir(std::string& dir) {
 			char* login_name = getlogin();
@@ -0,0 +1,67 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "ksync/logging.h"
+#include "ksync/wakeup_signal.h"
+
+namespace KSync {
+	namespace Utilities {
+		WakeupSignal::WakeupSignalException::WakeupSignalException() {
+			this->SetMessage("Couldn't create the wakeup eventfd!");
+		}
+
+		WakeupSignal::WakeupSignal() {
+			this->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+			if(this->fd < 0) {
+				throw WakeupSignalException();
+			}
+		}
+
+		WakeupSignal::~WakeupSignal() {
+			close(this->fd);
+		}
+
+		void WakeupSignal::Signal() {
+			const uint64_t one = 1;
+			if((write(this->fd, &one, sizeof(one)) != sizeof(one))&&(errno != EAGAIN)) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Couldn't signal the wakeup eventfd!");
+			}
+		}
+
+		void WakeupSignal::Clear() {
+			uint64_t value;
+			if((read(this->fd, &value, sizeof(value)) != sizeof(value))&&(errno != EAGAIN)) {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Couldn't clear the wakeup eventfd!");
+			}
+		}
+
+		bool WakeupSignal::Wait(const int timeout) {
+			struct pollfd item;
+			item.fd = this->fd;
+			item.events = POLLIN;
+			item.revents = 0;
+			return (poll(&item, 1, timeout) > 0)&&(item.revents & POLLIN);
+		}
+	}
+}
@@ -0,0 +1,312 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <atomic>
+#include <cstring>
+
+#include "ksync/xxh3.h"
+
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#define KSYNC_XXH3_X86 1
+#endif
+
+namespace KSync {
+	namespace Hash {
+		static const uint64_t Prime32_1 = 0x9E3779B1U;
+		static const uint64_t Prime32_2 = 0x85EBCA77U;
+		static const uint64_t Prime32_3 = 0xC2B2AE3DU;
+		static const uint64_t Prime64_1 = 0x9E3779B185EBCA87ULL;
+		static const uint64_t Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+		static const uint64_t Prime64_3 = 0x165667B19E3779F9ULL;
+		static const uint64_t Prime64_4 = 0x85EBCA77C2B2AE63ULL;
+		static const uint64_t Prime64_5 = 0x27D4EB2F165667C5ULL;
+		static const uint64_t PrimeMx1 = 0x165667919E3779F9ULL;
+		static const uint64_t PrimeMx2 = 0x9FB21C651E98DF25ULL;
+
+		static const size_t SecretSize = 192;
+		static const size_t StripeLen = 64;
+		static const size_t SecretConsumeRate = 8;
+		static const size_t StripesPerBlock = (SecretSize-StripeLen)/SecretConsumeRate;
+		static const size_t BlockLen = StripeLen*StripesPerBlock;
+		static const size_t MidSizeMax = 240;
+
+		static const uint8_t DefaultSecret[SecretSize] = {
+			0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+			0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+			0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+			0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+			0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+			0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+			0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+			0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+			0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+			0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+			0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+			0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+		};
+
+		//Accumulate nb_stripes stripes, each against the secret moved on by SecretConsumeRate.
+		typedef void (*accumulate_t)(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, const size_t nb_stripes);
+		typedef void (*scramble_t)(uint64_t acc[8], const uint8_t* secret);
+
+		//The format is little endian, as is everything this is built for.
+		static inline uint64_t Read64(const uint8_t* p) {
+			uint64_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static inline uint32_t Read32(const uint8_t* p) {
+			uint32_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static inline uint64_t Rotl64(const uint64_t x, const int n) {
+			return (x << n)|(x >> (64-n));
+		}
+
+		static inline uint64_t Mul128Fold64(const uint64_t a, const uint64_t b) {
+			const unsigned __int128 product = ((unsigned __int128) a)*b;
+			return ((uint64_t) product)^((uint64_t) (product >> 64));
+		}
+
+		static inline uint64_t Xxh64Avalanche(uint64_t h) {
+			h ^= h >> 33;
+			h *= Prime64_2;
+			h ^= h >> 29;
+			h *= Prime64_3;
+			h ^= h >> 32;
+			return h;
+		}
+
+		static inline uint64_t Avalanche(uint64_t h) {
+			h ^= h >> 37;
+			h *= PrimeMx1;
+			h ^= h >> 32;
+			return h;
+		}
+
+		static inline uint64_t Rrmxmx(uint64_t h, const uint64_t len) {
+			h ^= Rotl64(h, 49)^Rotl64(h, 24);
+			h *= PrimeMx2;
+			h ^= (h >> 35)+len;
+			h *= PrimeMx2;
+			return h^(h >> 28);
+		}
+
+		static inline uint64_t Mix16(const uint8_t* input, const uint8_t* secret, const uint64_t seed) {
+			return Mul128Fold64(Read64(input)^(Read64(secret)+seed), Read64(input+8)^(Read64(secret+8)-seed));
+		}
+
+		static uint64_t Hash0To16(const uint8_t* input, const size_t len, const uint8_t* secret, uint64_t seed) {
+			if(len > 8) {
+				const uint64_t bitflip1 = (Read64(secret+24)^Read64(secret+32))+seed;
+				const uint64_t bitflip2 = (Read64(secret+40)^Read64(secret+48))-seed;
+				const uint64_t lo = Read64(input)^bitflip1;
+				const uint64_t hi = Read64(input+len-8)^bitflip2;
+				return Avalanche(len+__builtin_bswap64(lo)+hi+Mul128Fold64(lo, hi));
+			}
+			if(len >= 4) {
+				seed ^= ((uint64_t) __builtin_bswap32((uint32_t) seed)) << 32;
+				const uint64_t bitflip = (Read64(secret+8)^Read64(secret+16))-seed;
+				const uint64_t input64 = Read32(input+len-4)+(((uint64_t) Read32(input)) << 32);
+				return Rrmxmx(input64^bitflip, len);
+			}
+			if(len > 0) {
+				const uint32_t combined = (((uint32_t) input[0]) << 16)|(((uint32_t) input[len >> 1]) << 24)|((uint32_t) input[len-1])|(((uint32_t) len) << 8);
+				const uint64_t bitflip = (Read32(secret)^Read32(secret+4))+seed;
+				return Xxh64Avalanche(((uint64_t) combined)^bitflip);
+			}
+			return Xxh64Avalanche(seed^(Read64(secret+56)^Read64(secret+64)));
+		}
+
+		static uint64_t Hash17To128(const uint8_t* input, const size_t len, const uint8_t* secret, const uint64_t seed) {
+			uint64_t acc = len*Prime64_1;
+			//Pairs from both ends towards the middle.
+			for(size_t i = 0; i <= (len-1)/32; ++i) {
+				acc += Mix16(input+16*i, secret+32*i, seed);
+				acc += Mix16(input+len-16*(i+1), secret+32*i+16, seed);
+			}
+			return Avalanche(acc);
+		}
+
+		static uint64_t Hash129To240(const uint8_t* input, const size_t len, const uint8_t* secret, const uint64_t seed) {
+			uint64_t acc = len*Prime64_1;
+			for(size_t i = 0; i < 8; ++i) {
+				acc += Mix16(input+16*i, secret+16*i, seed);
+			}
+			acc = Avalanche(acc);
+			uint64_t acc_end = Mix16(input+len-16, secret+136-17, seed);
+			for(size_t i = 8; i < len/16; ++i) {
+				acc_end += Mix16(input+16*i, secret+16*(i-8)+3, seed);
+			}
+			return Avalanche(acc+acc_end);
+		}
+
+		static inline void Accumulate512Portable(uint64_t acc[8], const uint8_t* input, const uint8_t* secret) {
+			for(size_t lane = 0; lane < 8; ++lane) {
+				const uint64_t data_val = Read64(input+8*lane);
+				const uint64_t data_key = data_val^Read64(secret+8*lane);
+				acc[lane^1] += data_val;
+				acc[lane] += (data_key&0xFFFFFFFF)*(data_key >> 32);
+			}
+		}
+
+		static void AccumulatePortable(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, const size_t nb_stripes) {
+			for(size_t n = 0; n < nb_stripes; ++n) {
+				Accumulate512Portable(acc, input+n*StripeLen, secret+n*SecretConsumeRate);
+			}
+		}
+
+		static void ScramblePortable(uint64_t acc[8], const uint8_t* secret) {
+			for(size_t lane = 0; lane < 8; ++lane) {
+				uint64_t value = acc[lane];
+				value ^= value >> 47;
+				value ^= Read64(secret+8*lane);
+				acc[lane] = value*Prime32_1;
+			}
+		}
+
+#ifdef KSYNC_XXH3_X86
+		//Two 32 byte halves of the stripe, four lanes each.
+		__attribute__((target("avx2"))) static void AccumulateAvx2(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, const size_t nb_stripes) {
+			__m256i acc0 = _mm256_loadu_si256((const __m256i*) acc);
+			__m256i acc1 = _mm256_loadu_si256((const __m256i*) (acc+4));
+			for(size_t n = 0; n < nb_stripes; ++n) {
+				const uint8_t* in = input+n*StripeLen;
+				const uint8_t* key = secret+n*SecretConsumeRate;
+				const __m256i data0 = _mm256_loadu_si256((const __m256i*) in);
+				const __m256i data1 = _mm256_loadu_si256((const __m256i*) (in+32));
+				const __m256i data_key0 = _mm256_xor_si256(data0, _mm256_loadu_si256((const __m256i*) key));
+				const __m256i data_key1 = _mm256_xor_si256(data1, _mm256_loadu_si256((const __m256i*) (key+32)));
+				const __m256i product0 = _mm256_mul_epu32(data_key0, _mm256_srli_epi64(data_key0, 32));
+				const __m256i product1 = _mm256_mul_epu32(data_key1, _mm256_srli_epi64(data_key1, 32));
+				acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(product0, _mm256_shuffle_epi32(data0, _MM_SHUFFLE(1, 0, 3, 2))));
+				acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(product1, _mm256_shuffle_epi32(data1, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+			_mm256_storeu_si256((__m256i*) acc, acc0);
+			_mm256_storeu_si256((__m256i*) (acc+4), acc1);
+		}
+
+		__attribute__((target("avx2"))) static void ScrambleAvx2(uint64_t acc[8], const uint8_t* secret) {
+			const __m256i prime = _mm256_set1_epi32((int) Prime32_1);
+			for(size_t i = 0; i < 2; ++i) {
+				const __m256i value = _mm256_loadu_si256((const __m256i*) (acc+4*i));
+				const __m256i data_key = _mm256_xor_si256(_mm256_xor_si256(value, _mm256_srli_epi64(value, 47)), _mm256_loadu_si256((const __m256i*) (secret+32*i)));
+				//64 by 32 bit multiply out of two 32 by 32 bit ones.
+				const __m256i product_lo = _mm256_mul_epu32(data_key, prime);
+				const __m256i product_hi = _mm256_mul_epu32(_mm256_srli_epi64(data_key, 32), prime);
+				_mm256_storeu_si256((__m256i*) (acc+4*i), _mm256_add_epi64(product_lo, _mm256_slli_epi64(product_hi, 32)));
+			}
+		}
+#endif
+
+		class LongImplementation {
+			public:
+				const char* name;
+				accumulate_t accumulate;
+				scramble_t scramble;
+		};
+
+		static const LongImplementation Portable = {"portable", &AccumulatePortable, &ScramblePortable};
+#ifdef KSYNC_XXH3_X86
+		static const LongImplementation Avx2 = {"avx2", &AccumulateAvx2, &ScrambleAvx2};
+#endif
+
+		static const LongImplementation* SelectImplementation() {
+#ifdef KSYNC_XXH3_X86
+			__builtin_cpu_init();
+			if(__builtin_cpu_supports("avx2")) {
+				return &Avx2;
+			}
+#endif
+			return &Portable;
+		}
+
+		static std::atomic<const LongImplementation*>& GetImplementationSlot() {
+			static std::atomic<const LongImplementation*> implementation(SelectImplementation());
+			return implementation;
+		}
+
+		static uint64_t HashLong(const uint8_t* input, const size_t len, const uint8_t* secret) {
+			const LongImplementation* implementation = GetImplementationSlot().load(std::memory_order_relaxed);
+			uint64_t acc[8] = {Prime32_3, Prime64_1, Prime64_2, Prime64_3, Prime64_4, Prime32_2, Prime64_5, Prime32_1};
+			const size_t nb_blocks = (len-1)/BlockLen;
+			for(size_t n = 0; n < nb_blocks; ++n) {
+				implementation->accumulate(acc, input+n*BlockLen, secret, StripesPerBlock);
+				implementation->scramble(acc, secret+SecretSize-StripeLen);
+			}
+			const size_t nb_stripes = ((len-1)-BlockLen*nb_blocks)/StripeLen;
+			implementation->accumulate(acc, input+nb_blocks*BlockLen, secret, nb_stripes);
+			//The last stripe always ends at the end of the input, overlapping if need be.
+			Accumulate512Portable(acc, input+len-StripeLen, secret+SecretSize-StripeLen-7);
+			uint64_t result = len*Prime64_1;
+			for(size_t i = 0; i < 4; ++i) {
+				result += Mul128Fold64(acc[2*i]^Read64(secret+11+16*i), acc[2*i+1]^Read64(secret+11+16*i+8));
+			}
+			return Avalanche(result);
+		}
+
+		uint64_t Xxh3Hash64(const void* data, const size_t size, const uint64_t seed) {
+			const uint8_t* input = (const uint8_t*) data;
+			if(size <= 16) {
+				return Hash0To16(input, size, DefaultSecret, seed);
+			}
+			if(size <= 128) {
+				return Hash17To128(input, size, DefaultSecret, seed);
+			}
+			if(size <= MidSizeMax) {
+				return Hash129To240(input, size, DefaultSecret, seed);
+			}
+			if(seed == 0) {
+				return HashLong(input, size, DefaultSecret);
+			}
+			//Long inputs fold the seed into the secret instead.
+			uint8_t secret[SecretSize];
+			for(size_t i = 0; i < SecretSize/16; ++i) {
+				const uint64_t lo = Read64(DefaultSecret+16*i)+seed;
+				const uint64_t hi = Read64(DefaultSecret+16*i+8)-seed;
+				memcpy(secret+16*i, &lo, sizeof(lo));
+				memcpy(secret+16*i+8, &hi, sizeof(hi));
+			}
+			return HashLong(input, size, secret);
+		}
+
+		std::string Xxh3GetImplementation() {
+			return GetImplementationSlot().load(std::memory_order_relaxed)->name;
+		}
+
+		int Xxh3SetImplementation(const std::string& name) {
+			if(name == Portable.name) {
+				GetImplementationSlot().store(&Portable);
+				return 0;
+			}
+#ifdef KSYNC_XXH3_X86
+			__builtin_cpu_init();
+			if((name == Avx2.name)&&__builtin_cpu_supports("avx2")) {
+				GetImplementationSlot().store(&Avx2);
+				return 0;
+			}
+#endif
+			return -1;
+		}
+	}
+}
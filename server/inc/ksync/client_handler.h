@@ -0,0 +1,107 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef KSYNC_SERVER_CLIENT_HANDLER_HDR
+#define KSYNC_SERVER_CLIENT_HANDLER_HDR
+
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <set>
+
+#include "ksync/comm/object.h"
+#include "ksync/client_communicator.h"
+#include "ksync/command_system_interface.h"
+#include "ksync/metrics.h"
+#include "ksync/thread_utilities.h"
+
+namespace KSync {
+	namespace Server {
+		//Answers requests arriving on client communicators. Each client is served
+		//by its own coroutine written as a plain receive and reply loop, so one
+		//thread keeps every session of a shard going. Commands run on a pool of
+		//worker threads so a slow command neither holds up its client's other
+		//requests, other clients nor shutdown.
+		class ClientHandler {
+			public:
+				static const int DefaultDrainTimeout = 2000;
+				//How long killed commands get to exit before being killed with force.
+				static const int KillGracePeriod = 200;
+				//Longest a reply waits for room in a client's send queue before it's dropped.
+				static const int ReplySendTimeout = 1000;
+				//How often an idle session checks whether it should stop.
+				static const int SessionPollInterval = 100;
+
+				//0 command threads means one per core.
+				ClientHandler(std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const size_t num_command_threads = 0);
+
+				//Returns the reply to recv_obj, or a null pointer if there shouldn't be one.
+				//While draining new work is answered with a RequestRefused.
+				std::shared_ptr<KSync::Comm::CommObject> HandleMessage(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj);
+				//Coroutine answering communicator's requests until the handler stops.
+				//Each command gets a coroutine of its own so they overlap.
+				void Serve(const std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator);
+
+				//Refuse new work from now on.
+				void BeginDrain();
+				//Coroutine which refuses whatever is still waiting and lets running commands
+				//finish, then stops every session. Commands still running after timeout ms
+				//are killed, their replies are still sent. Returns the number of commands killed.
+				size_t Drain(const int timeout = DefaultDrainTimeout);
+
+				bool ShutdownRequested() const {
+					return this->shutdown_requested.load();
+				}
+				bool Draining() const {
+					return this->draining.load();
+				}
+				size_t GetCommandsInFlight();
+			private:
+				std::shared_ptr<KSync::Comm::CommObject> Refuse(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj);
+				std::shared_ptr<KSync::Comm::CommObject> Answer(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj);
+				std::shared_ptr<KSync::Comm::CommObject> RunCommand(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj);
+				size_t KillCommands(const bool force);
+				void Reply(KSync::Comm::ClientCommunicator& communicator, std::shared_ptr<KSync::Comm::CommObject>& resp_obj);
+				//Run a command on the pool and reply with its output, from a coroutine.
+				void Execute(KSync::Comm::ClientCommunicator& communicator, const std::shared_ptr<KSync::Comm::CommObject>& recv_obj);
+
+				std::shared_ptr<KSync::Commanding::SystemInterface> command_system;
+				std::atomic<bool> shutdown_requested;
+				std::atomic<bool> draining;
+				//Set once a drain runs out of time, commands which haven't started yet are refused.
+				std::atomic<bool> drain_expired;
+				KSync::Metrics::Counter& messages_handled;
+				KSync::Metrics::Counter& requests_refused;
+				KSync::Metrics::Histogram& command_time;
+
+				//Only touched by the coroutines.
+				size_t num_sessions;
+				size_t num_handled;
+				bool stopping;
+
+				std::mutex commands_mutex;
+				std::set<std::shared_ptr<KSync::Commanding::ExecutionContext>> running_commands;
+				size_t commands_in_flight;
+
+				//Last, so its workers are joined before anything they use is destroyed.
+				KSync::Utilities::thread_pool command_pool;
+		};
+	}
+}
+
+#endif
@@ -2,10 +2,32 @@
 #define KSYNC_SERVER_GATEWAY_THREAD_HDR
 
 #include "ksync/comm/interface.h"
+#include "ksync/messages.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/client_communicator.h"
+#include "ksync/shard.h"
 
 namespace KSync {
 	namespace Server {
-		void gateway_thread(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, const std::string& gateway_thread_socket_url, const std::string& gateway_socket_url);
+		//Messages between the master and gateway threads are handed over as
+		//objects, they never get packed into a CommObject.
+		typedef KSync::Utilities::spsc_channel<std::shared_ptr<KSync::Comm::CommunicableObject>> GatewayChannel;
+		class GatewayChannels {
+			public:
+				GatewayChannel to_master;
+				GatewayChannel to_gateway;
+		};
+
+		//How long the master waits for the gateway to come up.
+		static const int GatewayStartTimeout = 5000;
+
+		//Answer a client's handshake, creating its communicator if it's new and
+		//handing it to shard to serve.
+		std::shared_ptr<KSync::Comm::CommObject> AdmitClient(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, Shard& shard, const std::string& broadcast_url, const KSync::Utilities::client_id_t client_id);
+
+		//Admits each client straight into the shard which serves it.
+		//Sends a SocketConnectHerald once it's listening, and stops on ServerShuttingDown.
+		void gateway_thread(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, GatewayChannels& channels, const std::string& gateway_socket_url, ShardList& shards, const std::string& broadcast_url);
 	}
 }
 
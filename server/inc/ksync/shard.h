@@ -0,0 +1,113 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef KSYNC_SERVER_SHARD_HDR
+#define KSYNC_SERVER_SHARD_HDR
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/utilities.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/client_communicator.h"
+#include "ksync/command_system_interface.h"
+#include "ksync/coroutine.h"
+#include "ksync/client_handler.h"
+
+namespace KSync {
+	namespace Server {
+		//Like the gateway's, shard messages are handed over as objects.
+		typedef KSync::Utilities::spsc_channel<std::shared_ptr<KSync::Comm::CommunicableObject>> ShardChannel;
+		typedef KSync::Utilities::spsc_channel<std::shared_ptr<KSync::Comm::ClientCommunicator>> AdmissionChannel;
+
+		// A shard serves its slice of the clients on its own thread, with its own
+		// ClientHandler and command pool, so independent clients never contend for
+		// a loop. The thread runs a coroutine scheduler with a session coroutine
+		// per client, and a dispatcher which starts a session for each communicator
+		// the gateway hands over and handles messages from the master. Clients are
+		// assigned by hashing their id. Everything which crosses shards is a message:
+		//   admissions ClientCommunicator  a newly admitted client to serve
+		//   to_shard   ServerShuttingDown  drain, then stop
+		//   to_master  ShutdownRequest     one of its clients asked the server to stop
+		class Shard {
+			public:
+				static const size_t ChannelCapacity = 16;
+				//Clients the gateway may admit faster than the shard starts them.
+				static const size_t AdmissionCapacity = 256;
+				//Longest a message from the master, or a client's shutdown request, waits to be handled.
+				static const int DispatchInterval = 10;
+
+				Shard(const size_t index, std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const size_t num_command_threads, const int drain_timeout = ClientHandler::DefaultDrainTimeout);
+				~Shard();
+
+				Shard(const Shard& other) = delete;
+				Shard& operator=(const Shard& other) = delete;
+
+				void Start();
+				//Wait for the shard to stop, which it does once it's been sent ServerShuttingDown.
+				void Join();
+
+				size_t GetIndex() const {
+					return this->index;
+				}
+				//Every client admitted to the shard, only the gateway uses it.
+				KSync::Comm::ClientCommunicatorList& GetClientCommunicators() {
+					return this->client_communicators;
+				}
+				//Commands killed while draining, valid after Join.
+				size_t GetNumKilled() const {
+					return this->num_killed;
+				}
+
+				//Gateway to shard, only the gateway may push.
+				AdmissionChannel admissions;
+				//Master to shard, only the master may push.
+				ShardChannel to_shard;
+				//Shard to master, only the master may pop.
+				ShardChannel to_master;
+			private:
+				void Run();
+				void Dispatch();
+
+				const size_t index;
+				const int drain_timeout;
+				KSync::Comm::ClientCommunicatorList client_communicators;
+				//Outlives the handler's command pool, which may still wake coroutines.
+				KSync::Coroutine::Scheduler scheduler;
+				ClientHandler client_handler;
+				size_t num_killed;
+				std::thread thread;
+		};
+
+		typedef std::vector<std::shared_ptr<Shard>> ShardList;
+
+		//The shard serving client_id.
+		size_t GetShardIndex(const KSync::Utilities::client_id_t client_id, const size_t num_shards);
+		//0 shards means one per core. Command threads are split between the shards.
+		void CreateShards(ShardList& shards, size_t num_shards, std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const int drain_timeout = ClientHandler::DefaultDrainTimeout);
+		//Send every shard ServerShuttingDown, they all drain at once.
+		void StopShards(ShardList& shards);
+		//Wait for stopped shards to finish draining. Returns the number of commands killed.
+		size_t JoinShards(ShardList& shards);
+	}
+}
+
+#endif
@@ -0,0 +1,227 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ksync/logging.h"
+#include "ksync/binary_log.h"
+#include "ksync/tracing.h"
+#include "ksync/messages.h"
+#include "ksync/coroutine.h"
+#include "ksync/client_handler.h"
+
+namespace KSync {
+	namespace Server {
+		ClientHandler::ClientHandler(std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const size_t num_command_threads) :
+			messages_handled(KSync::Metrics::GetCounter("server.messages_handled")),
+			requests_refused(KSync::Metrics::GetCounter("server.requests_refused")),
+			command_time(KSync::Metrics::GetHistogram("server.command_execution")),
+			command_pool((num_command_threads != 0) ? num_command_threads : std::max(1u, std::thread::hardware_concurrency())) {
+			this->command_system = command_system;
+			this->shutdown_requested.store(false);
+			this->draining.store(false);
+			this->drain_expired.store(false);
+			this->commands_in_flight = 0;
+			this->num_sessions = 0;
+			this->num_handled = 0;
+			this->stopping = false;
+		}
+
+		std::shared_ptr<KSync::Comm::CommObject> ClientHandler::HandleMessage(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj) {
+			if(this->draining.load()&&((recv_obj->GetType() == KSync::Comm::ExecuteCommand::Type)||(recv_obj->GetType() == KSync::Comm::CommString::Type))) {
+				return this->Refuse(recv_obj);
+			}
+			return this->Answer(recv_obj);
+		}
+
+		std::shared_ptr<KSync::Comm::CommObject> ClientHandler::Refuse(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj) {
+			this->requests_refused.Add();
+			KSync::Comm::RequestRefused refused("The server is shutting down");
+			std::shared_ptr<KSync::Comm::CommObject> resp_obj = refused.GetCommObject();
+			resp_obj->SetReplyId(recv_obj->GetMessageId());
+			resp_obj->SetTraceId(recv_obj->GetTraceId());
+			return resp_obj;
+		}
+
+		std::shared_ptr<KSync::Comm::CommObject> ClientHandler::Answer(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj) {
+			KSync::Tracing::Span span("master_dispatch", recv_obj->GetTraceId());
+			std::shared_ptr<KSync::Comm::CommObject> resp_obj;
+			if(recv_obj->GetType() == KSync::Comm::CommString::Type) {
+				std::shared_ptr<KSync::Comm::CommString> message;
+				KSync::Comm::CommCreator(message, recv_obj);
+				BLOGF(INFO, "Got message (%s)", *message);
+				resp_obj = message->GetCommObject();
+			} else if (recv_obj->GetType() == KSync::Comm::ShutdownRequest::Type) {
+				this->shutdown_requested.store(true);
+				KSync::Comm::ShutdownAck shutdown_ack;
+				resp_obj = shutdown_ack.GetCommObject();
+			} else if (recv_obj->GetType() == KSync::Comm::StatsRequest::Type) {
+				KSync::Comm::StatsReply stats_reply(KSync::Metrics::Dump());
+				resp_obj = stats_reply.GetCommObject();
+			} else if (recv_obj->GetType() == KSync::Comm::ExecuteCommand::Type) {
+				resp_obj = this->RunCommand(recv_obj);
+			} else {
+				LOGF_RATE_LIMITED(WARNING, 10, 1000, "Unsupported message from client! (%i) (%s)", recv_obj->GetType(), KSync::Comm::GetTypeName(recv_obj->GetType()));
+				return resp_obj;
+			}
+			//Every response is stamped with the id of the request it answers so
+			//clients can have many requests in flight at once.
+			resp_obj->SetReplyId(recv_obj->GetMessageId());
+			resp_obj->SetTraceId(recv_obj->GetTraceId());
+			return resp_obj;
+		}
+
+		std::shared_ptr<KSync::Comm::CommObject> ClientHandler::RunCommand(const std::shared_ptr<KSync::Comm::CommObject>& recv_obj) {
+			std::shared_ptr<KSync::Comm::ExecuteCommand> exec_com;
+			KSync::Comm::CommCreator(exec_com, recv_obj);
+			BLOGF(INFO, "Received command (%s)", *exec_com);
+
+			std::shared_ptr<KSync::Commanding::ExecutionContext> command_context = this->command_system->GetExecutionContext();
+			KSync::Metrics::ScopedTimer command_timer(this->command_time);
+			{
+				//Registered so a drain which runs out of time can kill it.
+				std::lock_guard<std::mutex> lk(this->commands_mutex);
+				this->running_commands.insert(command_context);
+			}
+			{
+				KSync::Tracing::Span launch_span("command_launch", recv_obj->GetTraceId());
+				command_context->LaunchCommand(exec_com->c_str());
+			}
+			std::string std_out;
+			std::string std_err;
+			{
+				KSync::Tracing::Span output_span("output_collection", recv_obj->GetTraceId());
+				command_context->GetOutput(std_out, std_err);
+			}
+			{
+				std::lock_guard<std::mutex> lk(this->commands_mutex);
+				this->running_commands.erase(command_context);
+			}
+
+			KSync::Comm::CommandOutput com_out;
+			com_out.SetStdout(std_out);
+			com_out.SetStderr(std_err);
+			com_out.SetReturnCode(command_context->GetReturnCode());
+			return com_out.GetCommObject();
+		}
+
+		void ClientHandler::Reply(KSync::Comm::ClientCommunicator& communicator, std::shared_ptr<KSync::Comm::CommObject>& resp_obj) {
+			if(resp_obj&&(KSync::Coroutine::Send(communicator, resp_obj, ReplySendTimeout) < 0)) {
+				LOGF(WARNING, "Dropped a reply to (%lu), its send queue stayed full!", communicator.GetClientId());
+			}
+		}
+
+		void ClientHandler::Execute(KSync::Comm::ClientCommunicator& communicator, const std::shared_ptr<KSync::Comm::CommObject>& recv_obj) {
+			//Commands fork, which can't happen on a coroutine's stack.
+			std::shared_ptr<KSync::Comm::CommObject> resp_obj;
+			KSync::Coroutine::Offload(this->command_pool, [this, &recv_obj, &resp_obj]() {
+				if(this->drain_expired.load()) {
+					resp_obj = this->Refuse(recv_obj);
+				} else {
+					resp_obj = this->Answer(recv_obj);
+				}
+			});
+			this->Reply(communicator, resp_obj);
+			std::lock_guard<std::mutex> lk(this->commands_mutex);
+			--this->commands_in_flight;
+		}
+
+		void ClientHandler::Serve(const std::shared_ptr<KSync::Comm::ClientCommunicator>& communicator) {
+			++this->num_sessions;
+			while(!this->stopping) {
+				std::shared_ptr<KSync::Comm::CommObject> recv_obj = KSync::Coroutine::Recv(*communicator, SessionPollInterval);
+				if(!recv_obj) {
+					continue;
+				}
+				++this->num_handled;
+				this->messages_handled.Add();
+				if((!this->draining.load())&&(recv_obj->GetType() == KSync::Comm::ExecuteCommand::Type)) {
+					{
+						std::lock_guard<std::mutex> lk(this->commands_mutex);
+						++this->commands_in_flight;
+					}
+					if(KSync::Coroutine::Spawn([this, communicator, recv_obj]() { this->Execute(*communicator, recv_obj); }) < 0) {
+						//No coroutine for it, so hold up this client's other requests instead.
+						this->Execute(*communicator, recv_obj);
+					}
+					continue;
+				}
+				std::shared_ptr<KSync::Comm::CommObject> resp_obj = this->HandleMessage(recv_obj);
+				this->Reply(*communicator, resp_obj);
+			}
+			--this->num_sessions;
+		}
+
+		void ClientHandler::BeginDrain() {
+			this->draining.store(true);
+		}
+
+		size_t ClientHandler::GetCommandsInFlight() {
+			std::lock_guard<std::mutex> lk(this->commands_mutex);
+			return this->commands_in_flight;
+		}
+
+		size_t ClientHandler::KillCommands(const bool force) {
+			std::lock_guard<std::mutex> lk(this->commands_mutex);
+			for(auto it = this->running_commands.begin(); it != this->running_commands.end(); ++it) {
+				LOGF(WARNING, "Killing (%s)%s", (*it)->GetCommandLaunched().c_str(), force ? " with force" : "");
+				(*it)->Kill(force);
+			}
+			return this->running_commands.size();
+		}
+
+		size_t ClientHandler::Drain(const int timeout) {
+			this->BeginDrain();
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			size_t num_killed = 0;
+			//0 waiting for commands, 1 asked them to stop, 2 killed them with force.
+			int stage = 0;
+			size_t last_handled = this->num_handled;
+			while(true) {
+				//The sessions refuse what's waiting meanwhile.
+				KSync::Coroutine::Sleep(1);
+				const bool quiet = (this->num_handled == last_handled);
+				last_handled = this->num_handled;
+				if((this->GetCommandsInFlight() == 0)&&quiet) {
+					break;
+				}
+				if(std::chrono::steady_clock::now() >= deadline) {
+					this->drain_expired.store(true);
+					if(stage < 2) {
+						const size_t num_running = this->KillCommands(stage == 1);
+						if(stage == 0) {
+							num_killed = num_running;
+						}
+						++stage;
+						deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(KillGracePeriod);
+					} else {
+						LOGF(SEVERE, "(%lu) commands wouldn't die!", this->GetCommandsInFlight());
+						break;
+					}
+				}
+			}
+			if(num_killed != 0) {
+				LOGF(WARNING, "(%lu) commands were killed while draining!", num_killed);
+			}
+			//Idle sessions notice within SessionPollInterval.
+			this->stopping = true;
+			while(this->num_sessions != 0) {
+				KSync::Coroutine::Sleep(1);
+			}
+			return num_killed;
+		}
+	}
+}
@@ -1,56 +1,62 @@
 #include <unistd.h>
 
 #include "ksync/logging.h"
+#include "ksync/messages.h"
 #include "ksync/gateway_thread.h"
 
 namespace KSync {
 	namespace Server {
-		void gateway_thread(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, const std::string& gateway_thread_socket_url, const std::string& gateway_socket_url) {
-			if(comm_system == nullptr) {
-				LOGF(SEVERE, "The Gateway thread was given a null comm_system!!");
-				return;
-			}
-
-			//Setup our end of the gateway thread socket
-			std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_thread_socket;
-			if(comm_system->Create_Pair_Socket(gateway_thread_socket) < 0) {
-				LOGF(SEVERE, "There was a problem creating the gateway thread pair socket!");
-				return;
+		std::shared_ptr<KSync::Comm::CommObject> AdmitClient(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, Shard& shard, const std::string& broadcast_url, const KSync::Utilities::client_id_t client_id) {
+			LOGF(INFO, "Received client id: (%lu)\n", client_id);
+			//Only the gateway adds to the list, so nothing can slip in between the find and the push.
+			KSync::Comm::ClientCommunicatorList& client_communicators = shard.GetClientCommunicators();
+			std::shared_ptr<KSync::Comm::ClientCommunicator> client_communicator = client_communicators.find_first_if(client_id);
+			if((client_communicator != nullptr)&&client_communicator->HeardFrom()) {
+				//We have a client with that ID!
+				LOGF(WARNING, "We already have a client with ID (%lu)!\n", client_id);
+				KSync::Comm::GatewaySocketInitializationChangeId response;
+				return response.GetCommObject();
 			}
-
-			if(gateway_thread_socket->SetRecvTimeout(1000) < 0) {
-				LOGF(SEVERE, "There was a problem setting the recv timeout!");
-				return;
-			}
-
-			if(gateway_thread_socket->Connect(gateway_thread_socket_url) < 0) {
-				LOGF(SEVERE, "There was a problem connectng to the gateway thread pair socket!");
-				return;
+			if(client_communicator == nullptr) {
+				//Don't have a client with that ID yet! Handle creation of new socket
+				try {
+					client_communicator.reset(new KSync::Comm::ClientCommunicator(comm_system, client_id, true));
+				} catch (KSync::Comm::ClientCommunicator::SocketException& e) {
+					LOGF(WARNING, "Couldn't create a client socket for (%lu)! (%s)", client_id, e.GetMessage().c_str());
+					KSync::Comm::GatewaySocketInitializationChangeId response;
+					return response.GetCommObject();
+				}
+				//The shard starts the session, the list only remembers who was admitted.
+				std::shared_ptr<KSync::Comm::ClientCommunicator> admitted = client_communicator;
+				if(!shard.admissions.try_push(admitted)) {
+					LOGF(WARNING, "Shard (%lu) is behind on starting sessions, (%lu) will have to retry!", shard.GetIndex(), client_id);
+					KSync::Comm::GatewaySocketInitializationChangeId response;
+					return response.GetCommObject();
+				}
+				client_communicators.push_front(client_communicator);
+			} else {
+				//The client never used its socket, so this is a retry of a lost reply.
+				LOGF(INFO, "Repeating the socket address for (%lu)", client_id);
 			}
+			KSync::Comm::ClientSocketCreation socket_message;
+			socket_message.SetClientUrl(client_communicator->GetSocketUrl());
+			socket_message.SetBroadcastUrl(broadcast_url);
+			return socket_message.GetCommObject();
+		}
 
-			//Herald our existence
-			KSync::Comm::SocketConnectHerald herald;
-			std::shared_ptr<KSync::Comm::CommObject> herald_obj = herald.GetCommObject();
-			if(gateway_thread_socket->Send(herald_obj) < 0) {
-				LOGF(SEVERE, "There was a problem sending the herald message!");
+		void gateway_thread(std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system, GatewayChannels& channels, const std::string& gateway_socket_url, ShardList& shards, const std::string& broadcast_url) {
+			if(comm_system == nullptr) {
+				LOGF(SEVERE, "The Gateway thread was given a null comm_system!!");
 				return;
 			}
-
-			//Check for acknowledgement
-			std::shared_ptr<KSync::Comm::CommObject> ack_obj;
-			if(gateway_thread_socket->Recv(ack_obj) < 0) {
-				LOGF(SEVERE, "Didn't receive the Acknowledge message!");
+			if(shards.empty()) {
+				LOGF(SEVERE, "The Gateway thread was given no shards to admit clients to!!");
 				return;
-			} else {
-				if(ack_obj->GetType() != KSync::Comm::SocketConnectAcknowledge::Type) {
-					LOGF(SEVERE, "Message received wasn't an acknowledgement!");
-					return;
-				}
 			}
 
 			//Set up gateway socket
 			std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_socket;
-			if (comm_system->Create_Gateway_Rep_Socket(gateway_socket) < 0) {
+			if (comm_system->Create_Gateway_Router_Socket(gateway_socket) < 0) {
 				LOGF(SEVERE, "There was a problem creating the gateway socket!");
 				return;
 			}
@@ -60,11 +66,19 @@ namespace KSync {
 				return;
 			}
 
+			if(gateway_socket->SetSendTimeout(1000) < 0) {
+				LOGF(SEVERE, "There was a problem setting the send timeout!");
+				return;
+			}
+
 			if (gateway_socket->Bind(gateway_socket_url) < 0) {
 				LOGF(SEVERE, "There was a problem binding the gateway socket!");
 				return;
 			}
 
+			//Herald our existence
+			channels.to_master.try_push(std::make_shared<KSync::Comm::SocketConnectHerald>());
+
 			bool finished = false;
 
 			int status = 0;
@@ -72,65 +86,53 @@ namespace KSync {
 			while(!finished) {
 				//Listen for new connections 
 				std::shared_ptr<KSync::Comm::CommObject> recv_obj;
-				status = gateway_socket->Recv(recv_obj);
+				std::string peer;
+				//Messages from the master wake us rather than waiting out the timeout
+				if(channels.to_gateway.prepare_wait()) {
+					status = gateway_socket->Poll(1000, channels.to_gateway.GetFd());
+					channels.to_gateway.finish_wait();
+				} else {
+					status = KSync::Comm::CommSystemSocket::Woken;
+				}
+				if (status == KSync::Comm::CommSystemSocket::Success) {
+					status = gateway_socket->RecvRouted(peer, recv_obj);
+				}
 				if(status == KSync::Comm::CommSystemSocket::Other) {
 					LOGF(SEVERE, "There was a problem receiving connection requests!");
 					return;
-				} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
+				} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::Woken)) {
 				} else if (status == KSync::Comm::CommSystemSocket::EmptyMessage) {
 				} else {
+					std::shared_ptr<KSync::Comm::CommObject> resp_obj;
 					if(recv_obj->GetType() == KSync::Comm::GatewaySocketInitializationRequest::Type) {
-						LOGF(INFO, "Received init request, Passing on..");
-						status = gateway_thread_socket->Send(recv_obj);
-						if(status == KSync::Comm::CommSystemSocket::Other) {
-							LOGF(SEVERE, "There was a problem passing on the init request!");
-							return;
-						} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-							LOGF(SEVERE, "Sending timed out!!!");
-							return;
-						} else {
-							std::shared_ptr<KSync::Comm::CommObject> resp_obj;
-							status = gateway_thread_socket->ForceRecv(resp_obj);
-							if (status == KSync::Comm::CommSystemSocket::Other) {
-								LOGF(SEVERE, "There was a problem getting the response!!");
-								return;
-							} else {
-								status = gateway_socket->Send(resp_obj);
-								if (status == KSync::Comm::CommSystemSocket::Other) {
-									LOGF(SEVERE, "There was a problem passing on the response!");
-									return;
-								} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-									LOGF(SEVERE, "There was a timeout when sending on the response!");
-									return;
-								}
-							}
-						}
+						std::shared_ptr<KSync::Comm::GatewaySocketInitializationRequest> request;
+						KSync::Comm::CommCreator(request, recv_obj);
+						const size_t shard_index = GetShardIndex(request->GetClientId(), shards.size());
+						resp_obj = AdmitClient(comm_system, *shards[shard_index], broadcast_url, request->GetClientId());
 					} else if(recv_obj->GetType() == KSync::Comm::CommString::Type) {
 						std::shared_ptr<KSync::Comm::CommString> message;
 						KSync::Comm::CommCreator(message, recv_obj);
 						LOGF(INFO, "Received (%s)\n", message->c_str());
-						std::shared_ptr<KSync::Comm::CommObject> send_obj = message->GetCommObject();
-						status = gateway_socket->Send(send_obj); 
+						resp_obj = message->GetCommObject();
+					} else {
+						LOGF(WARNING, "Message unsupported! (%i) (%s)\n", recv_obj->GetType(), KSync::Comm::GetTypeName(recv_obj->GetType()));
+					}
+					if(resp_obj) {
+						//A peer which gave up won't get its reply, it retries with a fresh socket.
+						status = gateway_socket->SendRouted(peer, resp_obj);
 						if(status == KSync::Comm::CommSystemSocket::Other) {
-							LOGF(SEVERE, "There was a problem sending a message!!");
+							LOGF(SEVERE, "There was a problem sending a gateway response!");
 							return;
 						} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-							LOGF(SEVERE, "Sending message timedout!");
-							return;
+							LOGF(WARNING, "Sending a gateway response timed out!");
 						}
-					} else {
-						LOGF(WARNING, "Message unsupported! (%i) (%s)\n", recv_obj->GetType(), KSync::Comm::GetTypeName(recv_obj->GetType()));
 					}
 				}
 
 				// Check for messages from the master!
-				std::shared_ptr<KSync::Comm::CommObject> master_obj;
-				status = gateway_thread_socket->Recv(master_obj);
-				if(status == KSync::Comm::CommSystemSocket::Other) {
-					LOGF(WARNING, "There was a problem checking the master thread!");
-				} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
-				} else {
-					if (master_obj->GetType() == KSync::Comm::ServerShuttingDown::Type) {
+				std::shared_ptr<KSync::Comm::CommunicableObject> master_message;
+				while(channels.to_gateway.try_pop(master_message)) {
+					if (master_message->GetType() == KSync::Comm::ServerShuttingDown::Type) {
 						finished = true;
 					}
 				}
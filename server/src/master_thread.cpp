@@ -7,6 +7,9 @@
 
 #include "ksync/master_thread.h"
 #include "ksync/logging.h"
+#include "ksync/binary_log.h"
+#include "ksync/tracing.h"
+#include "ksync/metrics.h"
 #include "ksync/messages.h"
 #include "ksync/utilities.h"
 #include "ksync/comm/interface.h"
@@ -16,6 +19,8 @@
 #include "ksync/command_system_interface.h"
 #include "ksync/pstreams_command_system.h"
 #include "ksync/gateway_thread.h"
+#include "ksync/client_handler.h"
+#include "ksync/shard.h"
 #include "ksync/pstream.h"
 #include "ksync/common_ops.h"
 #include "ksync/thread_utilities.h"
@@ -34,19 +39,39 @@ static void Cleanup(int signal) {
 	finished = true;
 }
 
+volatile sig_atomic_t dump_metrics = 0;
+
+//Dumping happens in the main loop, nothing in a signal handler may allocate.
+static void RequestMetricsDump(int signal __attribute__((unused))) {
+	dump_metrics = 1;
+}
+
+static void StopGateway(KSync::Server::GatewayChannels& gateway_channels, std::thread& gateway) {
+	gateway_channels.to_gateway.try_push(std::make_shared<KSync::Comm::ServerShuttingDown>());
+	gateway.join();
+}
+
 int main(int argc, char** argv) {
 	//Setting the signals to trigger the cleanup function
 	signal(SIGTERM, Cleanup);
 	signal(SIGINT, Cleanup);
+	signal(SIGUSR1, RequestMetricsDump);
 
 	//Define and process command line arguments
 	std::string log_dir;
 	std::string gateway_socket_url;
 	bool gateway_socket_url_defined;
 	bool nanomsg;
+	KSync::Utilities::CommTuning comm_tuning;
+	std::string trace_path;
+	int drain_timeout = KSync::Server::ClientHandler::DefaultDrainTimeout;
+	int num_shards = 0;
 
 	ArgParse::ArgParser arg_parser("KSync Server - Server side of a Client-Server synchonization system using rsync.");
-	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg);
+	KSync::Utilities::set_up_common_arguments_and_defaults(arg_parser, log_dir, gateway_socket_url, gateway_socket_url_defined, nanomsg, comm_tuning);
+	arg_parser.AddArgument("--trace", "Record per-message spans and write them to this file as Chrome trace JSON.", &trace_path);
+	arg_parser.AddArgument("--drain-timeout", "Milliseconds to let running commands finish on shutdown before killing them. Default is 2000.", &drain_timeout);
+	arg_parser.AddArgument("--shards", "Number of threads clients are spread over, 0 for one per core. Default is 0.", &num_shards);
 
 	int status;
 	if((status = arg_parser.ParseArgs(argc, argv)) < 0) {
@@ -59,6 +84,11 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	if(num_shards < 0) {
+		printf("The number of shards can't be negative!\n");
+		return -1;
+	}
+
 	if (log_dir == "") {
 		if(KSync::Utilities::get_user_ksync_dir(log_dir) < 0) {
 			printf("There was a problem getting the ksync user directory!\n");
@@ -69,6 +99,16 @@ int main(int argc, char** argv) {
 	//Initialize logging:
 	std::unique_ptr<g3::LogWorker> logworker;
 	KSync::InitializeLogger(logworker, true, "KSync Server", log_dir);
+	if(KSync::BinaryLog::Initialize("KSync Server", log_dir) < 0) {
+		LOGF(SEVERE, "There was a problem starting the binary log!");
+		return -2;
+	}
+	if(trace_path != "") {
+		if(KSync::Tracing::Enable(trace_path, "KSync Server") < 0) {
+			LOGF(SEVERE, "There was a problem enabling tracing!");
+			return -2;
+		}
+	}
 
 	//Get gateway URL
 	if (KSync::Utilities::GetGatewaySocketURL(gateway_socket_url, gateway_socket_url_defined) < 0) {
@@ -80,7 +120,7 @@ int main(int argc, char** argv) {
 
 	//Initialize communication system
 	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
-	if (KSync::Utilities::GetCommSystem(comm_system, nanomsg) < 0) {
+	if (KSync::Utilities::GetCommSystem(comm_system, nanomsg, comm_tuning) < 0) {
 		LOGF(SEVERE, "There was a problem initializing the comm system!");
 		return -2;
 	}
@@ -88,193 +128,82 @@ int main(int argc, char** argv) {
 	//Initialize command system
 	std::shared_ptr<KSync::Commanding::SystemInterface> command_system(new KSync::Commanding::PSCommandSystem());
 
-	//Initialize Gateway Thread socket
-	std::shared_ptr<KSync::Comm::CommSystemSocket> gateway_thread_socket;
-	if (comm_system->Create_Pair_Socket(gateway_thread_socket, 10) < 0) {
-		LOGF(SEVERE, "There was a problem creating the gateway thread socket!");
-		return -3;
+	//Initialize broadcast socket
+	std::string broadcast_url;
+	if(KSync::Utilities::get_default_broadcast_url(broadcast_url) < 0) {
+		LOGF(SEVERE, "There was a problem getting the default broadcast url!");
+		return -9;
 	}
 
-	std::string gateway_thread_socket_url;
-	if(KSync::Utilities::get_default_gateway_thread_url(gateway_thread_socket_url) < 0) {
-		LOGF(SEVERE, "There was a problem getting the default gateway thread socket url!");
-		return -4;
+	std::shared_ptr<KSync::Comm::CommSystemSocket> broadcast_socket;
+	if(comm_system->Create_Pub_Socket(broadcast_socket) < 0) {
+		LOGF(SEVERE, "There was a problem creating the broadcast socket!");
+		return -9;
 	}
 
-	if(gateway_thread_socket->Bind(gateway_thread_socket_url) < 0) {
-		LOGF(SEVERE, "There was a problem binding the gateway thread socket!");
-		return -5;
+	if(broadcast_socket->Bind(broadcast_url) < 0) {
+		LOGF(SEVERE, "There was a problem binding the broadcast socket!");
+		return -9;
 	}
 
+	//The gateway admits each client into the shard which serves it
+	KSync::Server::ShardList shards;
+	KSync::Server::CreateShards(shards, (size_t) num_shards, command_system, drain_timeout);
+
 	//Launch Gateway Thread
-	std::thread gateway(KSync::Server::gateway_thread, comm_system, gateway_thread_socket_url, gateway_socket_url);
+	KSync::Server::GatewayChannels gateway_channels;
+	std::thread gateway(KSync::Server::gateway_thread, comm_system, std::ref(gateway_channels), gateway_socket_url, std::ref(shards), broadcast_url);
 
-	//Acknowledge connection
-	std::shared_ptr<KSync::Comm::CommObject> herald_obj;
-	status = gateway_thread_socket->Recv(herald_obj);
-	if(status == KSync::Comm::CommSystemSocket::Other) {
-		LOGF(SEVERE, "Didn't receive connect herald!");
-		return -6;
-	} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||
-	           (status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
+	//Wait for it to come up
+	std::shared_ptr<KSync::Comm::CommunicableObject> herald;
+	if(!gateway_channels.to_master.wait(KSync::Server::GatewayStartTimeout)||!gateway_channels.to_master.try_pop(herald)) {
 		LOGF(SEVERE, "Herald retreive timed out!!!");
+		StopGateway(gateway_channels, gateway);
 		return -7;
-	} else {
-		if(herald_obj->GetType() == KSync::Comm::SocketConnectHerald::Type) {
-			KSync::Comm::SocketConnectAcknowledge ack;
-			std::shared_ptr<KSync::Comm::CommObject> ack_obj = ack.GetCommObject();
-			status = gateway_thread_socket->Send(ack_obj);
-			if(status == KSync::Comm::CommSystemSocket::Other) {
-				LOGF(SEVERE, "Couldn't send Acknowledgement!");
-				return -7;
-			} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-				LOGF(SEVERE, "Retreival of Ack timed out!!");
-				return -8;
-			}
-		} else {
-			LOGF(SEVERE, "Didn't get a herald type (%i)!!\n", herald_obj->GetType());
-			return -8;
-		}
 	}
-
-	KSync::Comm::ClientCommunicatorList client_communicators;
+	if(herald->GetType() != KSync::Comm::SocketConnectHerald::Type) {
+		LOGF(SEVERE, "Didn't get a herald type (%i)!!\n", herald->GetType());
+		StopGateway(gateway_channels, gateway);
+		return -8;
+	}
 
 	while(!finished) {
-		//Check gateway thread
-		std::shared_ptr<KSync::Comm::CommObject> recv_obj;
-		status = gateway_thread_socket->Recv(recv_obj);
-		if(status == KSync::Comm::CommSystemSocket::Other) {
-			LOGF(SEVERE,"There was a problem checking the gateway thread socket!");
-			return -9;
-		} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-		} else if (status == KSync::Comm::CommSystemSocket::EmptyMessage) {
-		} else {
-			// Handle connection request!!
-			if(recv_obj->GetType() == KSync::Comm::GatewaySocketInitializationRequest::Type) {
-				LOGF(INFO, "Received a connection request!");
-				std::shared_ptr<KSync::Comm::GatewaySocketInitializationRequest> request;
-				KSync::Comm::CommCreator(request, recv_obj);
-				LOGF(INFO, "Received client id: (%lu)\n",request->GetClientId());
-				std::shared_ptr<KSync::Comm::ClientCommunicator> client_communicator = client_communicators.find_first_if(request->GetClientId());
-				if(client_communicator == nullptr) {
-					LOGF(INFO, "Generating new client socket!");
-					//Don't have a client with that ID yet! Handle creation of new socket
-					client_communicator.reset(new KSync::Comm::ClientCommunicator(comm_system, request->GetClientId(), true));
-					//std::string new_socket_url;
-					//if(KSync::Utilities::get_client_socket_url(new_socket_url, request->GetClientId()) < 0) {
-					//	LOGF(SEVERE, "Error! Couldn't get the client socket url!");
-					//	return -10;
-					//}
-
-					//std::shared_ptr<KSync::Comm::CommSystemSocket> client_socket;
-					//if (comm_system->Create_Pair_Socket(client_socket) < 0) {
-					//	LOGF(SEVERE, "There was a problem creating the gateway thread socket!");
-					//	return -10;
-					//}
-
-					//if (client_socket->SetRecvTimeout(1000) < 0) {
-					//	LOGF(SEVERE, "There was a problem setting the recv timeout!");
-					//	return -10;
-					//}
-
-					//if(client_socket->Bind(new_socket_url) < 0) {
-					//	LOGF(SEVERE, "There was a problem binding the gateway thread socket!");
-					//	return -10;
-					//}
-
-					client_communicators.push_front(*client_communicator);
-
-					KSync::Comm::ClientSocketCreation socket_message;
-					socket_message.SetClientUrl(new_socket_url);
-					socket_message.SetBroadcastUrl(broadcast_url);
-					std::shared_ptr<KSync::Comm::CommObject> socket_message_obj = socket_message.GetCommObject();
-					LOGF(INFO, "Sending new client socket address!");
-					status = gateway_thread_socket->Send(socket_message_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(SEVERE, "Couldn't send response!");
-						return -11;
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(SEVERE, "Sending response timed out!!");
-						return -12;
-					}
+		//Check gateway thread, this also paces the loop
+		gateway_channels.to_master.wait(10);
+		std::shared_ptr<KSync::Comm::CommunicableObject> gateway_message;
+		if(gateway_channels.to_master.try_pop(gateway_message)) {
+			LOGF(SEVERE, "Unsupported message from gateway thread! (%i) (%s)\n", gateway_message->GetType(), KSync::Comm::GetTypeName(gateway_message->GetType()));
+			return -11;
+		}
+
+		//Check shards
+		for(size_t i = 0; i < shards.size(); ++i) {
+			std::shared_ptr<KSync::Comm::CommunicableObject> shard_message;
+			while(shards[i]->to_master.try_pop(shard_message)) {
+				if(shard_message->GetType() == KSync::Comm::ShutdownRequest::Type) {
+					finished = true;
 				} else {
-					//We have a client with that ID!
-					LOGF(WARNING, "We already have a client with ID (%lu)!\n", request->GetClientId());
-					KSync::Comm::GatewaySocketInitializationChangeId response;
-					std::shared_ptr<KSync::Comm::CommObject> resp_obj = response.GetCommObject();
-					status = gateway_thread_socket->Send(resp_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(SEVERE, "There was a problem sending a response to the gateway thread socket!");
-						return -11;
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(SEVERE, "Sending response timedout!!");
-						return -12;
-					}
+					LOGF(SEVERE, "Unsupported message from shard (%lu)! (%i) (%s)\n", i, shard_message->GetType(), KSync::Comm::GetTypeName(shard_message->GetType()));
 				}
-			} else {
-				LOGF(SEVERE, "Unsupported message from gateway thread! (%i) (%s)\n", recv_obj->GetType(), KSync::Comm::GetTypeName(recv_obj->GetType()));
-				return -11;
 			}
 		}
 
-		//Check client sockets
-		for(auto client_socket_it = client_sockets.begin(); client_socket_it != client_sockets.end(); ++client_socket_it) {
-			//Check for incoming messages
-			recv_obj = 0;
-			std::shared_ptr<KSync::Comm::CommSystemSocket> client_socket = client_socket_it->second;
-			status = client_socket->Recv(recv_obj);
-			if(status == KSync::Comm::CommSystemSocket::Other) {
-				LOGF(WARNING, "There was a problem receiving a message from a client socket!");
-			} else if ((status == KSync::Comm::CommSystemSocket::Timeout)||(status == KSync::Comm::CommSystemSocket::EmptyMessage)) {
+		if(dump_metrics) {
+			dump_metrics = 0;
+			std::stringstream metrics_path;
+			metrics_path << log_dir << "/KSync_Server." << getpid() << ".metrics.json";
+			if(KSync::Metrics::DumpToFile(metrics_path.str()) < 0) {
+				LOGF(WARNING, "There was a problem dumping the metrics!");
 			} else {
-				if(recv_obj->GetType() == KSync::Comm::CommString::Type) {
-					std::shared_ptr<KSync::Comm::CommString> message;
-					KSync::Comm::CommCreator(message, recv_obj);
-					LOGF(INFO, "Got message (%s)\n", message->c_str());
-					std::shared_ptr<KSync::Comm::CommObject> send_obj = message->GetCommObject();
-					status = client_socket->Send(send_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(WARNING, "There was a problem sending a message on a client socket!");
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(WARNING, "Sending a message on a client socket timed out!");
-					}
-				} else if (recv_obj->GetType() == KSync::Comm::ShutdownRequest::Type) {
-					finished = true;
-					KSync::Comm::ShutdownAck shutdown_ack;
-					std::shared_ptr<KSync::Comm::CommObject> shutdown_obj = shutdown_ack.GetCommObject();
-					status = client_socket->Send(shutdown_obj);
-					if(status == KSync::Comm::CommSystemSocket::Other) {
-						LOGF(WARNING, "There was a problem sending the shutdown ack");
-					} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-						LOGF(WARNING, "There was a timeout sending the shutdown ack");
-					}
-				} else if (recv_obj->GetType() == KSync::Comm::ExecuteCommand::Type) {
-					std::shared_ptr<KSync::Comm::ExecuteCommand> exec_com;
-					KSync::Comm::CommCreator(exec_com, recv_obj);
-					LOGF(INFO, "Received command (%s)\n", exec_com->c_str());
-
-					std::shared_ptr<KSync::Commanding::ExecutionContext> command_context = command_system->GetExecutionContext();
-					command_context->LaunchCommand(exec_com->c_str());
-					std::string std_out;
-					std::string std_err;
-					command_context->GetOutput(std_out, std_err);
-
-					KSync::Comm::CommandOutput com_out;
-					com_out.SetStdout(std_out);
-					com_out.SetStderr(std_err);
-					com_out.SetReturnCode(command_context->GetReturnCode());
-
-					std::shared_ptr<KSync::Comm::CommObject> test_resp = com_out.GetCommObject();
-					status = client_socket->Send(test_resp);
-					if(status != KSync::Comm::CommSystemSocket::Success) {
-						LOGF(WARNING, "There was a problem sending the test reponse!");
-					}
-				}
+				LOGF(INFO, "Dumped metrics to (%s)", metrics_path.str().c_str());
 			}
 		}
 	}
 
 	// Shutting down
+	// Shards stop taking new work and let what's running finish
+	KSync::Server::StopShards(shards);
+
 	// Broadcast shutdown message
 	KSync::Comm::ServerShuttingDown shutdown_message;
 	std::shared_ptr<KSync::Comm::CommObject> shutdown_obj = shutdown_message.GetCommObject();
@@ -286,14 +215,17 @@ int main(int argc, char** argv) {
 	} else {
 		LOGF(WARNING, "Shutdown sent!");
 	}
+
+	size_t num_killed = KSync::Server::JoinShards(shards);
+	if(num_killed != 0) {
+		LOGF(WARNING, "(%lu) commands didn't finish in time and were killed!", num_killed);
+	}
+
 	// Shutdown gateway thread
-	status = gateway_thread_socket->Send(shutdown_obj);
-	if(status == KSync::Comm::CommSystemSocket::Other) {
-		LOGF(WARNING, "There was a problem closing down the gateway thread!");
-	} else if (status == KSync::Comm::CommSystemSocket::Timeout) {
-		LOGF(WARNING, "There was a timeout closing down the gateway thread!");
+	StopGateway(gateway_channels, gateway);
+	if(KSync::Tracing::Finish() < 0) {
+		LOGF(WARNING, "There was a problem writing the trace!");
 	}
-	//Join gateway thread
-	gateway.join();
+	KSync::BinaryLog::Shutdown();
 	return 0;
 }
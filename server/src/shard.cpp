@@ -0,0 +1,141 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+
+#include "ksync/logging.h"
+#include "ksync/shard.h"
+
+namespace KSync {
+	namespace Server {
+		Shard::Shard(const size_t index, std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const size_t num_command_threads, const int drain_timeout) :
+			admissions(AdmissionCapacity),
+			to_shard(ChannelCapacity),
+			to_master(ChannelCapacity),
+			index(index),
+			drain_timeout(drain_timeout),
+			client_handler(command_system, num_command_threads) {
+			this->num_killed = 0;
+		}
+
+		Shard::~Shard() {
+			if(this->thread.joinable()) {
+				if(!this->to_shard.try_push(std::make_shared<KSync::Comm::ServerShuttingDown>())) {
+					LOGF(SEVERE, "Couldn't tell shard (%lu) to stop!", this->index);
+				}
+				this->thread.join();
+			}
+		}
+
+		void Shard::Start() {
+			this->thread = std::thread(&Shard::Run, this);
+		}
+
+		void Shard::Join() {
+			if(this->thread.joinable()) {
+				this->thread.join();
+			}
+		}
+
+		void Shard::Run() {
+			if(this->scheduler.Spawn([this]() { this->Dispatch(); }) < 0) {
+				LOGF(SEVERE, "Couldn't start shard (%lu)!", this->index);
+				return;
+			}
+			this->scheduler.Run();
+		}
+
+		void Shard::Dispatch() {
+			bool shutdown_reported = false;
+			while(true) {
+				//Start sessions for the clients the gateway handed over.
+				std::shared_ptr<KSync::Comm::ClientCommunicator> communicator;
+				while(this->admissions.try_pop(communicator)) {
+					if(KSync::Coroutine::Spawn([this, communicator]() { this->client_handler.Serve(communicator); }) < 0) {
+						LOGF_RATE_LIMITED(SEVERE, 10, 1000, "Couldn't start a session for (%lu)!", communicator->GetClientId());
+					}
+				}
+				if(this->client_handler.ShutdownRequested()&&!shutdown_reported) {
+					shutdown_reported = this->to_master.try_push(std::make_shared<KSync::Comm::ShutdownRequest>());
+				}
+
+				std::shared_ptr<KSync::Comm::CommunicableObject> message;
+				while(this->to_shard.try_pop(message)) {
+					if(message->GetType() == KSync::Comm::ServerShuttingDown::Type) {
+						this->num_killed = this->client_handler.Drain(this->drain_timeout);
+						//Don't wait on commands which wouldn't die.
+						this->scheduler.Stop();
+						return;
+					}
+					LOGF(SEVERE, "Unsupported message for shard (%lu)! (%i) (%s)", this->index, message->GetType(), KSync::Comm::GetTypeName(message->GetType()));
+				}
+
+				//Admissions wake us straight away, the master's messages are rare enough to wait for the next pass.
+				if(this->admissions.prepare_wait()) {
+					KSync::Coroutine::WaitFd(this->admissions.GetFd(), EPOLLIN, DispatchInterval);
+					this->admissions.finish_wait();
+				}
+			}
+		}
+
+		size_t GetShardIndex(const KSync::Utilities::client_id_t client_id, const size_t num_shards) {
+			//Clients pick their own ids, so mix the bits before taking the remainder.
+			uint64_t hash = (uint64_t) client_id;
+			hash ^= hash >> 33;
+			hash *= 0xff51afd7ed558ccdULL;
+			hash ^= hash >> 33;
+			hash *= 0xc4ceb9fe1a85ec53ULL;
+			hash ^= hash >> 33;
+			return (size_t) (hash%num_shards);
+		}
+
+		void CreateShards(ShardList& shards, size_t num_shards, std::shared_ptr<KSync::Commanding::SystemInterface>& command_system, const int drain_timeout) {
+			const size_t num_cores = std::max(1u, std::thread::hardware_concurrency());
+			if(num_shards == 0) {
+				num_shards = num_cores;
+			}
+			const size_t num_command_threads = std::max((size_t) 1, num_cores/num_shards);
+			LOGF(INFO, "Starting (%lu) shards with (%lu) command threads each", num_shards, num_command_threads);
+			shards.clear();
+			for(size_t i = 0; i < num_shards; ++i) {
+				shards.push_back(std::make_shared<Shard>(i, command_system, num_command_threads, drain_timeout));
+			}
+			for(size_t i = 0; i < shards.size(); ++i) {
+				shards[i]->Start();
+			}
+		}
+
+		void StopShards(ShardList& shards) {
+			for(size_t i = 0; i < shards.size(); ++i) {
+				if(!shards[i]->to_shard.try_push(std::make_shared<KSync::Comm::ServerShuttingDown>())) {
+					LOGF(SEVERE, "Couldn't tell shard (%lu) to stop!", i);
+				}
+			}
+		}
+
+		size_t JoinShards(ShardList& shards) {
+			size_t num_killed = 0;
+			for(size_t i = 0; i < shards.size(); ++i) {
+				shards[i]->Join();
+				num_killed += shards[i]->GetNumKilled();
+			}
+			return num_killed;
+		}
+	}
+}
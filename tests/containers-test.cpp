@@ -0,0 +1,434 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/thread_utilities.h"
+#include "ksync/epoch.h"
+
+#include "test-utilities.h"
+
+using KSync::Utilities::FutureWrapper;
+using KSync::Utilities::PromiseWrapper;
+
+//Whether getting future throws an E.
+template<class E, class T>
+bool Throws(FutureWrapper<T>& future) {
+	try {
+		future.get();
+	} catch (E&) {
+		return true;
+	} catch (...) {
+	}
+	return false;
+}
+
+int TestFutures() {
+	int failures = 0;
+
+	//Continuations run on completion, and chain.
+	{
+		PromiseWrapper<int> promise;
+		FutureWrapper<int> doubled = promise.get_future().then([](FutureWrapper<int> f) { return f.get()*2; });
+		FutureWrapper<std::string> text = doubled.then([](FutureWrapper<int> f) { return std::to_string(f.get()); });
+		CHECK(!doubled.valid());
+		CHECK(!text.is_ready());
+		CHECK(promise.set_value(21));
+		CHECK(text.get() == "42");
+	}
+
+	//An exception thrown by a continuation fails the future it returned.
+	{
+		PromiseWrapper<int> promise;
+		FutureWrapper<int> failed = promise.get_future().then([](FutureWrapper<int>) -> int { throw std::runtime_error("no"); });
+		CHECK(promise.set_value(1));
+		CHECK(Throws<std::runtime_error>(failed));
+	}
+
+	//Continuations run on the executor they're given.
+	{
+		KSync::Utilities::thread_pool pool(2);
+		PromiseWrapper<int> promise;
+		const std::thread::id caller = std::this_thread::get_id();
+		FutureWrapper<bool> elsewhere = promise.get_future().then(pool, [caller](FutureWrapper<int>) { return std::this_thread::get_id() != caller; });
+		CHECK(promise.set_value(0));
+		CHECK(elsewhere.get());
+	}
+
+	//Cancelling fails the future and tells the producer, once.
+	{
+		PromiseWrapper<int> promise;
+		std::atomic<int> cancelled(0);
+		promise.set_cancel_handler([&cancelled]() { ++cancelled; });
+		FutureWrapper<int> future = promise.get_future();
+		CHECK(future.cancel());
+		CHECK(!future.cancel());
+		CHECK(!promise.set_value(1));
+		CHECK(cancelled.load() == 1);
+		CHECK(Throws<KSync::Utilities::FutureCancelledException>(future));
+	}
+
+	//Cancelling a continuation's future cancels the future it waits on.
+	{
+		PromiseWrapper<int> promise;
+		std::atomic<int> cancelled(0);
+		promise.set_cancel_handler([&cancelled]() { ++cancelled; });
+		FutureWrapper<int> next = promise.get_future().then([](FutureWrapper<int> f) { return f.get(); });
+		CHECK(next.cancel());
+		CHECK(cancelled.load() == 1);
+	}
+
+	//Deadlines fail futures which haven't completed, and leave those which have.
+	{
+		PromiseWrapper<int> late;
+		FutureWrapper<int> late_future = late.get_future();
+		late_future.set_timeout(std::chrono::milliseconds(20));
+		CHECK(late_future.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+		CHECK(Throws<KSync::Utilities::PendingTimeoutException>(late_future));
+
+		PromiseWrapper<int> early;
+		FutureWrapper<int> early_future = early.get_future();
+		early_future.set_timeout(std::chrono::milliseconds(20));
+		CHECK(early.set_value(5));
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(early_future.get() == 5);
+	}
+
+	//A promise dropped without a value breaks its future.
+	{
+		FutureWrapper<int> orphan;
+		{
+			PromiseWrapper<int> promise;
+			orphan = promise.get_future();
+		}
+		CHECK(Throws<std::future_error>(orphan));
+	}
+
+	//when_all keeps the order given, whatever order they complete in.
+	{
+		std::vector<PromiseWrapper<int>> promises(4);
+		std::vector<FutureWrapper<int>> futures;
+		for(size_t i=0; i < promises.size(); ++i) {
+			futures.push_back(promises[i].get_future());
+		}
+		FutureWrapper<std::vector<int>> all = KSync::Utilities::when_all(std::move(futures));
+		for(size_t i=promises.size(); i > 0; --i) {
+			CHECK(!all.is_ready());
+			CHECK(promises[i-1].set_value((int) (i-1)*10));
+		}
+		const std::vector<int> values = all.get();
+		CHECK(values.size() == 4);
+		for(size_t i=0; i < values.size(); ++i) {
+			CHECK(values[i] == (int) i*10);
+		}
+	}
+
+	//when_all fails as soon as any one does.
+	{
+		std::vector<PromiseWrapper<int>> promises(3);
+		std::vector<FutureWrapper<int>> futures;
+		for(size_t i=0; i < promises.size(); ++i) {
+			futures.push_back(promises[i].get_future());
+		}
+		FutureWrapper<std::vector<int>> all = KSync::Utilities::when_all(std::move(futures));
+		CHECK(promises[1].set_exception(std::make_exception_ptr(std::runtime_error("no"))));
+		CHECK(all.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+		CHECK(Throws<std::runtime_error>(all));
+	}
+
+	//when_any gives the first to complete along with its index.
+	{
+		std::vector<PromiseWrapper<int>> promises(3);
+		std::vector<FutureWrapper<int>> futures;
+		for(size_t i=0; i < promises.size(); ++i) {
+			futures.push_back(promises[i].get_future());
+		}
+		FutureWrapper<std::pair<size_t, int>> any = KSync::Utilities::when_any(std::move(futures));
+		CHECK(promises[2].set_value(7));
+		CHECK(promises[0].set_value(8));
+		const std::pair<size_t, int> first = any.get();
+		CHECK((first.first == 2)&&(first.second == 7));
+	}
+
+	return failures;
+}
+
+class Counted {
+	public:
+		Counted(std::atomic<int>& num_freed) : num_freed(num_freed) {}
+		~Counted() {
+			++this->num_freed;
+		}
+	private:
+		std::atomic<int>& num_freed;
+};
+
+int TestEpoch() {
+	int failures = 0;
+
+	//Nothing retired while another thread is pinned is freed until it unpins.
+	{
+		std::atomic<int> num_freed(0);
+		std::atomic<bool> pinned(false);
+		std::atomic<bool> release(false);
+		std::thread reader([&pinned, &release]() {
+			KSync::Epoch::Guard guard;
+			pinned.store(true);
+			while(!release.load()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+		while(!pinned.load()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		const int num_objects = 10;
+		for(int i=0; i < num_objects; ++i) {
+			KSync::Epoch::Retire(new Counted(num_freed));
+		}
+		for(int i=0; i < 10; ++i) {
+			KSync::Epoch::Collect();
+		}
+		CHECK(num_freed.load() == 0);
+		release.store(true);
+		reader.join();
+		for(int i=0; (i < 10)&&(num_freed.load() != num_objects); ++i) {
+			KSync::Epoch::Collect();
+		}
+		CHECK(num_freed.load() == num_objects);
+	}
+
+	//Producers and consumers hammering the stack and queue lose and repeat nothing.
+	{
+		const int num_threads = 4;
+		const int num_values = 20000;
+		KSync::Utilities::epoch_lock_free_stack<int> stack;
+		KSync::Utilities::epoch_lock_free_queue<int> queue;
+		std::atomic<long> stack_sum(0);
+		std::atomic<long> queue_sum(0);
+		std::atomic<int> num_popped(0);
+		std::vector<std::thread> threads;
+		for(int t=0; t < num_threads; ++t) {
+			threads.emplace_back([&, t]() {
+				for(int i=0; i < num_values; ++i) {
+					const int value = t*num_values+i;
+					stack.push(value);
+					std::shared_ptr<int> boxed = std::make_shared<int>(value);
+					queue.push(boxed);
+				}
+			});
+			threads.emplace_back([&]() {
+				while(num_popped.load() < 2*num_threads*num_values) {
+					std::shared_ptr<int> value = stack.pop();
+					if(value) {
+						stack_sum += *value;
+						++num_popped;
+					}
+					value = queue.pop();
+					if(value) {
+						queue_sum += *value;
+						++num_popped;
+					}
+				}
+			});
+		}
+		for(size_t i=0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+		const long total = (long) num_threads*num_values;
+		const long expected = total*(total-1)/2;
+		CHECK(stack_sum.load() == expected);
+		CHECK(queue_sum.load() == expected);
+		CHECK(!stack.pop());
+		CHECK(!queue.pop());
+	}
+
+	//The queue hands values back in the order a single producer pushed them.
+	{
+		KSync::Utilities::epoch_lock_free_queue<int> queue;
+		for(int i=0; i < 100; ++i) {
+			std::shared_ptr<int> value = std::make_shared<int>(i);
+			queue.push(value);
+		}
+		bool in_order = true;
+		for(int i=0; i < 100; ++i) {
+			std::shared_ptr<int> value = queue.pop();
+			in_order = in_order&&value&&(*value == i);
+		}
+		CHECK(in_order);
+	}
+
+	return failures;
+}
+
+int TestSpscChannel() {
+	int failures = 0;
+
+	//try_push refuses once the ring is full, leaving the value alone.
+	{
+		KSync::Utilities::spsc_channel<std::string> channel(4);
+		for(int i=0; i < 4; ++i) {
+			CHECK(channel.try_push(std::to_string(i)));
+		}
+		std::string extra("extra");
+		CHECK(!channel.try_push(extra));
+		CHECK(extra == "extra");
+		std::string value;
+		CHECK(channel.try_pop(value)&&(value == "0"));
+		CHECK(channel.try_push(extra));
+	}
+
+	//A consumer sleeping on the channel sees every value, in order.
+	{
+		const uint64_t num_values = 200000;
+		KSync::Utilities::spsc_channel<uint64_t> channel(64);
+		std::thread producer([&channel, num_values]() {
+			for(uint64_t i=0; i < num_values; ++i) {
+				while(!channel.try_push(i)) {
+					std::this_thread::yield();
+				}
+			}
+		});
+		uint64_t expected = 0;
+		bool in_order = true;
+		int num_timeouts = 0;
+		while(expected < num_values) {
+			uint64_t value;
+			if(channel.try_pop(value)) {
+				in_order = in_order&&(value == expected);
+				++expected;
+			} else if(!channel.wait(1000)) {
+				//Should never sleep through a push.
+				++num_timeouts;
+			}
+		}
+		producer.join();
+		CHECK(in_order);
+		CHECK(num_timeouts == 0);
+	}
+
+	//wait times out on an empty channel.
+	{
+		KSync::Utilities::spsc_channel<int> channel(4);
+		CHECK(!channel.wait(10));
+	}
+
+	return failures;
+}
+
+int TestBoundedQueue() {
+	int failures = 0;
+
+	//A full queue holds its producer back until there is room.
+	{
+		KSync::Utilities::bounded_queue<int> queue(2);
+		CHECK(queue.push(1));
+		CHECK(queue.push(2));
+		std::atomic<bool> pushed(false);
+		std::thread producer([&queue, &pushed]() {
+			if(queue.push(3)) {
+				pushed.store(true);
+			}
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(!pushed.load());
+		int value = 0;
+		CHECK(queue.pop(value)&&(value == 1));
+		producer.join();
+		CHECK(pushed.load());
+		CHECK(queue.size() == 2);
+	}
+
+	//Closing drains what's left, then pop and push fail.
+	{
+		KSync::Utilities::bounded_queue<int> queue(4);
+		CHECK(queue.push(1));
+		queue.close();
+		CHECK(!queue.push(2));
+		int value = 0;
+		CHECK(queue.pop(value)&&(value == 1));
+		CHECK(!queue.pop(value));
+	}
+
+	//Closing wakes a consumer waiting on an empty queue.
+	{
+		KSync::Utilities::bounded_queue<int> queue(4);
+		std::thread consumer([&queue]() {
+			int value;
+			while(queue.pop(value));
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		queue.close();
+		consumer.join();
+	}
+
+	//A budget lets an amount through once it fits, or once nothing else is held.
+	{
+		KSync::Utilities::byte_budget budget(100);
+		budget.acquire(60);
+		std::atomic<bool> acquired(false);
+		std::thread waiter([&budget, &acquired]() {
+			budget.acquire(50);
+			acquired.store(true);
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(!acquired.load());
+		budget.release(60);
+		waiter.join();
+		CHECK(budget.in_use() == 50);
+		budget.release(50);
+		budget.acquire(1000);
+		CHECK(budget.in_use() == 1000);
+		budget.release(1000);
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "containers-test", log_dir);
+
+	int failures = 0;
+	const int future_failures = TestFutures();
+	printf("Futures: %d failures\n", future_failures);
+	failures += future_failures;
+
+	const int epoch_failures = TestEpoch();
+	printf("Epoch containers: %d failures\n", epoch_failures);
+	failures += epoch_failures;
+
+	const int spsc_failures = TestSpscChannel();
+	printf("spsc_channel: %d failures\n", spsc_failures);
+	failures += spsc_failures;
+
+	const int bounded_failures = TestBoundedQueue();
+	printf("bounded_queue: %d failures\n", bounded_failures);
+	failures += bounded_failures;
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
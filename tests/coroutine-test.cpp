@@ -0,0 +1,323 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/coroutine.h"
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+namespace Coroutine = KSync::Coroutine;
+typedef std::chrono::steady_clock Clock;
+
+int TestScheduling() {
+	int failures = 0;
+	Coroutine::Scheduler scheduler;
+	KSync::Utilities::thread_pool pool(2);
+
+	//Many coroutines sleeping, yielding and offloading all finish, and resume
+	//on the scheduler's thread.
+	{
+		const int num_coroutines = 1000;
+		int num_done = 0;
+		int num_wrong_thread = 0;
+		const std::thread::id scheduler_thread = std::this_thread::get_id();
+		for(int i=0; i < num_coroutines; ++i) {
+			CHECK(scheduler.Spawn([&num_done, &num_wrong_thread, &pool, scheduler_thread, i]() {
+				Coroutine::Sleep(i%7);
+				Coroutine::Yield();
+				int value = 0;
+				Coroutine::Offload(pool, [&value, i]() { value = i; });
+				if(std::this_thread::get_id() != scheduler_thread) {
+					++num_wrong_thread;
+				}
+				if(value == i) {
+					++num_done;
+				}
+			}) >= 0);
+		}
+		scheduler.Run();
+		CHECK(num_done == num_coroutines);
+		CHECK(num_wrong_thread == 0);
+		CHECK(scheduler.GetNumCoroutines() == 0);
+	}
+
+	//Yield runs the others before coming back.
+	{
+		std::string order;
+		for(int i=0; i < 3; ++i) {
+			CHECK(scheduler.Spawn([&order, i]() {
+				order += (char) ('a'+i);
+				Coroutine::Yield();
+				order += (char) ('A'+i);
+			}) >= 0);
+		}
+		scheduler.Run();
+		CHECK(order == "abcABC");
+	}
+
+	//Sleeping coroutines wake in deadline order, not far from when they asked.
+	{
+		std::vector<int> woke;
+		const Clock::time_point start = Clock::now();
+		const int delays[] = {60, 20, 40};
+		for(size_t i=0; i < 3; ++i) {
+			const int delay = delays[i];
+			CHECK(scheduler.Spawn([&woke, delay]() {
+				Coroutine::Sleep(delay);
+				woke.push_back(delay);
+			}) >= 0);
+		}
+		scheduler.Run();
+		const double elapsed = std::chrono::duration<double, std::milli>(Clock::now()-start).count();
+		CHECK((woke.size() == 3)&&(woke[0] == 20)&&(woke[1] == 40)&&(woke[2] == 60));
+		CHECK((elapsed >= 60.)&&(elapsed < 1000.));
+	}
+
+	//Exceptions from offloaded work come back to the coroutine.
+	{
+		bool caught = false;
+		CHECK(scheduler.Spawn([&caught, &pool]() {
+			try {
+				Coroutine::Offload(pool, []() { throw std::runtime_error("offloaded"); });
+			} catch (std::runtime_error&) {
+				caught = true;
+			}
+		}) >= 0);
+		scheduler.Run();
+		CHECK(caught);
+	}
+
+	//WaitFd wakes on readiness, and times out without it.
+	{
+		int fds[2];
+		CHECK(pipe(fds) == 0);
+		int readable = -10;
+		int timed_out = -10;
+		CHECK(scheduler.Spawn([&readable, &fds]() { readable = Coroutine::WaitFd(fds[0], EPOLLIN, 5000); }) >= 0);
+		CHECK(scheduler.Spawn([&fds]() {
+			Coroutine::Sleep(20);
+			if(write(fds[1], "x", 1) != 1) {
+				fprintf(stderr, "Couldn't write to the pipe!\n");
+			}
+		}) >= 0);
+		scheduler.Run();
+		CHECK((readable & EPOLLIN) != 0);
+		char c;
+		CHECK(read(fds[0], &c, 1) == 1);
+		CHECK(scheduler.Spawn([&timed_out, &fds]() { timed_out = Coroutine::WaitFd(fds[0], EPOLLIN, 30); }) >= 0);
+		scheduler.Run();
+		CHECK(timed_out == 0);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	//Stop from another thread makes Run return with coroutines still waiting.
+	{
+		bool finished = false;
+		CHECK(scheduler.Spawn([&finished]() {
+			Coroutine::Sleep(100);
+			finished = true;
+		}) >= 0);
+		std::thread stopper([&scheduler]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			scheduler.Stop();
+		});
+		scheduler.Run();
+		stopper.join();
+		CHECK(!finished);
+		CHECK(scheduler.GetNumCoroutines() == 1);
+		scheduler.Run();
+		CHECK(finished);
+	}
+
+	return failures;
+}
+
+//Coroutines on one thread talking to a peer over loopback communicators.
+int TestMessaging(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system) {
+	int failures = 0;
+	std::shared_ptr<KSync::Comm::ClientCommunicator> local(new KSync::Comm::ClientCommunicator(comm_system, 40, true));
+	std::shared_ptr<KSync::Comm::ClientCommunicator> remote(new KSync::Comm::ClientCommunicator(comm_system, 40, false));
+
+	//The peer echoes everything back.
+	std::atomic<bool> stop(false);
+	std::thread echo([&remote, &stop]() {
+		while(!stop.load()) {
+			std::shared_ptr<KSync::Comm::CommObject> comm_obj = remote->get(10);
+			if(comm_obj) {
+				std::shared_ptr<KSync::Comm::CommString> text;
+				KSync::Comm::CommCreator(text, comm_obj);
+				KSync::Comm::CommString reply(*text);
+				std::shared_ptr<KSync::Comm::CommObject> reply_obj = reply.GetCommObject();
+				if(remote->send(reply_obj) < 0) {
+					return;
+				}
+			}
+		}
+	});
+
+	Coroutine::Scheduler scheduler;
+	const int num_messages = 500;
+	std::vector<std::string> received;
+	int num_send_errors = 0;
+	bool idle_timed_out = false;
+	//One coroutine sends while another receives, neither blocking the thread.
+	CHECK(scheduler.Spawn([&local, &num_send_errors, num_messages]() {
+		for(int i=0; i < num_messages; ++i) {
+			KSync::Comm::CommString text(std::to_string(i));
+			std::shared_ptr<KSync::Comm::CommObject> comm_obj = text.GetCommObject();
+			if(Coroutine::Send(*local, comm_obj, 5000) < 0) {
+				++num_send_errors;
+			}
+			if(i%50 == 0) {
+				Coroutine::Yield();
+			}
+		}
+	}) >= 0);
+	CHECK(scheduler.Spawn([&local, &received, &idle_timed_out, num_messages]() {
+		while((int) received.size() < num_messages) {
+			std::shared_ptr<KSync::Comm::CommObject> comm_obj = Coroutine::Recv(*local, 5000);
+			if(!comm_obj) {
+				return;
+			}
+			std::shared_ptr<KSync::Comm::CommString> text;
+			KSync::Comm::CommCreator(text, comm_obj);
+			received.push_back(*text);
+		}
+		//Nothing more is coming, so Recv gives up on time.
+		const Clock::time_point start = Clock::now();
+		idle_timed_out = !Coroutine::Recv(*local, 50)&&(Clock::now()-start >= std::chrono::milliseconds(50));
+	}) >= 0);
+	scheduler.Run();
+	stop.store(true);
+	echo.join();
+
+	CHECK(num_send_errors == 0);
+	CHECK((int) received.size() == num_messages);
+	bool in_order = true;
+	for(size_t i=0; i < received.size(); ++i) {
+		in_order = in_order&&(received[i] == std::to_string(i));
+	}
+	CHECK(in_order);
+	CHECK(idle_timed_out);
+	return failures;
+}
+
+int Recurse(const int depth) {
+	volatile char frame[512];
+	memset((char*) frame, depth, sizeof(frame));
+	return (depth == 0) ? frame[3] : Recurse(depth-1)+frame[7];
+}
+
+//Run a coroutine recursing depth deep on a small stack in a child process,
+//returning how the child ended.
+int RecurseInChild(const int depth) {
+	const pid_t pid = fork();
+	if(pid == 0) {
+		Coroutine::Scheduler scheduler;
+		volatile int result = 0;
+		if(scheduler.Spawn([&result, depth]() { result = Recurse(depth); }, 16*1024) < 0) {
+			_exit(2);
+		}
+		scheduler.Run();
+		_exit(0);
+	}
+	int status = 0;
+	if((pid < 0)||(waitpid(pid, &status, 0) != pid)) {
+		return -1;
+	}
+	return status;
+}
+
+int TestStacks() {
+	int failures = 0;
+
+	//Within the stack is fine.
+	const int fits = RecurseInChild(10);
+	CHECK(WIFEXITED(fits)&&(WEXITSTATUS(fits) == 0));
+	//Overflowing hits the guard page instead of whatever lies below.
+	const int overflows = RecurseInChild(200);
+	CHECK(WIFSIGNALED(overflows)&&(WTERMSIG(overflows) == SIGSEGV));
+
+	//Stacks are reused across coroutines of different sizes without trouble.
+	{
+		Coroutine::Scheduler scheduler;
+		int num_done = 0;
+		for(int round=0; round < 3; ++round) {
+			for(int i=0; i < 100; ++i) {
+				const size_t stack_size = (i%2 == 0) ? 16*1024 : Coroutine::Scheduler::DefaultStackSize;
+				CHECK(scheduler.Spawn([&num_done]() {
+					volatile int result = Recurse(8);
+					(void) result;
+					Coroutine::Yield();
+					++num_done;
+				}, stack_size) >= 0);
+			}
+			scheduler.Run();
+		}
+		CHECK(num_done == 300);
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "coroutine-test", log_dir);
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+
+	int failures = 0;
+	//Before any threads are started, so the children fork cleanly.
+	const int stack_failures = TestStacks();
+	printf("Coroutine stacks: %d failures\n", stack_failures);
+	failures += stack_failures;
+
+	const int scheduling_failures = TestScheduling();
+	printf("Coroutine scheduling: %d failures\n", scheduling_failures);
+	failures += scheduling_failures;
+
+	const int messaging_failures = TestMessaging(comm_system);
+	printf("Coroutine messaging: %d failures\n", messaging_failures);
+	failures += messaging_failures;
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+typedef std::shared_ptr<KSync::Comm::ClientCommunicator> Communicator;
+
+std::shared_ptr<KSync::Comm::CommObject> Numbered(const int i) {
+	KSync::Comm::CommString text(std::to_string(i));
+	return text.GetCommObject();
+}
+
+int Number(const std::shared_ptr<KSync::Comm::CommObject>& comm_obj) {
+	std::shared_ptr<KSync::Comm::CommString> text;
+	KSync::Comm::CommCreator(text, comm_obj);
+	return atoi(text->c_str());
+}
+
+//Take everything that arrives until nothing has for timeout ms.
+std::vector<int> Drain(Communicator& communicator, const int timeout) {
+	std::vector<int> numbers;
+	while(true) {
+		std::shared_ptr<KSync::Comm::CommObject> comm_obj = communicator->get(timeout);
+		if(!comm_obj) {
+			return numbers;
+		}
+		numbers.push_back(Number(comm_obj));
+	}
+}
+
+bool Increasing(const std::vector<int>& numbers) {
+	for(size_t i=1; i < numbers.size(); ++i) {
+		if(numbers[i] <= numbers[i-1]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int TestCredit(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system) {
+	int failures = 0;
+
+	//With the other end not taking anything, only its credit goes out and only
+	//the high water mark waits here, the rest is refused.
+	{
+		Communicator sender(new KSync::Comm::ClientCommunicator(comm_system, 20, true));
+		Communicator receiver(new KSync::Comm::ClientCommunicator(comm_system, 20, false));
+		const size_t high_water = 100;
+		sender->SetSendHighWater(high_water);
+		int num_accepted = 0;
+		for(int i=0; i < 1000; ++i) {
+			std::shared_ptr<KSync::Comm::CommObject> comm_obj = Numbered(i);
+			if(sender->send(comm_obj, 0) == 0) {
+				++num_accepted;
+			}
+			//Give the watch thread a chance to put credited messages on the wire.
+			if(i%50 == 0) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		}
+		CHECK(num_accepted >= (int) high_water);
+		CHECK(num_accepted <= (int) (KSync::Comm::ClientCommunicator::InitialWindow+high_water));
+		//Taking them hands credit back, so everything accepted arrives, in order.
+		const std::vector<int> received = Drain(receiver, 500);
+		CHECK((int) received.size() == num_accepted);
+		CHECK(Increasing(received));
+	}
+
+	//A sender which waits for room gets everything through a slow receiver.
+	{
+		Communicator sender(new KSync::Comm::ClientCommunicator(comm_system, 21, true));
+		Communicator receiver(new KSync::Comm::ClientCommunicator(comm_system, 21, false));
+		sender->SetSendHighWater(16);
+		receiver->SetRecvWindow(8);
+		const int num_messages = 2000;
+		std::atomic<int> num_refused(0);
+		std::thread producer([&sender, &num_refused, num_messages]() {
+			for(int i=0; i < num_messages; ++i) {
+				std::shared_ptr<KSync::Comm::CommObject> comm_obj = Numbered(i);
+				if(sender->send(comm_obj, KSync::Comm::ClientCommunicator::WaitForever) < 0) {
+					++num_refused;
+				}
+			}
+		});
+		std::vector<int> received;
+		while((int) received.size() < num_messages) {
+			std::shared_ptr<KSync::Comm::CommObject> comm_obj = receiver->get(5000);
+			if(!comm_obj) {
+				break;
+			}
+			received.push_back(Number(comm_obj));
+			if(received.size()%100 == 0) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		producer.join();
+		CHECK(num_refused.load() == 0);
+		CHECK((int) received.size() == num_messages);
+		CHECK(Increasing(received));
+	}
+
+	//Replies nothing is waiting for are dropped, and still give their credit
+	//back, so more of them than the window doesn't stall the link.
+	{
+		Communicator client(new KSync::Comm::ClientCommunicator(comm_system, 22, true));
+		Communicator peer(new KSync::Comm::ClientCommunicator(comm_system, 22, false));
+		const int num_stray = 3*KSync::Comm::ClientCommunicator::InitialWindow;
+		for(int i=0; i < num_stray; ++i) {
+			std::shared_ptr<KSync::Comm::CommObject> stray = Numbered(i);
+			stray->SetReplyId(KSync::Comm::CommObject::GenMessageId());
+			CHECK(peer->send(stray, 5000) == 0);
+		}
+		std::shared_ptr<KSync::Comm::CommObject> last = Numbered(-1);
+		CHECK(peer->send(last, 5000) == 0);
+		const std::vector<int> received = Drain(client, 2000);
+		CHECK((received.size() == 1)&&(received[0] == -1));
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "flow-control-test", log_dir);
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+
+	const int failures = TestCredit(comm_system);
+	printf("Credit flow control: %d failures\n", failures);
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,429 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ksync/hash_cache.h"
+#include "ksync/thread_utilities.h"
+
+#include "test-utilities.h"
+
+using KSync::Hash::HashCache;
+using KSync::Hash::FileHashes;
+
+//Where things are in the cache file, see hash_cache.cxx.
+static const off_t HeaderSize = 64;
+static const off_t SlotSize = 96;
+static const off_t DirtyOffset = 20;
+static const off_t NumEntriesOffset = 32;
+static const off_t BlocksUsedOffset = 40;
+static const off_t SlotInoOffset = 8;
+static const off_t SlotFirstBlockOffset = 40;
+static const off_t SlotUsedOffset = 52;
+
+//A file which last changed long enough ago to be cached.
+struct stat Stat(const uint64_t ino, const off_t size, const time_t mtime) {
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_dev = 1;
+	st.st_ino = ino;
+	st.st_size = size;
+	st.st_mtim.tv_sec = mtime;
+	st.st_ctim.tv_sec = mtime;
+	return st;
+}
+
+//Hashes telling which file and version they came from.
+FileHashes Hashes(const uint64_t ino, const size_t num_blocks) {
+	FileHashes hashes;
+	hashes.digest.fill(0);
+	memcpy(hashes.digest.data(), &ino, sizeof(ino));
+	for(size_t i=0; i < num_blocks; ++i) {
+		KSync::Hash::digest_t block;
+		block.fill((uint8_t) i);
+		memcpy(block.data(), &ino, sizeof(ino));
+		hashes.blocks.push_back(block);
+	}
+	return hashes;
+}
+
+bool Same(const FileHashes& a, const FileHashes& b) {
+	return (a.digest == b.digest)&&(a.blocks == b.blocks);
+}
+
+//Whether the cache has exactly what Hashes(ino, num_blocks) stored.
+bool Has(HashCache& cache, const uint64_t ino, const size_t num_blocks) {
+	FileHashes found;
+	return cache.Lookup(Stat(ino, (off_t) num_blocks*100, 1000), found)&&Same(found, Hashes(ino, num_blocks));
+}
+
+int Store(HashCache& cache, const uint64_t ino, const size_t num_blocks) {
+	return cache.Store(Stat(ino, (off_t) num_blocks*100, 1000), Hashes(ino, num_blocks));
+}
+
+template<typename T>
+void Poke(const std::string& path, const off_t offset, const T value) {
+	const int fd = open(path.c_str(), O_WRONLY);
+	if((fd < 0)||(pwrite(fd, &value, sizeof(value), offset) != (ssize_t) sizeof(value))) {
+		fprintf(stderr, "Couldn't write to (%s)!\n", path.c_str());
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+}
+
+template<typename T>
+T Peek(const std::string& path, const off_t offset) {
+	T value = T();
+	const int fd = open(path.c_str(), O_RDONLY);
+	if((fd < 0)||(pread(fd, &value, sizeof(value), offset) != (ssize_t) sizeof(value))) {
+		fprintf(stderr, "Couldn't read from (%s)!\n", path.c_str());
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+	return value;
+}
+
+off_t FileSize(const std::string& path) {
+	struct stat st;
+	return (stat(path.c_str(), &st) == 0) ? st.st_size : -1;
+}
+
+//The offset of the slot holding ino, -1 if there isn't one.
+off_t FindSlot(const std::string& path, const uint64_t ino) {
+	const uint64_t num_slots = Peek<uint64_t>(path, 24);
+	for(uint64_t i=0; i < num_slots; ++i) {
+		const off_t slot = HeaderSize+(off_t) i*SlotSize;
+		if((Peek<uint32_t>(path, slot+SlotUsedOffset) != 0)&&(Peek<uint64_t>(path, slot+SlotInoOffset) == ino)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+int TestEntries(const std::string& dir) {
+	int failures = 0;
+	const std::string path = dir+"/entries.cache";
+	HashCache cache;
+	CHECK(cache.Open(path) == 0);
+	CHECK(cache.GetNumEntries() == 0);
+
+	//What went in comes out, and only while the file looks the same.
+	CHECK(Store(cache, 1, 3) == 0);
+	CHECK(Store(cache, 2, 0) == 0);
+	CHECK(Has(cache, 1, 3));
+	CHECK(Has(cache, 2, 0));
+	CHECK(cache.GetNumEntries() == 2);
+	{
+		FileHashes found;
+		CHECK(!cache.Lookup(Stat(1, 301, 1000), found));
+		CHECK(!cache.Lookup(Stat(1, 300, 1001), found));
+		struct stat touched = Stat(1, 300, 1000);
+		touched.st_ctim.tv_nsec = 1;
+		CHECK(!cache.Lookup(touched, found));
+		CHECK(!cache.Lookup(Stat(3, 300, 1000), found));
+		struct stat other_dev = Stat(1, 300, 1000);
+		other_dev.st_dev = 2;
+		CHECK(!cache.Lookup(other_dev, found));
+	}
+
+	//A changed file replaces its entry, whether it grew or shrank.
+	CHECK(cache.Store(Stat(1, 500, 2000), Hashes(11, 5)) == 0);
+	CHECK(cache.GetNumEntries() == 2);
+	{
+		FileHashes found;
+		CHECK(!cache.Lookup(Stat(1, 300, 1000), found));
+		CHECK(cache.Lookup(Stat(1, 500, 2000), found)&&Same(found, Hashes(11, 5)));
+		CHECK(cache.Store(Stat(1, 100, 3000), Hashes(12, 1)) == 0);
+		CHECK(cache.Lookup(Stat(1, 100, 3000), found)&&Same(found, Hashes(12, 1)));
+	}
+
+	//Far more entries and blocks than it started with makes it grow, losing nothing.
+	const uint64_t num_files = 3*HashCache::MinSlots;
+	const off_t first_size = FileSize(path);
+	bool all_stored = true;
+	for(uint64_t i=100; i < 100+num_files; ++i) {
+		all_stored = all_stored&&(Store(cache, i, (size_t) (i%5)) == 0);
+	}
+	CHECK(all_stored);
+	CHECK(FileSize(path) > first_size);
+	CHECK(cache.GetNumEntries() == num_files+2);
+	bool all_found = true;
+	for(uint64_t i=100; i < 100+num_files; ++i) {
+		all_found = all_found&&Has(cache, i, (size_t) (i%5));
+	}
+	CHECK(all_found);
+	CHECK(Has(cache, 2, 0));
+
+	//Everything is still there after closing and opening again.
+	CHECK(cache.Close() == 0);
+	CHECK(!cache.IsOpen());
+	CHECK(Peek<uint32_t>(path, DirtyOffset) == 0);
+	CHECK(cache.Open(path) == 0);
+	CHECK(Peek<uint32_t>(path, DirtyOffset) != 0);
+	CHECK(cache.GetNumEntries() == num_files+2);
+	all_found = true;
+	for(uint64_t i=100; i < 100+num_files; ++i) {
+		all_found = all_found&&Has(cache, i, (size_t) (i%5));
+	}
+	CHECK(all_found);
+	CHECK(cache.Close() == 0);
+
+	//A different block size means different hashes, so none of them are kept.
+	CHECK(cache.Open(path, HashCache::DefaultBlockSize/2) == 0);
+	CHECK(cache.GetNumEntries() == 0);
+	CHECK(!Has(cache, 2, 0));
+	CHECK(cache.Close() == 0);
+
+	//Nothing is cached without an open cache.
+	CHECK(Store(cache, 1, 1) == 0);
+	CHECK(!Has(cache, 1, 1));
+	return failures;
+}
+
+int TestIdle(const std::string& dir) {
+	int failures = 0;
+	const std::string path = dir+"/idle.cache";
+	HashCache cache;
+
+	//Entries not looked at for a while are dropped when the table is rebuilt,
+	//those in use are kept.
+	CHECK(cache.Open(path) == 0);
+	CHECK(Store(cache, 1, 2) == 0);
+	CHECK(Store(cache, 2, 2) == 0);
+	CHECK(cache.Close() == 0);
+	for(uint64_t i=0; i < HashCache::MaxIdleGenerations+2; ++i) {
+		CHECK(cache.Open(path) == 0);
+		CHECK(Has(cache, 2, 2));
+		CHECK(cache.Close() == 0);
+	}
+	CHECK(cache.Open(path) == 0);
+	for(uint64_t i=100; i < 100+HashCache::MinSlots; ++i) {
+		CHECK(Store(cache, i, 1) == 0);
+	}
+	CHECK(!Has(cache, 1, 2));
+	CHECK(Has(cache, 2, 2));
+	CHECK(cache.GetNumEntries() == HashCache::MinSlots+1);
+	CHECK(cache.Close() == 0);
+
+	//Only one user at a time.
+	{
+		HashCache first;
+		HashCache second;
+		CHECK(first.Open(path) == 0);
+		CHECK(second.Open(path) < 0);
+		CHECK(first.Close() == 0);
+		CHECK(second.Open(path) == 0);
+		CHECK(second.Close() == 0);
+	}
+	return failures;
+}
+
+//Fill a cache with a few entries and close it, for corrupting.
+int Prepare(const std::string& path) {
+	int failures = 0;
+	unlink(path.c_str());
+	HashCache cache;
+	CHECK(cache.Open(path) == 0);
+	for(uint64_t i=1; i <= 10; ++i) {
+		CHECK(Store(cache, i, 3) == 0);
+	}
+	CHECK(cache.Close() == 0);
+	return failures;
+}
+
+int TestCorrupt(const std::string& dir) {
+	int failures = 0;
+	const std::string path = dir+"/corrupt.cache";
+
+	//Caches which can't be trusted are started over rather than believed.
+	{
+		failures += Prepare(path);
+		Poke<uint64_t>(path, NumEntriesOffset, 1ULL << 40);
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 0);
+		CHECK(!Has(cache, 1, 3));
+		CHECK(Store(cache, 1, 3) == 0);
+		CHECK(Has(cache, 1, 3));
+		CHECK(cache.Close() == 0);
+	}
+	{
+		failures += Prepare(path);
+		Poke<uint32_t>(path, DirtyOffset, 1);
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 0);
+		CHECK(!Has(cache, 1, 3));
+		CHECK(cache.Close() == 0);
+	}
+	{
+		failures += Prepare(path);
+		CHECK(truncate(path.c_str(), FileSize(path)-1) == 0);
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 0);
+		CHECK(!Has(cache, 1, 3));
+		CHECK(cache.Close() == 0);
+	}
+	{
+		failures += Prepare(path);
+		CHECK(truncate(path.c_str(), 10) == 0);
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 0);
+		CHECK(cache.Close() == 0);
+	}
+	{
+		failures += Prepare(path);
+		Poke<char>(path, 0, 'X');
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 0);
+		CHECK(cache.Close() == 0);
+	}
+
+	//An entry pointing past the blocks in use misses, and can be stored over.
+	{
+		failures += Prepare(path);
+		const off_t slot = FindSlot(path, 4);
+		CHECK(slot >= 0);
+		Poke<uint64_t>(path, slot+SlotFirstBlockOffset, Peek<uint64_t>(path, BlocksUsedOffset)-1);
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		CHECK(cache.GetNumEntries() == 10);
+		CHECK(!Has(cache, 4, 3));
+		CHECK(Has(cache, 5, 3));
+		CHECK(Store(cache, 4, 3) == 0);
+		CHECK(Has(cache, 4, 3));
+		CHECK(cache.Close() == 0);
+	}
+
+	//With every slot claiming to be used there's nowhere for a probe to stop,
+	//lookups still miss rather than spin and a store rebuilds the table.
+	{
+		failures += Prepare(path);
+		const uint64_t num_slots = Peek<uint64_t>(path, 24);
+		for(uint64_t i=0; i < num_slots; ++i) {
+			Poke<uint32_t>(path, HeaderSize+(off_t) i*SlotSize+SlotUsedOffset, 1);
+		}
+		HashCache cache;
+		CHECK(cache.Open(path) == 0);
+		FileHashes found;
+		CHECK(!cache.Lookup(Stat(12345, 300, 1000), found));
+		CHECK(Has(cache, 1, 3));
+		CHECK(Store(cache, 12345, 3) == 0);
+		CHECK(Has(cache, 12345, 3));
+		CHECK(Has(cache, 1, 3));
+		CHECK(cache.Close() == 0);
+	}
+
+	return failures;
+}
+
+int TestFiles(const std::string& dir) {
+	int failures = 0;
+	const std::string path = dir+"/files.cache";
+	const uint32_t block_size = 4096;
+	HashCache cache;
+	CHECK(cache.Open(path, block_size) == 0);
+	KSync::Utilities::thread_pool pool(2);
+	cache.SetThreadPool(&pool);
+
+	//Hashing a real file gives the same hashes as hashing its contents.
+	const std::string file = dir+"/data";
+	std::string data(10*block_size+123, '\0');
+	for(size_t i=0; i < data.size(); ++i) {
+		data[i] = (char) (i*7+(i >> 12));
+	}
+	{
+		std::ofstream out(file.c_str(), std::ios::binary);
+		out.write(data.data(), data.size());
+	}
+	FileHashes expected;
+	KSync::Hash::HashBuffer(data.data(), data.size(), block_size, expected);
+	CHECK(expected.blocks.size() == 11);
+	FileHashes hashes;
+	CHECK(cache.GetHashes(file, hashes) == HashCache::Hashed);
+	CHECK(Same(hashes, expected));
+
+	//It was only just written, so it could change again unnoticed and isn't kept.
+	CHECK(cache.GetNumEntries() == 0);
+	CHECK(cache.GetHashes(file, hashes) == HashCache::Hashed);
+
+	//Once the cache knows it, it's answered without reading.
+	struct stat st;
+	CHECK(stat(file.c_str(), &st) == 0);
+	CHECK(cache.Store(st, expected) == 0);
+	FileHashes cached;
+	CHECK(cache.GetHashes(file, cached) == HashCache::Cached);
+	CHECK(Same(cached, expected));
+
+	CHECK(cache.GetHashes(dir+"/missing", hashes) < 0);
+
+	//Only a file which held still and settled may be stored.
+	{
+		const struct stat old = Stat(1, 100, 1000);
+		CHECK(HashCache::Storable(old, old));
+		CHECK(!HashCache::Storable(old, Stat(1, 101, 1000)));
+		CHECK(!HashCache::Storable(old, Stat(1, 100, 1001)));
+		CHECK(!HashCache::Storable(st, st));
+	}
+
+	CHECK(cache.Close() == 0);
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "hash-cache-test", log_dir);
+	const std::string dir = KSync::Test::MakeTempDir("hash-cache-test");
+
+	int failures = 0;
+	const int entry_failures = TestEntries(dir);
+	printf("Hash cache entries: %d failures\n", entry_failures);
+	failures += entry_failures;
+
+	const int idle_failures = TestIdle(dir);
+	printf("Hash cache idle entries: %d failures\n", idle_failures);
+	failures += idle_failures;
+
+	const int corrupt_failures = TestCorrupt(dir);
+	printf("Hash cache corrupt files: %d failures\n", corrupt_failures);
+	failures += corrupt_failures;
+
+	const int file_failures = TestFiles(dir);
+	printf("Hash cache files: %d failures\n", file_failures);
+	failures += file_failures;
+
+	KSync::Test::RemoveTree(dir);
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
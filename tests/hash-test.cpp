@@ -0,0 +1,240 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ksync/thread_utilities.h"
+#include "ksync/blake3.h"
+#include "ksync/xxh3.h"
+
+//Known answers from the BLAKE3 and xxHash reference implementations. Input n
+//is the bytes 0, 1, ..., 250, 0, 1, ... as in the official BLAKE3 vectors.
+
+class Blake3Vector {
+	public:
+		size_t size;
+		const char* digest;
+};
+
+const Blake3Vector blake3_vectors[] = {
+	{0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+	{1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+	{1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+	{1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+	{1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+	{2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+	{2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+	{3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2"},
+	{3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3"},
+	{4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969"},
+	{4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+	{5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833"},
+	{5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff"},
+	{6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205"},
+	{6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f"},
+	{7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a"},
+	{7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817"},
+	{8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63"},
+	{8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+	{16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+	{31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+	{102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+};
+
+class Xxh3Vector {
+	public:
+		size_t size;
+		uint64_t seed;
+		uint64_t hash;
+};
+
+const Xxh3Vector xxh3_vectors[] = {
+	{0, 0x0000000000000000ULL, 0x2d06800538d394c2ULL},
+	{0, 0x0000000000000001ULL, 0x4dc5b0cc826f6703ULL},
+	{0, 0x9e3779b185ebca8dULL, 0xa8a6b918b2f0364aULL},
+	{0, 0xffffffffffffffffULL, 0x4c093276ae47a555ULL},
+	{1, 0x0000000000000000ULL, 0xc44bdff4074eecdbULL},
+	{1, 0x0000000000000001ULL, 0x5eaac1f7b17ef730ULL},
+	{1, 0x9e3779b185ebca8dULL, 0x032be332dd766ef8ULL},
+	{1, 0xffffffffffffffffULL, 0x77b2df5ff42aab88ULL},
+	{3, 0x0000000000000000ULL, 0x5f4299fc161c9cbbULL},
+	{3, 0x0000000000000001ULL, 0x3b3b85a968c7f81dULL},
+	{3, 0x9e3779b185ebca8dULL, 0x1a6e223be5f46239ULL},
+	{3, 0xffffffffffffffffULL, 0x8fecb24e5f5c2208ULL},
+	{4, 0x0000000000000000ULL, 0x60dab036a58211f2ULL},
+	{4, 0x0000000000000001ULL, 0x94e67b47eb6fcc90ULL},
+	{4, 0x9e3779b185ebca8dULL, 0x305fb4c44f8d6951ULL},
+	{4, 0xffffffffffffffffULL, 0xaa8f0efb0ac36941ULL},
+	{8, 0x0000000000000000ULL, 0x3a1c2d7c85af88f8ULL},
+	{8, 0x0000000000000001ULL, 0xe7241ac1fdcd24bbULL},
+	{8, 0x9e3779b185ebca8dULL, 0xce514adfb5603640ULL},
+	{8, 0xffffffffffffffffULL, 0x45eee6adde1382aeULL},
+	{9, 0x0000000000000000ULL, 0xe9612598145bb9dcULL},
+	{9, 0x0000000000000001ULL, 0xd010a1fb14096c63ULL},
+	{9, 0x9e3779b185ebca8dULL, 0xdefb5a4d8e24da5bULL},
+	{9, 0xffffffffffffffffULL, 0x38bbdbee4e2aec8aULL},
+	{16, 0x0000000000000000ULL, 0x8355e3a6f61770dbULL},
+	{16, 0x0000000000000001ULL, 0xe2d1e4053a219356ULL},
+	{16, 0x9e3779b185ebca8dULL, 0x39b05b5e53840a8fULL},
+	{16, 0xffffffffffffffffULL, 0xc6b0c8183df9cfb1ULL},
+	{17, 0x0000000000000000ULL, 0x9ef341a99de37328ULL},
+	{17, 0x0000000000000001ULL, 0xc44e866040ed1467ULL},
+	{17, 0x9e3779b185ebca8dULL, 0x290132b0798b2853ULL},
+	{17, 0xffffffffffffffffULL, 0x3b81616daebc9078ULL},
+	{128, 0x0000000000000000ULL, 0x85c6174c7ff4c46bULL},
+	{128, 0x0000000000000001ULL, 0xc04e68f839ddd006ULL},
+	{128, 0x9e3779b185ebca8dULL, 0x3b87a094e01c19eeULL},
+	{128, 0xffffffffffffffffULL, 0x71fff67b6b8ce45aULL},
+	{129, 0x0000000000000000ULL, 0xec7642b431ba3e5aULL},
+	{129, 0x0000000000000001ULL, 0x88ee72694368e67dULL},
+	{129, 0x9e3779b185ebca8dULL, 0x7d07ba727c76f7baULL},
+	{129, 0xffffffffffffffffULL, 0x57535c385e347ecdULL},
+	{240, 0x0000000000000000ULL, 0x375a384d957fe865ULL},
+	{240, 0x0000000000000001ULL, 0x31a14c358e824be4ULL},
+	{240, 0x9e3779b185ebca8dULL, 0x331d5d4af197fb6bULL},
+	{240, 0xffffffffffffffffULL, 0x11bd15de7afb35d0ULL},
+	{241, 0x0000000000000000ULL, 0x02e8cd95421c6d02ULL},
+	{241, 0x0000000000000001ULL, 0xda735d4f53476cb5ULL},
+	{241, 0x9e3779b185ebca8dULL, 0x1f049462ca4edf9aULL},
+	{241, 0xffffffffffffffffULL, 0xb1f001885dc89e7cULL},
+	{1024, 0x0000000000000000ULL, 0xe5d78bafa45b2aa5ULL},
+	{1024, 0x0000000000000001ULL, 0x4a13b381a01c4d2aULL},
+	{1024, 0x9e3779b185ebca8dULL, 0x9410196a581ccd0eULL},
+	{1024, 0xffffffffffffffffULL, 0x9b140e4be1e12cafULL},
+	{1025, 0x0000000000000000ULL, 0xe95c42288f28186eULL},
+	{1025, 0x0000000000000001ULL, 0x62bba1783af9af7cULL},
+	{1025, 0x9e3779b185ebca8dULL, 0x0eb328f6e3cca019ULL},
+	{1025, 0xffffffffffffffffULL, 0x2dccb13b7fe830bdULL},
+	{2055, 0x0000000000000000ULL, 0xceef225a2f231458ULL},
+	{2055, 0x0000000000000001ULL, 0xf0e1b9c9fb93a9bfULL},
+	{2055, 0x9e3779b185ebca8dULL, 0xdda8776a6627fa3bULL},
+	{2055, 0xffffffffffffffffULL, 0xc079fc9f7b7e06daULL},
+	{10000, 0x0000000000000000ULL, 0x1cb3abee1c2fc1c4ULL},
+	{10000, 0x0000000000000001ULL, 0xce0c43b3dcc1e373ULL},
+	{10000, 0x9e3779b185ebca8dULL, 0xd05d5a9cc0a7b606ULL},
+	{10000, 0xffffffffffffffffULL, 0x0b021e4809bcdfb0ULL},
+	{102400, 0x0000000000000000ULL, 0x1428e17f1cac2837ULL},
+	{102400, 0x0000000000000001ULL, 0x68dcf1ac5bbd1dbfULL},
+	{102400, 0x9e3779b185ebca8dULL, 0xeffb513a328b22f1ULL},
+	{102400, 0xffffffffffffffffULL, 0xf14e659544b2f114ULL},
+};
+
+std::vector<uint8_t> Input(const size_t size) {
+	std::vector<uint8_t> input(size);
+	for(size_t i=0; i < size; ++i) {
+		input[i] = (uint8_t) (i%251);
+	}
+	return input;
+}
+
+std::string ToHex(const KSync::Hash::digest_t& digest) {
+	static const char hex[] = "0123456789abcdef";
+	std::string result;
+	for(size_t i=0; i < digest.size(); ++i) {
+		result += hex[digest[i] >> 4];
+		result += hex[digest[i] & 0xf];
+	}
+	return result;
+}
+
+bool CheckBlake3(const std::string& method, const Blake3Vector& vector, const KSync::Hash::digest_t& digest) {
+	const std::string result = ToHex(digest);
+	if(result != vector.digest) {
+		fprintf(stderr, "BLAKE3 (%s, %s) of %lu bytes was %s, expected %s\n", KSync::Hash::Blake3::GetImplementation().c_str(), method.c_str(), vector.size, result.c_str(), vector.digest);
+		return false;
+	}
+	return true;
+}
+
+//Hash each vector in one go, in odd sized pieces and on a thread pool.
+int TestBlake3(KSync::Utilities::thread_pool& pool) {
+	int failures = 0;
+	for(size_t i=0; i < sizeof(blake3_vectors)/sizeof(blake3_vectors[0]); ++i) {
+		const Blake3Vector& vector = blake3_vectors[i];
+		const std::vector<uint8_t> input = Input(vector.size);
+		KSync::Hash::digest_t digest;
+
+		KSync::Hash::Blake3::Digest(input.data(), input.size(), digest);
+		if(!CheckBlake3("whole", vector, digest)) {
+			++failures;
+		}
+
+		KSync::Hash::Blake3 pieces;
+		for(size_t offset=0; offset < input.size(); offset += 1000) {
+			pieces.Update(input.data()+offset, std::min((size_t) 1000, input.size()-offset));
+		}
+		pieces.Final(digest);
+		if(!CheckBlake3("pieces", vector, digest)) {
+			++failures;
+		}
+
+		KSync::Hash::Blake3 parallel;
+		parallel.UpdateParallel(input.data(), input.size(), pool);
+		parallel.Final(digest);
+		if(!CheckBlake3("parallel", vector, digest)) {
+			++failures;
+		}
+	}
+	return failures;
+}
+
+int TestXxh3() {
+	int failures = 0;
+	for(size_t i=0; i < sizeof(xxh3_vectors)/sizeof(xxh3_vectors[0]); ++i) {
+		const Xxh3Vector& vector = xxh3_vectors[i];
+		const std::vector<uint8_t> input = Input(vector.size);
+		const uint64_t hash = KSync::Hash::Xxh3Hash64(input.data(), input.size(), vector.seed);
+		if(hash != vector.hash) {
+			fprintf(stderr, "XXH3 (%s) of %lu bytes with seed %lx was %lx, expected %lx\n", KSync::Hash::Xxh3GetImplementation().c_str(), vector.size, vector.seed, hash, vector.hash);
+			++failures;
+		}
+	}
+	return failures;
+}
+
+int main() {
+	int failures = 0;
+	KSync::Utilities::thread_pool pool(4);
+
+	const std::string blake3_implementations[] = {"portable", "avx2", "avx512"};
+	for(size_t i=0; i < sizeof(blake3_implementations)/sizeof(blake3_implementations[0]); ++i) {
+		if(KSync::Hash::Blake3::SetImplementation(blake3_implementations[i]) < 0) {
+			printf("BLAKE3 %s: not supported by this cpu, skipped\n", blake3_implementations[i].c_str());
+			continue;
+		}
+		const int blake3_failures = TestBlake3(pool);
+		printf("BLAKE3 %s: %d failures\n", blake3_implementations[i].c_str(), blake3_failures);
+		failures += blake3_failures;
+	}
+
+	const std::string xxh3_implementations[] = {"portable", "avx2"};
+	for(size_t i=0; i < sizeof(xxh3_implementations)/sizeof(xxh3_implementations[0]); ++i) {
+		if(KSync::Hash::Xxh3SetImplementation(xxh3_implementations[i]) < 0) {
+			printf("XXH3 %s: not supported by this cpu, skipped\n", xxh3_implementations[i].c_str());
+			continue;
+		}
+		const int xxh3_failures = TestXxh3();
+		printf("XXH3 %s: %d failures\n", xxh3_implementations[i].c_str(), xxh3_failures);
+		failures += xxh3_failures;
+	}
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/varint.h"
+#include "ksync/comm/object.h"
+
+#include "test-utilities.h"
+
+using KSync::Comm::CommObject;
+
+//What a message looks like on the wire.
+std::string Packed(const std::shared_ptr<CommObject>& comm_obj) {
+	return std::string(comm_obj->GetDataPointer(), comm_obj->GetDataSize());
+}
+
+//Whether bytes off the wire unpack.
+bool Unpacks(const std::string& wire) {
+	CommObject received(wire.data(), wire.size(), true);
+	return received.UnPack() == 0;
+}
+
+int TestHeader() {
+	int failures = 0;
+
+	KSync::Comm::CommString text("some payload");
+	std::shared_ptr<CommObject> sent = text.GetCommObject();
+	sent->SetReplyId(1234);
+	sent->SetTraceId(5678);
+	const std::string wire = Packed(sent);
+	CHECK(wire.size() == CommObject::HeaderSize+text.size());
+
+	//Little endian whatever the host.
+	CHECK(((uint8_t) wire[0] == (CommObject::Magic & 0xff))&&((uint8_t) wire[1] == (CommObject::Magic >> 8)));
+	CHECK((uint8_t) wire[2] == CommObject::Version);
+
+	//Everything in the header survives the trip, and the payload is 8 byte aligned.
+	{
+		std::shared_ptr<CommObject> received = CommObject::Create(wire.data(), wire.size(), true);
+		CHECK(received->UnPack() == 0);
+		CHECK(received->GetType() == KSync::Comm::CommString::Type);
+		CHECK(received->GetMessageId() == sent->GetMessageId());
+		CHECK(received->GetReplyId() == 1234);
+		CHECK(received->GetTraceId() == 5678);
+		CHECK((received->GetFlags() & CommObject::FlagTraced) != 0);
+		CHECK(received->GetDataSize() == text.size());
+		CHECK(memcmp(received->GetDataPointer(), text.data(), text.size()) == 0);
+		CHECK(((uintptr_t) received->GetDataPointer())%8 == 0);
+	}
+
+	//Anything off about the header is refused rather than trusted.
+	CHECK(Unpacks(wire));
+	CHECK(!Unpacks(wire.substr(0, CommObject::HeaderSize-1)));
+	CHECK(!Unpacks(std::string()));
+	{
+		std::string bad_magic(wire);
+		bad_magic[0] ^= 1;
+		CHECK(!Unpacks(bad_magic));
+	}
+	{
+		std::string bad_version(wire);
+		bad_version[2] = (char) (CommObject::Version+1);
+		CHECK(!Unpacks(bad_version));
+	}
+	{
+		std::string unknown_flags(wire);
+		unknown_flags[3] |= (char) 0x80;
+		CHECK(!Unpacks(unknown_flags));
+	}
+	{
+		CHECK(!Unpacks(wire+"x"));
+		CHECK(!Unpacks(wire.substr(0, wire.size()-1)));
+	}
+	{
+		std::string bad_payload(wire);
+		bad_payload[CommObject::HeaderSize] ^= 1;
+		CHECK(!Unpacks(bad_payload));
+	}
+	{
+		std::string bad_crc(wire);
+		bad_crc[36] ^= 1;
+		CHECK(!Unpacks(bad_crc));
+	}
+
+	//An empty message is still a whole header.
+	{
+		KSync::Comm::ShutdownRequest request;
+		const std::string empty = Packed(request.GetCommObject());
+		CHECK(empty.size() == CommObject::HeaderSize);
+		CHECK(Unpacks(empty));
+	}
+
+	return failures;
+}
+
+//A string array received with the given payload. ClientSocketCreation is the
+//array that goes on the wire.
+std::shared_ptr<KSync::Comm::ClientSocketCreation> Received(const std::string& payload) {
+	std::shared_ptr<CommObject> comm_obj = CommObject::Create(payload.size(), KSync::Comm::ClientSocketCreation::Type);
+	memcpy(comm_obj->GetWritablePayload(), payload.data(), payload.size());
+	if(comm_obj->Seal(payload.size()) < 0) {
+		return std::shared_ptr<KSync::Comm::ClientSocketCreation>();
+	}
+	std::shared_ptr<CommObject> received = CommObject::Create(comm_obj->GetDataPointer(), comm_obj->GetDataSize(), true);
+	std::shared_ptr<KSync::Comm::ClientSocketCreation> array;
+	KSync::Comm::CommCreator(array, received);
+	return array;
+}
+
+std::string Varint(const uint64_t value) {
+	char buffer[KSync::Utilities::MaxVarintSize];
+	return std::string(buffer, KSync::Utilities::WriteVarint(buffer, value));
+}
+
+//Whether reading every string of a received array with the given payload throws.
+bool Malformed(const std::string& payload) {
+	try {
+		std::shared_ptr<KSync::Comm::ClientSocketCreation> array = Received(payload);
+		for(size_t i=0; i < array->size(); ++i) {
+			array->Get(i);
+		}
+		array->for_each([](const KSync::Utilities::StringView&) {});
+	} catch (CommObject::UnPackException&) {
+		return true;
+	}
+	return false;
+}
+
+int TestStringArray() {
+	int failures = 0;
+
+	//Strings either side of each varint length boundary, empty and binary ones come back the same.
+	std::vector<std::string> strings;
+	strings.push_back("");
+	strings.push_back("a");
+	strings.push_back(std::string(127, 'b'));
+	strings.push_back(std::string(128, 'c'));
+	strings.push_back(std::string(16383, 'd'));
+	strings.push_back(std::string(16384, 'e'));
+	strings.push_back(std::string("nul\0in the middle", 18));
+	{
+		KSync::Comm::ClientSocketCreation array;
+		array.resize(strings.size());
+		for(size_t i=0; i < strings.size(); ++i) {
+			array.Set(i, strings[i]);
+		}
+		std::shared_ptr<CommObject> comm_obj = array.GetCommObject();
+		std::shared_ptr<CommObject> wire = CommObject::Create(comm_obj->GetDataPointer(), comm_obj->GetDataSize(), true);
+		std::shared_ptr<KSync::Comm::ClientSocketCreation> received;
+		KSync::Comm::CommCreator(received, wire);
+		CHECK(received->size() == strings.size());
+		//Indexed access out of order.
+		for(size_t i=strings.size(); i > 0; --i) {
+			CHECK(received->Get(i-1).str() == strings[i-1]);
+		}
+		size_t index = 0;
+		bool in_order = true;
+		received->for_each([&strings, &index, &in_order](const KSync::Utilities::StringView& view) {
+			in_order = in_order&&(view.str() == strings[index++]);
+		});
+		CHECK(in_order&&(index == strings.size()));
+
+		//Sending what was received sends the same strings.
+		std::shared_ptr<CommObject> again = received->GetCommObject();
+		CHECK(Packed(again).substr(CommObject::HeaderSize) == Packed(comm_obj).substr(CommObject::HeaderSize));
+
+		//Changing a received array leaves the rest alone.
+		received->Set(1, "changed");
+		received->push_back("added");
+		CHECK(received->size() == strings.size()+1);
+		CHECK(received->Get(0).str() == strings[0]);
+		CHECK(received->Get(1).str() == "changed");
+		CHECK(received->Get(5).str() == strings[5]);
+		CHECK(received->Get(strings.size()).str() == "added");
+	}
+
+	//The named fields of ClientSocketCreation are just its strings.
+	{
+		KSync::Comm::ClientSocketCreation creation;
+		creation.SetBroadcastUrl("tcp://broadcast");
+		creation.SetClientUrl("tcp://client");
+		std::shared_ptr<CommObject> comm_obj = creation.GetCommObject();
+		std::shared_ptr<CommObject> wire = CommObject::Create(comm_obj->GetDataPointer(), comm_obj->GetDataSize(), true);
+		std::shared_ptr<KSync::Comm::ClientSocketCreation> received;
+		KSync::Comm::CommCreator(received, wire);
+		CHECK(received->GetBroadcastUrl().str() == "tcp://broadcast");
+		CHECK(received->GetClientUrl().str() == "tcp://client");
+	}
+
+	//Well formed edge cases.
+	CHECK(!Malformed(Varint(0)));
+	CHECK(!Malformed(Varint(2)+Varint(0)+Varint(0)));
+	CHECK(Received(Varint(0))->empty());
+
+	//Malformed payloads throw, however they're read.
+	CHECK(Malformed(""));
+	//More strings than there are bytes left.
+	CHECK(Malformed(Varint(5)+Varint(0)));
+	CHECK(Malformed(Varint(1ULL << 62)));
+	//A length running past the end.
+	CHECK(Malformed(Varint(1)+Varint(10)+"short"));
+	CHECK(Malformed(Varint(2)+Varint(1)+"a"+Varint(1ULL << 40)));
+	//A varint which never ends.
+	CHECK(Malformed(Varint(1)+std::string(3, (char) 0x80)));
+	CHECK(Malformed(std::string(12, (char) 0xff)));
+
+	//Indexing past the end throws for sent and received arrays alike.
+	{
+		bool threw = false;
+		try {
+			KSync::Comm::CommStringArray array(strings);
+			array.Get(strings.size());
+		} catch (CommObject::UnPackException&) {
+			threw = true;
+		}
+		CHECK(threw);
+		threw = false;
+		try {
+			Received(Varint(1)+Varint(1)+"a")->Get(1);
+		} catch (CommObject::UnPackException&) {
+			threw = true;
+		}
+		CHECK(threw);
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "messages-test", log_dir);
+
+	int failures = 0;
+	const int header_failures = TestHeader();
+	printf("CommObject header: %d failures\n", header_failures);
+	failures += header_failures;
+
+	const int array_failures = TestStringArray();
+	printf("CommStringArray: %d failures\n", array_failures);
+	failures += array_failures;
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
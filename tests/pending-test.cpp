@@ -0,0 +1,290 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/thread_utilities.h"
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+using KSync::Utilities::FutureWrapper;
+using KSync::Utilities::PromiseWrapper;
+typedef KSync::Utilities::lock_free_pending_table<int> Table;
+typedef std::chrono::steady_clock Clock;
+
+int TestTable() {
+	int failures = 0;
+
+	//Replies find their own entry whichever order they come in.
+	{
+		Table table(64);
+		std::vector<FutureWrapper<int>> futures;
+		for(int i=0; i < 40; ++i) {
+			PromiseWrapper<int> promise;
+			futures.push_back(promise.get_future());
+			table.insert(1000+i, std::move(promise));
+		}
+		CHECK(table.size() == 40);
+		CHECK(!table.fulfill(999, 0));
+		for(int i=39; i >= 0; --i) {
+			CHECK(table.fulfill(1000+i, i));
+		}
+		CHECK(!table.fulfill(1000, 0));
+		CHECK(table.size() == 0);
+		for(int i=0; i < 40; ++i) {
+			CHECK(futures[i].get() == i);
+		}
+	}
+
+	//Failing an entry fails its future.
+	{
+		Table table(64);
+		PromiseWrapper<int> promise;
+		FutureWrapper<int> future = promise.get_future();
+		table.insert(5, std::move(promise));
+		CHECK(table.fail(5, std::make_exception_ptr(std::runtime_error("no"))));
+		CHECK(!table.fail(5, std::make_exception_ptr(std::runtime_error("no"))));
+		bool threw = false;
+		try {
+			future.get();
+		} catch (std::runtime_error&) {
+			threw = true;
+		}
+		CHECK(threw);
+	}
+
+	//Ids from a global counter land anywhere, so keys all wanting the same few
+	//slots must still go in, be found and expire.
+	{
+		Table table(16);
+		const Clock::time_point past = Clock::now()-std::chrono::seconds(1);
+		std::vector<FutureWrapper<int>> futures;
+		for(int i=0; i < 100; ++i) {
+			PromiseWrapper<int> promise;
+			futures.push_back(promise.get_future());
+			table.insert((uint64_t) i*16, std::move(promise), (i%2 == 0) ? past : Clock::time_point::max());
+		}
+		CHECK(table.size() == 100);
+		CHECK(table.expire() == 50);
+		CHECK(table.size() == 50);
+		for(int i=1; i < 100; i += 2) {
+			CHECK(table.fulfill((uint64_t) i*16, i));
+		}
+		CHECK(table.size() == 0);
+		int num_timed_out = 0;
+		int num_values = 0;
+		for(int i=0; i < 100; ++i) {
+			try {
+				if(futures[i].get() == i) {
+					++num_values;
+				}
+			} catch (KSync::Utilities::PendingTimeoutException&) {
+				++num_timed_out;
+			}
+		}
+		CHECK(num_timed_out == 50);
+		CHECK(num_values == 50);
+	}
+
+	//Threads inserting and fulfilling at once each get their own value.
+	{
+		const int num_threads = 4;
+		const int num_keys = 5000;
+		Table table(256);
+		std::vector<std::vector<FutureWrapper<int>>> futures(num_threads);
+		std::vector<std::atomic<bool>> inserted(num_threads*num_keys);
+		for(size_t i=0; i < inserted.size(); ++i) {
+			inserted[i].store(false);
+		}
+		std::atomic<int> num_unmatched(0);
+		std::vector<std::thread> threads;
+		for(int t=0; t < num_threads; ++t) {
+			threads.emplace_back([&, t]() {
+				for(int i=0; i < num_keys; ++i) {
+					const int key = i*num_threads+t;
+					PromiseWrapper<int> promise;
+					futures[t].push_back(promise.get_future());
+					table.insert(key, std::move(promise));
+					inserted[key].store(true);
+				}
+			});
+			threads.emplace_back([&, t]() {
+				for(int i=0; i < num_keys; ++i) {
+					const int key = i*num_threads+t;
+					while(!inserted[key].load()) {
+						std::this_thread::yield();
+					}
+					if(!table.fulfill(key, key)) {
+						++num_unmatched;
+					}
+				}
+			});
+		}
+		for(size_t i=0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+		CHECK(num_unmatched.load() == 0);
+		CHECK(table.size() == 0);
+		bool all_match = true;
+		for(int t=0; t < num_threads; ++t) {
+			for(int i=0; i < num_keys; ++i) {
+				all_match = all_match&&(futures[t][i].get() == i*num_threads+t);
+			}
+		}
+		CHECK(all_match);
+	}
+
+	return failures;
+}
+
+//Answers requests with their own text, a batch at a time in reverse order.
+//Requests whose text is "ignore" get no answer.
+void Answer(std::shared_ptr<KSync::Comm::ClientCommunicator> peer, std::atomic<bool>& stop, const size_t batch) {
+	std::vector<std::shared_ptr<KSync::Comm::CommObject>> requests;
+	while(!stop.load()) {
+		std::shared_ptr<KSync::Comm::CommObject> request = peer->get(10);
+		if(request) {
+			requests.push_back(request);
+		}
+		if((requests.size() < batch)&&(request||requests.empty())) {
+			continue;
+		}
+		while(!requests.empty()) {
+			std::shared_ptr<KSync::Comm::CommString> text;
+			KSync::Comm::CommCreator(text, requests.back());
+			if(*text != "ignore") {
+				KSync::Comm::CommString reply(*text);
+				std::shared_ptr<KSync::Comm::CommObject> reply_obj = reply.GetCommObject();
+				reply_obj->SetReplyId(requests.back()->GetMessageId());
+				if(peer->send(reply_obj) < 0) {
+					return;
+				}
+			}
+			requests.pop_back();
+		}
+	}
+}
+
+std::string ReplyText(FutureWrapper<std::shared_ptr<KSync::Comm::CommObject>>& future) {
+	std::shared_ptr<KSync::Comm::CommString> text;
+	KSync::Comm::CommCreator(text, future.get());
+	return *text;
+}
+
+int TestReplies(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system) {
+	int failures = 0;
+	std::shared_ptr<KSync::Comm::ClientCommunicator> client(new KSync::Comm::ClientCommunicator(comm_system, 10, true));
+	std::shared_ptr<KSync::Comm::ClientCommunicator> peer(new KSync::Comm::ClientCommunicator(comm_system, 10, false));
+	std::atomic<bool> stop(false);
+	std::thread answerer(Answer, peer, std::ref(stop), 16);
+
+	//Every future gets the reply to its own request.
+	{
+		std::vector<FutureWrapper<std::shared_ptr<KSync::Comm::CommObject>>> futures;
+		for(int i=0; i < 200; ++i) {
+			KSync::Comm::CommString request("request "+std::to_string(i));
+			std::shared_ptr<KSync::Comm::CommObject> request_obj = request.GetCommObject();
+			futures.push_back(client->send_get_response(request_obj, 5000));
+		}
+		bool all_match = true;
+		for(int i=0; i < 200; ++i) {
+			all_match = all_match&&(ReplyText(futures[i]) == "request "+std::to_string(i));
+		}
+		CHECK(all_match);
+	}
+
+	//As does every callback.
+	{
+		std::atomic<int> num_matched(0);
+		std::atomic<int> num_done(0);
+		for(int i=0; i < 100; ++i) {
+			const std::string expected = "callback "+std::to_string(i);
+			KSync::Comm::CommString request(expected);
+			std::shared_ptr<KSync::Comm::CommObject> request_obj = request.GetCommObject();
+			client->send_with_callback(request_obj, [expected, &num_matched, &num_done](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr) {
+				if(reply) {
+					std::shared_ptr<KSync::Comm::CommString> text;
+					KSync::Comm::CommCreator(text, reply);
+					if(*text == expected) {
+						++num_matched;
+					}
+				}
+				++num_done;
+			}, 5000);
+		}
+		CHECK(KSync::Test::WaitFor([&num_done]() { return num_done.load() == 100; }, 10000));
+		CHECK(num_matched.load() == 100);
+	}
+
+	//A request nobody answers times out, and doesn't hold up the rest.
+	{
+		KSync::Comm::CommString ignored("ignore");
+		std::shared_ptr<KSync::Comm::CommObject> ignored_obj = ignored.GetCommObject();
+		FutureWrapper<std::shared_ptr<KSync::Comm::CommObject>> ignored_future = client->send_get_response(ignored_obj, 50);
+		KSync::Comm::CommString answered("answered");
+		std::shared_ptr<KSync::Comm::CommObject> answered_obj = answered.GetCommObject();
+		FutureWrapper<std::shared_ptr<KSync::Comm::CommObject>> answered_future = client->send_get_response(answered_obj, 5000);
+		bool timed_out = false;
+		try {
+			ignored_future.get();
+		} catch (KSync::Utilities::PendingTimeoutException&) {
+			timed_out = true;
+		}
+		CHECK(timed_out);
+		CHECK(ReplyText(answered_future) == "answered");
+	}
+
+	stop.store(true);
+	answerer.join();
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "pending-test", log_dir);
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+
+	int failures = 0;
+	const int table_failures = TestTable();
+	printf("Pending table: %d failures\n", table_failures);
+	failures += table_failures;
+
+	const int reply_failures = TestReplies(comm_system);
+	printf("Reply matching: %d failures\n", reply_failures);
+	failures += reply_failures;
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/stream_transfer.h"
+#include "ksync/transfer_pipeline.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+typedef std::shared_ptr<KSync::Comm::ClientCommunicator> Communicator;
+
+std::string Pattern(const size_t size, const size_t seed) {
+	std::string data(size, '\0');
+	for(size_t i=0; i < size; ++i) {
+		data[i] = (char) ((i*131+seed*7)^(i >> 11));
+	}
+	return data;
+}
+
+void WriteFile(const std::string& path, const std::string& data) {
+	std::ofstream out(path.c_str(), std::ios::binary|std::ios::trunc);
+	out.write(data.data(), data.size());
+}
+
+bool Exists(const std::string& path) {
+	return access(path.c_str(), F_OK) == 0;
+}
+
+//The contents of path, or "missing" with a nul if there's no such file.
+std::string ReadFile(const std::string& path) {
+	if(!Exists(path)) {
+		return std::string("missing\0", 8);
+	}
+	std::ifstream in(path.c_str(), std::ios::binary);
+	std::stringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+}
+
+//A source tree of files of many sizes, returning their paths.
+std::vector<std::string> MakeTree(const std::string& root, const size_t big_size) {
+	std::vector<std::string> paths;
+	mkdir(root.c_str(), 0700);
+	mkdir((root+"/sub").c_str(), 0700);
+	mkdir((root+"/sub/deeper").c_str(), 0700);
+	for(size_t i=0; i < 30; ++i) {
+		const std::string path = ((i%3 == 0) ? "sub/" : "")+std::string("file")+std::to_string(i);
+		WriteFile(root+"/"+path, Pattern(i*3001, i));
+		paths.push_back(path);
+	}
+	WriteFile(root+"/sub/deeper/big", Pattern(big_size, 99));
+	paths.push_back("sub/deeper/big");
+	WriteFile(root+"/empty", "");
+	paths.push_back("empty");
+	return paths;
+}
+
+//Receives whatever arrives on its communicators until stopped.
+class Receivers {
+	public:
+		Receivers(const std::vector<Communicator>& communicators, const std::string& root) : stop(false), num_received(0), num_bad(0) {
+			for(size_t i=0; i < communicators.size(); ++i) {
+				Communicator communicator = communicators[i];
+				this->threads.emplace_back([this, communicator, root]() {
+					Communicator comm = communicator;
+					KSync::Transfer::Receiver receiver(comm, root);
+					while(!this->stop.load()) {
+						std::shared_ptr<KSync::Comm::CommObject> comm_obj = comm->get(10);
+						if(!comm_obj) {
+							continue;
+						}
+						const int status = receiver.HandleMessage(comm_obj);
+						if(status < 0) {
+							++this->num_bad;
+						} else if(status == KSync::Transfer::Receiver::Finished) {
+							++this->num_received;
+						}
+					}
+				});
+			}
+		}
+		~Receivers() {
+			this->stop.store(true);
+			for(size_t i=0; i < this->threads.size(); ++i) {
+				this->threads[i].join();
+			}
+		}
+		int GetNumReceived() const {
+			return this->num_received.load();
+		}
+		int GetNumBad() const {
+			return this->num_bad.load();
+		}
+	private:
+		std::vector<std::thread> threads;
+		std::atomic<bool> stop;
+		std::atomic<int> num_received;
+		std::atomic<int> num_bad;
+};
+
+//Pairs of communicators numbered from base, the sending ends in senders.
+void MakePairs(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const int base, const size_t num, std::vector<Communicator>& senders, std::vector<Communicator>& receivers) {
+	for(size_t i=0; i < num; ++i) {
+		senders.emplace_back(new KSync::Comm::ClientCommunicator(comm_system, base+(int) i, true));
+		receivers.emplace_back(new KSync::Comm::ClientCommunicator(comm_system, base+(int) i, false));
+	}
+}
+
+int TestPipeline(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string& dir) {
+	int failures = 0;
+	const std::string source = dir+"/source";
+	const std::vector<std::string> paths = MakeTree(source, 3*1024*1024+5);
+
+	//Everything arrives whole, big files going from disk in blocks and small
+	//ones from memory.
+	{
+		const std::string dest = dir+"/dest";
+		mkdir(dest.c_str(), 0700);
+		std::vector<Communicator> senders;
+		std::vector<Communicator> receivers;
+		MakePairs(comm_system, 60, 3, senders, receivers);
+		KSync::Transfer::PipelineConfig config;
+		config.read = KSync::Transfer::StageConfig(2, 2);
+		config.hash = KSync::Transfer::StageConfig(3, 2);
+		config.send_queue_depth = 2;
+		config.block_size = 4096;
+		config.chunk_size = 8192;
+		config.window = 4;
+		config.max_buffered_size = 64*1024;
+		uint64_t total_size = 0;
+		{
+			Receivers receiving(receivers, dest);
+			KSync::Transfer::Pipeline pipeline(config, senders);
+			CHECK(pipeline.Run(source, paths) == 0);
+			CHECK(KSync::Test::WaitFor([&receiving, &paths]() { return receiving.GetNumReceived() == (int) paths.size(); }, 10000));
+			CHECK(receiving.GetNumBad() == 0);
+			CHECK(pipeline.GetFilesSent() == paths.size());
+			CHECK(pipeline.GetFilesSkipped() == 0);
+			CHECK(pipeline.GetNumErrors() == 0);
+			for(size_t i=0; i < paths.size(); ++i) {
+				total_size += ReadFile(source+"/"+paths[i]).size();
+			}
+			CHECK(pipeline.GetBytesSent() == total_size);
+		}
+		bool all_match = true;
+		for(size_t i=0; i < paths.size(); ++i) {
+			all_match = all_match&&(ReadFile(dest+"/"+paths[i]) == ReadFile(source+"/"+paths[i]));
+			all_match = all_match&&!Exists(dest+"/"+paths[i]+KSync::Transfer::Receiver::PartSuffix);
+		}
+		CHECK(all_match);
+	}
+
+	//Files the receiver already has aren't sent, and one which can't be read
+	//is counted without stopping the rest.
+	{
+		const std::string dest = dir+"/dest-known";
+		mkdir(dest.c_str(), 0700);
+		std::vector<Communicator> senders;
+		std::vector<Communicator> receivers;
+		MakePairs(comm_system, 70, 2, senders, receivers);
+		KSync::Transfer::PipelineConfig config;
+		config.block_size = 4096;
+		for(size_t i=0; i < 10; ++i) {
+			const std::string data = ReadFile(source+"/"+paths[i]);
+			KSync::Hash::FileHashes hashes;
+			KSync::Hash::HashBuffer(data.data(), data.size(), config.block_size, hashes);
+			config.known[paths[i]] = hashes.digest;
+		}
+		//A stale digest doesn't stop the file going.
+		config.known[paths[10]] = KSync::Hash::digest_t();
+		std::vector<std::string> with_missing(paths);
+		with_missing.push_back("not-there");
+		{
+			Receivers receiving(receivers, dest);
+			KSync::Transfer::Pipeline pipeline(config, senders);
+			CHECK(pipeline.Run(source, with_missing) < 0);
+			CHECK(pipeline.GetNumErrors() == 1);
+			CHECK(pipeline.GetFilesSkipped() == 10);
+			CHECK(pipeline.GetFilesSent() == paths.size()-10);
+			CHECK(KSync::Test::WaitFor([&receiving, &paths]() { return receiving.GetNumReceived() == (int) paths.size()-10; }, 10000));
+			CHECK(receiving.GetNumBad() == 0);
+		}
+		bool all_match = true;
+		for(size_t i=0; i < paths.size(); ++i) {
+			const bool sent = Exists(dest+"/"+paths[i]);
+			all_match = all_match&&(sent == (i >= 10));
+			all_match = all_match&&(!sent||(ReadFile(dest+"/"+paths[i]) == ReadFile(source+"/"+paths[i])));
+		}
+		CHECK(all_match);
+		CHECK(!Exists(dest+"/not-there"));
+	}
+
+	//A memory budget smaller than any one file still lets every file through,
+	//one at a time.
+	{
+		const std::string dest = dir+"/dest-budget";
+		mkdir(dest.c_str(), 0700);
+		std::vector<Communicator> senders;
+		std::vector<Communicator> receivers;
+		MakePairs(comm_system, 80, 2, senders, receivers);
+		KSync::Transfer::PipelineConfig config;
+		config.block_size = 4096;
+		config.max_buffered_bytes = 100;
+		{
+			Receivers receiving(receivers, dest);
+			KSync::Transfer::Pipeline pipeline(config, senders);
+			CHECK(pipeline.Run(source, paths) == 0);
+			CHECK(pipeline.GetFilesSent() == paths.size());
+			CHECK(KSync::Test::WaitFor([&receiving, &paths]() { return receiving.GetNumReceived() == (int) paths.size(); }, 10000));
+		}
+		bool all_match = true;
+		for(size_t i=0; i < paths.size(); ++i) {
+			all_match = all_match&&(ReadFile(dest+"/"+paths[i]) == ReadFile(source+"/"+paths[i]));
+		}
+		CHECK(all_match);
+	}
+
+	return failures;
+}
+
+int TestReceiver(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system, const std::string& dir) {
+	int failures = 0;
+	const std::string dest = dir+"/dest-receiver";
+	mkdir(dest.c_str(), 0700);
+	mkdir((dest+"/a").c_str(), 0700);
+	Communicator sender_end(new KSync::Comm::ClientCommunicator(comm_system, 90, true));
+	Communicator receiver_end(new KSync::Comm::ClientCommunicator(comm_system, 90, false));
+	KSync::Transfer::Receiver receiver(receiver_end, dest);
+	receiver.SetIdleTimeout(2000);
+	const KSync::Hash::digest_t zero = KSync::Hash::digest_t();
+
+	//Paths which would leave the root are refused before anything is created.
+	const char* hostile[] = {"../x", "/x", "a/../../x", "..", "", "a/..", "./../x", "a//../../x"};
+	for(size_t i=0; i < sizeof(hostile)/sizeof(hostile[0]); ++i) {
+		KSync::Comm::TransferFile transfer(hostile[i], 0, 4096, zero);
+		CHECK(receiver.HandleMessage(transfer.GetCommObject()) < 0);
+	}
+	CHECK(!Exists(dir+"/x"));
+	CHECK(!Exists(dir+"/x"+KSync::Transfer::Receiver::PartSuffix));
+	CHECK(!Exists("/x"));
+	//As is a block size nothing could be hashed with.
+	{
+		KSync::Comm::TransferFile transfer("zero-block", 0, 0, zero);
+		CHECK(receiver.HandleMessage(transfer.GetCommObject()) < 0);
+		KSync::Comm::TransferFile huge("huge-block", 0, KSync::Transfer::Receiver::MaxBlockSize+1, zero);
+		CHECK(receiver.HandleMessage(huge.GetCommObject()) < 0);
+	}
+	CHECK(receiver.GetFilesReceived() == 0);
+	//Nothing is listening for the credit it sent.
+	while(receiver_end->get()) {
+	}
+
+	//A file whose contents don't match the digest sent with it leaves nothing behind.
+	{
+		const std::string data = Pattern(10000, 1);
+		int send_status = 0;
+		std::thread sender_thread([&sender_end, &data, &zero, &send_status]() {
+			KSync::Comm::TransferFile transfer("wrong", data.size(), 4096, zero);
+			std::shared_ptr<KSync::Comm::CommObject> transfer_obj = transfer.GetCommObject();
+			send_status = sender_end->send(transfer_obj);
+			KSync::Comm::StreamSender sender(sender_end, 4096, 2);
+			sender.SetIdleTimeout(2000);
+			if(send_status == 0) {
+				send_status = sender.SendBuffer(data.data(), data.size());
+			}
+		});
+		CHECK(receiver.ReceiveFile() < 0);
+		sender_thread.join();
+		CHECK(send_status >= 0);
+		CHECK(!Exists(dest+"/wrong"));
+		CHECK(!Exists(dest+"/wrong"+KSync::Transfer::Receiver::PartSuffix));
+	}
+
+	//The same receiver still takes a good file afterwards.
+	{
+		const std::string data = Pattern(10000, 2);
+		KSync::Hash::FileHashes hashes;
+		KSync::Hash::HashBuffer(data.data(), data.size(), 4096, hashes);
+		std::thread sender_thread([&sender_end, &data, &hashes]() {
+			KSync::Comm::TransferFile transfer("a/right", data.size(), 4096, hashes.digest);
+			std::shared_ptr<KSync::Comm::CommObject> transfer_obj = transfer.GetCommObject();
+			if(sender_end->send(transfer_obj) == 0) {
+				KSync::Comm::StreamSender sender(sender_end, 4096, 2);
+				sender.SetIdleTimeout(2000);
+				if(sender.SendBuffer(data.data(), data.size()) < 0) {
+					fprintf(stderr, "Couldn't send the file!\n");
+				}
+			}
+		});
+		CHECK(receiver.ReceiveFile() == KSync::Transfer::Receiver::Finished);
+		sender_thread.join();
+		CHECK(ReadFile(dest+"/a/right") == data);
+		CHECK(receiver.GetFilesReceived() == 1);
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "pipeline-test", log_dir);
+	const std::string dir = KSync::Test::MakeTempDir("pipeline-test");
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+
+	int failures = 0;
+	const int pipeline_failures = TestPipeline(comm_system, dir);
+	printf("Transfer pipeline: %d failures\n", pipeline_failures);
+	failures += pipeline_failures;
+
+	const int receiver_failures = TestReceiver(comm_system, dir);
+	printf("Transfer receiver: %d failures\n", receiver_failures);
+	failures += receiver_failures;
+
+	KSync::Test::RemoveTree(dir);
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
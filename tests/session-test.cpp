@@ -0,0 +1,319 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/client/session.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+typedef std::shared_ptr<KSync::Comm::ClientCommunicator> Communicator;
+typedef KSync::Client::Session Session;
+
+//The other end of a session, which holds on to requests until told to answer them.
+class Peer {
+	public:
+		Peer(Communicator& communicator) : communicator(communicator), stop(false), to_answer(0), answer_all(false), to_drop(false), num_held(0), max_held(0) {
+			this->thread = std::thread([this]() { this->Loop(); });
+		}
+		~Peer() {
+			this->stop.store(true);
+			this->thread.join();
+		}
+		//Answer the next n requests, oldest first.
+		void Answer(const int n) {
+			this->to_answer += n;
+		}
+		//Answer everything as soon as it arrives.
+		void AnswerAll(const bool answer_all) {
+			this->answer_all.store(answer_all);
+		}
+		//Forget the requests held so far, they're never answered.
+		void Drop() {
+			this->to_drop.store(true);
+		}
+		size_t GetNumHeld() const {
+			return this->num_held.load();
+		}
+		size_t GetMaxHeld() const {
+			return this->max_held.load();
+		}
+	private:
+		void Loop() {
+			while(!this->stop.load()) {
+				std::shared_ptr<KSync::Comm::CommObject> request = this->communicator->get(5);
+				if(request) {
+					this->held.push_back(request);
+				}
+				if(this->to_drop.exchange(false)) {
+					this->held.clear();
+				}
+				while(!this->held.empty()&&(this->answer_all.load()||(this->to_answer.load() > 0))) {
+					if(!this->answer_all.load()) {
+						--this->to_answer;
+					}
+					std::shared_ptr<KSync::Comm::CommString> text;
+					KSync::Comm::CommCreator(text, this->held.front());
+					KSync::Comm::CommString reply(*text);
+					std::shared_ptr<KSync::Comm::CommObject> reply_obj = reply.GetCommObject();
+					reply_obj->SetReplyId(this->held.front()->GetMessageId());
+					this->held.pop_front();
+					if(this->communicator->send(reply_obj) < 0) {
+						return;
+					}
+				}
+				this->num_held.store(this->held.size());
+				this->max_held.store(std::max(this->max_held.load(), this->held.size()));
+			}
+		}
+
+		Communicator communicator;
+		std::thread thread;
+		std::deque<std::shared_ptr<KSync::Comm::CommObject>> held;
+		std::atomic<bool> stop;
+		std::atomic<int> to_answer;
+		std::atomic<bool> answer_all;
+		std::atomic<bool> to_drop;
+		std::atomic<size_t> num_held;
+		std::atomic<size_t> max_held;
+};
+
+std::shared_ptr<KSync::Comm::CommObject> Text(const std::string& text) {
+	KSync::Comm::CommString comm_string(text);
+	return comm_string.GetCommObject();
+}
+
+std::string ReplyText(Session::Future_t& future) {
+	std::shared_ptr<KSync::Comm::CommString> text;
+	KSync::Comm::CommCreator(text, future.get());
+	return *text;
+}
+
+int TestInFlight(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system) {
+	int failures = 0;
+
+	//Only max_in_flight requests go out, the next waits for a reply.
+	{
+		Communicator client(new KSync::Comm::ClientCommunicator(comm_system, 50, true));
+		Communicator server(new KSync::Comm::ClientCommunicator(comm_system, 50, false));
+		Peer peer(server);
+		Session session(client, 4, 5000);
+		const int num_requests = 10;
+		std::vector<Session::Future_t> futures;
+		std::atomic<int> num_issued(0);
+		std::thread requester([&session, &futures, &num_issued, num_requests]() {
+			for(int i=0; i < num_requests; ++i) {
+				std::shared_ptr<KSync::Comm::CommObject> request = Text(std::to_string(i));
+				futures.push_back(session.Request(request));
+				++num_issued;
+			}
+		});
+		CHECK(KSync::Test::WaitFor([&peer]() { return peer.GetNumHeld() == 4; }, 5000));
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(num_issued.load() == 4);
+		CHECK(session.GetInFlight() == 4);
+		CHECK(peer.GetNumHeld() == 4);
+
+		//One reply lets exactly one more through.
+		peer.Answer(1);
+		CHECK(KSync::Test::WaitFor([&num_issued]() { return num_issued.load() == 5; }, 5000));
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		CHECK(num_issued.load() == 5);
+		CHECK(session.GetInFlight() == 4);
+
+		//Raising the limit lets the waiting request through without any reply.
+		session.SetMaxInFlight(6);
+		CHECK(KSync::Test::WaitFor([&num_issued]() { return num_issued.load() == 7; }, 5000));
+		CHECK(session.GetInFlight() == 6);
+
+		peer.AnswerAll(true);
+		requester.join();
+		session.Flush();
+		CHECK(session.GetInFlight() == 0);
+		bool all_match = true;
+		for(int i=0; i < num_requests; ++i) {
+			all_match = all_match&&(ReplyText(futures[i]) == std::to_string(i));
+		}
+		CHECK(all_match);
+		CHECK(peer.GetMaxHeld() <= 6);
+	}
+
+	//Many threads sharing a session never have more than the limit outstanding.
+	{
+		Communicator client(new KSync::Comm::ClientCommunicator(comm_system, 51, true));
+		Communicator server(new KSync::Comm::ClientCommunicator(comm_system, 51, false));
+		Peer peer(server);
+		const size_t max_in_flight = 8;
+		Session session(client, max_in_flight, 5000);
+		std::atomic<int> num_matched(0);
+		std::atomic<size_t> max_seen(0);
+		std::vector<std::thread> threads;
+		for(int t=0; t < 4; ++t) {
+			threads.emplace_back([&session, &num_matched, &max_seen, t]() {
+				for(int i=0; i < 100; ++i) {
+					const std::string expected = std::to_string(t)+":"+std::to_string(i);
+					std::shared_ptr<KSync::Comm::CommObject> request = Text(expected);
+					session.Request(request, [expected, &num_matched](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr) {
+						if(reply) {
+							std::shared_ptr<KSync::Comm::CommString> text;
+							KSync::Comm::CommCreator(text, reply);
+							if(*text == expected) {
+								++num_matched;
+							}
+						}
+					});
+					const size_t in_flight = session.GetInFlight();
+					size_t seen = max_seen.load();
+					while((in_flight > seen)&&!max_seen.compare_exchange_weak(seen, in_flight));
+				}
+			});
+		}
+		//Answer in bursts so requests pile up against the limit.
+		std::atomic<bool> done(false);
+		std::thread answerer([&peer, &done]() {
+			while(!done.load()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				peer.Answer(3);
+			}
+		});
+		for(size_t i=0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+		peer.AnswerAll(true);
+		session.Flush();
+		done.store(true);
+		answerer.join();
+		CHECK(num_matched.load() == 400);
+		CHECK(max_seen.load() <= max_in_flight);
+		CHECK(peer.GetMaxHeld() <= max_in_flight);
+		CHECK(session.GetInFlight() == 0);
+	}
+
+	return failures;
+}
+
+int TestTimeouts(std::shared_ptr<KSync::Comm::CommSystemInterface>& comm_system) {
+	int failures = 0;
+
+	//Requests that are never answered time out and give their slot back, so
+	//those waiting behind them still go.
+	{
+		Communicator client(new KSync::Comm::ClientCommunicator(comm_system, 52, true));
+		Communicator server(new KSync::Comm::ClientCommunicator(comm_system, 52, false));
+		Peer peer(server);
+		Session session(client, 2, 100);
+		std::vector<Session::Future_t> futures;
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(int i=0; i < 6; ++i) {
+			std::shared_ptr<KSync::Comm::CommObject> request = Text("silent");
+			futures.push_back(session.Request(request));
+		}
+		const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+		//Two rounds of timeouts before the last pair could go out.
+		CHECK(elapsed >= 200.);
+		int num_timed_out = 0;
+		for(size_t i=0; i < futures.size(); ++i) {
+			try {
+				futures[i].get();
+			} catch (KSync::Utilities::PendingTimeoutException&) {
+				++num_timed_out;
+			}
+		}
+		CHECK(num_timed_out == 6);
+		session.Flush();
+		CHECK(session.GetInFlight() == 0);
+
+		//The session still works once the peer does.
+		peer.Drop();
+		peer.AnswerAll(true);
+		std::shared_ptr<KSync::Comm::CommObject> request = Text("answered");
+		Session::Future_t future = session.Request(request);
+		CHECK(ReplyText(future) == "answered");
+	}
+
+	//A lossy link loses some requests, the rest are answered, and every slot
+	//comes back either way.
+	{
+		std::shared_ptr<KSync::Comm::CommSystemInterface> lossy_system;
+		KSync::Comm::LoopbackConditions conditions;
+		conditions.loss = 0.2;
+		conditions.seed = 7;
+		CHECK(KSync::Comm::GetLoopbackCommSystem(lossy_system, conditions) == 0);
+		Communicator client(new KSync::Comm::ClientCommunicator(lossy_system, 53, true));
+		Communicator server(new KSync::Comm::ClientCommunicator(lossy_system, 53, false));
+		Peer peer(server);
+		peer.AnswerAll(true);
+		Session session(client, 4, 200);
+		std::atomic<int> num_answered(0);
+		std::atomic<int> num_timed_out(0);
+		for(int i=0; i < 50; ++i) {
+			std::shared_ptr<KSync::Comm::CommObject> request = Text(std::to_string(i));
+			session.Request(request, [&num_answered, &num_timed_out](std::shared_ptr<KSync::Comm::CommObject> reply, std::exception_ptr error) {
+				if(reply) {
+					++num_answered;
+				} else if(error) {
+					++num_timed_out;
+				}
+			});
+		}
+		session.Flush();
+		CHECK(session.GetInFlight() == 0);
+		CHECK(num_answered.load()+num_timed_out.load() == 50);
+		CHECK(num_answered.load() > 0);
+		CHECK(num_timed_out.load() > 0);
+	}
+
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "session-test", log_dir);
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+
+	int failures = 0;
+	const int in_flight_failures = TestInFlight(comm_system);
+	printf("Session in flight limit: %d failures\n", in_flight_failures);
+	failures += in_flight_failures;
+
+	const int timeout_failures = TestTimeouts(comm_system);
+	printf("Session timeouts: %d failures\n", timeout_failures);
+	failures += timeout_failures;
+
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ksync/messages.h"
+#include "ksync/client_communicator.h"
+#include "ksync/stream_transfer.h"
+#include "ksync/comm/loopback/loopback_comm_system.h"
+
+#include "test-utilities.h"
+
+typedef std::shared_ptr<KSync::Comm::ClientCommunicator> Communicator;
+typedef std::vector<std::pair<KSync::Comm::stream_seq_t, size_t>> ChunkList;
+
+std::string Pattern(const size_t size) {
+	std::string data(size, '\0');
+	for(size_t i=0; i < size; ++i) {
+		data[i] = (char) ((i*131)^(i >> 9));
+	}
+	return data;
+}
+
+//Feed a receiver a hand made stream, returning the first error or the result of the end.
+int Replay(Communicator& communicator, const uint64_t total_size, const uint32_t chunk_size, const uint32_t window, const ChunkList& chunks, const uint64_t end_size) {
+	const KSync::Comm::stream_id_t stream_id = 42;
+	KSync::Comm::StreamReceiver receiver(communicator);
+	std::stringstream out;
+	KSync::Comm::StreamStart start(stream_id, total_size, chunk_size, window);
+	int status = receiver.HandleMessage(start.GetCommObject(), out);
+	if(status < 0) {
+		return status;
+	}
+	for(size_t i=0; i < chunks.size(); ++i) {
+		const std::string data = Pattern(chunks[i].second);
+		KSync::Comm::StreamChunk chunk(stream_id, chunks[i].first, data.data(), data.size());
+		status = receiver.HandleMessage(chunk.GetCommObject(), out);
+		if(status < 0) {
+			return status;
+		}
+	}
+	KSync::Comm::StreamEnd end(stream_id, chunks.size(), end_size);
+	return receiver.HandleMessage(end.GetCommObject(), out);
+}
+
+int TestValidation(Communicator& communicator) {
+	int failures = 0;
+	CHECK(Replay(communicator, 10, 4, 2, {{0, 4}, {1, 4}, {2, 2}}, 10) == KSync::Comm::StreamReceiver::Finished);
+	//A chunk size of 0 would never finish, and one past the limit is too much to buffer.
+	CHECK(Replay(communicator, 10, 0, 2, {}, 0) < 0);
+	CHECK(Replay(communicator, 10, KSync::Comm::StreamReceiver::MaxChunkSize+1, 2, {}, 0) < 0);
+	//Chunks out of order.
+	CHECK(Replay(communicator, 10, 4, 2, {{0, 4}, {2, 4}}, 8) < 0);
+	//A chunk bigger than the chunk size announced.
+	CHECK(Replay(communicator, 10, 4, 2, {{0, 8}}, 8) < 0);
+	//Chunks running past the total size announced.
+	CHECK(Replay(communicator, 6, 4, 4, {{0, 4}, {1, 4}}, 8) < 0);
+	//Ending short of the total size, or with a different size.
+	CHECK(Replay(communicator, 10, 4, 2, {{0, 4}}, 4) < 0);
+	CHECK(Replay(communicator, 8, 4, 2, {{0, 4}, {1, 4}}, 7) < 0);
+	//The credit the receiver sent the whole time isn't wanted by anyone.
+	while(communicator->get());
+	return failures;
+}
+
+int TestTransfer(Communicator& sender_end, Communicator& receiver_end, const std::string& dir) {
+	int failures = 0;
+
+	//A buffer arrives whole, through many windows of small chunks.
+	{
+		const std::string data = Pattern(3000000+17);
+		std::string received;
+		int receive_status = 0;
+		std::thread receiver_thread([&receiver_end, &received, &receive_status]() {
+			KSync::Comm::StreamReceiver receiver(receiver_end);
+			std::stringstream out;
+			receiver.SetIdleTimeout(5000);
+			while(true) {
+				std::shared_ptr<KSync::Comm::CommObject> comm_obj = receiver_end->get(5000);
+				if(!comm_obj) {
+					receive_status = -100;
+					break;
+				}
+				receive_status = receiver.HandleMessage(comm_obj, out);
+				if(receive_status != KSync::Comm::StreamReceiver::Continue) {
+					break;
+				}
+			}
+			received = out.str();
+		});
+		KSync::Comm::StreamSender sender(sender_end, 65536, 4);
+		sender.SetIdleTimeout(5000);
+		CHECK(sender.SendBuffer(data.data(), data.size()) >= 0);
+		receiver_thread.join();
+		CHECK(receive_status == KSync::Comm::StreamReceiver::Finished);
+		CHECK(received == data);
+	}
+
+	//Files too, including one that's a whole number of chunks and an empty one.
+	const size_t sizes[] = {0, 1, 65536, 3*65536, 1000001};
+	for(size_t i=0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		const std::string data = Pattern(sizes[i]);
+		const std::string source = dir+"/source";
+		const std::string dest = dir+"/dest";
+		{
+			std::ofstream out(source.c_str(), std::ios::binary|std::ios::trunc);
+			out.write(data.data(), data.size());
+		}
+		int receive_status = 0;
+		std::thread receiver_thread([&receiver_end, &dest, &receive_status]() {
+			KSync::Comm::StreamReceiver receiver(receiver_end);
+			receiver.SetIdleTimeout(5000);
+			receive_status = receiver.ReceiveFile(dest);
+		});
+		KSync::Comm::StreamSender sender(sender_end, 65536, 3);
+		sender.SetIdleTimeout(5000);
+		CHECK(sender.SendFile(source) >= 0);
+		receiver_thread.join();
+		CHECK(receive_status >= 0);
+		std::ifstream in(dest.c_str(), std::ios::binary);
+		std::stringstream received;
+		received << in.rdbuf();
+		CHECK(received.str() == data);
+	}
+
+	return failures;
+}
+
+//The sender stops at the edge of its window until credit comes back.
+int TestWindow(Communicator& sender_end, Communicator& receiver_end) {
+	int failures = 0;
+	const uint32_t window = 4;
+	const std::string data = Pattern(64*1024);
+	int send_status = 0;
+	std::thread sender_thread([&sender_end, &data, &send_status]() {
+		KSync::Comm::StreamSender sender(sender_end, 1024, window);
+		sender.SetIdleTimeout(300);
+		send_status = sender.SendBuffer(data.data(), data.size());
+	});
+	//Grant the first window, then go quiet.
+	std::shared_ptr<KSync::Comm::CommObject> start = receiver_end->get(5000);
+	CHECK(start&&(start->GetType() == KSync::Comm::StreamStart::Type));
+	if(start) {
+		std::shared_ptr<KSync::Comm::StreamStart> the_start;
+		KSync::Comm::CommCreator(the_start, start);
+		KSync::Comm::StreamCredit credit(the_start->GetStreamId(), 0, window);
+		std::shared_ptr<KSync::Comm::CommObject> credit_obj = credit.GetCommObject();
+		CHECK(receiver_end->send(credit_obj) == 0);
+	}
+	size_t num_chunks = 0;
+	while(std::shared_ptr<KSync::Comm::CommObject> comm_obj = receiver_end->get(200)) {
+		if(comm_obj->GetType() == KSync::Comm::StreamChunk::Type) {
+			++num_chunks;
+		}
+	}
+	CHECK(num_chunks == window);
+	//Nobody answers, so the sender gives up rather than waiting for ever.
+	sender_thread.join();
+	CHECK(send_status < 0);
+	while(receiver_end->get(100));
+	return failures;
+}
+
+int main() {
+	std::unique_ptr<g3::LogWorker> logworker;
+	std::string log_dir;
+	KSync::Test::InitializeLogger(logworker, "stream-test", log_dir);
+	const std::string dir = KSync::Test::MakeTempDir("stream-test");
+
+	std::shared_ptr<KSync::Comm::CommSystemInterface> comm_system;
+	if(KSync::Comm::GetLoopbackCommSystem(comm_system, KSync::Comm::LoopbackConditions()) < 0) {
+		fprintf(stderr, "Couldn't get the loopback comm system!\n");
+		return 1;
+	}
+	Communicator sender_end(new KSync::Comm::ClientCommunicator(comm_system, 30, true));
+	Communicator receiver_end(new KSync::Comm::ClientCommunicator(comm_system, 30, false));
+
+	int failures = 0;
+	const int validation_failures = TestValidation(receiver_end);
+	printf("Stream validation: %d failures\n", validation_failures);
+	failures += validation_failures;
+
+	const int transfer_failures = TestTransfer(sender_end, receiver_end, dir);
+	printf("Stream transfer: %d failures\n", transfer_failures);
+	failures += transfer_failures;
+
+	const int window_failures = TestWindow(sender_end, receiver_end);
+	printf("Stream window: %d failures\n", window_failures);
+	failures += window_failures;
+
+	KSync::Test::RemoveTree(dir);
+	logworker.reset();
+	if(failures == 0) {
+		KSync::Test::RemoveTree(log_dir);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef KSYNC_TEST_UTILITIES_HDR
+#define KSYNC_TEST_UTILITIES_HDR
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ftw.h>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <thread>
+#include <functional>
+
+#include "ksync/logging.h"
+
+//Count a failure in the enclosing function's failures and say where it was.
+#define CHECK(condition) \
+	do { \
+		if(!(condition)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} while(0)
+
+namespace KSync {
+	namespace Test {
+		//A fresh directory under TMPDIR. Empty if one couldn't be made.
+		inline std::string MakeTempDir(const std::string& name) {
+			const char* tmp = getenv("TMPDIR");
+			std::string path = std::string((tmp != nullptr) ? tmp : "/tmp")+"/ksync-"+name+"-XXXXXX";
+			if(mkdtemp(&path[0]) == nullptr) {
+				return std::string();
+			}
+			return path;
+		}
+
+		inline int RemovePath(const char* path, const struct stat*, int, struct FTW*) {
+			return remove(path);
+		}
+
+		inline void RemoveTree(const std::string& path) {
+			if(!path.empty()) {
+				nftw(path.c_str(), RemovePath, 16, FTW_DEPTH|FTW_PHYS);
+			}
+		}
+
+		//Logs go to a directory of their own so the tests don't touch ~/.ksync.
+		inline void InitializeLogger(std::unique_ptr<g3::LogWorker>& logworker, const std::string& name, std::string& log_dir) {
+			log_dir = MakeTempDir(name+"-log");
+			KSync::InitializeLogger(logworker, false, "KSync "+name, log_dir);
+		}
+
+		//Poll condition until it holds or timeout ms pass.
+		inline bool WaitFor(const std::function<bool()>& condition, const int timeout) {
+			const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout);
+			while(!condition()) {
+				if(std::chrono::steady_clock::now() >= deadline) {
+					return false;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			return true;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+
+#include "ksync/logging.h"
+#include "ksync/utilities.h"
+#include "ksync/metrics.h"
+#include "ksync/thread_utilities.h"
+#include "ksync/hash_cache.h"
+
+#include "ArgParse/ArgParse.h"
+
+class Totals {
+	public:
+		Totals() : num_files(0), num_cached(0), num_errors(0) {}
+		size_t num_files;
+		size_t num_cached;
+		size_t num_errors;
+};
+
+static std::string ToHex(const KSync::Hash::digest_t& digest) {
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for(size_t i = 0; i < digest.size(); ++i) {
+		hex.push_back(digits[digest[i] >> 4]);
+		hex.push_back(digits[digest[i]&0xf]);
+	}
+	return hex;
+}
+
+//Print the digest of every regular file under dir, not following symlinks.
+static void HashTree(KSync::Hash::HashCache& cache, const std::string& root, const std::string& relative, const std::string& skip, Totals& totals) {
+	const std::string dir_path = (relative == "") ? root : root+"/"+relative;
+	DIR* dir = opendir(dir_path.c_str());
+	if(dir == nullptr) {
+		LOGF(SEVERE, "Couldn't open the directory (%s)!", dir_path.c_str());
+		++totals.num_errors;
+		return;
+	}
+	while(struct dirent* entry = readdir(dir)) {
+		const std::string name(entry->d_name);
+		if((name == ".")||(name == "..")) {
+			continue;
+		}
+		const std::string entry_relative = (relative == "") ? name : relative+"/"+name;
+		const std::string entry_path = root+"/"+entry_relative;
+		struct stat st;
+		if(lstat(entry_path.c_str(), &st) < 0) {
+			++totals.num_errors;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			HashTree(cache, root, entry_relative, skip, totals);
+		} else if (S_ISREG(st.st_mode)&&(entry_path != skip)&&(entry_path != skip+".tmp")) {
+			KSync::Hash::FileHashes hashes;
+			const int status = cache.GetHashes(entry_path, hashes);
+			if(status < 0) {
+				++totals.num_errors;
+				continue;
+			}
+			++totals.num_files;
+			if(status == KSync::Hash::HashCache::Cached) {
+				++totals.num_cached;
+			}
+			printf("%s  %s\n", ToHex(hashes.digest).c_str(), entry_relative.c_str());
+		}
+	}
+	closedir(dir);
+}
+
+int main(int argc, char** argv) {
+	std::string root;
+	std::string cache_path;
+	std::string log_dir;
+	int block_size = (int) KSync::Hash::HashCache::DefaultBlockSize;
+	bool use_xattr = false;
+	bool no_cache = false;
+	int num_threads = 0;
+
+	ArgParse::ArgParser arg_parser("KSync Hash - Hash every file under a directory, skipping files whose hashes are cached.");
+	arg_parser.AddArgument("--root", "Directory to hash.", &root, ArgParse::Argument::Required);
+	arg_parser.AddArgument("--cache", "Hash cache to use. Default is <root>/.ksync-hash-cache", &cache_path);
+	arg_parser.AddArgument("--block-size", "Bytes per block hash. Default is 65536.", &block_size);
+	arg_parser.AddArgument("--xattr", "Also keep hashes in an xattr on each file.", &use_xattr);
+	arg_parser.AddArgument("--no-cache", "Hash everything without a cache.", &no_cache);
+	arg_parser.AddArgument("--threads", "Extra threads to hash the blocks of large files with. Default is 0.", &num_threads);
+	arg_parser.AddArgument("--log-dir", "Use this directory for logging.", &log_dir);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	if(block_size <= 0) {
+		printf("The block size must be positive!\n");
+		return -1;
+	}
+
+	if(num_threads < 0) {
+		printf("The number of threads can't be negative!\n");
+		return -1;
+	}
+
+	if (log_dir == "") {
+		if(KSync::Utilities::get_user_ksync_dir(log_dir) < 0) {
+			printf("There was a problem getting the ksync user directory!\n");
+			return -2;
+		}
+	}
+
+	//Initialize logging:
+	std::unique_ptr<g3::LogWorker> logworker;
+	KSync::InitializeLogger(logworker, false, "KSync Hash", log_dir);
+
+	while((root.size() > 1)&&(root[root.size()-1] == '/')) {
+		root.erase(root.size()-1);
+	}
+	if(cache_path == "") {
+		cache_path = root+"/"+KSync::Hash::HashCache::DefaultFileName;
+	}
+
+	std::unique_ptr<KSync::Utilities::thread_pool> pool;
+	if(num_threads > 0) {
+		pool.reset(new KSync::Utilities::thread_pool((size_t) num_threads));
+	}
+
+	KSync::Hash::HashCache cache;
+	cache.SetUseXattr(use_xattr);
+	cache.SetThreadPool(pool.get());
+	if(!no_cache&&(cache.Open(cache_path, (uint32_t) block_size) < 0)) {
+		fprintf(stderr, "Couldn't open the hash cache (%s), hashing without it.\n", cache_path.c_str());
+	}
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Totals totals;
+	HashTree(cache, root, "", cache_path, totals);
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+	if(cache.Close() < 0) {
+		fprintf(stderr, "There was a problem closing the hash cache (%s)!\n", cache_path.c_str());
+	}
+	fprintf(stderr, "%lu files, %lu cached, %lu errors, %llu bytes hashed in %.3f s\n", totals.num_files, totals.num_cached, totals.num_errors, (unsigned long long) KSync::Metrics::GetCounter("hash_cache.bytes_hashed").Get(), elapsed);
+	return (totals.num_errors == 0) ? 0 : -3;
+}
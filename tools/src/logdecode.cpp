@@ -0,0 +1,67 @@
+/*
+KSync - Client-Server synchronization system using rsync.
+Copyright (C) 2015  Matthew Scott Krafczyk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+
+#include "ksync/binary_log.h"
+
+#include "ArgParse/ArgParse.h"
+
+int main(int argc, char** argv) {
+	std::string input_path;
+	std::string output_path;
+
+	ArgParse::ArgParser arg_parser("KSync Log Decode - Turn a KSync binary log (.blog) into text.");
+	arg_parser.AddArgument("--input", "The binary log to decode.", &input_path, ArgParse::Argument::Required);
+	arg_parser.AddArgument("--output", "Write the text log here instead of stdout.", &output_path);
+
+	if(arg_parser.ParseArgs(argc, argv) < 0) {
+		printf("Problem parsing arguments\n");
+		arg_parser.PrintHelp();
+		return -1;
+	}
+
+	if(arg_parser.HelpPrinted()) {
+		return 0;
+	}
+
+	std::ifstream in(input_path.c_str(), std::ios::in|std::ios::binary);
+	if(!in) {
+		printf("Couldn't open (%s)!\n", input_path.c_str());
+		return -2;
+	}
+
+	int status;
+	if(output_path == "") {
+		status = KSync::BinaryLog::Decode(in, std::cout);
+	} else {
+		std::ofstream out(output_path.c_str());
+		if(!out) {
+			printf("Couldn't open (%s)!\n", output_path.c_str());
+			return -3;
+		}
+		status = KSync::BinaryLog::Decode(in, out);
+	}
+	if(status < 0) {
+		printf("There was a problem decoding (%s)!\n", input_path.c_str());
+		return -4;
+	}
+	return 0;
+}